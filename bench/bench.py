@@ -0,0 +1,267 @@
+#!/usr/bin/env python
+#
+# Benchmarks for the idam module, run against the stub IDAM library
+# in stub/ so that no server is needed. Build with setup.py in this
+# directory first (run.sh does both).
+#
+# Each scenario runs in its own process so that the peak memory (RSS)
+# is for that scenario alone. For each one this prints
+#
+#   signals/s   Signals read per second
+#   MB/s        Megabytes of arrays (data, errors, dimensions) per second
+#   p50, p99    Latency of one call in ms (one batch for fetchMany)
+#   RSS         Peak resident memory in Mb
+#
+# Usage:
+#
+#   python bench.py [--quick] [--json results.json]
+#                   [--baseline baseline.json [--tolerance 0.2]]
+#                   [scenario ...]
+#
+# With --baseline, exits with status 1 if any scenario is slower
+# (in signals/s) than the baseline by more than the tolerance, or
+# uses more memory by more than the tolerance.
+
+from __future__ import print_function
+
+import sys
+import os
+import time
+import json
+import subprocess
+import resource
+
+# Settings of the stub signals. See stub/idamstub.c
+SMALL  = "n=1000"
+LARGE  = "n=1000000"
+NATIVE = "n=1000000,type=short,dimtype=double"
+ERRORS = "n=1000000,errors=asym"
+RANK2  = "n=10000,rank=2,m=64"
+SLOW   = "n=10000,latency=0.002"
+STREAM = "n=100000,rank=2,m=64"
+ALIGN  = "n=100000"
+
+BATCH = 64   # Signals in each fetchMany() or fetch() batch
+
+def nbytes(d):
+    """ Bytes in the arrays of a Data object """
+    total = 0
+    for a in [d.data, d.errl, d.errh]:
+        if a is not None:
+            total += a.nbytes
+    for dim in d.dim:
+        for a in [dim.data, dim.errl, dim.errh]:
+            if a is not None:
+                total += a.nbytes
+    return total
+
+def data(signal, **kwargs):
+    def call():
+        d = idam.Data(signal, 0, **kwargs)
+        return 1, nbytes(d)
+    return call
+
+def shared(signal):
+    # After the first call, each read maps a shared memory segment
+    idam.setSharedMemory(2**28)
+    return data(signal)
+
+def lowlevel(signal):
+    def call():
+        handle = idam.getAPI(signal, "0")
+        a = idam.readData(handle)
+        idam.freeAPI(handle)
+        return 1, a.nbytes
+    return call
+
+def stream(signal, chunk):
+    def call():
+        total = 0
+        for d in idam.stream(signal, 0, chunk=chunk):
+            total += d.data.nbytes + d.time.nbytes
+        return 1, total
+    return call
+
+def scan(signal, depth):
+    # Each call reads the next shot, as in a loop over shots
+    idam.setPrefetch(depth)
+    shots = iter(range(1, 10**6))
+    def call():
+        d = idam.Data(signal, next(shots))
+        return 1, nbytes(d)
+    return call
+
+def align(signal, workers):
+    import numpy
+    ds = [idam.Data(signal, i) for i in range(BATCH)]
+    t = numpy.linspace(0.0, 0.1, 100000)
+    def call():
+        a = idam.align(ds, t, workers=workers)
+        return len(ds), a.nbytes
+    return call
+
+def batch(signal, workers):
+    requests = [(signal, i) for i in range(BATCH)]
+    def call():
+        ds = idam.fetchMany(requests, workers=workers)
+        return len(ds), sum(nbytes(d) for d in ds)
+    return call
+
+def asyncfetch(signal, workers):
+    import asyncio
+    idam.setWorkers(workers)
+    loop = asyncio.new_event_loop()
+    asyncio.set_event_loop(loop)
+
+    async def gather():
+        # fetch() needs the loop to be running
+        return await asyncio.gather(*[idam.fetch(signal, i) for i in range(BATCH)])
+    def call():
+        ds = loop.run_until_complete(gather())
+        return len(ds), sum(nbytes(d) for d in ds)
+    return call
+
+# Name, function making the call, number of calls (full, quick)
+SCENARIOS = [
+    ("data_small",    lambda: data(SMALL),                       2000, 200),
+    ("data_large",    lambda: data(LARGE),                       100,  10),
+    ("data_native",   lambda: data(NATIVE, dtype="native"),      100,  10),
+    ("data_nocopy",   lambda: data(NATIVE, dtype="native", copy=False), 100, 10),
+    ("data_calibrate", lambda: data(NATIVE, dtype="native", scale=0.01, offset=1.0,
+                                     baseline=(0.0, 0.01), valid=(-30000, 30000)), 100, 10),
+    ("data_errors",   lambda: data(ERRORS),                      100,  10),
+    ("data_rank2",    lambda: data(RANK2),                       200,  20),
+    ("data_window",   lambda: data(LARGE, tmin=0.1, tmax=0.2),   100,  10),
+    ("data_decimate", lambda: data(LARGE, decimate=2000),        100,  10),
+    ("data_shared",   lambda: shared(LARGE),                     100,  10),
+    ("lowlevel",      lambda: lowlevel(LARGE),                   100,  10),
+    ("stream_rank2",  lambda: stream(STREAM, 1000),              20,   2),
+    ("scan",          lambda: scan(SLOW, 0),                     200,  20),
+    ("scan_prefetch", lambda: scan(SLOW, 4),                     200,  20),
+    ("align_1",       lambda: align(ALIGN, 1),                   20,   2),
+    ("align_4",       lambda: align(ALIGN, 4),                   20,   2),
+    ("fetchmany_1",   lambda: batch(SLOW, 1),                    10,   2),
+    ("fetchmany_4",   lambda: batch(SLOW, 4),                    10,   2),
+    ("fetch_async",   lambda: asyncfetch(SLOW, 4),               10,   2),
+]
+
+def percentile(times, p):
+    times = sorted(times)
+    i = int(round(p * (len(times) - 1)))
+    return times[i]
+
+def run(name, quick):
+    """ Run one scenario in this process, returning a dict of results """
+    for sname, make, ncalls, nquick in SCENARIOS:
+        if sname == name:
+            break
+    else:
+        raise ValueError("Unknown scenario '%s'" % name)
+    if quick:
+        ncalls = nquick
+
+    call = make()
+    call()  # Warm up
+
+    times = []
+    signals = 0
+    total = 0
+    start = time.time()
+    for i in range(ncalls):
+        t = time.time()
+        n, b = call()
+        times.append(time.time() - t)
+        signals += n
+        total += b
+    elapsed = time.time() - start
+
+    # ru_maxrss is in kb on Linux, bytes on macOS
+    rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    if sys.platform == "darwin":
+        rss /= 1024.
+
+    return {"name": name,
+            "signals_per_s": signals / elapsed,
+            "mb_per_s": total / elapsed / 2.**20,
+            "p50_ms": 1e3 * percentile(times, 0.5),
+            "p99_ms": 1e3 * percentile(times, 0.99),
+            "peak_rss_mb": rss / 1024.}
+
+def compare(results, baseline, tolerance):
+    """ Returns a list of regressions against the baseline """
+    old = dict((r["name"], r) for r in baseline)
+    failed = []
+    for r in results:
+        b = old.get(r["name"])
+        if b is None:
+            continue
+        if r["signals_per_s"] < b["signals_per_s"] * (1. - tolerance):
+            failed.append("%s: %.1f signals/s, baseline %.1f"
+                          % (r["name"], r["signals_per_s"], b["signals_per_s"]))
+        if r["peak_rss_mb"] > b["peak_rss_mb"] * (1. + tolerance):
+            failed.append("%s: peak RSS %.1f Mb, baseline %.1f Mb"
+                          % (r["name"], r["peak_rss_mb"], b["peak_rss_mb"]))
+    return failed
+
+def main(argv):
+    quick = False
+    jsonfile = None
+    basefile = None
+    tolerance = 0.2
+    names = []
+
+    args = iter(argv)
+    for a in args:
+        if a == "--quick":
+            quick = True
+        elif a == "--json":
+            jsonfile = next(args)
+        elif a == "--baseline":
+            basefile = next(args)
+        elif a == "--tolerance":
+            tolerance = float(next(args))
+        elif a == "--run":
+            # Run one scenario, printing the results. Used by the parent
+            print(json.dumps(run(next(args), quick)))
+            return 0
+        else:
+            names.append(a)
+
+    if not names:
+        names = [s[0] for s in SCENARIOS]
+        if sys.version_info < (3, 5):
+            names.remove("fetch_async")
+
+    print("%-14s %11s %9s %9s %9s %8s" % ("scenario", "signals/s", "MB/s",
+                                         "p50 ms", "p99 ms", "RSS Mb"))
+    results = []
+    for name in names:
+        cmd = [sys.executable, os.path.abspath(__file__)]
+        if quick:
+            cmd.append("--quick")
+        cmd += ["--run", name]
+        out = subprocess.check_output(cmd)
+        r = json.loads(out.decode().strip().splitlines()[-1])
+        print("%-14s %11.1f %9.1f %9.3f %9.3f %8.1f" % (
+            name, r["signals_per_s"], r["mb_per_s"],
+            r["p50_ms"], r["p99_ms"], r["peak_rss_mb"]))
+        sys.stdout.flush()
+        results.append(r)
+
+    if jsonfile:
+        with open(jsonfile, "w") as f:
+            json.dump(results, f, indent=1)
+
+    if basefile:
+        with open(basefile) as f:
+            failed = compare(results, json.load(f), tolerance)
+        for msg in failed:
+            print("REGRESSION " + msg)
+        if failed:
+            return 1
+    return 0
+
+if __name__ == "__main__":
+    sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+    import idam
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,24 @@
+#!/bin/bash
+
+#
+# Builds the idam module against the stub library, then runs the benchmarks,
+# or with --test the tests
+#
+# Usage:
+#
+# ./run.sh  [ bench.py options ]
+# ./run.sh --test [ test ... ]
+#
+# e.g.  ./run.sh --quick --baseline baseline.json
+#
+
+cd "$(dirname "$0")"
+
+python setup.py build_ext --inplace > build.log || { cat build.log; exit 1; }
+
+if [ "$1" = "--test" ]; then
+    shift
+    python tests.py "$@"
+else
+    python bench.py "$@"
+fi
@@ -0,0 +1,20 @@
+# Builds the idam module against a stub IDAM library, for benchmarks
+# The stub makes up signals, so no server or libidam is needed
+#
+# python setup.py build_ext --inplace
+
+from distutils.core import setup, Extension
+
+import sys
+
+import numpy
+
+module1 = Extension('idam',
+                    include_dirs = ['stub', numpy.get_include()],
+                    libraries = ['rt'] if sys.platform.startswith('linux') else [],
+                    sources = ['../idammodule.c', 'stub/idamstub.c'])
+
+setup (name = 'IDAM',
+       version = '1.0',
+       description = 'IDAM module built against a stub library for benchmarks',
+       ext_modules = [module1])
@@ -0,0 +1,48 @@
+/*
+ * Stub of the IDAM client API, implemented by idamstub.c
+ */
+
+#ifndef IDAMCLIENT_H
+#define IDAMCLIENT_H
+
+int idamGetAPI(const char *data_object, const char *data_source);
+void idamFree(int handle);
+
+int getIdamSignalStatus(int handle);
+char *getIdamErrorMsg(int handle);
+
+int getIdamDataNum(int handle);
+int getIdamRank(int handle);
+int getIdamOrder(int handle);
+int getIdamDataType(int handle);
+int getIdamErrorType(int handle);
+int getIdamErrorAsymmetry(int handle);
+char *getIdamData(int handle);
+char *getIdamAsymmetricError(int handle, int above);
+void getIdamFloatData(int handle, float *fp);
+void getIdamFloatAsymmetricError(int handle, int above, float *fp);
+char *getIdamDataLabel(int handle);
+char *getIdamDataUnits(int handle);
+char *getIdamDataDesc(int handle);
+
+int getIdamDimNum(int handle, int ndim);
+int getIdamDimType(int handle, int ndim);
+int getIdamDimErrorType(int handle, int ndim);
+int getIdamDimErrorAsymmetry(int handle, int ndim);
+char *getIdamDimData(int handle, int ndim);
+char *getIdamDimAsymmetricError(int handle, int ndim, int above);
+void getIdamFloatDimData(int handle, int ndim, float *fp);
+void getIdamFloatDimAsymmetricError(int handle, int ndim, int above, float *fp);
+char *getIdamDimLabel(int handle, int ndim);
+char *getIdamDimUnits(int handle, int ndim);
+
+void putIdamServerHost(const char *host);
+void putIdamServerPort(int port);
+char *getIdamServerHost(void);
+int getIdamServerPort(void);
+
+void setIdamProperty(const char *property);
+void resetIdamProperty(const char *property);
+int getIdamProperty(const char *property);
+
+#endif /* IDAMCLIENT_H */
@@ -0,0 +1,28 @@
+/*
+ * Stub of the IDAM client/server header, with just what
+ * idammodule.c needs. The values match the IDAM library.
+ */
+
+#ifndef IDAMCLIENTSERVER_H
+#define IDAMCLIENTSERVER_H
+
+#define MAXNAME        1024
+#define STRING_LENGTH  1024
+
+#define TYPE_UNKNOWN          0
+#define TYPE_CHAR             1
+#define TYPE_SHORT            2
+#define TYPE_INT              3
+#define TYPE_UNSIGNED_INT     4
+#define TYPE_LONG             5
+#define TYPE_FLOAT            6
+#define TYPE_DOUBLE           7
+#define TYPE_UNSIGNED_CHAR    8
+#define TYPE_UNSIGNED_SHORT   9
+#define TYPE_UNSIGNED_LONG    10
+#define TYPE_LONG64           11
+#define TYPE_UNSIGNED_LONG64  12
+#define TYPE_COMPLEX          13
+#define TYPE_DCOMPLEX         14
+
+#endif /* IDAMCLIENTSERVER_H */
@@ -0,0 +1,415 @@
+/*
+ * Stub IDAM client library, for benchmarking the idam module
+ * without a server.
+ *
+ * Signals are made up from their names, which are a list of
+ * settings separated by commas:
+ *
+ *   n=100000       Number of times
+ *   rank=1         Number of dimensions. Others have size m
+ *   m=16
+ *   type=float     Data type: char, short, int, long, long64,
+ *                  float or double (also uchar, ushort, uint)
+ *   dimtype=float  Type of the time dimension
+ *   errors=none    Errors: none, sym or asym
+ *   latency=0      Seconds spent in idamGetAPI, as for a server
+ *   fail=0         If 1, the request fails
+ *
+ * e.g. idam.Data("n=1000000,type=short,errors=sym,latency=0.01", 1)
+ *
+ * The source is ignored. Like the real library this is not
+ * thread-safe, which idammodule.c must handle with its lock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "idamclientserver.h"
+#include "idamclient.h"
+
+#define STUB_MAXHANDLES 4096
+#define STUB_MAXRANK    8
+#define STUB_MAXPROPS   64
+
+typedef struct {
+  int used;
+  int ok;
+  char error[STRING_LENGTH];
+
+  int rank;
+  int type, dimtype, errtype;
+  int errasym;
+  int n;                 /* Number of data values */
+  int dimsize[STUB_MAXRANK];
+
+  char *data;
+  char *errl, *errh;
+  char *dim[STUB_MAXRANK];
+  char *dimerrl[STUB_MAXRANK], *dimerrh[STUB_MAXRANK];
+} stub_Block;
+
+static stub_Block blocks[STUB_MAXHANDLES];
+
+static char server_host[MAXNAME] = "localhost";
+static int server_port = 56565;
+
+static char props[STUB_MAXPROPS][64];
+static int nprops = 0;
+
+static const struct {
+  const char *name;
+  int type;
+  size_t size;
+} stub_types[] = {
+  {"char",   TYPE_CHAR,           sizeof(char)},
+  {"short",  TYPE_SHORT,          sizeof(short)},
+  {"int",    TYPE_INT,            sizeof(int)},
+  {"long",   TYPE_LONG,           sizeof(long)},
+  {"long64", TYPE_LONG64,         sizeof(long long)},
+  {"float",  TYPE_FLOAT,          sizeof(float)},
+  {"double", TYPE_DOUBLE,         sizeof(double)},
+  {"uchar",  TYPE_UNSIGNED_CHAR,  sizeof(unsigned char)},
+  {"ushort", TYPE_UNSIGNED_SHORT, sizeof(unsigned short)},
+  {"uint",   TYPE_UNSIGNED_INT,   sizeof(unsigned int)},
+  {NULL, TYPE_UNKNOWN, 0}
+};
+
+static int
+typeByName(const char *name, int len)
+{
+  int i;
+  for(i=0;stub_types[i].name;i++) {
+    if((strlen(stub_types[i].name) == (size_t) len) && (strncmp(stub_types[i].name, name, len) == 0))
+      return stub_types[i].type;
+  }
+  return TYPE_UNKNOWN;
+}
+
+static size_t
+typeSize(int type)
+{
+  int i;
+  for(i=0;stub_types[i].name;i++) {
+    if(stub_types[i].type == type)
+      return stub_types[i].size;
+  }
+  return 0;
+}
+
+/* Set value i of a buffer */
+static void
+setValue(char *buf, int type, int i, double v)
+{
+  switch(type) {
+  case TYPE_CHAR:           ((signed char*) buf)[i] = (signed char) v; break;
+  case TYPE_SHORT:          ((short*) buf)[i] = (short) v; break;
+  case TYPE_INT:            ((int*) buf)[i] = (int) v; break;
+  case TYPE_LONG:           ((long*) buf)[i] = (long) v; break;
+  case TYPE_LONG64:         ((long long*) buf)[i] = (long long) v; break;
+  case TYPE_FLOAT:          ((float*) buf)[i] = (float) v; break;
+  case TYPE_DOUBLE:         ((double*) buf)[i] = v; break;
+  case TYPE_UNSIGNED_CHAR:  ((unsigned char*) buf)[i] = (unsigned char) v; break;
+  case TYPE_UNSIGNED_SHORT: ((unsigned short*) buf)[i] = (unsigned short) v; break;
+  case TYPE_UNSIGNED_INT:   ((unsigned int*) buf)[i] = (unsigned int) v; break;
+  }
+}
+
+static double
+getValue(const char *buf, int type, int i)
+{
+  switch(type) {
+  case TYPE_CHAR:           return ((const signed char*) buf)[i];
+  case TYPE_SHORT:          return ((const short*) buf)[i];
+  case TYPE_INT:            return ((const int*) buf)[i];
+  case TYPE_LONG:           return ((const long*) buf)[i];
+  case TYPE_LONG64:         return ((const long long*) buf)[i];
+  case TYPE_FLOAT:          return ((const float*) buf)[i];
+  case TYPE_DOUBLE:         return ((const double*) buf)[i];
+  case TYPE_UNSIGNED_CHAR:  return ((const unsigned char*) buf)[i];
+  case TYPE_UNSIGNED_SHORT: return ((const unsigned short*) buf)[i];
+  case TYPE_UNSIGNED_INT:   return ((const unsigned int*) buf)[i];
+  }
+  return 0.0;
+}
+
+static void
+toFloat(const char *buf, int type, int n, float *fp)
+{
+  int i;
+  for(i=0;i<n;i++)
+    fp[i] = (float) getValue(buf, type, i);
+}
+
+static void
+freeBlock(stub_Block *b)
+{
+  int i;
+  free(b->data);
+  if(b->errh != b->errl)
+    free(b->errh);
+  free(b->errl);
+  for(i=0;i<STUB_MAXRANK;i++) {
+    free(b->dim[i]);
+    if(b->dimerrh[i] != b->dimerrl[i])
+      free(b->dimerrh[i]);
+    free(b->dimerrl[i]);
+  }
+  memset(b, 0, sizeof(stub_Block));
+}
+
+/* Make up a signal from its settings */
+static void
+makeSignal(stub_Block *b, const char *settings)
+{
+  const char *c = settings, *eq, *end;
+  int n = 1000, m = 16, rank = 1, fail = 0;
+  int i, j, len;
+  double latency = 0.0, v;
+  char errors[8] = "none";
+  struct timespec ts;
+
+  b->type = b->dimtype = TYPE_FLOAT;
+
+  while(*c) {
+    end = strchr(c, ',');
+    if(end == NULL)
+      end = c + strlen(c);
+    eq = memchr(c, '=', end - c);
+    if(eq) {
+      len = (int) (end - eq - 1);
+      if(strncmp(c, "n=", 2) == 0)            n = atoi(eq+1);
+      else if(strncmp(c, "m=", 2) == 0)       m = atoi(eq+1);
+      else if(strncmp(c, "rank=", 5) == 0)    rank = atoi(eq+1);
+      else if(strncmp(c, "type=", 5) == 0)    b->type = typeByName(eq+1, len);
+      else if(strncmp(c, "dimtype=", 8) == 0) b->dimtype = typeByName(eq+1, len);
+      else if(strncmp(c, "latency=", 8) == 0) latency = atof(eq+1);
+      else if(strncmp(c, "fail=", 5) == 0)    fail = atoi(eq+1);
+      else if((strncmp(c, "errors=", 7) == 0) && (len < 8)) {
+        memcpy(errors, eq+1, len);
+        errors[len] = 0;
+      }
+    }
+    c = *end ? end + 1 : end;
+  }
+
+  if(latency > 0.0) {
+    ts.tv_sec = (time_t) latency;
+    ts.tv_nsec = (long) ((latency - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+  }
+
+  if(fail) {
+    strcpy(b->error, "Stub signal set to fail");
+    return;
+  }
+  if((n <= 0) || (m <= 0) || (rank < 1) || (rank > STUB_MAXRANK) ||
+     (b->type == TYPE_UNKNOWN) || (b->dimtype == TYPE_UNKNOWN)) {
+    strcpy(b->error, "Invalid stub signal settings");
+    return;
+  }
+
+  /* Dimension 0 is time */
+  b->rank = rank;
+  b->n = n;
+  b->dimsize[0] = n;
+  for(i=1;i<rank;i++) {
+    b->dimsize[i] = m;
+    b->n *= m;
+  }
+
+  b->data = (char*) malloc(b->n * typeSize(b->type));
+  if(b->data == NULL) {
+    strcpy(b->error, "Out of memory");
+    return;
+  }
+  for(i=0;i<b->n;i++)
+    setValue(b->data, b->type, i, 100.0*sin(1e-3*i));
+
+  for(i=0;i<rank;i++) {
+    b->dim[i] = (char*) malloc(b->dimsize[i] * typeSize(b->dimtype));
+    if(b->dim[i] == NULL) {
+      strcpy(b->error, "Out of memory");
+      return;
+    }
+    for(j=0;j<b->dimsize[i];j++) {
+      v = (i == 0) ? 1e-6*j : j; /* Time in seconds at 1 MHz */
+      setValue(b->dim[i], b->dimtype, j, v);
+    }
+  }
+
+  if(strcmp(errors, "none") != 0) {
+    b->errtype = b->type;
+    b->errasym = (strcmp(errors, "asym") == 0);
+    b->errl = (char*) malloc(b->n * typeSize(b->type));
+    b->errh = b->errasym ? (char*) malloc(b->n * typeSize(b->type)) : b->errl;
+    if((b->errl == NULL) || (b->errh == NULL)) {
+      strcpy(b->error, "Out of memory");
+      return;
+    }
+    for(i=0;i<b->n;i++) {
+      setValue(b->errl, b->type, i, 1.0);
+      if(b->errasym)
+        setValue(b->errh, b->type, i, 2.0);
+    }
+  }
+
+  b->ok = 1;
+}
+
+static stub_Block *
+getBlock(int handle)
+{
+  static stub_Block empty;
+  if((handle < 0) || (handle >= STUB_MAXHANDLES) || !blocks[handle].used)
+    return &empty;
+  return &blocks[handle];
+}
+
+int
+idamGetAPI(const char *data_object, const char *data_source)
+{
+  int h;
+
+  for(h=0;h<STUB_MAXHANDLES;h++) {
+    if(!blocks[h].used)
+      break;
+  }
+  if(h == STUB_MAXHANDLES)
+    return -1;
+
+  blocks[h].used = 1;
+  makeSignal(&blocks[h], data_object);
+  return h;
+}
+
+void
+idamFree(int handle)
+{
+  if((handle >= 0) && (handle < STUB_MAXHANDLES) && blocks[handle].used)
+    freeBlock(&blocks[handle]);
+}
+
+int   getIdamSignalStatus(int handle) { return getBlock(handle)->ok; }
+char *getIdamErrorMsg(int handle)     { return getBlock(handle)->error; }
+
+int   getIdamDataNum(int handle)        { return getBlock(handle)->ok ? getBlock(handle)->n : 0; }
+int   getIdamRank(int handle)           { return getBlock(handle)->rank; }
+int   getIdamOrder(int handle)          { return 0; }
+int   getIdamDataType(int handle)       { return getBlock(handle)->type; }
+int   getIdamErrorType(int handle)      { return getBlock(handle)->errtype; }
+int   getIdamErrorAsymmetry(int handle) { return getBlock(handle)->errasym; }
+char *getIdamData(int handle)           { return getBlock(handle)->data; }
+
+char *
+getIdamAsymmetricError(int handle, int above)
+{
+  stub_Block *b = getBlock(handle);
+  return above ? b->errh : b->errl;
+}
+
+void
+getIdamFloatData(int handle, float *fp)
+{
+  stub_Block *b = getBlock(handle);
+  if(b->data)
+    toFloat(b->data, b->type, b->n, fp);
+}
+
+void
+getIdamFloatAsymmetricError(int handle, int above, float *fp)
+{
+  stub_Block *b = getBlock(handle);
+  char *err = above ? b->errh : b->errl;
+  if(err)
+    toFloat(err, b->errtype, b->n, fp);
+}
+
+char *getIdamDataLabel(int handle) { return "Stub signal"; }
+char *getIdamDataUnits(int handle) { return "A"; }
+char *getIdamDataDesc(int handle)  { return "Synthetic signal from the stub IDAM library"; }
+
+static int
+validDim(stub_Block *b, int ndim)
+{
+  return (ndim >= 0) && (ndim < b->rank);
+}
+
+int
+getIdamDimNum(int handle, int ndim)
+{
+  stub_Block *b = getBlock(handle);
+  return validDim(b, ndim) ? b->dimsize[ndim] : 0;
+}
+
+int getIdamDimType(int handle, int ndim)           { return getBlock(handle)->dimtype; }
+int getIdamDimErrorType(int handle, int ndim)      { return TYPE_UNKNOWN; }
+int getIdamDimErrorAsymmetry(int handle, int ndim) { return 0; }
+
+char *
+getIdamDimData(int handle, int ndim)
+{
+  stub_Block *b = getBlock(handle);
+  return validDim(b, ndim) ? b->dim[ndim] : NULL;
+}
+
+char *
+getIdamDimAsymmetricError(int handle, int ndim, int above)
+{
+  return NULL;
+}
+
+void
+getIdamFloatDimData(int handle, int ndim, float *fp)
+{
+  stub_Block *b = getBlock(handle);
+  if(validDim(b, ndim) && b->dim[ndim])
+    toFloat(b->dim[ndim], b->dimtype, b->dimsize[ndim], fp);
+}
+
+void
+getIdamFloatDimAsymmetricError(int handle, int ndim, int above, float *fp)
+{
+}
+
+char *getIdamDimLabel(int handle, int ndim) { return (ndim == 0) ? "Time (sec)" : "Channel"; }
+char *getIdamDimUnits(int handle, int ndim) { return (ndim == 0) ? "s" : ""; }
+
+void  putIdamServerHost(const char *host) { strncpy(server_host, host, MAXNAME-1); }
+void  putIdamServerPort(int port)         { server_port = port; }
+char *getIdamServerHost(void)             { return server_host; }
+int   getIdamServerPort(void)             { return server_port; }
+
+static int
+findProperty(const char *property)
+{
+  int i;
+  for(i=0;i<nprops;i++) {
+    if(strcmp(props[i], property) == 0)
+      return i;
+  }
+  return -1;
+}
+
+void
+setIdamProperty(const char *property)
+{
+  if((findProperty(property) < 0) && (nprops < STUB_MAXPROPS) && (strlen(property) < 64))
+    strcpy(props[nprops++], property);
+}
+
+void
+resetIdamProperty(const char *property)
+{
+  int i = findProperty(property);
+  if(i >= 0)
+    strcpy(props[i], props[--nprops]);
+}
+
+int
+getIdamProperty(const char *property)
+{
+  return findProperty(property) >= 0;
+}
@@ -0,0 +1,1146 @@
+#!/usr/bin/env python
+#
+# Tests for the idam module, run against the stub IDAM library in
+# stub/ so that no server is needed. Build with setup.py in this
+# directory first (run.sh --test does both).
+#
+# Each test_ function checks one feature with plain asserts, and
+# runs in its own process so that settings (caches, shared memory,
+# timeouts, ...) and threads left by one test don't affect another.
+# Signals are made up by the stub from their names (see
+# stub/idamstub.c): data is 100*sin(0.001*i) and time is 1e-6*i s.
+#
+# Usage:
+#
+#   python tests.py [test ...]      e.g. python tests.py data cache
+#
+# Exits with status 1 if any test fails. Tests needing modules which
+# aren't installed (e.g. pyarrow) are skipped.
+
+from __future__ import print_function
+
+import sys
+import os
+import shutil
+import tempfile
+import atexit
+import subprocess
+
+import numpy
+
+def stub_data(n):
+    """ The data values the stub makes up for n times """
+    return 100.0*numpy.sin(1e-3*numpy.arange(n))
+
+def stub_time(n):
+    return 1e-6*numpy.arange(n)
+
+def close(a, b):
+    return numpy.allclose(a, b, rtol=1e-5, atol=1e-4)
+
+def same(a, b):
+    """ Same values and type, NaN equal to NaN """
+    return (a.dtype == b.dtype) and (a.shape == b.shape) and \
+        numpy.array_equal(numpy.isnan(a), numpy.isnan(b)) and \
+        numpy.array_equal(a[~numpy.isnan(a)], b[~numpy.isnan(b)])
+
+def tempdir():
+    """ A directory removed when the test finishes """
+    path = tempfile.mkdtemp(prefix="idamtest")
+    atexit.register(shutil.rmtree, path, True)
+    return path
+
+class Skip(Exception):
+    """ Raised by a test which can't run here, e.g. without a module """
+
+SKIPPED = 77
+
+def raises(exc, f, *args, **kwargs):
+    try:
+        f(*args, **kwargs)
+    except exc:
+        return True
+    return False
+
+def test_data():
+    d = idam.Data("n=1000", 15100)
+    assert d.name == "n=1000"
+    assert d.source == "15100"
+    assert d.label == "Stub signal"
+    assert d.units == "A"
+    assert d.data.dtype == numpy.float32
+    assert d.data.shape == (1000,)
+    assert close(d.data, stub_data(1000))
+    assert len(d.dim) == 1 and d.order == 0
+    assert d.dim[0].label == "Time (sec)"
+    assert d.dim[0].units == "s"
+    assert d.time is d.dim[0].data
+    assert close(d.time, stub_time(1000))
+    assert d.errl is None and d.errh is None
+
+    d = idam.Data("n=100,errors=sym", 1)
+    assert d.errh is d.errl
+    assert numpy.all(d.errl == 1.0)
+    d = idam.Data("n=100,errors=asym", 1)
+    assert numpy.all(d.errl == 1.0) and numpy.all(d.errh == 2.0)
+
+    assert raises(RuntimeError, idam.Data, "fail=1", 1)
+
+    handle = idam.getAPI("n=100", "1")
+    a = idam.readData(handle)
+    idam.freeAPI(handle)
+    assert close(a, stub_data(100))
+
+def test_fetchmany():
+    # Slowest first, to check the order is kept
+    ds = idam.fetchMany([("n=10,latency=0.2", 1), ("fail=1", 2), ("n=20", 3)], workers=2)
+    assert len(ds) == 3
+    assert ds[0].data.shape == (10,) and ds[0].source == "1"
+    assert isinstance(ds[1], RuntimeError)
+    assert ds[2].data.shape == (20,) and ds[2].source == "3"
+    assert close(ds[2].data, stub_data(20))
+    assert idam.fetchMany([]) == []
+
+def test_dtype():
+    s = "n=1000,type=short,dimtype=double,errors=sym"
+    d = idam.Data(s, 1)
+    assert d.data.dtype == numpy.float32 and d.time.dtype == numpy.float32
+    assert d.errl.dtype == numpy.float32
+
+    n = idam.Data(s, 1, dtype="native")
+    assert n.data.dtype == numpy.int16
+    assert n.errl.dtype == numpy.int16
+    assert n.time.dtype == numpy.float64
+    assert numpy.all(abs(n.data - stub_data(1000)) < 1)
+    assert numpy.array_equal(n.data.astype(numpy.float32), d.data)
+    assert close(n.time, stub_time(1000))
+
+    for name, t in [("char", numpy.int8), ("int", numpy.intc), ("long64", numpy.longlong),
+                    ("double", numpy.float64), ("uchar", numpy.uint8), ("uint", numpy.uintc)]:
+        assert idam.Data("n=10,type=" + name, 1, dtype="native").data.dtype == t
+
+    assert idam.Data("n=10,type=double", 1, dtype="float32").data.dtype == numpy.float32
+    assert idam.fetchMany([(s, 1)], dtype="native")[0].data.dtype == numpy.int16
+    handle = idam.getAPI(s, "1")
+    assert idam.readData(handle, "native").dtype == numpy.int16
+    idam.freeAPI(handle)
+    assert raises(ValueError, idam.Data, s, 1, dtype="int16")
+
+def test_copy():
+    import gc
+    s = "n=1000,type=short,dimtype=double,errors=asym"
+    c = idam.Data(s, 1, dtype="native")
+    d = idam.Data(s, 1, dtype="native", copy=False)
+    assert c.data.flags.owndata
+    # Shares IDAM's buffers, kept alive by the arrays
+    for a in [d.data, d.errl, d.errh, d.time]:
+        assert not a.flags.owndata and a.base is not None
+    assert numpy.array_equal(d.data, c.data)
+    assert numpy.array_equal(d.errh, c.errh)
+    assert numpy.array_equal(d.time, c.time)
+
+    data, view = d.data, d.time[10:20]
+    del d
+    gc.collect()
+    for i in range(10):
+        idam.Data(s, 2, dtype="native", copy=False)
+    assert numpy.array_equal(data, c.data)
+    assert numpy.array_equal(view, c.time[10:20])
+
+    # Converted to float, so can't share
+    assert idam.Data(s, 1, copy=False).data.flags.owndata
+
+def test_lazy():
+    s = "n=1000,rank=2,m=4,errors=asym"
+    e = idam.Data(s, 1)
+    d = idam.Data(s, 1, lazy=True)
+    assert numpy.array_equal(d.data, e.data)
+    assert numpy.array_equal(d.time, e.time)
+    for i in range(2):
+        assert numpy.array_equal(d.dim[i].data, e.dim[i].data)
+        assert d.dim[i].label == e.dim[i].label
+    assert d.time is d.dim[d.order].data
+    assert numpy.array_equal(d.errl, e.errl)
+    assert numpy.array_equal(d.errh, e.errh)
+    assert d.errl is d.errl  # Created once
+
+    # Symmetric errors are one array, as when not lazy
+    d = idam.Data("n=100,errors=sym", 1, lazy=True)
+    assert d.errh is d.errl
+    d = idam.Data("n=100", 1, lazy=True)
+    assert d.errl is None and d.errh is None
+
+    for lazy in [False, True]:
+        d = idam.Data("n=100,errors=asym", 1, errors=False, lazy=lazy)
+        assert d.errl is None and d.errh is None
+        assert close(d.time, stub_time(100))
+    ds = idam.fetchMany([("n=100,errors=sym", 1)], errors=False, lazy=True)
+    assert ds[0].errl is None
+
+def cache_files(path):
+    return [os.path.join(path, f) for f in os.listdir(path) if f.endswith(".idam")]
+
+def test_cache():
+    path = tempdir()
+    idam.setCache(path)
+    s = "n=1000,rank=2,m=4,errors=asym"
+    idam.reset_stats()
+    a = idam.Data(s, 1)
+    assert idam.stats()["disk_cache_hits"] == 0
+    assert len(cache_files(path)) == 1
+    b = idam.Data(s, 1)
+    assert idam.stats()["disk_cache_hits"] == 1
+    for x, y in [(a, b)] + list(zip(a.dim, b.dim)):
+        assert x.label == y.label and x.units == y.units
+        assert numpy.array_equal(x.data, y.data)
+    assert b.desc == a.desc and b.order == a.order
+    assert numpy.array_equal(b.errl, a.errl) and numpy.array_equal(b.errh, a.errh)
+
+    # Arrays can be changed without changing the file
+    b.data[0] = 1234.
+    assert idam.Data(s, 1).data[0] == a.data[0]
+
+    # Separate entries for options which change what is stored
+    idam.reset_stats()
+    idam.Data(s, 1, dtype="native")
+    idam.Data(s, 1, tmax=1e-4)
+    idam.Data(s, 2)
+    assert idam.stats()["disk_cache_hits"] == 0
+    idam.Data(s, 1, cache=False)
+    assert idam.stats()["disk_cache_hits"] == 0
+    assert len(cache_files(path)) == 4
+    assert close(idam.Data(s, 1, scale=2.0).data, 2.0*a.data)
+    assert idam.stats()["disk_cache_hits"] == 1
+
+    # Kept within maxsize, removing the oldest
+    idam.setCache(path, maxsize=40000)
+    for i in range(20):
+        idam.Data("n=1000", i)
+        assert sum(os.path.getsize(f) for f in cache_files(path)) <= 40000
+    idam.setCache(None)
+    idam.reset_stats()
+    idam.Data("n=1000", 19)
+    assert idam.stats()["disk_cache_hits"] == 0
+
+def test_memcache():
+    idam.setMemoryCache(20000)  # Two signals of 1000 float32 times
+    a = idam.Data("n=1000", 1)
+    b = idam.Data("n=1000", 1)
+    info = idam.memoryCacheInfo()
+    assert info["hits"] == 1 and info["misses"] == 1 and info["entries"] == 1
+    assert info["bytes"] == 8000
+    assert b is not a and b.data is a.data and b.time is a.time
+    assert not b.data.flags.writeable and not b.time.flags.writeable
+    assert raises(ValueError, b.data.__setitem__, 0, 1.0)
+    assert b.data.copy().flags.writeable
+
+    # Not used for lazy or uncached reads
+    assert idam.Data("n=1000", 1, lazy=True).data is not a.data
+    assert idam.Data("n=1000", 1, cache=False).data is not a.data
+    assert idam.memoryCacheInfo()["hits"] == 1
+    assert idam.fetchMany([("n=1000", 1)])[0].data is a.data
+
+    for i in range(2, 6):
+        idam.Data("n=1000", i)
+    info = idam.memoryCacheInfo()
+    assert info["evictions"] == 3 and info["entries"] == 2
+    assert info["bytes"] <= 20000
+    assert idam.Data("n=1000", 1).data is not a.data  # Evicted
+
+    idam.setMemoryCache(0)
+    info = idam.memoryCacheInfo()
+    assert info["entries"] == 0 and info["bytes"] == 0
+
+def test_window():
+    s = "n=10000,dimtype=double,errors=asym"
+    full = idam.Data(s, 1)
+    t = full.time
+    # Bounds between samples, so rounding doesn't matter
+    for tmin, tmax, stride in [(1.0005e-3, 2.0005e-3, 1), (1.0005e-3, 2.0005e-3, 7),
+                               (None, 5.55e-5, 1), (9.9905e-3, None, 1), (-1.0, 1.0, 3)]:
+        kw = {"stride": stride}
+        keep = numpy.ones(len(t), bool)
+        if tmin is not None:
+            kw["tmin"] = tmin
+            keep &= t >= tmin
+        if tmax is not None:
+            kw["tmax"] = tmax
+            keep &= t <= tmax
+        d = idam.Data(s, 1, **kw)
+        for a, b in [(d.data, full.data), (d.errl, full.errl), (d.errh, full.errh), (d.time, t)]:
+            assert numpy.array_equal(a, b[keep][::stride])
+
+    d = idam.Data(s, 1, tmin=1.0, tmax=2.0)
+    assert len(d.data) == 0 and len(d.time) == 0
+
+    # Along the time axis of a 2D signal
+    s = "n=1000,rank=2,m=4"
+    full = idam.Data(s, 1)
+    d = idam.Data(s, 1, tmin=1.005e-4, tmax=3.005e-4, stride=2)
+    keep = numpy.arange(101, 301, 2)
+    assert close(d.time, full.time[keep])
+    assert numpy.array_equal(d.data, numpy.take(full.data, keep, axis=d.order))
+    assert numpy.array_equal(d.dim[1 - d.order].data, full.dim[1 - full.order].data)
+
+    assert raises(ValueError, idam.Data, s, 1, stride=0)
+    assert raises(ValueError, idam.Data, s, 1, tmin=float("nan"))
+
+def test_decimate():
+    d = idam.Data("n=100000,errors=sym", 1)
+    p = d.decimate(2000)
+    assert len(p.data) == 2000 and len(p.time) == 2000 and p.time is p.dim[0].data
+    assert p.errl is None and p.errh is None
+    assert p.data.max() == d.data.max() and p.data.min() == d.data.min()
+    assert numpy.all(numpy.diff(p.time) >= 0)
+    # Points of the signal, two from each interval of 100
+    i = numpy.searchsorted(d.time, p.time)
+    assert numpy.array_equal(d.time[i], p.time) and numpy.array_equal(d.data[i], p.data)
+    assert numpy.all(i[0::2] // 100 == numpy.arange(1000))
+    assert numpy.all(i[1::2] // 100 == numpy.arange(1000))
+
+    p = d.decimate(2000, method="mean")
+    assert len(p.data) == 2000
+    assert close(p.data, d.data.astype(float).reshape(2000, 50).mean(axis=1))
+    assert close(p.time, d.time.astype(float).reshape(2000, 50).mean(axis=1))
+
+    p = d.decimate(2000, method="lttb")
+    assert len(p.data) == 2000
+    assert p.time[0] == d.time[0] and p.data[-1] == d.data[-1]
+
+    # The same while reading
+    for method in ["minmax", "mean", "lttb"]:
+        r = idam.Data("n=100000,errors=sym", 1, decimate=2000, method=method)
+        p = d.decimate(2000, method=method)
+        assert numpy.array_equal(r.data, p.data) and numpy.array_equal(r.time, p.time)
+        assert r.errl is None
+
+    # Nothing to remove
+    d = idam.Data("n=100", 1)
+    p = d.decimate(2000)
+    assert numpy.array_equal(p.data, d.data) and numpy.array_equal(p.time, d.time)
+    assert numpy.array_equal(idam.Data("n=100", 1, decimate=2000).data, d.data)
+
+    # Integers are averaged afterwards
+    d = idam.Data("n=1000,type=short", 1, dtype="native")
+    assert d.decimate(10, method="mean").data.dtype == numpy.float64
+    assert raises(RuntimeError, idam.Data, "n=1000,type=short", 1, dtype="native",
+                  decimate=10, method="mean")
+
+    assert raises(ValueError, d.decimate, 1)
+    assert raises(ValueError, d.decimate, 10, method="median")
+    assert raises(ValueError, idam.Data("n=100,rank=2", 1).decimate, 10)
+    assert raises(RuntimeError, idam.Data, "n=100,rank=2", 1, decimate=10)
+
+def test_fetch():
+    import asyncio
+    idam.setWorkers(2)
+    reads = [("n=1000,latency=0.1", 1), ("n=10", 2), ("n=500,latency=0.05", 3), ("fail=1", 4)]
+
+    async def gather():
+        futures = [idam.fetch(s, shot) for s, shot in reads]
+        return await asyncio.gather(*futures, return_exceptions=True)
+    ds = asyncio.run(gather())
+    for (s, shot), n, d in zip(reads[:3], [1000, 10, 500], ds):
+        assert d.source == str(shot) and close(d.data, stub_data(n)) and close(d.time, stub_time(n))
+    assert isinstance(ds[3], RuntimeError)
+
+    # A read cancelled while queued isn't made
+    idam.setWorkers(1)
+    idam.reset_stats()
+    async def cancel():
+        first = idam.fetch("n=100,latency=0.2", 1)
+        second = idam.fetch("n=100", 2)
+        second.cancel()
+        d = await first
+        await asyncio.sleep(0.2)  # The worker moves on to the second
+        return d, second
+    d, second = asyncio.run(cancel())
+    assert close(d.data, stub_data(100)) and second.cancelled()
+    assert idam.stats()["requests"] == 1
+
+    assert raises(RuntimeError, idam.fetch, "n=10", 1)  # No running loop
+
+def test_client():
+    import threading
+    s = "n=1000,errors=sym"
+    c = idam.Client("localhost", 56565, verbose=True)
+    assert c.host == "localhost" and c.port == 56565
+    assert c.properties == {"verbose": True}
+    d = c.get(s, 1)
+    e = idam.Data(s, 1)
+    assert numpy.array_equal(d.data, e.data) and numpy.array_equal(d.time, e.time)
+    assert numpy.array_equal(d.errl, e.errl) and d.label == e.label
+    assert not idam.getProperty("verbose")  # Only set for the client's requests
+    assert numpy.array_equal(c.fetchMany([(s, 1)])[0].data, e.data)
+    assert c.describe(s, 1)["shape"] == (1000,)
+    assert numpy.array_equal(numpy.concatenate([x.data for x in c.stream(s, 1, chunk=400)]), e.data)
+
+    c.setProperty("verbose", False)
+    c.setProperty("get_datadble")
+    assert c.properties == {"verbose": False, "get_datadble": True}
+    assert not idam.getProperty("verbose") and not idam.getProperty("get_datadble")
+    assert idam.Client().properties == {}
+
+    # Properties are part of the cache key
+    idam.setCache(tempdir())
+    idam.reset_stats()
+    idam.Data(s, 2)
+    a = idam.Client(verbose=True)
+    a.get(s, 2)
+    idam.Client(verbose=False).get(s, 2)
+    assert idam.stats()["disk_cache_hits"] == 0
+    assert close(a.get(s, 2).data, stub_data(1000))
+    assert idam.Client(verbose=True).get(s, 2).data.shape == (1000,)
+    assert idam.stats()["disk_cache_hits"] == 2
+    idam.setCache(None)
+
+    # Clients in different threads
+    got = {}
+    def read(client, shot):
+        got[shot] = [client.get("n=1000,latency=0.02", shot) for i in range(5)]
+    threads = [threading.Thread(target=read, args=(idam.Client(verbose=(i == 0)), i))
+               for i in range(2)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    assert sorted(got) == [0, 1]
+    assert all(close(x.data, stub_data(1000)) for ds in got.values() for x in ds)
+    assert not idam.getProperty("verbose")
+
+def test_dedup():
+    import gc
+    a = idam.Data("n=1000", 1)
+    b = idam.Data("n=1000", 2)
+    assert a.time is not b.time and a.time.flags.writeable  # Off by default
+
+    idam.setDedup(True)
+    idam.reset_stats()
+    a = idam.Data("n=1000", 1)
+    assert not a.time.flags.writeable  # Read-only from the first read
+    assert a.data.flags.writeable      # Only dimensions are shared
+    b = idam.Data("n=1000,errors=sym", 2)
+    assert b.time is a.time and b.dim[0].data is a.time
+    assert idam.stats()["shared_dimensions"] == 1
+
+    # Different time bases aren't shared
+    for s in ["n=500", "n=1000,dimtype=double"]:
+        c = idam.Data(s, 1)
+        assert c.time is not a.time and not c.time.flags.writeable
+    assert idam.stats()["shared_dimensions"] == 1
+
+    # The same time base in other shapes, or created lazily
+    d = idam.Data("n=1000,rank=2,m=4", 1)
+    assert d.time is a.time and not d.dim[1 - d.order].data.flags.writeable
+    assert idam.Data("n=1000", 3, lazy=True).time is a.time
+    assert idam.stats()["shared_dimensions"] == 3
+
+    # Forgotten once no longer used
+    del a, b, d
+    gc.collect()
+    e = idam.Data("n=1000", 4)
+    assert idam.stats()["shared_dimensions"] == 3
+    assert idam.Data("n=1000", 5).time is e.time
+
+    idam.setDedup(False)
+    f = idam.Data("n=1000", 6)
+    assert f.time is not e.time and f.time.flags.writeable
+
+def test_trace():
+    import logging
+    idam.Data("n=10", 1)
+    assert idam.trace()["traceEvents"] == []  # Off by default
+
+    idam.setTrace(True)
+    idam.Data("n=10", 1)
+    t = idam.trace()
+    assert t["displayTimeUnit"] == "ms"
+    events = t["traceEvents"]
+    assert [e["name"] for e in events] == ["lock_wait", "server", "objects", "cache_write",
+                                           "convert", "total"]
+    assert all(e["ph"] == "X" and e["cat"] == "idam" and e["args"] == {"signal": "n=10"} and
+               e["pid"] == os.getpid() and e["tid"] == events[0]["tid"] for e in events)
+    total = events[-1]
+    assert all(e["ts"] >= total["ts"] and e["ts"] + e["dur"] <= total["ts"] + total["dur"] + 1
+               for e in events)
+
+    # From the disk cache
+    idam.setCache(tempdir())
+    idam.Data("n=10", 2)
+    idam.reset_stats()
+    assert idam.trace()["traceEvents"] == []
+    idam.Data("n=10", 2)
+    assert "disk_cache" in [e["name"] for e in idam.trace()["traceEvents"]]
+    idam.setCache(None)
+
+    idam.setTrace(False)
+    idam.reset_stats()
+    idam.Data("n=10", 1)
+    assert idam.trace()["traceEvents"] == []
+
+    # Messages go to the "idam" logger
+    class Handler(logging.Handler):
+        def __init__(self):
+            logging.Handler.__init__(self)
+            self.records = []
+        def emit(self, record):
+            self.records.append(record)
+    log = logging.getLogger("idam")
+    h = Handler()
+    log.addHandler(h)
+    idam.Data("n=10", 1)
+    assert h.records == []  # Not enabled
+    log.setLevel(logging.DEBUG)
+    idam.Data("n=10", 1)
+    assert [r.levelno for r in h.records] == [logging.DEBUG]
+    assert h.records[0].getMessage().startswith("Reading 'n=10' from '1' on ")
+    assert raises(RuntimeError, idam.Data, "fail=1", 3)
+    assert h.records[-1].getMessage() == "IDAM error: Stub signal set to fail"
+
+def same_data(a, b):
+    """ Same values, types, labels and units """
+    if a.label != b.label or a.units != b.units or a.desc != b.desc or len(a.dim) != len(b.dim):
+        return False
+    pairs = [(a.data, b.data), (a.errl, b.errl), (a.errh, b.errh)]
+    for x, y in zip(a.dim, b.dim):
+        if x.label != y.label or x.units != y.units:
+            return False
+        pairs.append((x.data, y.data))
+    for x, y in pairs:
+        if (x is None) != (y is None) or (x is not None and not same(x, y)):
+            return False
+    return True
+
+def test_backend():
+    import time
+    import gc
+    path = tempdir()
+    signals = ["n=1000,rank=2,m=4,errors=asym,latency=0.2",
+               "n=1000,type=short,dimtype=double,errors=sym,latency=0.2"]
+    s = signals[1]
+    options = [{}, {"dtype": "native"}, {"tmin": 1.005e-4, "tmax": 6.005e-4, "stride": 3},
+               {"decimate": 100}, {"decimate": 100, "method": "mean"}]
+    assert idam.getBackend() == ("live", None)
+    assert raises(ValueError, idam.setBackend, "replay")
+    assert raises(ValueError, idam.setBackend, "other", path)
+
+    # Each signal is saved once, whatever the options
+    idam.setBackend("record", path)
+    assert idam.getBackend() == ("record", path)
+    live = [idam.Data(t, 1, dtype="native") for t in signals]
+    want = [idam.Data(s, 1, **opt) for opt in options]
+    held = idam.Data(signals[0], 1, lazy=True)
+    recs = [os.path.join(path, f) for f in os.listdir(path) if f.endswith(".rec")]
+    assert len(recs) == 2
+    for f in recs:
+        with open(f, "rb") as fp:
+            assert fp.read(8) == b"IDAMREC1"
+
+    # Replayed without the server (whose latency isn't paid), and
+    # with options applied as when live
+    idam.setBackend("replay", path)
+    assert idam.getBackend() == ("replay", path)
+    assert numpy.array_equal(held.data, live[0].data)  # Still the recording backend's handle
+    del held
+    gc.collect()
+    idam.reset_stats()
+    start = time.time()
+    for t, d in zip(signals, live):
+        assert same_data(idam.Data(t, 1, dtype="native"), d)
+    assert time.time() - start < 0.2
+    assert idam.stats()["requests"] == 2
+    for opt, d in zip(options, want):
+        assert same_data(idam.Data(s, 1, **opt), d)
+
+    # Only what was recorded
+    assert raises(RuntimeError, idam.Data, "n=1000", 1)
+    assert raises(RuntimeError, idam.Data, s, 2)
+    assert raises(RuntimeError, idam.Data, s, 1, host="elsewhere")
+
+    # Arrays sharing a mapped recording outlive the backend
+    r = idam.Data(s, 1, dtype="native", copy=False)
+    idam.setBackend("live")
+    assert idam.getBackend() == ("live", None)
+    assert same_data(r, live[1])
+    del r
+    gc.collect()
+    assert same_data(idam.Data(s, 1, dtype="native"), live[1])
+
+def test_arrow():
+    import gc
+    try:
+        import pyarrow
+    except ImportError:
+        raise Skip("needs pyarrow")
+    s = "n=1000,errors=asym"
+    d = idam.Data(s, 15100, copy=False)
+    want = [d.time.copy(), d.data.copy(), d.errl.copy(), d.errh.copy()]
+    b = d.to_arrow()
+    assert isinstance(b, pyarrow.RecordBatch) and b.num_rows == 1000
+    assert b.schema.names == ["time", "data", "errl", "errh"]
+    for name, a in zip(b.schema.names, want):
+        assert b.schema.field(name).type == pyarrow.float32()
+        assert numpy.array_equal(b.column(name).to_numpy(), a)
+    assert b.schema.metadata == {b"name": s.encode(), b"source": b"15100",
+                                 b"desc": d.desc.encode()}
+    assert b.schema.field("time").metadata == {b"label": b"Time (sec)", b"units": b"s"}
+    assert b.schema.field("errh").metadata == {b"label": b"Stub signal", b"units": b"A"}
+    assert pyarrow.record_batch(d).equals(b)
+    assert d.__arrow_c_schema__() is not None and len(d.__arrow_c_array__()) == 2
+
+    # The arrays are kept (with IDAM's buffers) while Arrow uses them
+    del d
+    gc.collect()
+    junk = [idam.Data(s, i, copy=False) for i in range(10)]
+    for name, a in zip(b.schema.names, want):
+        assert numpy.array_equal(b.column(name).to_numpy(), a)
+    del b
+    gc.collect()
+
+    # Only columns which aren't None, of IDAM's types
+    b = idam.Data("n=10,type=short,dimtype=double", 1, dtype="native").to_arrow()
+    assert b.schema.names == ["time", "data"]
+    assert b.schema.field("data").type == pyarrow.int16()
+    assert b.schema.field("time").type == pyarrow.float64()
+
+    # More dimensions give a fixed size list at each time, once
+    # time is first
+    d = idam.Data("n=100,rank=2,m=4,errors=sym", 1)
+    assert d.order == 1 and raises(ValueError, d.to_arrow)
+    d.data, d.errl, d.errh = d.data.T, d.errl.T, d.errh.T
+    d.dim, d.order = d.dim[::-1], 0
+    b = d.to_arrow()
+    assert b.num_rows == 100
+    for name in ["data", "errl", "errh"]:
+        assert b.schema.field(name).type == pyarrow.list_(pyarrow.float32(), 4)
+        values = b.column(name).flatten().to_numpy().reshape(100, 4)
+        assert numpy.array_equal(values, getattr(d, name))
+    assert b.schema.field("data").metadata == {b"label": b"Stub signal", b"units": b"A"}
+
+    # Lists, keeping exceptions
+    ds = idam.fetchMany([("n=10", 1), ("fail=1", 2), ("n=20", 3)])
+    bs = idam.to_arrow(ds)
+    assert [b.num_rows for b in bs[0::2]] == [10, 20]
+    assert bs[1] is ds[1]
+    assert idam.to_arrow([]) == []
+    assert raises(TypeError, idam.to_arrow, [1])
+
+def joined(chunks, name, axis):
+    return numpy.concatenate([getattr(c, name) for c in chunks], axis=axis)
+
+def test_stream():
+    import threading
+    s = "n=1000,rank=2,m=4,errors=asym"
+    full = idam.Data(s, 1)
+    st = idam.stream(s, 1, chunk=300)
+    assert st.ntimes == 1000 and st.chunk == 300 and st.order == full.order
+    assert st.label == full.label and st.units == full.units
+    assert numpy.array_equal(st.dim[st.order].data, full.time)
+    chunks = list(st)
+    assert [c.data.shape[st.order] for c in chunks] == [300, 300, 300, 100]
+    assert [len(c.time) for c in chunks] == [300, 300, 300, 100]
+    for name in ["data", "errl", "errh"]:
+        assert numpy.array_equal(joined(chunks, name, st.order), getattr(full, name))
+    assert numpy.array_equal(joined(chunks, "time", 0), full.time)
+    assert list(st) == []
+
+    # Chunks of the whole signal
+    for chunk in [1000, 5000]:
+        chunks = list(idam.stream(s, 1, chunk=chunk))
+        assert len(chunks) == 1 and numpy.array_equal(chunks[0].data, full.data)
+
+    # Within a window
+    w = idam.Data(s, 1, tmin=1.005e-4, tmax=6.005e-4, stride=3)
+    chunks = list(idam.stream(s, 1, chunk=64, tmin=1.005e-4, tmax=6.005e-4, stride=3))
+    assert numpy.array_equal(joined(chunks, "data", st.order), w.data)
+    assert numpy.array_equal(joined(chunks, "time", 0), w.time)
+
+    chunks = list(idam.stream("n=100,type=short", 1, chunk=30, dtype="native"))
+    assert chunks[0].data.dtype == numpy.int16 and len(chunks) == 4
+
+    # Threads sharing a stream each get different chunks
+    full = idam.Data("n=10000", 1)
+    st = idam.stream("n=10000", 1, chunk=7)
+    got = []
+    def take():
+        for c in st:
+            got.append((c.time[0], c))
+    threads = [threading.Thread(target=take) for i in range(4)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    got.sort(key=lambda x: x[0])
+    assert len(got) == (10000 + 6) // 7
+    assert numpy.array_equal(joined([c for t, c in got], "data", 0), full.data)
+
+    # Saved to the disk cache, and read from it the next time
+    idam.setCache(tempdir())
+    idam.reset_stats()
+    s = "n=1000,type=short,errors=sym"
+    full = idam.Data(s, 2, cache=False)
+    for i in range(2):
+        chunks = list(idam.stream(s, 2, chunk=300))
+        assert numpy.array_equal(joined(chunks, "data", 0), full.data)
+        assert numpy.array_equal(joined(chunks, "errl", 0), full.errl)
+    assert idam.stats()["disk_cache_hits"] == 1
+
+    assert raises(RuntimeError, idam.stream, "fail=1", 1)
+
+def test_prefetch():
+    import time
+    s = "n=1000,latency=0.05"
+    direct = idam.Data(s, 1)
+    assert raises(ValueError, idam.setPrefetch, -1)
+    idam.setPrefetch(2)
+    info = idam.prefetchInfo()
+    assert info["depth"] == 2 and info["issued"] == 0 and info["entries"] == 0
+
+    # Shots 4 on are read ahead, once 1, 2, 3 show the step
+    ds = [idam.Data(s, shot) for shot in range(1, 11)]
+    info = idam.prefetchInfo()
+    assert info["issued"] == 9 and info["hits"] == 7 and info["misses"] == 3
+    assert abs(info["hit_rate"] - 0.7) < 1e-9
+    for shot, d in enumerate(ds, 1):
+        assert d.source == str(shot)
+        assert numpy.array_equal(d.data, direct.data) and numpy.array_equal(d.time, direct.time)
+
+    # 11 and 12 wait to be used, then are wasted when the sequence breaks
+    time.sleep(0.5)
+    info = idam.prefetchInfo()
+    assert info["entries"] == 2 and info["bytes"] == 2*8000
+    idam.Data(s, 3)
+    info = idam.prefetchInfo()
+    assert info["entries"] == 0 and info["bytes"] == 0
+    assert info["wasted"] == 2 and info["wasted_bytes"] == 2*8000 and info["cancelled"] == 0
+
+    # Reads in progress or queued are cancelled
+    s = "n=1000,latency=0.2"
+    for shot in [20, 21, 22]:
+        idam.Data(s, shot)
+    idam.Data(s, 1)
+    time.sleep(1.0)
+    info = idam.prefetchInfo()
+    assert info["entries"] == 0 and info["cancelled"] + info["wasted"] == 4
+
+    # Failed reads are read again when asked for
+    for shot in range(1, 5):
+        assert raises(RuntimeError, idam.Data, "fail=1", shot)
+    time.sleep(0.2)
+    info = idam.prefetchInfo()
+    assert info["failed"] == 3 and info["hits"] == 7
+
+    idam.setPrefetch(0)
+    info = idam.prefetchInfo()
+    assert info["depth"] == 0 and info["entries"] == 0 and info["bytes"] == 0
+
+def test_timeout():
+    import threading
+    import time
+    assert issubclass(idam.TimeoutError, RuntimeError)
+    assert issubclass(idam.CancelledError, RuntimeError)
+    idam.reset_stats()
+    start = time.time()
+    assert raises(idam.TimeoutError, idam.Data, "n=10,latency=1", 1, timeout=0.1)
+    assert time.time() - start < 0.9
+    assert idam.stats()["timeouts"] == 1
+    # The read carries on in the background, and the next waits for it
+    d = idam.Data("n=10", 2, timeout=5)
+    assert close(d.data, stub_data(10))
+
+    assert idam.setTimeout(timeout=0.1)["timeout"] == 0.1
+    assert raises(idam.TimeoutError, idam.Data, "n=10,latency=1", 3)
+    assert idam.setTimeout(timeout=0)["timeout"] == 0
+    assert idam.stats()["timeouts"] == 2
+
+    # Cancelled from another thread
+    got = []
+    def read():
+        try:
+            idam.Data("n=10,latency=1", 4, timeout=30)
+            got.append("read")
+        except idam.CancelledError:
+            got.append("cancelled")
+    t = threading.Thread(target=read)
+    t.start()
+    time.sleep(0.2)
+    assert idam.cancel(threading.current_thread().ident) == 0
+    start = time.time()
+    assert idam.cancel(t.ident) == 1
+    t.join()
+    assert time.time() - start < 0.5
+    assert got == ["cancelled"]
+    assert idam.stats()["cancelled"] == 1
+    assert idam.cancel() == 0
+
+def test_servers():
+    import socket
+    # A server which accepts connections, and a port nobody listens on
+    up = socket.socket()
+    up.bind(("127.0.0.1", 0))
+    up.listen(16)
+    live = up.getsockname()[1]
+    down = socket.socket()
+    down.bind(("127.0.0.1", 0))
+    dead = down.getsockname()[1]
+    down.close()
+
+    assert idam.serverInfo() == []
+    assert raises(ValueError, idam.setServers, ["127.0.0.1:0"])
+    idam.setServers(["127.0.0.1:%d" % dead, ("127.0.0.1", live)])
+    info = idam.serverInfo()
+    assert [(i["host"], i["port"]) for i in info] == [("127.0.0.1", dead), ("127.0.0.1", live)]
+    assert all(i["requests"] == 0 and i["latency"] is None for i in info)
+
+    # The dead mirror is tried first, then left out
+    for shot in range(5):
+        assert close(idam.Data("n=100", shot).data, stub_data(100))
+    bad, good = idam.serverInfo()
+    assert bad["failures"] == 1 and bad["requests"] == 0 and bad["down"] > 0
+    assert not bad["current"]
+    assert good["requests"] == 5 and good["failures"] == 0
+    assert good["latency"] is not None and good["current"]
+
+    # host= goes straight to that server
+    assert raises(RuntimeError, idam.Data, "n=100", 1, host="127.0.0.1", port=dead,
+                  connect_timeout=1)
+    assert idam.Data("n=100", 1, host="127.0.0.1", port=live, connect_timeout=1).data.shape == (100,)
+    assert [(i["requests"], i["failures"]) for i in idam.serverInfo()] == [(0, 1), (5, 0)]
+
+    idam.setServers(None)
+    assert idam.serverInfo() == []
+    assert idam.Data("n=100", 1).data.shape == (100,)
+
+    # Set from the environment
+    env = dict(os.environ, PYTHONPATH=os.path.dirname(os.path.abspath(__file__)),
+               IDAM_SERVERS="127.0.0.1:%d,127.0.0.1:%d" % (dead, live))
+    out = subprocess.check_output([sys.executable, "-c", "import idam; idam.Data('n=10', 1); "
+                                   "print(' '.join('%d %d %d' % (i['port'], i['requests'], i['failures']) "
+                                   "for i in idam.serverInfo()))"], env=env)
+    assert out.decode().split() == [str(dead), "0", "1", str(live), "1", "0"]
+    up.close()
+
+def test_out():
+    s = "n=1000,errors=asym"
+    d = idam.Data(s, 1)
+    arrays = [d.data, d.errl, d.errh, d.time]
+    for a in arrays:
+        a[:] = 0
+    e = idam.Data(s, 2, out=d)
+    assert all(x is y for x, y in zip([e.data, e.errl, e.errh, e.time], arrays))
+    assert close(e.data, stub_data(1000)) and numpy.all(e.errh == 2.0)
+    assert close(e.time, stub_time(1000))
+
+    # Just the data, the rest created as usual
+    a = numpy.zeros(1000, numpy.float32)
+    e = idam.Data(s, 3, out=a)
+    assert e.data is a and close(a, stub_data(1000))
+    assert close(e.time, stub_time(1000))
+    n = numpy.zeros(1000, numpy.int16)
+    assert idam.Data("n=1000,type=short", 1, dtype="native", out=n).data is n
+
+    readonly = numpy.zeros(1000, numpy.float32)
+    readonly.flags.writeable = False
+    for bad in [numpy.zeros(999, numpy.float32), numpy.zeros(1000, numpy.float64),
+                numpy.zeros((1000, 1), numpy.float32), numpy.zeros(2000, numpy.float32)[::2],
+                readonly]:
+        assert raises(ValueError, idam.Data, s, 1, out=bad)
+    assert raises(TypeError, idam.Data, s, 1, out=[0.0]*1000)
+    assert raises(ValueError, idam.Data, s, 1, out=a, lazy=True)
+
+    handle = idam.getAPI(s, "1")
+    b = numpy.zeros(1000, numpy.float32)
+    assert idam.readData(handle, out=b) is b
+    assert raises(ValueError, idam.readData, handle, out=numpy.zeros(10, numpy.float32))
+    idam.freeAPI(handle)
+    assert close(b, stub_data(1000))
+
+def test_pool():
+    import gc
+    idam.setBufferPool(2**20)
+    d = idam.Data("n=1000", 1)
+    info = idam.bufferPoolInfo()
+    assert info["misses"] == 2 and info["hits"] == 0  # data and time
+    del d
+    gc.collect()
+    info = idam.bufferPoolInfo()
+    assert info["buffers"] == 2 and info["bytes"] == 8000
+    d = idam.Data("n=1000", 2)
+    info = idam.bufferPoolInfo()
+    assert info["hits"] == 2 and info["buffers"] == 0 and info["bytes"] == 0
+    assert close(d.data, stub_data(1000)) and close(d.time, stub_time(1000))
+
+    # Only kept up to maxsize
+    idam.setBufferPool(4000)
+    del d
+    gc.collect()
+    assert idam.bufferPoolInfo()["buffers"] == 1
+    idam.setBufferPool(0)
+    info = idam.bufferPoolInfo()
+    assert info["buffers"] == 0 and info["bytes"] == 0
+
+def test_describe():
+    s = "n=1000,rank=2,m=4,type=short,dimtype=double,errors=asym"
+    d = idam.Data(s, 1, dtype="native")
+    info = idam.describe(s, 1)
+    assert info["name"] == s
+    assert info["label"] == d.label and info["units"] == d.units and info["desc"] == d.desc
+    assert info["rank"] == 2 and info["shape"] == d.data.shape and info["order"] == d.order
+    assert info["dtype"] == numpy.int16 and info["errors"] == numpy.int16
+    assert info["asymmetric"] is True
+    assert len(info["dim"]) == 2
+    for i, dim in enumerate(info["dim"]):
+        assert dim["label"] == d.dim[i].label and dim["units"] == d.dim[i].units
+        assert dim["size"] == len(d.dim[i].data)
+        assert dim["dtype"] == d.dim[i].data.dtype and dim["errors"] is None
+
+    info = idam.describe("n=10,errors=sym", 1)
+    assert info["errors"] == numpy.float32 and info["asymmetric"] is False
+    info = idam.describe("n=10,errors=sym", 1, errors=False)
+    assert info["errors"] is None
+    assert raises(RuntimeError, idam.describe, "fail=1", 1)
+
+    infos = idam.describeMany([("n=10", 1), ("fail=1", 2), ("n=20", 3)], workers=2)
+    assert [i["shape"] for i in infos[0::2]] == [(10,), (20,)]
+    assert isinstance(infos[1], RuntimeError)
+
+    # Signals in the disk cache aren't read again, if cached with
+    # IDAM's types. Files of converted arrays aren't used
+    idam.setCache(tempdir())
+    s = "n=10,type=short,dimtype=double"
+    idam.Data(s, 1)
+    info = idam.describe(s, 1)
+    assert info["dtype"] == numpy.int16 and info["dim"][0]["dtype"] == numpy.float64
+    idam.Data(s, 2, dtype="native")
+    idam.reset_stats()
+    info = idam.describe(s, 2)
+    assert info["dtype"] == numpy.int16 and info["dim"][0]["dtype"] == numpy.float64
+    assert idam.stats()["disk_cache_hits"] == 1
+
+def test_transform():
+    s = "n=1000,type=short,dimtype=double,errors=asym"
+    raw = idam.Data(s, 1, dtype="native").data.astype(float)
+    d = idam.Data(s, 1, dtype="native", scale=2.0, offset=1.0)
+    assert d.data.dtype == numpy.float32 and d.errl.dtype == numpy.float32
+    assert close(d.data, raw*2.0 + 1.0)
+    assert numpy.all(d.errl == 2.0) and numpy.all(d.errh == 4.0)
+    assert d.units == "A"
+
+    # Units differing in prefix, scaling errors too
+    d = idam.Data(s, 1, scale=2.0, offset=1.0, units="mA")
+    assert d.units == "mA"
+    assert numpy.allclose(d.data, (raw*2.0 + 1.0)*1e3, rtol=1e-6)
+    assert numpy.all(d.errl == 2e3)
+    assert raises(ValueError, idam.Data, s, 1, units="V")
+
+    # Values outside valid are NaN, and left out of the baseline
+    valid = (raw >= -50.5) & (raw <= 50.5)
+    d = idam.Data(s, 1, valid=(-50.5, 50.5))
+    assert numpy.array_equal(numpy.isnan(d.data), ~valid)
+    assert numpy.array_equal(d.data[valid], raw[valid].astype(numpy.float32))
+    first = slice(0, 100)  # Times up to 9.95e-5
+    d = idam.Data(s, 1, baseline=(-1.0, 9.95e-5), valid=(-50.5, 50.5))
+    base = raw[first][valid[first]].mean()
+    assert numpy.allclose(d.data[valid], raw[valid] - base, atol=1e-4)
+
+    # Double data stays double
+    d = idam.Data("n=100,type=double", 1, dtype="native", scale=0.5)
+    assert d.data.dtype == numpy.float64
+
+    # The same from the disk cache and fetchMany
+    idam.setCache(tempdir())
+    idam.Data(s, 1)
+    d = idam.Data(s, 1, scale=2.0, offset=1.0)
+    assert close(d.data, raw*2.0 + 1.0)
+    d = idam.fetchMany([(s, 1)], scale=2.0, offset=1.0)[0]
+    assert close(d.data, raw*2.0 + 1.0)
+
+    assert raises(ValueError, idam.Data, s, 1, scale=2.0, lazy=True)
+    assert raises(ValueError, idam.Data, s, 1, baseline=(1.0, 0.0))
+    assert raises(ValueError, idam.Data, s, 1, baseline=(2.0, 3.0))
+
+def align_ref(d, t, method, fill=numpy.nan):
+    """ What align() should give for one signal """
+    time = d.time.astype(float)
+    data = d.data.astype(float)
+    out = numpy.empty(len(t))
+    out[:] = fill
+    inside = (t >= time[0]) & (t <= time[-1])
+    x = t[inside]
+    i = numpy.clip(numpy.searchsorted(time, x, side="right") - 1, 0, len(time) - 2)
+    t1, t2, d1, d2 = time[i], time[i+1], data[i], data[i+1]
+    if method == "linear":
+        out[inside] = d1 + (d2 - d1)*((x - t1)/(t2 - t1))
+    elif method == "nearest":
+        out[inside] = numpy.where(x - t1 <= t2 - x, d1, d2)
+    else:
+        out[inside] = numpy.where(x >= t2, d2, d1)
+    return out
+
+def test_align():
+    ds = [idam.Data("n=1000", 1), idam.Data("n=500,dimtype=double", 2),
+          idam.Data("n=2000,type=short", 3, dtype="native")]
+    # Between samples, on them, and outside some of the signals
+    t = numpy.concatenate([1e-6*(numpy.arange(0, 1200, 7) + 0.3),
+                           1e-6*(numpy.arange(0, 1200, 7) + 0.7),
+                           ds[0].time[::13].astype(float), [-1.0, 1.0]])
+    for method in ["linear", "nearest", "zoh"]:
+        a = idam.align(ds, t, method=method)
+        assert a.shape == (3, len(t)) and a.dtype == numpy.float64
+        for row, d in zip(a, ds):
+            ref = align_ref(d, t, method)
+            assert numpy.array_equal(numpy.isnan(row), numpy.isnan(ref))
+            assert numpy.allclose(row[~numpy.isnan(row)], ref[~numpy.isnan(ref)], rtol=1e-12)
+        for workers in [1, 4]:
+            assert same(idam.align(ds, t, method=method, workers=workers), a)
+    a = idam.align(ds, t, fill=0.0)
+    assert numpy.allclose(a[1], align_ref(ds[1], t, "linear", fill=0.0), rtol=1e-12)
+    assert idam.align(ds, []).shape == (3, 0)
+    assert idam.align([], t).shape == (0, len(t))
+
+    assert raises(ValueError, idam.align, ds, t, method="cubic")
+    assert raises(ValueError, idam.align, [idam.Data("n=100,rank=2", 1)], t)
+
+def segments():
+    """ This user's shared memory segments, if they can be listed """
+    if not os.path.isdir("/dev/shm"):
+        return set()
+    prefix = "idam%d." % os.getuid()
+    return set(f for f in os.listdir("/dev/shm") if f.startswith(prefix))
+
+# Run in another process, given a pickled Data (in hex) and a signal
+CHILD = """
+import sys, pickle, binascii, idam
+d = pickle.loads(binascii.unhexlify(sys.argv[1].encode()))
+idam.setSharedMemory(2**24)
+idam.reset_stats()
+e = idam.Data(sys.argv[2], 1)
+idam.Data("n=10", 99)  # Only held here, so removed at exit
+print("%r %d" % (float(d.data.sum()), idam.stats()["shared_memory_hits"]))
+"""
+
+def test_shared():
+    import gc
+    import pickle
+    import binascii
+    s = "n=1000,errors=asym"
+    assert raises(TypeError, pickle.dumps, idam.Data(s, 1))
+    idam.setSharedMemory(2**24)
+
+    before = segments()
+    d = idam.Data(s, 1)
+    name = d.__reduce__()[1][0]
+    assert len(name) <= 31  # PSHMNAMLEN on macOS
+    p = pickle.dumps(d)
+    assert len(p) < 1000
+    info = idam.sharedMemoryInfo()
+    assert info["held"] >= 1 and info["pinned"] == 1
+    if os.path.isdir("/dev/shm"):
+        assert segments() - before == set([name[1:]])
+        assert info["segments"] >= 1
+
+    e = pickle.loads(p)
+    assert e.name == d.name and e.source == d.source and e.label == d.label
+    for x, y in [(e.data, d.data), (e.errl, d.errl), (e.errh, d.errh), (e.time, d.time)]:
+        assert numpy.array_equal(x, y)
+    e.data[0] = 1234.  # Not pickled
+    assert pickle.loads(p).data[0] == d.data[0]
+
+    # Another process maps the segment, for a pickle or the same request
+    env = dict(os.environ, PYTHONPATH=os.path.dirname(os.path.abspath(__file__)))
+    before = segments()
+    out = subprocess.check_output([sys.executable, "-c", CHILD,
+                                   binascii.hexlify(p).decode(), s], env=env)
+    assert out.decode().split() == [repr(float(d.data.sum())), "1"]
+    assert segments() == before
+
+    # Removed when the last user lets go, once unpinned
+    del d, e
+    gc.collect()
+    if os.path.isdir("/dev/shm"):
+        assert name[1:] in segments()
+    idam.setSharedMemory(0)
+    assert idam.sharedMemoryInfo()["pinned"] == 0
+    assert name[1:] not in segments()
+    assert raises(RuntimeError, pickle.loads, p)
+
+    idam.setSharedMemory(2**24)
+    before = segments()
+    d = idam.Data("n=10", 2)
+    if os.path.isdir("/dev/shm"):
+        assert len(segments() - before) == 1
+    del d
+    gc.collect()
+    assert segments() == before
+
+    # Signals from the disk cache are shared too
+    path = tempdir()
+    idam.setCache(path)
+    idam.setSharedMemory(0)
+    idam.Data(s, 3)
+    idam.setSharedMemory(2**24)
+    idam.reset_stats()
+    d = idam.Data(s, 3)
+    assert idam.stats()["disk_cache_hits"] == 1
+    assert numpy.array_equal(pickle.loads(pickle.dumps(d)).data, d.data)
+
+    # describe() and stream() don't make segments, whether the
+    # signal comes from the server or the disk cache
+    idam.setSharedMemory(0)
+    idam.Data(s, 5)
+    idam.setSharedMemory(2**24)
+    before, held = segments(), idam.sharedMemoryInfo()["held"]
+    idam.reset_stats()
+    idam.describe(s, 4)
+    assert len(cache_files(path)) == 2  # Nor cache files
+    for shot in [4, 5]:
+        st = idam.stream(s, shot, chunk=100)
+        assert segments() == before and idam.sharedMemoryInfo()["held"] == held
+        assert numpy.array_equal(next(st).data, d.data[:100])
+        del st
+    assert idam.stats()["disk_cache_hits"] == 1
+
+    # Not shared once maxsize is reached
+    idam.setSharedMemory(1000)
+    assert raises(TypeError, pickle.dumps, idam.Data("n=100000", 1))
+
+def run(name):
+    """ Run one test in this process """
+    try:
+        globals()["test_" + name]()
+    except Skip as e:
+        print("%s: %s" % (name, e))
+        sys.exit(SKIPPED)
+
+def main(argv):
+    names = []
+    args = iter(argv)
+    for a in args:
+        if a == "--run":
+            # Run one test. Used by the parent
+            run(next(args))
+            return 0
+        names.append(a)
+
+    if not names:
+        tests = [(f.__code__.co_firstlineno, name[5:]) for name, f in globals().items()
+                 if name.startswith("test_")]
+        names = [name for line, name in sorted(tests)]
+
+    failed = []
+    for name in names:
+        sys.stdout.flush()
+        ret = subprocess.call([sys.executable, os.path.abspath(__file__), "--run", name])
+        print("%-14s %s" % (name, {0: "ok", SKIPPED: "skipped"}.get(ret, "FAIL")))
+        if ret not in (0, SKIPPED):
+            failed.append(name)
+
+    if failed:
+        print("FAILED " + " ".join(failed))
+        return 1
+    return 0
+
+if __name__ == "__main__":
+    sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+    import idam
+    sys.exit(main(sys.argv[1:]))
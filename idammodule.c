@@ -4,8 +4,10 @@
  * Access to IDA and MDS+ data, using D.G.Muir's IDAM library
  *
  * Known issues:
- * - Hangs if server cannot be contacted
- * - This code is not thread-safe, despite being a shared library
+ * - Hangs if server cannot be contacted, unless a connect timeout
+ *   is set with setTimeout()
+ * - The IDAM library is not thread-safe, so calls into it are
+ *   serialised by a lock. The GIL is released while waiting.
  *
  * Released July 2009 under the BSD license:
  *
@@ -49,6 +51,27 @@
 /* For defining types */
 #include "structmember.h"
 
+/* For locking the IDAM library */
+#include "pythread.h"
+
+/* For the disk cache */
+#include <stdint.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <stdarg.h>
+
 /* For numeric arrays */
 /*#include "Numeric/arrayobject.h" */
 #include "numpy/arrayobject.h"
@@ -69,286 +92,8336 @@
 #endif
 
 #if PY_MAJOR_VERSION >= 3
-const char* StringToChars(PyObject *s)
-{
-  PyObject* obj;
-  const char* ch;
-  
-  obj = PyUnicode_AsUTF8String(s);
-  if(obj == NULL)
-    return NULL;
-  
-  ch = PyBytes_AsString(obj);
-  Py_DECREF(obj);
-  
-  return ch;
-}
-
+/* NB: The UTF-8 buffer is cached in the string object, so stays
+   valid for as long as s does */
+#define StringToChars (const char*) PyUnicode_AsUTF8
 #define CharsToString PyUnicode_FromString
+#define InternString  PyUnicode_InternFromString
 #else
 #define StringToChars PyString_AsString
 #define CharsToString PyString_FromString
+#define InternString  PyString_InternFromString
 #endif
 
-static PyObject*
-idam_test(PyObject *self, PyObject *args)
-{
-  const char *str;
-  int ret;
-  if(!PyArg_ParseTuple(args, "s", &str))
-    return NULL;
+/************************************************************
+ * Locking
+ *
+ * The IDAM library keeps the server connection, data blocks
+ * and properties in globals, so every call into it must hold
+ * idam_lock. The lock is only taken with the GIL released,
+ * and code holding it must not touch Python objects.
+ ************************************************************/
 
-  printf("String: %s\n", str);
+static PyThread_type_lock idam_lock = NULL;
 
-  ret = 1;
-  return Py_BuildValue("i", ret);
-}
+#define IDAM_LOCK   PyThread_acquire_lock(idam_lock, WAIT_LOCK)
+#define IDAM_UNLOCK PyThread_release_lock(idam_lock)
 
-static PyObject*
-idam_setHost(PyObject *self, PyObject *args)
-{
-  const char* host;
-  int port = -1;
+/* Default server, set by setHost() and setPort(). Only
+   accessed with the GIL held, and applied to the library
+   before each request */
+static char idam_host[MAXNAME] = "mast.fusion.org.uk";
+static int  idam_port = 56565;
+static double idam_connecttimeout = 0.0; /* Set by setTimeout() */
 
-  if(!PyArg_ParseTuple(args, "s|i", &host, &port))
-    // Hostname, optional port
-    return NULL;
-  
-  if(port > 0)
-    putIdamServerPort(port);
-  
-  putIdamServerHost(host);
+#define IDAM_MAXPROPS 16
+#define IDAM_PROPLEN  56
 
-  Py_INCREF(Py_None);
-  return Py_None;
-}
+typedef struct {
+  char name[IDAM_PROPLEN];
+  int value;
+} idam_Property;
 
-static PyObject*
-idam_setPort(PyObject *self, PyObject *args)
-{
+/* Where to send a request. Properties are set in the library
+   just for that request, on top of those set by setProperty() */
+typedef struct {
+  char host[MAXNAME];
   int port;
-  if(!PyArg_ParseTuple(args, "i", &port))
-    return NULL;
-  
-  putIdamServerPort(port);
+  double connect;   /* Connect timeout in seconds. Zero waits forever */
+  int pool;         /* Set if setServers() can choose the server */
+  const char *via;  /* Server chosen from the pool, or NULL */
+  int viaport;
+  int nprops;
+  idam_Property props[IDAM_MAXPROPS];
+} idam_Server;
 
-  Py_INCREF(Py_None);
-  return Py_None;
+/* The default server, with no properties of its own. Needs the GIL */
+static void
+defaultServer(idam_Server *srv)
+{
+  memset(srv, 0, sizeof(idam_Server));
+  strcpy(srv->host, idam_host);
+  srv->port = idam_port;
+  srv->connect = idam_connecttimeout;
+  srv->pool = 1;
+}
+
+/* Where a request is actually sent */
+#define SERVER_HOST(srv) ((srv)->via ? (srv)->via : (srv)->host)
+#define SERVER_PORT(srv) ((srv)->via ? (srv)->viaport : (srv)->port)
+
+/* Copy base, changing the host and port if given. Needs the GIL */
+static int
+resolveServer(idam_Server *srv, const idam_Server *base, const char *host, int port)
+{
+  *srv = *base;
+  if(host != NULL) {
+    if(strlen(host) >= MAXNAME) {
+      PyErr_SetString(PyExc_ValueError, "Host name too long");
+      return -1;
+    }
+    strcpy(srv->host, host);
+    srv->pool = 0;
+  }
+  if(port > 0) {
+    srv->port = port;
+    srv->pool = 0;
+  }
+  return 0;
 }
 
 /************************************************************
- * Simple true/false properties for Client/Server behavior
+ * Backends
+ *
+ * Everything read from IDAM goes through an idam_Backend, so
+ * that signals can also be recorded to files or replayed from
+ * them. Handles belong to the backend which gave them, so a
+ * snapshot keeps a pointer to it. All backend calls must hold
+ * idam_lock.
  ************************************************************/
 
-static PyObject*
-idam_setProperty(PyObject *self, PyObject *args)
-{
-  const char* prop;
-  int val;
+typedef struct {
+  const char *name;
   
-  val = 1; /* By default, set to true */
+  /* Check the server can be reached, returning an error message
+     to be freed, or NULL. May be NULL if there is no server */
+  char *(*connect)(const idam_Server *srv);
+  
+  /* Send a request, returning the handle */
+  int (*request)(const idam_Server *srv, const char *name, const char *source);
+  void (*release)(int handle);
+  
+  int (*status)(int handle);
+  const char *(*errorMsg)(int handle);
+  
+  int (*dataNum)(int handle);
+  int (*rank)(int handle);
+  int (*order)(int handle);
+  const char *(*label)(int handle);
+  const char *(*units)(int handle);
+  const char *(*desc)(int handle);
+  int (*dataType)(int handle);
+  const char *(*data)(int handle);
+  int (*errorType)(int handle);
+  int (*errorAsymmetry)(int handle);
+  const char *(*error)(int handle, int above);
+  void (*floatData)(int handle, float *fp);
+  void (*floatError)(int handle, int above, float *fp);
+  
+  /* Dimensions, using IDAM's order */
+  int (*dimNum)(int handle, int n);
+  const char *(*dimLabel)(int handle, int n);
+  const char *(*dimUnits)(int handle, int n);
+  int (*dimType)(int handle, int n);
+  const char *(*dimData)(int handle, int n);
+  int (*dimErrorType)(int handle, int n);
+  int (*dimErrorAsymmetry)(int handle, int n);
+  const char *(*dimError)(int handle, int n, int above);
+  void (*floatDimData)(int handle, int n, float *fp);
+  void (*floatDimError)(int handle, int n, int above, float *fp);
+} idam_Backend;
 
-  if(!PyArg_ParseTuple(args, "s|i", &prop, &val)) {
+/* Server the library last reached, so that it's only checked again
+   after the server changes or a request fails. Needs idam_lock */
+static char idam_connhost[MAXNAME] = "";
+static int idam_connport = -1;
+
+/* The library waits forever for a server which doesn't answer, so
+   first check it accepts a connection within srv->connect seconds */
+static char *
+live_connect(const idam_Server *srv)
+{
+  struct addrinfo hints, *res, *ai;
+  struct pollfd pfd;
+  const char *host = SERVER_HOST(srv);
+  char port[16], *msg;
+  int fd, err = ETIMEDOUT, ok = 0;
+  socklen_t len;
+  
+  if((srv->connect <= 0) ||
+     ((strcmp(host, idam_connhost) == 0) && (SERVER_PORT(srv) == idam_connport)))
+    return NULL;
+  
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  sprintf(port, "%d", SERVER_PORT(srv));
+  if(getaddrinfo(host, port, &hints, &res) != 0)
+    res = NULL;
+  
+  for(ai=res;ai && !ok;ai=ai->ai_next) {
+    if((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+      err = errno;
+      continue;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      ok = 1;
+    else if(errno == EINPROGRESS) {
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      len = sizeof(err);
+      if(poll(&pfd, 1, (int) ceil(srv->connect*1e3)) <= 0)
+        err = ETIMEDOUT;
+      else if((getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0) && (err == 0))
+        ok = 1;
+    }else
+      err = errno;
+    close(fd);
+  }
+  
+  if(ok) {
+    strcpy(idam_connhost, host);
+    idam_connport = SERVER_PORT(srv);
+    freeaddrinfo(res);
     return NULL;
   }
   
-  if(val) {
-    setIdamProperty(prop);
-  }else
-    resetIdamProperty(prop);
-
-  Py_INCREF(Py_None);
-  return Py_None;
+  msg = (char*) malloc(strlen(host) + 128);
+  if(msg != NULL)
+    sprintf(msg, "Could not connect to %s:%d within %g s (%s)", host, SERVER_PORT(srv),
+            srv->connect, res ? strerror(err) : "unknown host");
+  if(res)
+    freeaddrinfo(res);
+  return msg;
 }
 
-static PyObject*
-idam_getProperty(PyObject *self, PyObject *args)
+/* Send a request to a server, returning the handle. The library
+   only reconnects if the host or port has changed */
+static int
+live_request(const idam_Server *srv, const char *name, const char *source)
 {
-  const char* prop;
-  int val;
+  int saved[IDAM_MAXPROPS];
+  int i, handle;
+  
+  if(strcmp(SERVER_HOST(srv), getIdamServerHost()) != 0)
+    putIdamServerHost(SERVER_HOST(srv));
+  if(SERVER_PORT(srv) != getIdamServerPort())
+    putIdamServerPort(SERVER_PORT(srv));
+  
+  for(i=0;i<srv->nprops;i++) {
+    saved[i] = getIdamProperty(srv->props[i].name);
+    if(srv->props[i].value)
+      setIdamProperty(srv->props[i].name);
+    else
+      resetIdamProperty(srv->props[i].name);
+  }
+  
+  handle = idamGetAPI(name, source);
+  if(handle < 0)
+    idam_connhost[0] = '\0'; /* Check the server next time */
+  
+  /* Put back the global properties */
+  for(i=srv->nprops-1;i>=0;i--) {
+    if(saved[i])
+      setIdamProperty(srv->props[i].name);
+    else
+      resetIdamProperty(srv->props[i].name);
+  }
+  return handle;
+}
 
-  if(!PyArg_ParseTuple(args, "s", &prop))
-    return NULL;
+/* The IDAM library's accessors, which don't all take const */
+static void live_release(int h) { idamFree(h); }
+static int live_status(int h) { return getIdamSignalStatus(h); }
+static const char *live_errorMsg(int h) { return getIdamErrorMsg(h); }
+static int live_dataNum(int h) { return getIdamDataNum(h); }
+static int live_rank(int h) { return getIdamRank(h); }
+static int live_order(int h) { return getIdamOrder(h); }
+static const char *live_label(int h) { return getIdamDataLabel(h); }
+static const char *live_units(int h) { return getIdamDataUnits(h); }
+static const char *live_desc(int h) { return getIdamDataDesc(h); }
+static int live_dataType(int h) { return getIdamDataType(h); }
+static const char *live_data(int h) { return getIdamData(h); }
+static int live_errorType(int h) { return getIdamErrorType(h); }
+static int live_errorAsymmetry(int h) { return getIdamErrorAsymmetry(h); }
+static const char *live_error(int h, int above) { return getIdamAsymmetricError(h, above); }
+static void live_floatData(int h, float *fp) { getIdamFloatData(h, fp); }
+static void live_floatError(int h, int above, float *fp) { getIdamFloatAsymmetricError(h, above, fp); }
 
-  val = getIdamProperty(prop);
+static int live_dimNum(int h, int n) { return getIdamDimNum(h, n); }
+static const char *live_dimLabel(int h, int n) { return getIdamDimLabel(h, n); }
+static const char *live_dimUnits(int h, int n) { return getIdamDimUnits(h, n); }
+static int live_dimType(int h, int n) { return getIdamDimType(h, n); }
+static const char *live_dimData(int h, int n) { return getIdamDimData(h, n); }
+static int live_dimErrorType(int h, int n) { return getIdamDimErrorType(h, n); }
+static int live_dimErrorAsymmetry(int h, int n) { return getIdamDimErrorAsymmetry(h, n); }
+static const char *live_dimError(int h, int n, int above) { return getIdamDimAsymmetricError(h, n, above); }
+static void live_floatDimData(int h, int n, float *fp) { getIdamFloatDimData(h, n, fp); }
+static void live_floatDimError(int h, int n, int above, float *fp) { getIdamFloatDimAsymmetricError(h, n, above, fp); }
 
-  return Py_BuildValue("i", val);
+#define LIVE_ACCESSORS \
+  live_release, live_status, live_errorMsg, \
+  live_dataNum, live_rank, live_order, live_label, live_units, live_desc, \
+  live_dataType, live_data, live_errorType, live_errorAsymmetry, live_error, \
+  live_floatData, live_floatError, \
+  live_dimNum, live_dimLabel, live_dimUnits, live_dimType, live_dimData, \
+  live_dimErrorType, live_dimErrorAsymmetry, live_dimError, \
+  live_floatDimData, live_floatDimError
+
+static const idam_Backend idam_live = {"live", live_connect, live_request, LIVE_ACCESSORS};
+
+/* Backend for new requests, set by setBackend(). Only changed
+   with idam_lock held */
+static const idam_Backend *idam_backend = &idam_live;
+
+/* Copy a string with malloc. NULL is copied as "" */
+static char*
+copyString(const char *str)
+{
+  char *s;
+  if(str == NULL)
+    str = "";
+  s = (char*) malloc(strlen(str) + 1);
+  if(s != NULL)
+    strcpy(s, str);
+  return s;
 }
 
 /************************************************************
- * Low-level routines
+ * Statistics
+ *
+ * Counts and times of each phase of a read, for idam.stats().
+ * These are updated with or without the GIL, so are protected
+ * by idam_statslock, which is only held briefly. If tracing,
+ * each phase is also kept as a span for Chrome's trace viewer.
  ************************************************************/
 
-static PyObject*
-idam_getAPI(PyObject *self, PyObject *args)
+enum {
+  IDAM_PHASE_WAIT,     /* Waiting for idam_lock */
+  IDAM_PHASE_SERVER,   /* Request to the server */
+  IDAM_PHASE_DISK,     /* Reading the disk cache */
+  IDAM_PHASE_OBJECTS,  /* Creating Python objects and arrays */
+  IDAM_PHASE_CONVERT,  /* Filling arrays */
+  IDAM_PHASE_STORE,    /* Writing the disk cache */
+  IDAM_PHASE_TOTAL,    /* Whole read */
+  IDAM_NPHASES
+};
+
+static const char *idam_phasenames[IDAM_NPHASES] = {
+  "lock_wait", "server", "disk_cache", "objects", "convert", "cache_write", "total"
+};
+
+#define IDAM_HISTBINS 32   /* Powers of 2 microseconds */
+#define IDAM_MAXSPANS (1 << 20)
+
+typedef struct {
+  long long count;
+  double total;      /* Seconds */
+  double max;
+  long long hist[IDAM_HISTBINS];
+} idam_PhaseStats;
+
+typedef struct {
+  int phase;
+  char *name;        /* Signal name */
+  double start, dur; /* Seconds */
+  long tid;
+} idam_Span;
+
+static PyThread_type_lock idam_statslock = NULL;
+static idam_PhaseStats idam_phases[IDAM_NPHASES];
+static long long idam_requests = 0, idam_failures = 0;
+static long long idam_bytes = 0;     /* Received from the server */
+static long long idam_diskhits = 0;
+static long long idam_shmhits = 0;
+
+static int idam_tracing = 0;
+static idam_Span *idam_spans = NULL;
+static int idam_nspans = 0, idam_maxspans = 0;
+
+/* Monotonic time in seconds */
+static double
+idam_now(void)
 {
-  int handle;
-  const char *data, *source;
-  
-  if(!PyArg_ParseTuple(args, "ss", &data, &source))
-    return NULL;
-  
-  handle = idamGetAPI(data, source);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
 
-  if(!getIdamSignalStatus(handle)) {
-    fprintf(stderr, "IDAM error: %s\n", getIdamErrorMsg(handle));
+/* Record a phase which ran from start to now, returning now.
+   name is the signal, or NULL. Doesn't need the GIL */
+static double
+Stats_phase(int phase, double start, const char *name)
+{
+  double end = idam_now(), dur = end - start;
+  idam_PhaseStats *p = &idam_phases[phase];
+  int bin = 0;
+  long long us = (long long) (dur * 1e6);
+  idam_Span *span;
+  
+  while((us > 1) && (bin < IDAM_HISTBINS-1)) {
+    us >>= 1;
+    bin++;
   }
   
-  return Py_BuildValue("i", handle);
+  PyThread_acquire_lock(idam_statslock, WAIT_LOCK);
+  p->count++;
+  p->total += dur;
+  if(dur > p->max)
+    p->max = dur;
+  p->hist[bin]++;
+  
+  if(idam_tracing && (idam_nspans < IDAM_MAXSPANS)) {
+    if(idam_nspans == idam_maxspans) {
+      int n = idam_maxspans ? 2*idam_maxspans : 1024;
+      span = (idam_Span*) realloc(idam_spans, n*sizeof(idam_Span));
+      if(span) {
+        idam_spans = span;
+        idam_maxspans = n;
+      }
+    }
+    if(idam_nspans < idam_maxspans) {
+      span = &idam_spans[idam_nspans++];
+      span->phase = phase;
+      span->name = name ? copyString(name) : NULL;
+      span->start = start;
+      span->dur = dur;
+      span->tid = (long) PyThread_get_thread_ident();
+    }
+  }
+  PyThread_release_lock(idam_statslock);
+  return end;
 }
 
-static PyObject*
-idam_freeAPI(PyObject *self, PyObject *args)
+/* Add to a counter. Doesn't need the GIL */
+static void
+Stats_add(long long *counter, long long n)
 {
-  int handle;
-  
-  if(!PyArg_ParseTuple(args, "i", &handle))
-    return NULL;
-
-  idamFree(handle);
-
-  Py_INCREF(Py_None);
-  return Py_None;
+  PyThread_acquire_lock(idam_statslock, WAIT_LOCK);
+  *counter += n;
+  PyThread_release_lock(idam_statslock);
 }
 
-static PyObject*
-idam_readData(PyObject *self, PyObject *args)
-{
-  int handle;
-  int data_n;
-  int rank, order;
-  npy_intp dimsize[8];
-  int i;
-  PyArrayObject *result;
+/************************************************************
+ * Logging
+ *
+ * Messages go to the Python logger "idam", so are off unless
+ * the application turns them on.
+ ************************************************************/
 
-  if(!PyArg_ParseTuple(args, "i", &handle))
-    return NULL;
+#define IDAM_DEBUG   10  /* Levels in the logging module */
+#define IDAM_WARNING 30
 
-  // Get the size of the data array
+static PyObject *idam_logger = NULL;
 
-  if((data_n = getIdamDataNum(handle)) <= 0) {
-    Py_INCREF(Py_None);
-    return Py_None;
-  }
+/* Log a message. Checks the level before formatting, and keeps
+   any exception being raised. Needs the GIL */
+static void
+idam_log(int level, const char *fmt, ...)
+{
+  PyObject *type, *value, *tb, *logging, *res;
+  char msg[1024];
+  va_list ap;
   
-  // Get the rank and order of the data
-  rank = getIdamRank(handle);
-  order = getIdamOrder(handle);
+  PyErr_Fetch(&type, &value, &tb);
   
-  //printf("Size = %d\nRank = %d\nOrder = %d\n", data_n, rank, order);
-
-  for(i=0;i<rank;i++) {
-    dimsize[i] = getIdamDimNum(handle, i); 
-    //printf("Dim %d: %d\n", i, dimsize[i]);
+  if(idam_logger == NULL) {
+    if((logging = PyImport_ImportModule("logging")) != NULL) {
+      idam_logger = PyObject_CallMethod(logging, "getLogger", "s", "idam");
+      Py_DECREF(logging);
+    }
   }
-  
-  //result = (PyArrayObject*) PyArray_FromDims(rank,dimsize,PyArray_FLOAT); // Depreciated
-  result = (PyArrayObject*) PyArray_SimpleNew(rank,dimsize,PyArray_FLOAT);
-  if (result == NULL) {
-    return NULL;
+  if(idam_logger) {
+    res = PyObject_CallMethod(idam_logger, "isEnabledFor", "i", level);
+    if(res && PyObject_IsTrue(res)) {
+      va_start(ap, fmt);
+      PyOS_vsnprintf(msg, sizeof(msg), fmt, ap);
+      va_end(ap);
+      Py_DECREF(res);
+      res = PyObject_CallMethod(idam_logger, "log", "iss", level, "%s", msg);
+    }
+    Py_XDECREF(res);
   }
   
-  getIdamFloatData(handle, (float *)(result->data));
-  
-  return PyArray_Return(result);
+  PyErr_Clear();
+  PyErr_Restore(type, value, tb);
 }
 
 /************************************************************
- * IDAM dimension members
+ * Server pools
+ *
+ * With setServers(), requests for the default server go to one
+ * of a list of mirrors instead. Each request goes to the server
+ * with the lowest average request time, apart from occasional
+ * requests to measure the others. A server which can't be
+ * reached is left out for a while, doubling each time it fails,
+ * and the request is tried on the next server. The pool is only
+ * used with idam_lock held.
  ************************************************************/
 
-/* Define data type */
-typedef struct {
-  PyObject_HEAD
-  
-  PyObject *label; /* Short label */
-  PyObject *units; 
-  PyObject *data;  /* NumPy array */
-
-  PyObject *errl;  /* NumPy array of low-side errors */
-  PyObject *errh;  /* NumPy array of high-side errors */
-
-} idam_Dimension;
+#define IDAM_MAXSERVERS  16
+#define IDAM_POOLCONNECT 5.0  /* Connect timeout (s), if none is set */
+#define IDAM_POOLEXPLORE 32   /* Measure another server this often */
+#define IDAM_POOLBACKOFF 10.0 /* Seconds out after the first failure */
+#define IDAM_POOLMAXOUT  300.0
 
-/* Members of the type */
-static PyMemberDef idam_DimensionMembers[] = {
-  {"label", T_OBJECT_EX, offsetof(idam_Dimension, label), 0,
-   "Short label"},
-  {"units", T_OBJECT_EX, offsetof(idam_Dimension, units), 0,
-   "units"},
-  {"data", T_OBJECT_EX, offsetof(idam_Dimension, data), 0,
-   "NumPy array of dimension values"},
-  {"errl", T_OBJECT_EX, offsetof(idam_Dimension, errl), 0,
-   "NumPy array of low-side errors"},
-  {"errh", T_OBJECT_EX, offsetof(idam_Dimension, errh), 0,
-   "NumPy array of high-side errors"},
-  {NULL}  /* Sentinel */
-};
+typedef struct {
+  char host[MAXNAME];
+  int port;
+  double latency;     /* Moving average of request time (s) */
+  double measured;    /* When latency was last updated. Zero if never */
+  long long requests, failures;
+  int fails;          /* Failures in a row */
+  double down;        /* Not used until this time */
+} idam_PoolServer;
 
-/************************************************************
- * IDAM dimension methods
- ************************************************************/
+static idam_PoolServer idam_pool[IDAM_MAXSERVERS];
+static int idam_npool = 0;
+static long long idam_poolcount = 0; /* Requests routed */
 
-/* Free memory */
-static void
-Dimension_dealloc(idam_Dimension* self)
+/* Choose a server: one not yet measured, every IDAM_POOLEXPLORE
+   requests the one measured longest ago, and otherwise the fastest.
+   The library reconnects to change server, so the server it's using
+   is kept unless another is clearly faster. If all are down, the
+   one due back first. Needs idam_lock */
+static int
+Pool_choose(void)
 {
-  Py_XDECREF(self->label);
-  Py_XDECREF(self->units);
+  double now = idam_now();
+  int i, best = -1, current = -1, explore;
+  idam_PoolServer *p;
   
-  Py_XDECREF(self->data);
+  explore = (++idam_poolcount % IDAM_POOLEXPLORE) == 0;
+  for(i=0;i<idam_npool;i++) {
+    p = &idam_pool[i];
+    if(p->down > now)
+      continue;
+    if(p->measured == 0)
+      return i;
+    if((strcmp(p->host, idam_connhost) == 0) && (p->port == idam_connport))
+      current = i;
+    if((best < 0) ||
+       (explore ? (p->measured < idam_pool[best].measured)
+                : (p->latency < idam_pool[best].latency)))
+      best = i;
+  }
   
-  Py_XDECREF(self->errl);
-  Py_XDECREF(self->errh);
+  if(best < 0) {
+    for(i=0;i<idam_npool;i++)
+      if((best < 0) || (idam_pool[i].down < idam_pool[best].down))
+        best = i;
+    return best;
+  }
+  if(!explore && (current >= 0) &&
+     (idam_pool[best].latency > 0.8*idam_pool[current].latency))
+    return current;
+  return best;
+}
 
-  Py_TYPE(self)->tp_free((PyObject*)self);
+static void
+Pool_done(int i, double latency)
+{
+  idam_PoolServer *p = &idam_pool[i];
+  
+  p->requests++;
+  p->fails = 0;
+  p->latency = (p->measured > 0) ? 0.8*p->latency + 0.2*latency : latency;
+  p->measured = idam_now();
 }
 
-/* Create a new instance (NOT initialisation) */
-static PyObject *
-Dimension_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+static void
+Pool_failed(int i)
 {
-  idam_Dimension *self;
+  idam_PoolServer *p = &idam_pool[i];
+  double out = IDAM_POOLBACKOFF * pow(2., p->fails);
+  
+  p->failures++;
+  p->fails++;
+  p->down = idam_now() + ((out < IDAM_POOLMAXOUT) ? out : IDAM_POOLMAXOUT);
+}
 
-  self = (idam_Dimension *)type->tp_alloc(type, 0);
-  if (self != NULL) {
+/* Check the server and send a request, using the pool if srv is
+   the default server. Sets *error (to be freed) if no server could
+   be reached. Needs idam_lock */
+static int
+Pool_request(const idam_Backend *b, const idam_Server *srv, const char *name,
+             const char *source, char **error)
+{
+  idam_Server s = *srv;
+  int i, tries, handle;
+  double t;
+  
+  *error = NULL;
+  if(!srv->pool || (idam_npool == 0) || (b->connect == NULL)) {
+    if(b->connect && ((*error = b->connect(srv)) != NULL))
+      return -1;
+    return b->request(srv, name, source);
+  }
+  
+  if(s.connect <= 0)
+    s.connect = IDAM_POOLCONNECT;
+  for(tries=0;tries<idam_npool;tries++) {
+    i = Pool_choose();
+    s.via = idam_pool[i].host; /* Keys still use srv->host */
+    s.viaport = idam_pool[i].port;
     
-    self->label = CharsToString("No data");
-    if (self->label == NULL) {
-      Py_DECREF(self);
-      return NULL;
+    free(*error);
+    if((*error = b->connect(&s)) != NULL) {
+      Pool_failed(i);
+      continue;
     }
-
-    self->units = CharsToString("No units");
-    if (self->units == NULL) {
-      Py_DECREF(self);
-      return NULL;
+    t = idam_now();
+    handle = b->request(&s, name, source);
+    if((handle < 0) && ((*error = b->connect(&s)) != NULL)) {
+      /* The server has gone away, rather than the request failing */
+      Pool_failed(i);
+      continue;
     }
-
-    Py_INCREF(Py_None);
-    self->data = Py_None;
-    
-    Py_INCREF(Py_None);
-    self->errl = Py_None;
-
-    Py_INCREF(Py_None);
-    self->errh = Py_None;
+    Pool_done(i, idam_now() - t);
+    return handle;
   }
-  
-  return (PyObject *)self;
+  return -1;
 }
 
-/* Methods */
-static PyMethodDef idam_DimensionMethods[] = {
-    {NULL}  /* Sentinel */
+/************************************************************
+ * Signal snapshots
+ *
+ * Everything needed from an IDAM handle is copied out while
+ * holding idam_lock, so that Python objects can then be
+ * created with the GIL held but without the lock.
+ ************************************************************/
+
+#define IDAM_MAXRANK 8
+
+typedef struct {
+  char *label;
+  char *units;
+  int type;
+  int errtype;
+  int errasym;
+
+  /* Values in the IDAM buffers, valid until the handle is freed */
+  const char *raw;
+  const char *rawerrl;
+  const char *rawerrh;
+
+  /* Where to put the values. Set before Signal_fill */
+  void *data;
+  void *errl;
+  void *errh;
+  int npytype;    /* NumPy type of data */
+  int npyerrtype; /* NumPy type of errl and errh */
+  
+  int hashed;     /* Set if hash is set, by Signal_hash */
+  uint64_t hash;  /* Hash of the raw values */
+} idam_SignalDim;
+
+typedef struct {
+  int handle;       /* IDAM handle, or -1 once freed */
+  const idam_Backend *backend; /* Which gave the handle */
+  char *error;      /* Error message if the read failed */
+
+  int rank;
+  int order;        /* Index of time dimension, in NumPy order */
+  npy_intp data_n;  /* Number of data values */
+  npy_intp dimsize[IDAM_MAXRANK]; /* Sizes, in NumPy order */
+
+  char *label;
+  char *units;
+  char *desc;
+  int type;
+  int errtype;
+  int errasym;
+
+  idam_SignalDim dim[IDAM_MAXRANK]; /* In NumPy order */
+
+  /* Values in the IDAM buffers, valid until the handle is freed */
+  const char *raw;
+  const char *rawerrl;
+  const char *rawerrh;
+
+  /* Where to put the values. Set before Signal_fill */
+  void *data;
+  void *errl;
+  void *errh;
+  int npytype;    /* NumPy type of data */
+  int npyerrtype; /* NumPy type of errl and errh */
+
+  /* If set, this object owns the handle and will free it. The
+     reference is released by the caller, not by Signal_clear */
+  PyObject *owner;
+
+  /* If read from the disk cache, the mapped file. The raw
+     pointers point into this, and there is no handle */
+  void *map;
+  size_t mapsize;
+  /* If the map is a shared memory segment, its name and an open
+     descriptor, holding a shared lock while the segment is in use */
+  char *shm;
+  int shmfd;
+
+  /* Set up by Signal_transform, and applied by Signal_fill */
+  int transform;
+  double scale, offset; /* Data become raw*scale + offset - baseline */
+  double vmin, vmax;    /* Raw values outside become NaN */
+  npy_intp bfirst, bend; /* Times of the baseline, if base is set */
+  double *base;         /* Baseline for each time series. Owned */
+} idam_Signal;
+
+/* Calibration of the data values, applied while they are copied */
+typedef struct {
+  int on;          /* Set if any of these are used */
+  double scale;    /* Values become raw*scale + offset */
+  double offset;
+  char units[32];  /* Units to convert to, or "" to keep */
+  double bmin;     /* Times to take the baseline from, if bmin <= bmax */
+  double bmax;
+  double vmin;     /* Raw values outside this range become NaN */
+  double vmax;
+} idam_Transform;
+
+/* Options for turning a signal into Python objects */
+typedef struct {
+  int native;     /* Keep IDAM types rather than converting to float */
+  int copy;       /* If zero, arrays can share the IDAM buffers */
+  int errors;     /* If zero, errors are not read */
+  int lazy;       /* Keep the handle, and create arrays when first used */
+  int cache;      /* If zero, don't use the disk cache */
+  double tmin;    /* Time window to keep */
+  double tmax;
+  int stride;     /* Keep every stride'th time */
+  npy_intp decimate; /* If non-zero, number of points to keep */
+  int method;     /* How to decimate */
+  int dedup;      /* Share dimension arrays with the same values */
+  double timeout; /* Seconds to wait for the result. Zero waits forever */
+  PyObject *out;  /* Arrays to fill (borrowed), or NULL */
+  int describe;   /* Batch results are Signal_describe records, not Data */
+  int share;      /* If zero, signals aren't copied to shared memory */
+  idam_Transform transform;
+} idam_Options;
+
+/* Every field, in order, so that none is left to implicit zeroing */
+#define IDAM_TRANSFORM_INIT {0, 1.0, 0.0, "", HUGE_VAL, -HUGE_VAL, -HUGE_VAL, HUGE_VAL}
+#define IDAM_OPTIONS_INIT {0, 1, 1, 0, 1, -HUGE_VAL, HUGE_VAL, 1, 0, 0, 0, 0.0, \
+                           NULL, 0, 1, IDAM_TRANSFORM_INIT}
+
+/* Default for dedup, set by setDedup() */
+static int idam_dedup = 0;
+
+/* Default for timeout, set by setTimeout() */
+static double idam_timeout = 0.0;
+
+/* Set if only part of the time axis is wanted */
+#define IDAM_WINDOW(opt) (((opt)->tmin > -HUGE_VAL) || ((opt)->tmax < HUGE_VAL) || ((opt)->stride > 1))
+
+/* Convert n values of the given IDAM type to float.
+   Returns -1 if the type is not handled here */
+static int
+convertToFloat(const char *src, int type, npy_intp n, float *dst)
+{
+  npy_intp i;
+  
+  if(src == NULL)
+    return -1;
+  
+#define CONVERT(T) { const T *p = (const T*) src; for(i=0;i<n;i++) dst[i] = (float) p[i]; }
+  switch(type) {
+  case TYPE_FLOAT:
+    memcpy(dst, src, n*sizeof(float));
+    break;
+  case TYPE_DOUBLE:          CONVERT(double); break;
+  case TYPE_CHAR:            CONVERT(signed char); break;
+  case TYPE_SHORT:           CONVERT(short); break;
+  case TYPE_INT:             CONVERT(int); break;
+  case TYPE_LONG:            CONVERT(long); break;
+  case TYPE_UNSIGNED_CHAR:   CONVERT(unsigned char); break;
+  case TYPE_UNSIGNED_SHORT:  CONVERT(unsigned short); break;
+  case TYPE_UNSIGNED_INT:    CONVERT(unsigned int); break;
+  case TYPE_UNSIGNED_LONG:   CONVERT(unsigned long); break;
+#ifdef TYPE_LONG64
+  case TYPE_LONG64:          CONVERT(long long); break;
+  case TYPE_UNSIGNED_LONG64: CONVERT(unsigned long long); break;
+#endif
+  default:
+    return -1;
+  }
+#undef CONVERT
+  return 0;
+}
+
+/* IDAM types which can be copied straight into a NumPy array */
+static const struct {
+  int type;
+  int npytype;
+  size_t size;
+} idam_types[] = {
+  {TYPE_FLOAT,          NPY_FLOAT,     sizeof(float)},
+  {TYPE_DOUBLE,         NPY_DOUBLE,    sizeof(double)},
+  {TYPE_CHAR,           NPY_BYTE,      sizeof(char)},
+  {TYPE_SHORT,          NPY_SHORT,     sizeof(short)},
+  {TYPE_INT,            NPY_INT,       sizeof(int)},
+  {TYPE_LONG,           NPY_LONG,      sizeof(long)},
+  {TYPE_UNSIGNED_CHAR,  NPY_UBYTE,     sizeof(unsigned char)},
+  {TYPE_UNSIGNED_SHORT, NPY_USHORT,    sizeof(unsigned short)},
+  {TYPE_UNSIGNED_INT,   NPY_UINT,      sizeof(unsigned int)},
+  {TYPE_UNSIGNED_LONG,  NPY_ULONG,     sizeof(unsigned long)},
+#ifdef TYPE_LONG64
+  {TYPE_LONG64,         NPY_LONGLONG,  sizeof(long long)},
+  {TYPE_UNSIGNED_LONG64,NPY_ULONGLONG, sizeof(unsigned long long)},
+#endif
+#ifdef TYPE_COMPLEX
+  {TYPE_COMPLEX,        NPY_CFLOAT,    2*sizeof(float)},
+  {TYPE_DCOMPLEX,       NPY_CDOUBLE,   2*sizeof(double)},
+#endif
+  {TYPE_UNKNOWN, -1, 0} /* Sentinel */
+};
+
+/* Look up an IDAM type, returning its index in idam_types or -1 */
+static int
+findType(int type)
+{
+  int i;
+  for(i=0;idam_types[i].npytype >= 0;i++) {
+    if(idam_types[i].type == type)
+      return i;
+  }
+  return -1;
+}
+
+/* NumPy type to use for an IDAM buffer. If native is not set,
+   or the type has no NumPy equivalent, this is float */
+static int
+arrayType(const char *raw, int type, int native)
+{
+  int t;
+  
+  if(!native || (raw == NULL))
+    return NPY_FLOAT;
+  if((t = findType(type)) < 0)
+    return NPY_FLOAT;
+  return idam_types[t].npytype;
+}
+
+/* Copy n values into an array of NumPy type npytype.
+   Returns -1 if this can't be done without the IDAM routines */
+static int
+fillArray(void *dst, int npytype, const char *src, int type, npy_intp n)
+{
+  int t;
+  
+  if(npytype == NPY_FLOAT)
+    return convertToFloat(src, type, n, (float*) dst);
+  
+  if((src == NULL) || ((t = findType(type)) < 0) || (idam_types[t].npytype != npytype))
+    return -1;
+  
+  memcpy(dst, src, n * idam_types[t].size);
+  return 0;
+}
+
+/* Parse a dtype keyword. This is "float32" (the default) to
+   convert everything to float, or "native" to keep IDAM types */
+static int
+parseDtype(const char *dtype, int *native)
+{
+  *native = 0;
+  if((dtype == NULL) || (strcmp(dtype, "float32") == 0) || (strcmp(dtype, "float") == 0))
+    return 0;
+  if(strcmp(dtype, "native") == 0) {
+    *native = 1;
+    return 0;
+  }
+  PyErr_SetString(PyExc_ValueError, "dtype must be 'float32' or 'native'");
+  return -1;
+}
+
+/* Check the time window options */
+static int
+checkWindow(const idam_Options *opt)
+{
+  if(opt->stride < 1) {
+    PyErr_SetString(PyExc_ValueError, "stride must be at least 1");
+    return -1;
+  }
+  if((opt->tmin != opt->tmin) || (opt->tmax != opt->tmax)) {
+    PyErr_SetString(PyExc_ValueError, "tmin and tmax can't be NaN");
+    return -1;
+  }
+  return 0;
+}
+
+/* Check for a type handled by rawValue, i.e. not complex */
+static int
+realType(int type)
+{
+#ifdef TYPE_COMPLEX
+  if((type == TYPE_COMPLEX) || (type == TYPE_DCOMPLEX))
+    return 0;
+#endif
+  return findType(type) >= 0;
+}
+
+/* Value i of an IDAM buffer as a double */
+static double
+rawValue(const char *src, int type, npy_intp i)
+{
+  switch(type) {
+  case TYPE_FLOAT:           return ((const float*) src)[i];
+  case TYPE_DOUBLE:          return ((const double*) src)[i];
+  case TYPE_CHAR:            return ((const signed char*) src)[i];
+  case TYPE_SHORT:           return ((const short*) src)[i];
+  case TYPE_INT:             return ((const int*) src)[i];
+  case TYPE_LONG:            return ((const long*) src)[i];
+  case TYPE_UNSIGNED_CHAR:   return ((const unsigned char*) src)[i];
+  case TYPE_UNSIGNED_SHORT:  return ((const unsigned short*) src)[i];
+  case TYPE_UNSIGNED_INT:    return ((const unsigned int*) src)[i];
+  case TYPE_UNSIGNED_LONG:   return ((const unsigned long*) src)[i];
+#ifdef TYPE_LONG64
+  case TYPE_LONG64:          return ((const long long*) src)[i];
+  case TYPE_UNSIGNED_LONG64: return ((const unsigned long long*) src)[i];
+#endif
+  }
+  return 0.0;
+}
+
+/* Set value i of an IDAM buffer */
+static void
+storeValue(char *dst, int type, npy_intp i, double v)
+{
+  switch(type) {
+  case TYPE_FLOAT:           ((float*) dst)[i] = (float) v; break;
+  case TYPE_DOUBLE:          ((double*) dst)[i] = v; break;
+  case TYPE_CHAR:            ((signed char*) dst)[i] = (signed char) v; break;
+  case TYPE_SHORT:           ((short*) dst)[i] = (short) v; break;
+  case TYPE_INT:             ((int*) dst)[i] = (int) v; break;
+  case TYPE_LONG:            ((long*) dst)[i] = (long) v; break;
+  case TYPE_UNSIGNED_CHAR:   ((unsigned char*) dst)[i] = (unsigned char) v; break;
+  case TYPE_UNSIGNED_SHORT:  ((unsigned short*) dst)[i] = (unsigned short) v; break;
+  case TYPE_UNSIGNED_INT:    ((unsigned int*) dst)[i] = (unsigned int) v; break;
+  case TYPE_UNSIGNED_LONG:   ((unsigned long*) dst)[i] = (unsigned long) v; break;
+#ifdef TYPE_LONG64
+  case TYPE_LONG64:          ((long long*) dst)[i] = (long long) v; break;
+  case TYPE_UNSIGNED_LONG64: ((unsigned long long*) dst)[i] = (unsigned long long) v; break;
+#endif
+  }
+}
+
+/* Convert n values of an IDAM buffer to double, from index start */
+static void
+loadDoubles(const char *src, int type, npy_intp start, npy_intp n, double *dst)
+{
+  npy_intp i;
+  
+#define LOAD(T) { const T *p = ((const T*) src) + start; for(i=0;i<n;i++) dst[i] = (double) p[i]; }
+  switch(type) {
+  case TYPE_FLOAT:           LOAD(float); break;
+  case TYPE_DOUBLE:          LOAD(double); break;
+  case TYPE_CHAR:            LOAD(signed char); break;
+  case TYPE_SHORT:           LOAD(short); break;
+  case TYPE_INT:             LOAD(int); break;
+  case TYPE_LONG:            LOAD(long); break;
+  case TYPE_UNSIGNED_CHAR:   LOAD(unsigned char); break;
+  case TYPE_UNSIGNED_SHORT:  LOAD(unsigned short); break;
+  case TYPE_UNSIGNED_INT:    LOAD(unsigned int); break;
+  case TYPE_UNSIGNED_LONG:   LOAD(unsigned long); break;
+#ifdef TYPE_LONG64
+  case TYPE_LONG64:          LOAD(long long); break;
+  case TYPE_UNSIGNED_LONG64: LOAD(unsigned long long); break;
+#endif
+  }
+#undef LOAD
+}
+
+/* Find the first index with value >= t (or > t if after is set)
+   in a sorted buffer */
+static npy_intp
+rawSearch(const char *src, int type, npy_intp n, double t, int after)
+{
+  npy_intp lo = 0, hi = n, mid;
+  double v;
+  while(lo < hi) {
+    mid = lo + (hi - lo)/2;
+    v = rawValue(src, type, mid);
+    if((v < t) || (after && (v == t)))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Check that a buffer can be sliced, i.e. it will be converted
+   by fillArray rather than the IDAM routines which would read
+   the whole of it */
+static int
+canSlice(const char *raw, int type, int native)
+{
+  if(raw == NULL)
+    return 0;
+  return native ? (findType(type) >= 0) : realType(type);
+}
+
+/* Keep count values along dimension k of an array, starting at
+   first and taking every stride'th. Values only move towards
+   the start of the buffer, so this can be done in place */
+static void
+sliceBuffer(char *buf, size_t size, int rank, const npy_intp *dimsize, int k,
+            npy_intp first, npy_intp count, int stride)
+{
+  npy_intp outer = 1, inner = 1, o, j;
+  int i;
+  
+  for(i=0;i<k;i++)
+    outer *= dimsize[i];
+  for(i=k+1;i<rank;i++)
+    inner *= dimsize[i];
+  inner *= size;
+  
+  for(o=0;o<outer;o++) {
+    for(j=0;j<count;j++)
+      memmove(buf + (o*count + j)*inner,
+              buf + (o*dimsize[k] + first + j*stride)*inner, inner);
+  }
+}
+
+/* Cut the time dimension down to the window in opt. Values are
+   moved within the IDAM buffers, so everything after this just
+   sees a smaller signal. Call with the GIL released, before the
+   buffers are used. On failure sig->error is set */
+static void
+Signal_subset(idam_Signal *sig, const idam_Options *opt)
+{
+  struct {
+    const char *raw;
+    int type;
+    int rank;
+    npy_intp *dimsize;
+  } buf[6];
+  int nbuf = 0, i, j, k = sig->order;
+  idam_SignalDim *t;
+  npy_intp n, first, end, count;
+  const char *error = NULL;
+  
+  if((k < 0) || (k >= sig->rank)) {
+    error = "Signal has no time dimension to subset";
+    goto fail;
+  }
+  t = &sig->dim[k];
+  n = sig->dimsize[k];
+  if(!canSlice(t->raw, t->type, 0)) {
+    error = "Can't subset this time dimension";
+    goto fail;
+  }
+  
+  first = (opt->tmin > -HUGE_VAL) ? rawSearch(t->raw, t->type, n, opt->tmin, 0) : 0;
+  end   = (opt->tmax <  HUGE_VAL) ? rawSearch(t->raw, t->type, n, opt->tmax, 1) : n;
+  count = (end > first) ? (end - first + opt->stride - 1) / opt->stride : 0;
+  
+  /* Arrays along the time dimension */
+#define ADDBUF(R, T, RANK, SIZES) { \
+    buf[nbuf].raw = (R); buf[nbuf].type = (T); \
+    buf[nbuf].rank = (RANK); buf[nbuf].dimsize = (SIZES); nbuf++; }
+  ADDBUF(sig->raw, sig->type, sig->rank, sig->dimsize);
+  if(sig->errtype != TYPE_UNKNOWN) {
+    ADDBUF(sig->rawerrl, sig->errtype, sig->rank, sig->dimsize);
+    ADDBUF(sig->rawerrh, sig->errtype, sig->rank, sig->dimsize);
+  }
+  ADDBUF(t->raw, t->type, 1, &n);
+  if(t->errtype != TYPE_UNKNOWN) {
+    ADDBUF(t->rawerrl, t->errtype, 1, &n);
+    ADDBUF(t->rawerrh, t->errtype, 1, &n);
+  }
+#undef ADDBUF
+  
+  for(i=0;i<nbuf;i++) {
+    if(!canSlice(buf[i].raw, buf[i].type, opt->native)) {
+      error = "Can't subset data of this type";
+      goto fail;
+    }
+  }
+  
+  for(i=0;i<nbuf;i++) {
+    /* Symmetric errors may be the same buffer */
+    for(j=0;(j<i) && (buf[j].raw != buf[i].raw);j++);
+    if(j < i)
+      continue;
+    sliceBuffer((char*) buf[i].raw, idam_types[findType(buf[i].type)].size,
+                buf[i].rank, buf[i].dimsize, (buf[i].rank == 1) ? 0 : k,
+                first, count, opt->stride);
+  }
+  
+  sig->data_n = (n > 0) ? (sig->data_n / n) * count : 0;
+  sig->dimsize[k] = count;
+  return;
+  
+ fail:
+  sig->error = copyString(error);
+  IDAM_LOCK;
+  sig->backend->release(sig->handle);
+  IDAM_UNLOCK;
+  sig->handle = -1;
+}
+
+/* Ways to decimate */
+enum { IDAM_MINMAX, IDAM_MEAN, IDAM_LTTB };
+
+/* Parse a decimation method and check the number of points */
+static int
+parseMethod(const char *method, npy_intp npoints, int *m)
+{
+  if((method == NULL) || (strcmp(method, "minmax") == 0))
+    *m = IDAM_MINMAX;
+  else if(strcmp(method, "mean") == 0)
+    *m = IDAM_MEAN;
+  else if(strcmp(method, "lttb") == 0)
+    *m = IDAM_LTTB;
+  else {
+    PyErr_SetString(PyExc_ValueError, "method must be 'minmax', 'mean' or 'lttb'");
+    return -1;
+  }
+  if(npoints < ((*m == IDAM_LTTB) ? 3 : 2)) {
+    PyErr_SetString(PyExc_ValueError, "Too few points to decimate to");
+    return -1;
+  }
+  return 0;
+}
+
+/* Check the keyword options shared by Data(), fetchMany() and fetch() */
+static int
+parseOptions(idam_Options *opt, const char *dtype, Py_ssize_t decimate, const char *method)
+{
+  if((parseDtype(dtype, &opt->native) < 0) || (checkWindow(opt) < 0))
+    return -1;
+  opt->dedup = idam_dedup;
+  if(decimate > 0) {
+    if(parseMethod(method, decimate, &opt->method) < 0)
+      return -1;
+    opt->decimate = decimate;
+  }
+  return 0;
+}
+
+/* Check the calibration keywords shared by Data(), fetchMany() and
+   fetch(). baseline and valid are (min, max) pairs, or None */
+static int
+parseTransform(idam_Options *opt, double scale, double offset, const char *units,
+               PyObject *baseline, PyObject *valid)
+{
+  idam_Transform *tr = &opt->transform;
+  
+  memset(tr, 0, sizeof(idam_Transform));
+  tr->scale = scale;
+  tr->offset = offset;
+  tr->bmin = HUGE_VAL;
+  tr->bmax = -HUGE_VAL;
+  tr->vmin = -HUGE_VAL;
+  tr->vmax = HUGE_VAL;
+  
+  if(units != NULL) {
+    if(strlen(units) >= sizeof(tr->units)) {
+      PyErr_SetString(PyExc_ValueError, "units is too long");
+      return -1;
+    }
+    strcpy(tr->units, units);
+  }
+  if(baseline != Py_None) {
+    if(!PyArg_ParseTuple(baseline, "dd;baseline must be a (tmin, tmax) tuple",
+                         &tr->bmin, &tr->bmax))
+      return -1;
+    if(!(tr->bmin <= tr->bmax)) {
+      PyErr_SetString(PyExc_ValueError, "baseline tmin must be less than tmax");
+      return -1;
+    }
+  }
+  if(valid != Py_None) {
+    if(!PyArg_ParseTuple(valid, "dd;valid must be a (min, max) tuple",
+                         &tr->vmin, &tr->vmax))
+      return -1;
+    if(!(tr->vmin <= tr->vmax)) {
+      PyErr_SetString(PyExc_ValueError, "valid min must be less than max");
+      return -1;
+    }
+  }
+  if((scale != scale) || (offset != offset)) {
+    PyErr_SetString(PyExc_ValueError, "scale and offset can't be NaN");
+    return -1;
+  }
+  
+  tr->on = (scale != 1.0) || (offset != 0.0) || tr->units[0] ||
+    (baseline != Py_None) || (valid != Py_None);
+  if(tr->on && opt->lazy) {
+    PyErr_SetString(PyExc_ValueError,
+                    "scale, offset, units, baseline and valid can't be used with lazy=True");
+    return -1;
+  }
+  return 0;
+}
+
+/* Number of points decimate() gives for n points */
+static npy_intp
+decimatedSize(npy_intp n, npy_intp npoints, int method)
+{
+  if(method == IDAM_MINMAX)
+    npoints -= npoints % 2; /* Pairs of points */
+  return (n <= npoints) ? n : npoints;
+}
+
+/* Reduce n points of (time, data) to a few for plotting, and put
+   them in outtime and outdata. Points are split into equal
+   buckets, and each bucket gives
+     minmax  Its smallest and largest values, in time order
+     mean    Its mean time and value
+     lttb    One point, by Largest-Triangle-Three-Buckets
+   Each bucket is converted to double in one go then scanned,
+   so this is a single pass over the data. A bucket is always
+   read before anything is written over it, so the output can
+   be the input buffers. Returns the number of points, or -1 if
+   out of memory. Doesn't need the GIL */
+static npy_intp
+decimate(const char *time, int ttype, const char *data, int dtype, npy_intp n,
+         npy_intp npoints, int method,
+         char *outtime, int outttype, char *outdata, int outdtype)
+{
+  npy_intp nout = decimatedSize(n, npoints, method);
+  npy_intp nb, b, i, start, end, len, nextlen, i0, i1, k = 0;
+  double *buf, *tcur, *dcur, *tnext, *dnext, *tmp;
+  double t0, t1, tsum, dsum, ax, ay, bx, by, lastx, lasty, area, best;
+  
+  if(nout == n) {
+    /* Nothing to remove */
+    if((outtime != time) || (outttype != ttype) || (outdata != data) || (outdtype != dtype)) {
+      for(i=0;i<n;i++) {
+        storeValue(outtime, outttype, i, rawValue(time, ttype, i));
+        storeValue(outdata, outdtype, i, rawValue(data, dtype, i));
+      }
+    }
+    return n;
+  }
+  
+  if(method == IDAM_LTTB) {
+    nb = nout - 2; /* First and last points are kept */
+    len = (n - 2)/nb + 2;
+  }else {
+    nb = (method == IDAM_MINMAX) ? nout/2 : nout;
+    len = n/nb + 2;
+  }
+  if((buf = (double*) malloc(4*len*sizeof(double))) == NULL)
+    return -1;
+  tcur = buf; dcur = buf + len; tnext = buf + 2*len; dnext = buf + 3*len;
+  
+  switch(method) {
+  case IDAM_MINMAX:
+    for(b=0;b<nb;b++) {
+      start = (b*n)/nb;
+      end = ((b+1)*n)/nb;
+      loadDoubles(data, dtype, start, end - start, dcur);
+      i0 = i1 = 0;
+      for(i=1;i<end-start;i++) {
+        if(dcur[i] < dcur[i0]) i0 = i;
+        if(dcur[i] > dcur[i1]) i1 = i;
+      }
+      if(i1 < i0) {
+        i = i0; i0 = i1; i1 = i;
+      }
+      /* Read both times before writing */
+      t0 = rawValue(time, ttype, start + i0);
+      t1 = rawValue(time, ttype, start + i1);
+      storeValue(outtime, outttype, k, t0);
+      storeValue(outdata, outdtype, k++, dcur[i0]);
+      storeValue(outtime, outttype, k, t1);
+      storeValue(outdata, outdtype, k++, dcur[i1]);
+    }
+    break;
+    
+  case IDAM_MEAN:
+    for(b=0;b<nb;b++) {
+      start = (b*n)/nb;
+      end = ((b+1)*n)/nb;
+      loadDoubles(time, ttype, start, end - start, tcur);
+      loadDoubles(data, dtype, start, end - start, dcur);
+      tsum = dsum = 0.0;
+      for(i=0;i<end-start;i++) {
+        tsum += tcur[i];
+        dsum += dcur[i];
+      }
+      storeValue(outtime, outttype, k, tsum / (end - start));
+      storeValue(outdata, outdtype, k++, dsum / (end - start));
+    }
+    break;
+    
+  case IDAM_LTTB:
+    ax = rawValue(time, ttype, 0);
+    ay = rawValue(data, dtype, 0);
+    lastx = rawValue(time, ttype, n-1);
+    lasty = rawValue(data, dtype, n-1);
+    storeValue(outtime, outttype, k, ax);
+    storeValue(outdata, outdtype, k++, ay);
+    
+#define BUCKET(B) (1 + ((B)*(n-2))/nb)
+    len = BUCKET(1) - BUCKET(0);
+    loadDoubles(time, ttype, BUCKET(0), len, tcur);
+    loadDoubles(data, dtype, BUCKET(0), len, dcur);
+    for(b=0;b<nb;b++) {
+      /* Average of the next bucket, or the last point */
+      bx = lastx;
+      by = lasty;
+      nextlen = 0;
+      if(b+1 < nb) {
+        nextlen = BUCKET(b+2) - BUCKET(b+1);
+        loadDoubles(time, ttype, BUCKET(b+1), nextlen, tnext);
+        loadDoubles(data, dtype, BUCKET(b+1), nextlen, dnext);
+        bx = by = 0.0;
+        for(i=0;i<nextlen;i++) {
+          bx += tnext[i];
+          by += dnext[i];
+        }
+        bx /= nextlen;
+        by /= nextlen;
+      }
+      
+      /* Point making the largest triangle */
+      i0 = 0;
+      best = -1.0;
+      for(i=0;i<len;i++) {
+        area = fabs((ax - bx)*(dcur[i] - ay) - (ax - tcur[i])*(by - ay));
+        if(area > best) {
+          best = area;
+          i0 = i;
+        }
+      }
+      ax = tcur[i0];
+      ay = dcur[i0];
+      storeValue(outtime, outttype, k, ax);
+      storeValue(outdata, outdtype, k++, ay);
+      
+      tmp = tcur; tcur = tnext; tnext = tmp;
+      tmp = dcur; dcur = dnext; dnext = tmp;
+      len = nextlen;
+    }
+#undef BUCKET
+    storeValue(outtime, outttype, k, lastx);
+    storeValue(outdata, outdtype, k++, lasty);
+    break;
+  }
+  
+  free(buf);
+  return k;
+}
+
+/* Decimate a signal as it is read, in place in the IDAM buffers.
+   Errors are dropped. Call with the GIL released. On failure
+   sig->error is set */
+static void
+Signal_decimate(idam_Signal *sig, const idam_Options *opt)
+{
+  idam_SignalDim *t = &sig->dim[0];
+  npy_intp n;
+  const char *error = NULL;
+  
+  if((sig->rank != 1) || (sig->order != 0))
+    error = "Can only decimate 1D signals";
+  else if((sig->raw == NULL) || (t->raw == NULL) || (sig->raw == t->raw) ||
+          !realType(sig->type) || !realType(t->type))
+    error = "Can't decimate data of this type";
+  else if((opt->method == IDAM_MEAN) &&
+          (((sig->type != TYPE_FLOAT) && (sig->type != TYPE_DOUBLE)) ||
+           ((t->type != TYPE_FLOAT) && (t->type != TYPE_DOUBLE))))
+    error = "Can't average integer data as it is read. Use Data.decimate()";
+  
+  if(error == NULL) {
+    n = decimate(t->raw, t->type, sig->raw, sig->type, sig->data_n,
+                 opt->decimate, opt->method,
+                 (char*) t->raw, t->type, (char*) sig->raw, sig->type);
+    if(n < 0)
+      error = "Out of memory";
+    else {
+      sig->data_n = sig->dimsize[0] = n;
+      sig->errtype = t->errtype = TYPE_UNKNOWN;
+      sig->rawerrl = sig->rawerrh = t->rawerrl = t->rawerrh = NULL;
+      return;
+    }
+  }
+  
+  sig->error = copyString(error);
+  IDAM_LOCK;
+  sig->backend->release(sig->handle);
+  IDAM_UNLOCK;
+  sig->handle = -1;
+}
+
+/* Set the NumPy types of the arrays in a snapshot */
+static void
+Signal_types(idam_Signal *sig, int native)
+{
+  int i;
+  
+  sig->npytype = arrayType(sig->raw, sig->type, native);
+  sig->npyerrtype = arrayType(sig->rawerrl, sig->errtype, native);
+  if(sig->errasym && (sig->npyerrtype != arrayType(sig->rawerrh, sig->errtype, native)))
+    sig->npyerrtype = NPY_FLOAT;
+  for(i=0;i<sig->rank;i++) {
+    idam_SignalDim *d = &sig->dim[i];
+    d->npytype = arrayType(d->raw, d->type, native);
+    d->npyerrtype = arrayType(d->rawerrl, d->errtype, native);
+    if(d->errasym && (d->npyerrtype != arrayType(d->rawerrh, d->errtype, native)))
+      d->npyerrtype = NPY_FLOAT;
+  }
+}
+
+/* Size of the IDAM buffers in a snapshot */
+static long long
+Signal_bytes(const idam_Signal *sig)
+{
+  long long total = 0;
+  int i, t;
+  
+#define ADD(RAW, TYPE, N) if((RAW) && ((t = findType(TYPE)) >= 0)) total += (N)*idam_types[t].size;
+  ADD(sig->raw, sig->type, sig->data_n);
+  ADD(sig->rawerrl, sig->errtype, sig->data_n);
+  if(sig->rawerrh != sig->rawerrl)
+    ADD(sig->rawerrh, sig->errtype, sig->data_n);
+  for(i=0;i<sig->rank;i++) {
+    const idam_SignalDim *d = &sig->dim[i];
+    ADD(d->raw, d->type, sig->dimsize[i]);
+    ADD(d->rawerrl, d->errtype, sig->dimsize[i]);
+    if(d->rawerrh != d->rawerrl)
+      ADD(d->rawerrh, d->errtype, sig->dimsize[i]);
+  }
+#undef ADD
+  return total;
+}
+
+/* Read a signal from the server and take a snapshot of it.
+   Call with the GIL released. On failure sig->error is set */
+static void
+Signal_read(idam_Signal *sig, const char *name, const char *source,
+            const idam_Server *srv, const idam_Options *opt)
+{
+  int i, n;
+  double t = idam_now();
+  
+  memset(sig, 0, sizeof(idam_Signal));
+  
+  IDAM_LOCK;
+  t = Stats_phase(IDAM_PHASE_WAIT, t, name);
+  
+  sig->backend = idam_backend;
+  sig->handle = Pool_request(sig->backend, srv, name, source, &sig->error);
+  Stats_phase(IDAM_PHASE_SERVER, t, name);
+  if(sig->error) {
+    sig->handle = -1;
+    IDAM_UNLOCK;
+    return;
+  }
+  
+  if(!sig->backend->status(sig->handle) || (sig->backend->dataNum(sig->handle) <= 0)) {
+    sig->error = copyString(sig->backend->errorMsg(sig->handle));
+    sig->backend->release(sig->handle);
+    sig->handle = -1;
+    IDAM_UNLOCK;
+    return;
+  }
+  
+  sig->rank = sig->backend->rank(sig->handle);
+  if((sig->rank < 0) || (sig->rank > IDAM_MAXRANK)) {
+    sig->error = copyString("Rank of data too large");
+    sig->backend->release(sig->handle);
+    sig->handle = -1;
+    IDAM_UNLOCK;
+    return;
+  }
+  
+  /* NOTE: Order of the dimensions is reversed */
+  sig->order = sig->rank - 1 - sig->backend->order(sig->handle);
+  sig->data_n = sig->backend->dataNum(sig->handle);
+  
+  sig->label = copyString(sig->backend->label(sig->handle));
+  sig->units = copyString(sig->backend->units(sig->handle));
+  sig->desc  = copyString(sig->backend->desc(sig->handle));
+  
+  sig->type = sig->backend->dataType(sig->handle);
+  sig->raw = sig->backend->data(sig->handle);
+  
+  sig->errtype = opt->errors ? sig->backend->errorType(sig->handle) : TYPE_UNKNOWN;
+  sig->errasym = sig->backend->errorAsymmetry(sig->handle);
+  if(sig->errtype != TYPE_UNKNOWN) {
+    sig->rawerrl = sig->backend->error(sig->handle, 0);
+    sig->rawerrh = sig->backend->error(sig->handle, 1);
+  }
+  
+  for(i=0;i<sig->rank;i++) {
+    n = sig->rank-1-i; /* IDAM index */
+    sig->dimsize[i] = sig->backend->dimNum(sig->handle, n);
+    sig->dim[i].label = copyString(sig->backend->dimLabel(sig->handle, n));
+    sig->dim[i].units = copyString(sig->backend->dimUnits(sig->handle, n));
+    
+    sig->dim[i].type = sig->backend->dimType(sig->handle, n);
+    sig->dim[i].raw = sig->backend->dimData(sig->handle, n);
+    
+    sig->dim[i].errtype = opt->errors ? sig->backend->dimErrorType(sig->handle, n) : TYPE_UNKNOWN;
+    sig->dim[i].errasym = sig->backend->dimErrorAsymmetry(sig->handle, n);
+    if(sig->dim[i].errtype != TYPE_UNKNOWN) {
+      sig->dim[i].rawerrl = sig->backend->dimError(sig->handle, n, 0);
+      sig->dim[i].rawerrh = sig->backend->dimError(sig->handle, n, 1);
+    }
+  }
+  
+  IDAM_UNLOCK;
+  
+  Stats_add(&idam_bytes, Signal_bytes(sig));
+  
+  if(IDAM_WINDOW(opt))
+    Signal_subset(sig, opt);
+  if((opt->decimate > 0) && (sig->handle >= 0))
+    Signal_decimate(sig, opt);
+}
+
+/* SI prefixes understood by unitFactor */
+static const struct {
+  const char *prefix;
+  double factor;
+} idam_prefixes[] = {
+  {"G", 1e9}, {"M", 1e6}, {"k", 1e3}, {"", 1.0},
+  {"c", 1e-2}, {"m", 1e-3}, {"u", 1e-6}, {"n", 1e-9},
+  {NULL, 0.0}
+};
+
+/* Find the factor to convert from units to units differing only
+   in SI prefix, e.g. "kA" to "MA". Returns -1 if not possible */
+static int
+unitFactor(const char *from, const char *to, double *factor)
+{
+  const char *p, *q;
+  int i, j;
+  
+  *factor = 1.0;
+  if(strcmp(from, to) == 0)
+    return 0;
+  for(i=0;idam_prefixes[i].prefix;i++) {
+    p = idam_prefixes[i].prefix;
+    if((strncmp(from, p, strlen(p)) != 0) || (from[strlen(p)] == 0))
+      continue;
+    for(j=0;idam_prefixes[j].prefix;j++) {
+      q = idam_prefixes[j].prefix;
+      if((strncmp(to, q, strlen(q)) == 0) && (strcmp(from + strlen(p), to + strlen(q)) == 0)) {
+        *factor = idam_prefixes[i].factor / idam_prefixes[j].factor;
+        return 0;
+      }
+    }
+  }
+  return -1;
+}
+
+/* Set up the transform in tr to be applied by Signal_fill. The data
+   and errors become floating point. sig->units is left as it is,
+   for the disk cache. Call after Signal_types, before the arrays are
+   created. Needs the GIL */
+static int
+Signal_transform(idam_Signal *sig, const idam_Transform *tr)
+{
+  idam_SignalDim *t;
+  double factor = 1.0;
+  npy_intp n;
+  int k = sig->order;
+  
+  if(!tr->on)
+    return 0;
+  
+  if((sig->raw == NULL) || !realType(sig->type) ||
+     ((sig->errtype != TYPE_UNKNOWN) &&
+      ((sig->rawerrl == NULL) || (sig->errasym && (sig->rawerrh == NULL)) || !realType(sig->errtype)))) {
+    PyErr_SetString(PyExc_ValueError, "Can't transform values of this type");
+    return -1;
+  }
+  if(tr->units[0] && (unitFactor(sig->units, tr->units, &factor) < 0)) {
+    PyErr_Format(PyExc_ValueError, "Can't convert units '%s' to '%s'", sig->units, tr->units);
+    return -1;
+  }
+  
+  if(tr->bmin <= tr->bmax) {
+    if((k < 0) || (k >= sig->rank) || (sig->dim[k].raw == NULL) || !realType(sig->dim[k].type)) {
+      PyErr_SetString(PyExc_ValueError, "Signal has no time dimension for the baseline");
+      return -1;
+    }
+    t = &sig->dim[k];
+    sig->bfirst = rawSearch(t->raw, t->type, sig->dimsize[k], tr->bmin, 0);
+    sig->bend = rawSearch(t->raw, t->type, sig->dimsize[k], tr->bmax, 1);
+    if(sig->bend <= sig->bfirst) {
+      PyErr_SetString(PyExc_ValueError, "No times in the baseline window");
+      return -1;
+    }
+    /* Space for the sums and counts of each time series */
+    n = (sig->dimsize[k] > 0) ? sig->data_n / sig->dimsize[k] : 0;
+    if((sig->base = (double*) malloc((2*n + 1) * sizeof(double))) == NULL) {
+      PyErr_NoMemory();
+      return -1;
+    }
+  }
+  
+  sig->transform = 1;
+  sig->scale = tr->scale * factor;
+  sig->offset = tr->offset * factor;
+  sig->vmin = tr->vmin;
+  sig->vmax = tr->vmax;
+  
+  if((sig->npytype != NPY_FLOAT) && (sig->npytype != NPY_DOUBLE))
+    sig->npytype = NPY_FLOAT;
+  if((sig->npyerrtype != NPY_FLOAT) && (sig->npyerrtype != NPY_DOUBLE))
+    sig->npyerrtype = NPY_FLOAT;
+  return 0;
+}
+
+/* Write dst[j] = src[j]*scale + offset - base[o*inner + i], where j
+   is (o*nt + t)*inner + i, or NaN if src[j] is outside vmin..vmax.
+   dst is NPY_FLOAT or NPY_DOUBLE, and base can be NULL. Doesn't
+   need the GIL */
+static void
+transformValues(void *dst, int npytype, const char *src, int type,
+                npy_intp outer, npy_intp nt, npy_intp inner,
+                double scale, double offset, const double *base,
+                double vmin, double vmax)
+{
+  npy_intp o, t, i;
+  double zero = 0.0, v;
+  const double *b;
+  
+  if(base == NULL) {
+    /* Same as one time series */
+    nt *= outer * inner;
+    outer = inner = 1;
+    base = &zero;
+  }
+  
+#define APPLY(T, D) {                                                   \
+    const T *p = (const T*) src; D *q = (D*) dst;                       \
+    for(o=0;o<outer;o++) {                                              \
+      for(t=0;t<nt;t++) {                                               \
+        b = base + o*inner;                                             \
+        for(i=0;i<inner;i++) {                                          \
+          v = (double) *p++;                                            \
+          *q++ = ((v < vmin) || (v > vmax)) ? (D) Py_NAN : (D) (v*scale + offset - b[i]); \
+        }}}}
+#define TYPES(D)                                                        \
+  switch(type) {                                                        \
+  case TYPE_FLOAT:           APPLY(float, D); break;                    \
+  case TYPE_DOUBLE:          APPLY(double, D); break;                   \
+  case TYPE_CHAR:            APPLY(signed char, D); break;              \
+  case TYPE_SHORT:           APPLY(short, D); break;                    \
+  case TYPE_INT:             APPLY(int, D); break;                      \
+  case TYPE_LONG:            APPLY(long, D); break;                     \
+  case TYPE_UNSIGNED_CHAR:   APPLY(unsigned char, D); break;            \
+  case TYPE_UNSIGNED_SHORT:  APPLY(unsigned short, D); break;           \
+  case TYPE_UNSIGNED_INT:    APPLY(unsigned int, D); break;             \
+  case TYPE_UNSIGNED_LONG:   APPLY(unsigned long, D); break;            \
+  TYPES64(D)                                                            \
+  }
+#ifdef TYPE_LONG64
+#define TYPES64(D)                                                      \
+  case TYPE_LONG64:          APPLY(long long, D); break;                \
+  case TYPE_UNSIGNED_LONG64: APPLY(unsigned long long, D); break;
+#else
+#define TYPES64(D)
+#endif
+  if(npytype == NPY_DOUBLE)
+    TYPES(double)
+  else
+    TYPES(float)
+#undef TYPES64
+#undef TYPES
+#undef APPLY
+}
+
+/* Apply the transform set up by Signal_transform to the data and
+   errors, filling their arrays in one pass. The baseline is the mean
+   of each time series over the baseline times, leaving out values
+   outside vmin..vmax. Errors are only scaled. Call with the GIL
+   released */
+static void
+Signal_applyTransform(idam_Signal *sig)
+{
+  npy_intp outer = 1, inner = 1, nt = 0, o, t, i;
+  int r, k = sig->order;
+  double v, *count, ascale = fabs(sig->scale);
+  
+  if(sig->base) {
+    for(r=0;r<k;r++)
+      outer *= sig->dimsize[r];
+    nt = sig->dimsize[k];
+    for(r=k+1;r<sig->rank;r++)
+      inner *= sig->dimsize[r];
+    
+    count = sig->base + outer*inner;
+    for(i=0;i<outer*inner;i++)
+      sig->base[i] = count[i] = 0.0;
+    for(o=0;o<outer;o++) {
+      for(t=sig->bfirst;t<sig->bend;t++) {
+        for(i=0;i<inner;i++) {
+          v = rawValue(sig->raw, sig->type, (o*nt + t)*inner + i);
+          if((v >= sig->vmin) && (v <= sig->vmax)) {
+            sig->base[o*inner + i] += v;
+            count[o*inner + i] += 1.0;
+          }
+        }
+      }
+    }
+    /* Mean of the calibrated values */
+    for(i=0;i<outer*inner;i++)
+      sig->base[i] = (count[i] > 0) ? (sig->base[i] / count[i]) * sig->scale + sig->offset : Py_NAN;
+  }else
+    nt = sig->data_n;
+  
+  if(sig->data) {
+    transformValues(sig->data, sig->npytype, sig->raw, sig->type, outer, nt, inner,
+                    sig->scale, sig->offset, sig->base, sig->vmin, sig->vmax);
+    sig->data = NULL;
+  }
+  if(sig->errl) {
+    transformValues(sig->errl, sig->npyerrtype, sig->rawerrl, sig->errtype, 1, sig->data_n, 1,
+                    ascale, 0.0, NULL, -HUGE_VAL, HUGE_VAL);
+    sig->errl = NULL;
+  }
+  if(sig->errh) {
+    transformValues(sig->errh, sig->npyerrtype, sig->rawerrh, sig->errtype, 1, sig->data_n, 1,
+                    ascale, 0.0, NULL, -HUGE_VAL, HUGE_VAL);
+    sig->errh = NULL;
+  }
+}
+
+/* Copy values into the arrays set in sig, then free the handle.
+   Call with the GIL released.
+   
+   The IDAM buffers are converted without holding idam_lock, so
+   that another thread can be waiting on the server meanwhile.
+   Types not handled by fillArray use the IDAM float routines,
+   which is safe because arrayType only picks a native type
+   when fillArray can copy it */
+static void
+Signal_fill(idam_Signal *sig)
+{
+  int i, n;
+  int fallback = 0;
+  
+  if(sig->transform)
+    Signal_applyTransform(sig);
+  
+  /* Copied even without a handle, e.g. from the cache into out= arrays */
+  if(sig->data && (fillArray(sig->data, sig->npytype, sig->raw, sig->type, sig->data_n) == 0))
+    sig->data = NULL;
+  if(sig->errl && (fillArray(sig->errl, sig->npyerrtype, sig->rawerrl, sig->errtype, sig->data_n) == 0))
+    sig->errl = NULL;
+  if(sig->errh && (fillArray(sig->errh, sig->npyerrtype, sig->rawerrh, sig->errtype, sig->data_n) == 0))
+    sig->errh = NULL;
+  fallback = sig->data || sig->errl || sig->errh;
+  
+  for(i=0;i<sig->rank;i++) {
+    idam_SignalDim *d = &sig->dim[i];
+    if(d->data && (fillArray(d->data, d->npytype, d->raw, d->type, sig->dimsize[i]) == 0))
+      d->data = NULL;
+    if(d->errl && (fillArray(d->errl, d->npyerrtype, d->rawerrl, d->errtype, sig->dimsize[i]) == 0))
+      d->errl = NULL;
+    if(d->errh && (fillArray(d->errh, d->npyerrtype, d->rawerrh, d->errtype, sig->dimsize[i]) == 0))
+      d->errh = NULL;
+    fallback |= d->data || d->errl || d->errh;
+  }
+  
+  if(sig->handle < 0)
+    return;
+  
+  if(!fallback && sig->owner) {
+    /* Nothing more to do with the handle */
+    sig->handle = -1;
+    return;
+  }
+  
+  IDAM_LOCK;
+  
+  if(fallback) {
+    /* Anything not yet converted */
+    if(sig->data)
+      sig->backend->floatData(sig->handle, sig->data);
+    if(sig->errl)
+      sig->backend->floatError(sig->handle, 0, sig->errl);
+    if(sig->errh)
+      sig->backend->floatError(sig->handle, 1, sig->errh);
+    
+    for(i=0;i<sig->rank;i++) {
+      n = sig->rank-1-i;
+      if(sig->dim[i].data)
+        sig->backend->floatDimData(sig->handle, n, sig->dim[i].data);
+      if(sig->dim[i].errl)
+        sig->backend->floatDimError(sig->handle, n, 0, sig->dim[i].errl);
+      if(sig->dim[i].errh)
+        sig->backend->floatDimError(sig->handle, n, 1, sig->dim[i].errh);
+    }
+  }
+  
+  if(sig->owner == NULL)
+    sig->backend->release(sig->handle);
+  sig->handle = -1;
+  
+  IDAM_UNLOCK;
+}
+
+static void Shm_release(int fd, const char *name);
+
+/* Unmap a cached signal, and let go of its shared memory segment,
+   removing the segment if nobody else holds it */
+static void
+Signal_unmap(idam_Signal *sig)
+{
+  if(sig->map)
+    munmap(sig->map, sig->mapsize);
+  if(sig->shm) {
+    Shm_release(sig->shmfd, sig->shm);
+    free(sig->shm);
+  }
+  sig->map = NULL;
+  sig->shm = NULL;
+}
+
+/* Free the handle (or mapped file) if not owned, and the copied
+   strings. Call with the GIL released */
+static void
+Signal_clear(idam_Signal *sig)
+{
+  int i;
+  PyObject *owner = sig->owner;
+  
+  if((sig->handle >= 0) && (owner == NULL)) {
+    IDAM_LOCK;
+    sig->backend->release(sig->handle);
+    IDAM_UNLOCK;
+  }
+  
+  if(owner == NULL)
+    Signal_unmap(sig);
+  
+  free(sig->error);
+  free(sig->label);
+  free(sig->units);
+  free(sig->desc);
+  free(sig->base);
+  for(i=0;i<sig->rank;i++) {
+    free(sig->dim[i].label);
+    free(sig->dim[i].units);
+  }
+  
+  memset(sig, 0, sizeof(idam_Signal));
+  sig->handle = -1;
+  sig->owner = owner;
+}
+
+/* Hash a buffer, 8 bytes at a time */
+static uint64_t
+hashBytes(const char *p, size_t n)
+{
+  uint64_t h = 14695981039346656037ULL, w;
+  size_t i;
+  
+  for(i=0;i+8<=n;i+=8) {
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * 1099511628211ULL;
+    h ^= h >> 29;
+  }
+  for(;i<n;i++)
+    h = (h ^ (unsigned char) p[i]) * 1099511628211ULL;
+  return h ^ n;
+}
+
+/* Hash the dimension values so that repeated dimensions can be
+   found. Call with the GIL released */
+static void
+Signal_hash(idam_Signal *sig)
+{
+  int i, t;
+  
+  for(i=0;i<sig->rank;i++) {
+    idam_SignalDim *d = &sig->dim[i];
+    if((d->raw == NULL) || ((t = findType(d->type)) < 0))
+      continue;
+    d->hash = hashBytes(d->raw, sig->dimsize[i] * idam_types[t].size);
+    d->hashed = 1;
+  }
+}
+
+/* Which array of a signal or dimension */
+enum { IDAM_DATA, IDAM_ERRL, IDAM_ERRH };
+
+/* Description of one array in a snapshot */
+typedef struct {
+  int rank;
+  npy_intp *dimsize;
+  npy_intp count;    /* Number of values */
+  int npytype;       /* NumPy type to create */
+  int type;          /* IDAM type of raw */
+  const char *raw;
+} idam_ArrayInfo;
+
+/* Describe one of the arrays in a snapshot. dim is the index of
+   the dimension in NumPy order, or -1 for the data */
+static void
+Signal_array(idam_Signal *sig, int dim, int which, idam_ArrayInfo *info)
+{
+  if(dim < 0) {
+    info->rank = sig->rank;
+    info->dimsize = sig->dimsize;
+    info->count = sig->data_n;
+    info->npytype = (which == IDAM_DATA) ? sig->npytype : sig->npyerrtype;
+    info->type = (which == IDAM_DATA) ? sig->type : sig->errtype;
+    info->raw = (which == IDAM_DATA) ? sig->raw : ((which == IDAM_ERRL) ? sig->rawerrl : sig->rawerrh);
+  }else {
+    idam_SignalDim *d = &sig->dim[dim];
+    info->rank = 1;
+    info->dimsize = &sig->dimsize[dim];
+    info->count = sig->dimsize[dim];
+    info->npytype = (which == IDAM_DATA) ? d->npytype : d->npyerrtype;
+    info->type = (which == IDAM_DATA) ? d->type : d->errtype;
+    info->raw = (which == IDAM_DATA) ? d->raw : ((which == IDAM_ERRL) ? d->rawerrl : d->rawerrh);
+  }
+}
+
+/* Read one of the arrays as float using the backend's
+   routines. Must hold idam_lock */
+static void
+Signal_floatArray(idam_Signal *sig, int handle, int dim, int which, float *ptr)
+{
+  const idam_Backend *b = sig->backend;
+  int n;
+  
+  if(dim < 0) {
+    if(which == IDAM_DATA)
+      b->floatData(handle, ptr);
+    else
+      b->floatError(handle, which == IDAM_ERRH, ptr);
+  }else {
+    n = sig->rank-1-dim; /* IDAM index */
+    if(which == IDAM_DATA)
+      b->floatDimData(handle, n, ptr);
+    else
+      b->floatDimError(handle, n, which == IDAM_ERRH, ptr);
+  }
+}
+
+/************************************************************
+ * Disk cache
+ *
+ * Signals can be kept in a local directory, one file per
+ * request. Each file has a header, the strings, then the
+ * arrays as they would be given to NumPy, so a cached read
+ * just maps the file and points the snapshot into it.
+ *
+ * Files are replaced atomically by rename, and the least
+ * recently used are removed when over the size limit.
+ *
+ * The same files can be kept in POSIX shared memory, so that
+ * processes on one host read each signal from the server once
+ * and map it rather than copy. Each process holds a shared
+ * flock on a segment while its arrays use it, and the last to
+ * let go removes it.
+ ************************************************************/
+
+#define CACHE_MAGIC "IDAMCAC1"
+#define CACHE_ALIGN 64
+
+/* Cache settings. Only accessed with the GIL held */
+static char *idam_cachedir = NULL;  /* NULL if not caching */
+static long long idam_cachemax = 0; /* Size limit in bytes */
+static long long idam_shmmax = 0;   /* Shared memory limit. Zero if off */
+
+/* Bytes in the cache directory at the last scan plus those written
+   since, or -1 if not known. The directory is only scanned when
+   this goes over the limit, or every IDAM_CACHESCAN writes to see
+   files from other processes. Protected by idam_cachelock */
+#define IDAM_CACHESCAN 64
+static PyThread_type_lock idam_cachelock = NULL;
+static long long idam_cachebytes = -1;
+static int idam_cachewrites = 0;
+static long long idam_shmbytes = -1;  /* The same, for shared memory */
+static int idam_shmwrites = 0;
+
+typedef struct {
+  int64_t offset;   /* From start of file. Zero if not present */
+  int64_t nbytes;
+  int32_t type;     /* IDAM type of the values */
+  int32_t pad;
+} idam_CacheArray;
+
+typedef struct {
+  char magic[8];
+  int32_t rank;
+  int32_t order;
+  int64_t data_n;
+  int64_t dimsize[IDAM_MAXRANK];
+  int32_t errasym;
+  int32_t dimerrasym[IDAM_MAXRANK];
+  int32_t pad;
+  int64_t strings;  /* Offset of the key, then labels, units etc. */
+  int64_t stringlen;
+  idam_CacheArray array[1+IDAM_MAXRANK][3]; /* Data, then dims */
+} idam_CacheHeader;
+
+/* Where a request is cached. Set up with the GIL held */
+typedef struct {
+  char *path;       /* NULL if not using the cache */
+  char *dir;
+  char *key;        /* Identifies the request, stored in the file */
+  long long maxsize;
+  char *shm;        /* Shared memory segment. NULL if not sharing */
+  long long shmmax;
+  int share;        /* If zero, the segment is only read, not written */
+  int written;      /* Set once Cache_write has been called */
+} idam_CacheEntry;
+
+static void
+Cache_free(idam_CacheEntry *entry)
+{
+  free(entry->path);
+  free(entry->dir);
+  free(entry->key);
+  free(entry->shm);
+  memset(entry, 0, sizeof(idam_CacheEntry));
+}
+
+/* A string identifying everything which affects the result of a
+   request. Returns NULL if out of memory */
+static char *
+requestKey(const char *name, const char *source,
+           const idam_Server *srv, const idam_Options *opt)
+{
+  char *key, *c;
+  int i;
+  
+  key = (char*) malloc(strlen(name) + strlen(source) + strlen(srv->host) + 384 +
+                       srv->nprops*(IDAM_PROPLEN + 4));
+  if(key == NULL)
+    return NULL;
+  c = key + sprintf(key, "%s\n%s\n%s\n%d\n%s\n%d\n%.17g\n%.17g\n%d\n%ld\n%d",
+                    name, source, srv->host, srv->port,
+                    opt->native ? "native" : "float32", opt->errors,
+                    opt->tmin, opt->tmax, opt->stride, (long) opt->decimate, opt->method);
+  if(opt->transform.on)
+    c += sprintf(c, "\n%.17g\n%.17g\n%s\n%.17g\n%.17g\n%.17g\n%.17g",
+                 opt->transform.scale, opt->transform.offset, opt->transform.units,
+                 opt->transform.bmin, opt->transform.bmax,
+                 opt->transform.vmin, opt->transform.vmax);
+  for(i=0;i<srv->nprops;i++)
+    c += sprintf(c, "\n%s=%d", srv->props[i].name, srv->props[i].value);
+  return key;
+}
+
+/* Names of shared memory segments start with this, so that
+   users don't share, or remove, each other's segments. With 12
+   digits of the hash, names are at most 28 characters, within
+   the 31 allowed on macOS */
+static void
+shmPrefix(char *prefix)
+{
+  sprintf(prefix, "idam%lu.", (unsigned long) getuid());
+}
+
+/* Find the cache file and shared memory segment for a request.
+   entry->path and entry->shm are left NULL if not used. Needs
+   the GIL */
+static int
+Cache_entry(idam_CacheEntry *entry, const char *name, const char *source,
+            const idam_Server *srv, const idam_Options *opt)
+{
+  uint64_t hash = 14695981039346656037ULL; /* FNV-1a */
+  const char *c;
+  char prefix[64];
+  idam_Options raw;
+  
+  memset(entry, 0, sizeof(idam_CacheEntry));
+  if(((idam_cachedir == NULL) && (idam_shmmax <= 0)) || !opt->cache)
+    return 0;
+  
+  /* Files hold the values before any transform */
+  raw = *opt;
+  raw.transform.on = 0;
+  if((entry->key = requestKey(name, source, srv, &raw)) == NULL)
+    goto nomem;
+  for(c=entry->key;*c;c++) {
+    hash ^= (unsigned char) *c;
+    hash *= 1099511628211ULL;
+  }
+  
+  if(idam_cachedir != NULL) {
+    entry->dir = copyString(idam_cachedir);
+    entry->path = (char*) malloc(strlen(idam_cachedir) + 32);
+    if(!entry->dir || !entry->path)
+      goto nomem;
+    sprintf(entry->path, "%s/%016llx.idam", idam_cachedir, (unsigned long long) hash);
+    entry->maxsize = idam_cachemax;
+  }
+  
+  if(idam_shmmax > 0) {
+    shmPrefix(prefix);
+    if((entry->shm = (char*) malloc(strlen(prefix) + 32)) == NULL)
+      goto nomem;
+    sprintf(entry->shm, "/%s%012llx", prefix, (unsigned long long) (hash & 0xffffffffffffULL));
+    entry->shmmax = idam_shmmax;
+    entry->share = opt->share;
+  }
+  return 0;
+  
+ nomem:
+  Cache_free(entry);
+  PyErr_NoMemory();
+  return -1;
+}
+
+/* Get the next string from the strings section */
+static const char *
+cacheString(const char **p, const char *end)
+{
+  const char *s = *p;
+  const char *e = (const char*) memchr(s, 0, end - s);
+  if(e == NULL)
+    return NULL;
+  *p = e + 1;
+  return s;
+}
+
+/* Point a snapshot at an array in the mapped file */
+static int
+cacheArray(idam_CacheArray *a, const char *map, size_t size, npy_intp n,
+           const char **raw, int *type)
+{
+  int t;
+  
+  *raw = NULL;
+  if(a->offset == 0)
+    return 0;
+  if(((t = findType(a->type)) < 0) ||
+     (a->nbytes != (int64_t) (n * idam_types[t].size)) ||
+     (a->offset < 0) || ((uint64_t) (a->offset + a->nbytes) > size))
+    return -1;
+  *raw = map + a->offset;
+  *type = a->type;
+  return 0;
+}
+
+/* Map an open cache file into sig. If key is not NULL, the file
+   must be for that request. Returns 0 and fills sig if valid, or
+   -1 if not. The descriptor is left open. Doesn't need the GIL */
+static int
+cacheMap(int fd, const char *key, idam_Signal *sig)
+{
+  int i;
+  struct stat st;
+  char *map;
+  idam_CacheHeader *h;
+  const char *p, *end, *str[4+2*IDAM_MAXRANK];
+  
+  memset(sig, 0, sizeof(idam_Signal));
+  sig->handle = -1;
+  
+  if((fstat(fd, &st) < 0) || ((size_t) st.st_size < sizeof(idam_CacheHeader)))
+    return -1;
+  /* Private mapping, so arrays are writable without changing the file */
+  map = (char*) mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(map == MAP_FAILED)
+    return -1;
+  
+  h = (idam_CacheHeader*) map;
+  if((memcmp(h->magic, CACHE_MAGIC, 8) != 0) ||
+     (h->rank < 0) || (h->rank > IDAM_MAXRANK) ||
+     (h->strings < (int64_t) sizeof(idam_CacheHeader)) || (h->stringlen < 0) ||
+     ((uint64_t) (h->strings + h->stringlen) > (uint64_t) st.st_size))
+    goto miss;
+  
+  /* Check the key, in case of a hash collision */
+  p = map + h->strings;
+  end = p + h->stringlen;
+  if(((str[0] = cacheString(&p, end)) == NULL) || (key && (strcmp(str[0], key) != 0)))
+    goto miss;
+  for(i=1;i<4+2*h->rank;i++) {
+    if((str[i] = cacheString(&p, end)) == NULL)
+      goto miss;
+  }
+  
+  sig->rank = h->rank;
+  sig->order = h->order;
+  sig->data_n = h->data_n;
+  sig->errasym = h->errasym;
+  sig->errtype = TYPE_UNKNOWN;
+  if((cacheArray(&h->array[0][IDAM_DATA], map, st.st_size, sig->data_n, &sig->raw, &sig->type) < 0) ||
+     (sig->raw == NULL) ||
+     (cacheArray(&h->array[0][IDAM_ERRL], map, st.st_size, sig->data_n, &sig->rawerrl, &sig->errtype) < 0) ||
+     (cacheArray(&h->array[0][IDAM_ERRH], map, st.st_size, sig->data_n, &sig->rawerrh, &sig->errtype) < 0))
+    goto miss;
+  if(!sig->errasym)
+    sig->rawerrh = sig->rawerrl;
+  
+  for(i=0;i<sig->rank;i++) {
+    idam_SignalDim *d = &sig->dim[i];
+    sig->dimsize[i] = h->dimsize[i];
+    d->errasym = h->dimerrasym[i];
+    d->errtype = TYPE_UNKNOWN;
+    if((cacheArray(&h->array[1+i][IDAM_DATA], map, st.st_size, sig->dimsize[i], &d->raw, &d->type) < 0) ||
+       (d->raw == NULL) ||
+       (cacheArray(&h->array[1+i][IDAM_ERRL], map, st.st_size, sig->dimsize[i], &d->rawerrl, &d->errtype) < 0) ||
+       (cacheArray(&h->array[1+i][IDAM_ERRH], map, st.st_size, sig->dimsize[i], &d->rawerrh, &d->errtype) < 0))
+      goto miss;
+    if(!d->errasym)
+      d->rawerrh = d->rawerrl;
+  }
+  
+  sig->label = copyString(str[1]);
+  sig->units = copyString(str[2]);
+  sig->desc  = copyString(str[3]);
+  for(i=0;i<sig->rank;i++) {
+    sig->dim[i].label = copyString(str[4+2*i]);
+    sig->dim[i].units = copyString(str[5+2*i]);
+  }
+  
+  sig->map = map;
+  sig->mapsize = st.st_size;
+  return 0;
+  
+ miss:
+  munmap(map, st.st_size);
+  memset(sig, 0, sizeof(idam_Signal));
+  sig->handle = -1;
+  return -1;
+}
+
+/* Read a signal from the cache. Returns 0 and fills sig if found,
+   or -1 if not. Call with the GIL released */
+static int
+Cache_read(idam_CacheEntry *entry, idam_Signal *sig)
+{
+  int fd, ret;
+  
+  if((fd = open(entry->path, O_RDONLY)) < 0) {
+    memset(sig, 0, sizeof(idam_Signal));
+    sig->handle = -1;
+    return -1;
+  }
+  ret = cacheMap(fd, entry->key, sig);
+  close(fd);
+  
+  /* Mark as recently used */
+  if(ret == 0)
+    utime(entry->path, NULL);
+  return ret;
+}
+
+/* Segments this process holds a shared lock on, so that they can
+   be removed when it lets go of them, or exits. Protected by
+   idam_cachelock */
+#define IDAM_SHMPINS 256 /* Segments held for pickled Data */
+
+typedef struct {
+  int fd;
+  pid_t pid;       /* Opened by this process, not inherited by fork */
+  int pinned;      /* Held for a pickled Data, not by arrays */
+  char name[32];
+} idam_ShmHold;
+
+static idam_ShmHold *idam_shmholds = NULL;
+static int idam_nshmholds = 0, idam_maxshmholds = 0, idam_nshmpins = 0;
+
+/* Remember a segment held with fd. If out of memory, the segment
+   is just never removed by this process. Doesn't need the GIL */
+static void
+Shm_hold(int fd, const char *name, int pinned)
+{
+  idam_ShmHold *tmp;
+  
+  PyThread_acquire_lock(idam_cachelock, WAIT_LOCK);
+  if(idam_nshmholds == idam_maxshmholds) {
+    tmp = (idam_ShmHold*) realloc(idam_shmholds, (2*idam_maxshmholds + 16)*sizeof(idam_ShmHold));
+    if(tmp) {
+      idam_shmholds = tmp;
+      idam_maxshmholds = 2*idam_maxshmholds + 16;
+    }
+  }
+  if(idam_nshmholds < idam_maxshmholds) {
+    idam_ShmHold *s = &idam_shmholds[idam_nshmholds++];
+    s->fd = fd;
+    s->pid = getpid();
+    s->pinned = pinned;
+    strncpy(s->name, name, sizeof(s->name) - 1);
+    s->name[sizeof(s->name) - 1] = 0;
+    idam_nshmpins += pinned;
+  }
+  PyThread_release_lock(idam_cachelock);
+}
+
+/* Let go of a segment held with fd, removing it if nobody else
+   holds it, so that it doesn't outlive its users. Doesn't need
+   the GIL */
+static void
+Shm_release(int fd, const char *name)
+{
+  int i, own = 0;
+  
+  PyThread_acquire_lock(idam_cachelock, WAIT_LOCK);
+  for(i=0;i<idam_nshmholds;i++) {
+    if(idam_shmholds[i].fd == fd) {
+      own = (idam_shmholds[i].pid == getpid());
+      idam_nshmpins -= idam_shmholds[i].pinned;
+      memmove(&idam_shmholds[i], &idam_shmholds[i+1], (idam_nshmholds - i - 1)*sizeof(idam_ShmHold));
+      idam_nshmholds--;
+      break;
+    }
+  }
+  PyThread_release_lock(idam_cachelock);
+  
+  /* Any other holder has a shared lock, so this fails */
+  if(own && (flock(fd, LOCK_EX | LOCK_NB) == 0))
+    shm_unlink(name);
+  close(fd);
+}
+
+/* Let go of the oldest pinned segment, if over the limit or if
+   all is set. Returns 1 if one was released. Doesn't need the GIL */
+static int
+Shm_unpin(int all)
+{
+  int i, fd = -1;
+  char name[32];
+  
+  PyThread_acquire_lock(idam_cachelock, WAIT_LOCK);
+  if(all ? (idam_nshmpins > 0) : (idam_nshmpins > IDAM_SHMPINS)) {
+    for(i=0;i<idam_nshmholds;i++) {
+      if(idam_shmholds[i].pinned) {
+        fd = idam_shmholds[i].fd;
+        strcpy(name, idam_shmholds[i].name);
+        break;
+      }
+    }
+  }
+  PyThread_release_lock(idam_cachelock);
+  
+  if(fd < 0)
+    return 0;
+  Shm_release(fd, name);
+  return 1;
+}
+
+/* Hold a segment for a pickled Data, so that it is still there
+   when the receiver maps it, even if the sender's arrays are gone
+   by then. Kept until IDAM_SHMPINS more are pinned, or this
+   process exits. Returns -1 if the segment has gone. Doesn't
+   need the GIL */
+static int
+Shm_pin(const char *name)
+{
+  int i, found = 0, fd;
+  
+  PyThread_acquire_lock(idam_cachelock, WAIT_LOCK);
+  for(i=0;i<idam_nshmholds;i++) {
+    if(idam_shmholds[i].pinned && (strcmp(idam_shmholds[i].name, name) == 0))
+      found = 1;
+  }
+  PyThread_release_lock(idam_cachelock);
+  if(found)
+    return 0;
+  
+  /* A new descriptor, so the lock is separate from the arrays' */
+  if((fd = shm_open(name, O_RDONLY, 0)) < 0)
+    return -1;
+  if(flock(fd, LOCK_SH | LOCK_NB) < 0) {
+    close(fd);
+    return -1;
+  }
+  Shm_hold(fd, name, 1);
+  Shm_unpin(0);
+  return 0;
+}
+
+/* At exit, remove the segments which nobody else holds. Locks
+   are dropped first, in case this process holds one twice */
+static void
+Shm_exit(void)
+{
+  pid_t pid = getpid();
+  int i;
+  
+  for(i=0;i<idam_nshmholds;i++) {
+    if(idam_shmholds[i].pid == pid)
+      flock(idam_shmholds[i].fd, LOCK_UN);
+  }
+  for(i=0;i<idam_nshmholds;i++) {
+    if((idam_shmholds[i].pid == pid) && (flock(idam_shmholds[i].fd, LOCK_EX | LOCK_NB) == 0))
+      shm_unlink(idam_shmholds[i].name);
+  }
+}
+
+/* Map a segment open as fd, on which a shared lock is held. On
+   success the descriptor belongs to sig, otherwise it is closed.
+   Doesn't need the GIL */
+static int
+shmAttach(int fd, const char *name, const char *key, idam_Signal *sig)
+{
+  if(cacheMap(fd, key, sig) < 0) {
+    close(fd);
+    return -1;
+  }
+  if((sig->shm = copyString(name)) == NULL) {
+    Signal_clear(sig);
+    close(fd);
+    return -1;
+  }
+  sig->shmfd = fd;
+  Shm_hold(fd, name, 0);
+  
+  /* Mark as recently used */
+  futimens(fd, NULL);
+  return 0;
+}
+
+/* Map a shared memory segment, checking the key if not NULL.
+   Returns -1 if there is no such segment, or it is still being
+   written. The descriptor is kept open with a shared lock until
+   the signal is unmapped. Call with the GIL released */
+static int
+Shm_map(const char *name, const char *key, idam_Signal *sig)
+{
+  int fd;
+  
+  memset(sig, 0, sizeof(idam_Signal));
+  sig->handle = -1;
+  
+  if((fd = shm_open(name, O_RDONLY, 0)) < 0)
+    return -1;
+  if(flock(fd, LOCK_SH | LOCK_NB) < 0) {
+    close(fd);
+    return -1;
+  }
+  return shmAttach(fd, name, key, sig);
+}
+
+/* Read a signal from shared memory. Returns 0 and fills sig if
+   found, or -1 if not. Call with the GIL released */
+static int
+Shm_read(idam_CacheEntry *entry, idam_Signal *sig)
+{
+  return Shm_map(entry->shm, entry->key, sig);
+}
+
+static int
+writeAll(int fd, const void *buf, size_t n)
+{
+  const char *p = (const char*) buf;
+  ssize_t w;
+  
+  while(n > 0) {
+    w = write(fd, p, n);
+    if(w < 0) {
+      if(errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += w;
+    n -= w;
+  }
+  return 0;
+}
+
+typedef struct {
+  time_t mtime;
+  off_t size;
+  char *name;
+} idam_CacheFile;
+
+static int
+compareCacheFiles(const void *a, const void *b)
+{
+  const idam_CacheFile *fa = (const idam_CacheFile*) a;
+  const idam_CacheFile *fb = (const idam_CacheFile*) b;
+  return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
+
+/* Count nbytes written to a cache with the given running total.
+   Returns 1 if it is time to scan (and trim) the cache. Doesn't
+   need the GIL */
+static int
+cacheCount(long long *total, int *writes, long long nbytes, long long maxsize)
+{
+  int scan;
+  
+  if(maxsize <= 0)
+    return 0;
+  PyThread_acquire_lock(idam_cachelock, WAIT_LOCK);
+  if(*total >= 0)
+    *total += nbytes;
+  scan = (*total < 0) || (*total > maxsize) || (++*writes >= IDAM_CACHESCAN);
+  if(scan)
+    *writes = 0;
+  PyThread_release_lock(idam_cachelock);
+  return scan;
+}
+
+/* Set a running total after a scan. Doesn't need the GIL */
+static void
+cacheCounted(long long *total, long long bytes)
+{
+  PyThread_acquire_lock(idam_cachelock, WAIT_LOCK);
+  *total = bytes;
+  PyThread_release_lock(idam_cachelock);
+}
+
+/* Remove least recently used files until the cache is within
+   maxsize bytes. Returns the bytes left, or -1 if the directory
+   can't be read. Call with the GIL released */
+static long long
+Cache_trim(const char *dir, long long maxsize)
+{
+  DIR *d;
+  struct dirent *ent;
+  struct stat st;
+  idam_CacheFile *files = NULL, *tmp;
+  size_t n = 0, nalloc = 0, i, len;
+  long long total = 0;
+  char *path;
+  
+  if((d = opendir(dir)) == NULL)
+    return -1;
+  
+  path = (char*) malloc(strlen(dir) + 256 + 2);
+  while(path && ((ent = readdir(d)) != NULL)) {
+    len = strlen(ent->d_name);
+    if((len < 5) || (len > 255) || (strcmp(ent->d_name + len - 5, ".idam") != 0))
+      continue;
+    sprintf(path, "%s/%s", dir, ent->d_name);
+    if(stat(path, &st) < 0)
+      continue;
+    if(n == nalloc) {
+      nalloc = nalloc ? 2*nalloc : 64;
+      if((tmp = (idam_CacheFile*) realloc(files, nalloc*sizeof(idam_CacheFile))) == NULL)
+        break;
+      files = tmp;
+    }
+    files[n].mtime = st.st_mtime;
+    files[n].size = st.st_size;
+    if((files[n].name = copyString(ent->d_name)) == NULL)
+      break;
+    total += st.st_size;
+    n++;
+  }
+  closedir(d);
+  
+  if(path && (total > maxsize)) {
+    qsort(files, n, sizeof(idam_CacheFile), compareCacheFiles);
+    for(i=0;(i<n) && (total > maxsize);i++) {
+      sprintf(path, "%s/%s", dir, files[i].name);
+      if(unlink(path) == 0)
+        total -= files[i].size;
+    }
+  }
+  
+  for(i=0;i<n;i++)
+    free(files[i].name);
+  free(files);
+  if(path == NULL)
+    return -1;
+  free(path);
+  return total;
+}
+
+#define IDAM_SHMDIR "/dev/shm"
+
+/* List this user's shared memory segments, returning their total
+   size. Only Linux lists segments (as files in /dev/shm), so
+   elsewhere there are none. Doesn't need the GIL */
+static long long
+Shm_list(idam_CacheFile **files, size_t *n)
+{
+  DIR *d;
+  struct dirent *ent;
+  struct stat st;
+  idam_CacheFile *tmp;
+  size_t nalloc = 0, len;
+  long long total = 0;
+  char prefix[64], path[sizeof(IDAM_SHMDIR) + 256 + 2];
+  
+  *files = NULL;
+  *n = 0;
+  if((d = opendir(IDAM_SHMDIR)) == NULL)
+    return 0;
+  
+  shmPrefix(prefix);
+  len = strlen(prefix);
+  while((ent = readdir(d)) != NULL) {
+    if((strncmp(ent->d_name, prefix, len) != 0) || (strlen(ent->d_name) > 255))
+      continue;
+    sprintf(path, "%s/%s", IDAM_SHMDIR, ent->d_name);
+    if(stat(path, &st) < 0)
+      continue;
+    if(*n == nalloc) {
+      nalloc = nalloc ? 2*nalloc : 64;
+      if((tmp = (idam_CacheFile*) realloc(*files, nalloc*sizeof(idam_CacheFile))) == NULL)
+        break;
+      *files = tmp;
+    }
+    (*files)[*n].mtime = st.st_mtime;
+    (*files)[*n].size = st.st_size;
+    if(((*files)[*n].name = copyString(ent->d_name)) == NULL)
+      break;
+    total += st.st_size;
+    (*n)++;
+  }
+  closedir(d);
+  return total;
+}
+
+/* Remove this user's segments which nobody holds. The last
+   process to let go of a segment removes it, so these were left
+   by processes which were killed. Empty segments less than a
+   minute old are skipped, as they may be about to be locked and
+   written. Returns the bytes in the rest. Call with the GIL
+   released */
+static long long
+Shm_trim(void)
+{
+  idam_CacheFile *files;
+  size_t n, i;
+  long long total = Shm_list(&files, &n);
+  time_t now = time(NULL);
+  char name[256 + 2];
+  int fd;
+  
+  for(i=0;i<n;i++) {
+    if((files[i].size == 0) && (now - files[i].mtime < 60))
+      continue;
+    sprintf(name, "/%s", files[i].name);
+    if((fd = shm_open(name, O_RDONLY, 0)) < 0)
+      continue;
+    if((flock(fd, LOCK_EX | LOCK_NB) == 0) && (shm_unlink(name) == 0))
+      total -= files[i].size;
+    close(fd);
+  }
+  
+  for(i=0;i<n;i++)
+    free(files[i].name);
+  free(files);
+  return total;
+}
+
+/* Check there is room for a new segment of nbytes, and count it.
+   Segments in use can't be removed, so when full new signals are
+   not shared. Like the disk cache, a running total is kept and
+   segments are only listed when it goes over maxsize, or every
+   IDAM_CACHESCAN segments. Doesn't need the GIL */
+static int
+Shm_room(long long nbytes, long long maxsize)
+{
+  long long total;
+  int ok;
+  
+  if(!cacheCount(&idam_shmbytes, &idam_shmwrites, nbytes, maxsize))
+    return 1; /* Counted, and still within maxsize */
+  
+  total = Shm_trim();
+  ok = (total + nbytes <= maxsize);
+  cacheCounted(&idam_shmbytes, ok ? total + nbytes : total);
+  return ok;
+}
+
+/* Set the offsets in h of the strings, then each array in values
+   with nbytes set in the header. Returns the size of the file */
+static int64_t
+cacheLayout(idam_CacheHeader *h, const char **str, int nstr, const void *values[][3])
+{
+  int64_t offset;
+  int i, j;
+  
+  h->strings = sizeof(idam_CacheHeader);
+  h->stringlen = 0;
+  for(i=0;i<nstr;i++)
+    h->stringlen += strlen(str[i]) + 1;
+  
+  offset = h->strings + h->stringlen;
+  for(i=0;i<=h->rank;i++) {
+    for(j=IDAM_DATA;j<=IDAM_ERRH;j++) {
+      idam_CacheArray *a = &h->array[i][j];
+      if(values[i][j] == NULL)
+        continue;
+      offset = (offset + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+      a->offset = offset;
+      offset += a->nbytes;
+    }
+  }
+  return offset;
+}
+
+/* Write a cache file: the header, strings, then the values of
+   each array with nbytes set in the header. Sets the offsets in
+   h. Written to a temporary file then renamed into place.
+   Returns 0 on success. Doesn't need the GIL */
+static int
+writeCacheFile(const char *path, idam_CacheHeader *h, const char **str, int nstr,
+               const void *values[][3])
+{
+  static const char zeros[CACHE_ALIGN] = {0};
+  char *tmppath;
+  int64_t offset;
+  int i, j, fd, ok = 0;
+  
+  cacheLayout(h, str, nstr, values);
+  
+  if((tmppath = (char*) malloc(strlen(path) + 64)) == NULL)
+    return -1;
+  sprintf(tmppath, "%s.%ld.%lu.tmp", path, (long) getpid(),
+          (unsigned long) PyThread_get_thread_ident());
+  if((fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    free(tmppath);
+    return -1;
+  }
+  
+  if(writeAll(fd, h, sizeof(idam_CacheHeader)) < 0)
+    goto done;
+  for(i=0;i<nstr;i++) {
+    if(writeAll(fd, str[i], strlen(str[i]) + 1) < 0)
+      goto done;
+  }
+  offset = h->strings + h->stringlen;
+  for(i=0;i<=h->rank;i++) {
+    for(j=IDAM_DATA;j<=IDAM_ERRH;j++) {
+      idam_CacheArray *a = &h->array[i][j];
+      if(a->offset == 0)
+        continue;
+      if((writeAll(fd, zeros, a->offset - offset) < 0) ||
+         (writeAll(fd, values[i][j], a->nbytes) < 0))
+        goto done;
+      offset = a->offset + a->nbytes;
+    }
+  }
+  ok = 1;
+  
+ done:
+  if(close(fd) < 0)
+    ok = 0;
+  if(!ok || (rename(tmppath, path) < 0)) {
+    unlink(tmppath);
+    ok = 0;
+  }
+  free(tmppath);
+  return ok ? 0 : -1;
+}
+
+/* Create a shared memory segment of size bytes, zero filled and
+   mapped for writing. It is locked until shmFinish, so readers
+   don't map it early. If the segment exists, another process has
+   it. Returns the descriptor, or -1. Doesn't need the GIL */
+static int
+shmCreate(const char *name, int64_t size, char **map)
+{
+  int fd;
+  
+  if((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+    return -1;
+  if(flock(fd, LOCK_EX) < 0)
+    goto fail;
+#ifdef __linux__
+  /* Reserve the pages, so a full /dev/shm fails here, not with SIGBUS */
+  if(posix_fallocate(fd, 0, size) != 0)
+    goto fail;
+#else
+  if(ftruncate(fd, size) < 0)
+    goto fail;
+#endif
+  *map = (char*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(*map == MAP_FAILED)
+    goto fail;
+  return fd;
+  
+ fail:
+  shm_unlink(name);
+  close(fd);
+  return -1;
+}
+
+/* Complete a segment from shmCreate, everything but the magic
+   having been written. Returns the descriptor, now holding a
+   shared lock like a reader, or -1. Doesn't need the GIL */
+static int
+shmFinish(const char *name, int fd, char *map, int64_t size)
+{
+  memcpy(map, CACHE_MAGIC, 8);
+  munmap(map, size);
+  if(flock(fd, LOCK_SH) < 0) {
+    shm_unlink(name);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Write a cache file as a new shared memory segment. Returns the
+   descriptor as from shmFinish, or -1. Doesn't need the GIL */
+static int
+writeCacheShm(const char *name, idam_CacheHeader *h, const char **str, int nstr,
+              const void *values[][3])
+{
+  int64_t size = cacheLayout(h, str, nstr, values);
+  char *map, *p;
+  int i, j, fd;
+  
+  if((fd = shmCreate(name, size, &map)) < 0)
+    return -1;
+  
+  /* Zero filled, so only the values are copied */
+  memcpy(map + 8, (const char*) h + 8, sizeof(idam_CacheHeader) - 8);
+  p = map + h->strings;
+  for(i=0;i<nstr;i++) {
+    strcpy(p, str[i]);
+    p += strlen(str[i]) + 1;
+  }
+  for(i=0;i<=h->rank;i++) {
+    for(j=IDAM_DATA;j<=IDAM_ERRH;j++) {
+      if(h->array[i][j].offset != 0)
+        memcpy(map + h->array[i][j].offset, values[i][j], h->array[i][j].nbytes);
+    }
+  }
+  return shmFinish(name, fd, map, size);
+}
+
+/* Write a signal to the cache, once. The arrays are stored with
+   the types they will have in NumPy, so sig's NumPy types must be
+   set and the handle still open. Returns the descriptor of a new
+   shared memory segment as from writeCacheShm, or -1. Call with
+   the GIL released */
+static int
+Cache_write(idam_CacheEntry *entry, idam_Signal *sig)
+{
+  idam_CacheHeader h;
+  idam_ArrayInfo info;
+  const void *values[1+IDAM_MAXRANK][3];
+  void *tmp[1+IDAM_MAXRANK][3];
+  const char *str[4+2*IDAM_MAXRANK];
+  int i, j, t, nstr, ok = 0, fd = -1;
+  int64_t size;
+  
+  if(((entry->path == NULL) && (entry->shm == NULL)) || (sig->handle < 0) || entry->written)
+    return -1;
+  entry->written = 1;
+  
+  memset(&h, 0, sizeof(h));
+  memset(tmp, 0, sizeof(tmp));
+  memset(values, 0, sizeof(values));
+  memcpy(h.magic, CACHE_MAGIC, 8);
+  h.rank = sig->rank;
+  h.order = sig->order;
+  h.data_n = sig->data_n;
+  h.errasym = sig->errasym;
+  
+  /* Strings */
+  str[0] = entry->key;
+  str[1] = sig->label ? sig->label : "";
+  str[2] = sig->units ? sig->units : "";
+  str[3] = sig->desc ? sig->desc : "";
+  for(i=0;i<sig->rank;i++) {
+    h.dimsize[i] = sig->dimsize[i];
+    h.dimerrasym[i] = sig->dim[i].errasym;
+    str[4+2*i] = sig->dim[i].label ? sig->dim[i].label : "";
+    str[5+2*i] = sig->dim[i].units ? sig->dim[i].units : "";
+  }
+  nstr = 4 + 2*sig->rank;
+  
+  /* Arrays, converted if they will be converted for NumPy */
+  for(i=0;i<=sig->rank;i++) {
+    for(j=IDAM_DATA;j<=IDAM_ERRH;j++) {
+      idam_CacheArray *a = &h.array[i][j];
+      
+      if((j != IDAM_DATA) && ((i == 0) ? (sig->errtype == TYPE_UNKNOWN) : (sig->dim[i-1].errtype == TYPE_UNKNOWN)))
+        continue; /* No errors */
+      if((j == IDAM_ERRH) && !((i == 0) ? sig->errasym : sig->dim[i-1].errasym))
+        continue; /* Symmetric, so same as errl */
+      
+      Signal_array(sig, i-1, j, &info);
+      
+      if((info.raw != NULL) && ((t = findType(info.type)) >= 0) &&
+         (idam_types[t].npytype == info.npytype)) {
+        /* Stored as is */
+        values[i][j] = info.raw;
+        a->type = info.type;
+        a->nbytes = info.count * idam_types[t].size;
+      }else {
+        /* Converted to float */
+        if((tmp[i][j] = malloc(info.count * sizeof(float) + 1)) == NULL)
+          goto done;
+        if(fillArray(tmp[i][j], NPY_FLOAT, info.raw, info.type, info.count) < 0) {
+          IDAM_LOCK;
+          Signal_floatArray(sig, sig->handle, i-1, j, (float*) tmp[i][j]);
+          IDAM_UNLOCK;
+        }
+        values[i][j] = tmp[i][j];
+        a->type = TYPE_FLOAT;
+        a->nbytes = info.count * sizeof(float);
+      }
+    }
+  }
+  
+  size = cacheLayout(&h, str, nstr, values);
+  if(entry->path)
+    ok = (writeCacheFile(entry->path, &h, str, nstr, values) == 0);
+  if(entry->shm && entry->share && Shm_room(size, entry->shmmax))
+    fd = writeCacheShm(entry->shm, &h, str, nstr, values);
+  
+ done:
+  for(i=0;i<=IDAM_MAXRANK;i++) {
+    for(j=0;j<3;j++)
+      free(tmp[i][j]);
+  }
+  
+  if(ok && cacheCount(&idam_cachebytes, &idam_cachewrites, size, entry->maxsize))
+    cacheCounted(&idam_cachebytes, Cache_trim(entry->dir, entry->maxsize));
+  return fd;
+}
+
+/* Write a signal just read from the server to the caches, then
+   swap it for the new shared memory segment. This process's
+   arrays then use the segment too, so it stays while they do.
+   Call with the GIL released */
+static void
+Shm_publish(idam_Signal *sig, idam_CacheEntry *entry, int native)
+{
+  idam_Signal shm;
+  int fd;
+  
+  Signal_types(sig, native);
+  if(((fd = Cache_write(entry, sig)) < 0) ||
+     (shmAttach(fd, entry->shm, entry->key, &shm) < 0))
+    return;
+  shm.backend = sig->backend;
+  Signal_clear(sig);
+  *sig = shm;
+}
+
+/* Copy a signal read from the disk cache to shared memory, and
+   swap it for the segment, so that other processes can map it
+   and it can be pickled. Call with the GIL released */
+static void
+Shm_copy(idam_Signal *sig, idam_CacheEntry *entry)
+{
+  idam_Signal shm;
+  char *map;
+  int fd;
+  
+  if(!Shm_room(sig->mapsize, entry->shmmax) ||
+     ((fd = shmCreate(entry->shm, sig->mapsize, &map)) < 0))
+    return;
+  memcpy(map + 8, (const char*) sig->map + 8, sig->mapsize - 8);
+  if(((fd = shmFinish(entry->shm, fd, map, sig->mapsize)) < 0) ||
+     (shmAttach(fd, entry->shm, entry->key, &shm) < 0))
+    return;
+  Signal_clear(sig);
+  *sig = shm;
+}
+
+/************************************************************
+ * Recording and replay
+ *
+ * The record backend passes requests to the live one, and
+ * saves each signal it reads to a file. The replay backend
+ * serves signals from these files, without a server. Files
+ * are in the cache format, but hold what IDAM gave: its types
+ * (converted to float only where IDAM's float routines are
+ * needed), and the dimensions in IDAM's order.
+ *
+ * Everything here holds idam_lock, like any backend call.
+ ************************************************************/
+
+#define RECORD_MAGIC "IDAMREC1"
+
+/* Directory used by the record and replay backends */
+static char *idam_recorddir = NULL;
+
+/* A string identifying what the server is asked for. Returns
+   NULL if out of memory */
+static char *
+recordKey(const char *name, const char *source, const idam_Server *srv)
+{
+  char *key, *c;
+  int i;
+  
+  key = (char*) malloc(strlen(name) + strlen(source) + strlen(srv->host) + 32 +
+                       srv->nprops*(IDAM_PROPLEN + 4));
+  if(key == NULL)
+    return NULL;
+  c = key + sprintf(key, "%s\n%s\n%s\n%d", name, source, srv->host, srv->port);
+  for(i=0;i<srv->nprops;i++)
+    c += sprintf(c, "\n%s=%d", srv->props[i].name, srv->props[i].value);
+  return key;
+}
+
+/* File holding the recording of a key. Returns NULL if out of memory */
+static char *
+recordPath(const char *key)
+{
+  char *path = (char*) malloc(strlen(idam_recorddir) + 32);
+  if(path != NULL)
+    sprintf(path, "%s/%016llx.rec", idam_recorddir,
+            (unsigned long long) hashBytes(key, strlen(key)));
+  return path;
+}
+
+/* Read one array with the float routines. n is the IDAM index
+   of the dimension, or -1 for the data */
+static void
+backendFloat(const idam_Backend *b, int handle, int n, int which, float *fp)
+{
+  if(n < 0) {
+    if(which == IDAM_DATA)
+      b->floatData(handle, fp);
+    else
+      b->floatError(handle, which == IDAM_ERRH, fp);
+  }else {
+    if(which == IDAM_DATA)
+      b->floatDimData(handle, n, fp);
+    else
+      b->floatDimError(handle, n, which == IDAM_ERRH, fp);
+  }
+}
+
+/* Save everything about a handle to a file */
+static void
+Record_write(const idam_Backend *b, int handle, const char *key)
+{
+  idam_CacheHeader h;
+  const void *values[1+IDAM_MAXRANK][3];
+  float *tmp[1+IDAM_MAXRANK][3];
+  const char *str[4+2*IDAM_MAXRANK];
+  const char *raw;
+  char *path;
+  int i, j, n, t, type, errtype, errasym;
+  npy_intp count;
+  
+  memset(&h, 0, sizeof(h));
+  memset(tmp, 0, sizeof(tmp));
+  memset(values, 0, sizeof(values));
+  memcpy(h.magic, RECORD_MAGIC, 8);
+  
+  h.rank = b->rank(handle);
+  if((h.rank < 0) || (h.rank > IDAM_MAXRANK))
+    return;
+  h.order = b->order(handle);
+  h.data_n = b->dataNum(handle);
+  h.errasym = b->errorAsymmetry(handle);
+  
+  str[0] = key;
+  str[1] = b->label(handle);
+  str[2] = b->units(handle);
+  str[3] = b->desc(handle);
+  for(n=0;n<h.rank;n++) {
+    h.dimsize[n] = b->dimNum(handle, n);
+    h.dimerrasym[n] = b->dimErrorAsymmetry(handle, n);
+    str[4+2*n] = b->dimLabel(handle, n);
+    str[5+2*n] = b->dimUnits(handle, n);
+  }
+  for(i=0;i<4+2*h.rank;i++) {
+    if(str[i] == NULL)
+      str[i] = "";
+  }
+  
+  for(i=0;i<=h.rank;i++) {
+    n = i-1; /* IDAM index of the dimension */
+    count = (i == 0) ? h.data_n : h.dimsize[n];
+    errtype = (i == 0) ? b->errorType(handle) : b->dimErrorType(handle, n);
+    errasym = (i == 0) ? h.errasym : h.dimerrasym[n];
+    
+    for(j=IDAM_DATA;j<=IDAM_ERRH;j++) {
+      idam_CacheArray *a = &h.array[i][j];
+      
+      if((j != IDAM_DATA) && (errtype == TYPE_UNKNOWN))
+        continue;
+      if((j == IDAM_ERRH) && !errasym)
+        continue; /* Same as errl */
+      
+      if(j == IDAM_DATA) {
+        type = (i == 0) ? b->dataType(handle) : b->dimType(handle, n);
+        raw = (i == 0) ? b->data(handle) : b->dimData(handle, n);
+      }else {
+        type = errtype;
+        raw = (i == 0) ? b->error(handle, j == IDAM_ERRH) : b->dimError(handle, n, j == IDAM_ERRH);
+      }
+      
+      if((raw != NULL) && realType(type)) {
+        t = findType(type);
+        values[i][j] = raw;
+        a->type = type;
+        a->nbytes = count * idam_types[t].size;
+      }else {
+        if((tmp[i][j] = (float*) malloc(count * sizeof(float) + 1)) == NULL)
+          goto done;
+        backendFloat(b, handle, n, j, tmp[i][j]);
+        values[i][j] = tmp[i][j];
+        a->type = TYPE_FLOAT;
+        a->nbytes = count * sizeof(float);
+      }
+    }
+  }
+  
+  if((path = recordPath(key)) != NULL) {
+    writeCacheFile(path, &h, str, 4+2*h.rank, values);
+    free(path);
+  }
+  
+ done:
+  for(i=0;i<=IDAM_MAXRANK;i++) {
+    for(j=0;j<3;j++)
+      free(tmp[i][j]);
+  }
+}
+
+static int
+Record_request(const idam_Server *srv, const char *name, const char *source)
+{
+  int handle = live_request(srv, name, source);
+  char *key;
+  
+  if(live_status(handle) && (live_dataNum(handle) > 0) &&
+     ((key = recordKey(name, source, srv)) != NULL)) {
+    Record_write(&idam_live, handle, key);
+    free(key);
+  }
+  return handle;
+}
+
+static const idam_Backend idam_record = {"record", live_connect, Record_request, LIVE_ACCESSORS};
+
+/* A recording opened by the replay backend */
+typedef struct {
+  int used;
+  char *error;       /* Set if the request failed */
+  char *map;         /* Mapped file, if it succeeded */
+  size_t mapsize;
+  const idam_CacheHeader *h;
+  const char *str[4+2*IDAM_MAXRANK];
+  const char *raw[1+IDAM_MAXRANK][3];
+  int type[1+IDAM_MAXRANK][3];
+} idam_Replay;
+
+static idam_Replay *idam_replays = NULL;
+static int idam_nreplays = 0;
+
+/* Open a recording into r, returning an error message or NULL */
+static const char *
+Replay_open(idam_Replay *r, const char *key)
+{
+  char *path;
+  int fd, i, j;
+  struct stat st;
+  const char *p, *end;
+  npy_intp count;
+  idam_CacheHeader *h;
+  
+  if((path = recordPath(key)) == NULL)
+    return "Out of memory";
+  fd = open(path, O_RDONLY);
+  free(path);
+  if(fd < 0)
+    return "No recording of this signal";
+  if((fstat(fd, &st) < 0) || ((size_t) st.st_size < sizeof(idam_CacheHeader))) {
+    close(fd);
+    return "Invalid recording";
+  }
+  /* Private and writable, as arrays with copy=False can be changed */
+  r->map = (char*) mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(r->map == MAP_FAILED) {
+    r->map = NULL;
+    return "Can't map recording";
+  }
+  r->mapsize = st.st_size;
+  
+  h = (idam_CacheHeader*) r->map;
+  r->h = h;
+  if((memcmp(h->magic, RECORD_MAGIC, 8) != 0) ||
+     (h->rank < 0) || (h->rank > IDAM_MAXRANK) ||
+     (h->strings < (int64_t) sizeof(idam_CacheHeader)) || (h->stringlen < 0) ||
+     ((uint64_t) (h->strings + h->stringlen) > (uint64_t) st.st_size))
+    return "Invalid recording";
+  
+  p = r->map + h->strings;
+  end = p + h->stringlen;
+  for(i=0;i<4+2*h->rank;i++) {
+    if((r->str[i] = cacheString(&p, end)) == NULL)
+      return "Invalid recording";
+  }
+  if(strcmp(r->str[0], key) != 0)
+    return "No recording of this signal"; /* Hash collision */
+  
+  for(i=0;i<=h->rank;i++) {
+    count = (i == 0) ? h->data_n : h->dimsize[i-1];
+    for(j=IDAM_DATA;j<=IDAM_ERRH;j++) {
+      r->type[i][j] = TYPE_UNKNOWN;
+      if(cacheArray(&h->array[i][j], r->map, st.st_size, count, &r->raw[i][j], &r->type[i][j]) < 0)
+        return "Invalid recording";
+    }
+    if(r->raw[i][IDAM_DATA] == NULL)
+      return "Invalid recording";
+    if(r->raw[i][IDAM_ERRH] == NULL) {
+      /* Symmetric */
+      r->raw[i][IDAM_ERRH] = r->raw[i][IDAM_ERRL];
+      r->type[i][IDAM_ERRH] = r->type[i][IDAM_ERRL];
+    }
+  }
+  return NULL;
+}
+
+static void
+Replay_release(int handle)
+{
+  idam_Replay *r;
+  
+  if((handle < 0) || (handle >= idam_nreplays) || !idam_replays[handle].used)
+    return;
+  r = &idam_replays[handle];
+  if(r->map)
+    munmap(r->map, r->mapsize);
+  free(r->error);
+  memset(r, 0, sizeof(idam_Replay));
+}
+
+static int
+Replay_request(const idam_Server *srv, const char *name, const char *source)
+{
+  idam_Replay *r;
+  const char *error;
+  char *key;
+  int handle, n;
+  
+  for(handle=0;(handle<idam_nreplays) && idam_replays[handle].used;handle++);
+  if(handle == idam_nreplays) {
+    n = idam_nreplays ? 2*idam_nreplays : 64;
+    if((r = (idam_Replay*) realloc(idam_replays, n*sizeof(idam_Replay))) == NULL)
+      return -1;
+    memset(r + idam_nreplays, 0, (n - idam_nreplays)*sizeof(idam_Replay));
+    idam_replays = r;
+    idam_nreplays = n;
+  }
+  r = &idam_replays[handle];
+  r->used = 1;
+  
+  if((key = recordKey(name, source, srv)) == NULL)
+    error = "Out of memory";
+  else
+    error = Replay_open(r, key);
+  free(key);
+  
+  if(error) {
+    if(r->map)
+      munmap(r->map, r->mapsize);
+    r->map = NULL;
+    r->h = NULL;
+    if((r->error = (char*) malloc(strlen(error) + strlen(name) + strlen(source) + 8)) != NULL)
+      sprintf(r->error, "%s (%s, %s)", error, name, source);
+  }
+  return handle;
+}
+
+/* The recording for a handle, or an empty one if not valid */
+static idam_Replay *
+Replay_get(int handle)
+{
+  static idam_Replay none;
+  if((handle < 0) || (handle >= idam_nreplays) ||
+     !idam_replays[handle].used || (idam_replays[handle].map == NULL))
+    return &none;
+  return &idam_replays[handle];
+}
+
+/* Dimension n in IDAM's order, or NULL */
+static idam_Replay *
+Replay_dim(int handle, int n)
+{
+  idam_Replay *r = Replay_get(handle);
+  if((r->h == NULL) || (n < 0) || (n >= r->h->rank))
+    return NULL;
+  return r;
+}
+
+static int
+Replay_status(int handle)
+{
+  return Replay_get(handle)->h != NULL;
+}
+
+static const char *
+Replay_errorMsg(int handle)
+{
+  if((handle < 0) || (handle >= idam_nreplays) || !idam_replays[handle].used)
+    return "Invalid handle";
+  return idam_replays[handle].error ? idam_replays[handle].error : "";
+}
+
+#define HEADER(FIELD) (Replay_get(handle)->h ? Replay_get(handle)->h->FIELD : 0)
+static int Replay_dataNum(int handle) { return (int) HEADER(data_n); }
+static int Replay_rank(int handle) { return HEADER(rank); }
+static int Replay_order(int handle) { return HEADER(order); }
+static int Replay_errorAsymmetry(int handle) { return HEADER(errasym); }
+#undef HEADER
+
+static const char *Replay_label(int handle) { return Replay_get(handle)->str[1]; }
+static const char *Replay_units(int handle) { return Replay_get(handle)->str[2]; }
+static const char *Replay_desc(int handle) { return Replay_get(handle)->str[3]; }
+static int Replay_dataType(int handle) { return Replay_get(handle)->type[0][IDAM_DATA]; }
+static const char *Replay_data(int handle) { return Replay_get(handle)->raw[0][IDAM_DATA]; }
+
+static int
+Replay_errorType(int handle)
+{
+  idam_Replay *r = Replay_get(handle);
+  return r->raw[0][IDAM_ERRL] ? r->type[0][IDAM_ERRL] : TYPE_UNKNOWN;
+}
+
+static const char *
+Replay_error(int handle, int above)
+{
+  return Replay_get(handle)->raw[0][above ? IDAM_ERRH : IDAM_ERRL];
+}
+
+static void
+Replay_floatData(int handle, float *fp)
+{
+  idam_Replay *r = Replay_get(handle);
+  if(r->h)
+    convertToFloat(r->raw[0][IDAM_DATA], r->type[0][IDAM_DATA], r->h->data_n, fp);
+}
+
+static void
+Replay_floatError(int handle, int above, float *fp)
+{
+  idam_Replay *r = Replay_get(handle);
+  int j = above ? IDAM_ERRH : IDAM_ERRL;
+  if(r->h)
+    convertToFloat(r->raw[0][j], r->type[0][j], r->h->data_n, fp);
+}
+
+static int
+Replay_dimNum(int handle, int n)
+{
+  idam_Replay *r = Replay_dim(handle, n);
+  return r ? (int) r->h->dimsize[n] : 0;
+}
+
+static const char *
+Replay_dimLabel(int handle, int n)
+{
+  idam_Replay *r = Replay_dim(handle, n);
+  return r ? r->str[4+2*n] : NULL;
+}
+
+static const char *
+Replay_dimUnits(int handle, int n)
+{
+  idam_Replay *r = Replay_dim(handle, n);
+  return r ? r->str[5+2*n] : NULL;
+}
+
+static int
+Replay_dimType(int handle, int n)
+{
+  idam_Replay *r = Replay_dim(handle, n);
+  return r ? r->type[1+n][IDAM_DATA] : TYPE_UNKNOWN;
+}
+
+static const char *
+Replay_dimData(int handle, int n)
+{
+  idam_Replay *r = Replay_dim(handle, n);
+  return r ? r->raw[1+n][IDAM_DATA] : NULL;
+}
+
+static int
+Replay_dimErrorType(int handle, int n)
+{
+  idam_Replay *r = Replay_dim(handle, n);
+  return (r && r->raw[1+n][IDAM_ERRL]) ? r->type[1+n][IDAM_ERRL] : TYPE_UNKNOWN;
+}
+
+static int
+Replay_dimErrorAsymmetry(int handle, int n)
+{
+  idam_Replay *r = Replay_dim(handle, n);
+  return r ? r->h->dimerrasym[n] : 0;
+}
+
+static const char *
+Replay_dimError(int handle, int n, int above)
+{
+  idam_Replay *r = Replay_dim(handle, n);
+  return r ? r->raw[1+n][above ? IDAM_ERRH : IDAM_ERRL] : NULL;
+}
+
+static void
+Replay_floatDimData(int handle, int n, float *fp)
+{
+  idam_Replay *r = Replay_dim(handle, n);
+  if(r)
+    convertToFloat(r->raw[1+n][IDAM_DATA], r->type[1+n][IDAM_DATA], r->h->dimsize[n], fp);
+}
+
+static void
+Replay_floatDimError(int handle, int n, int above, float *fp)
+{
+  idam_Replay *r = Replay_dim(handle, n);
+  int j = above ? IDAM_ERRH : IDAM_ERRL;
+  if(r)
+    convertToFloat(r->raw[1+n][j], r->type[1+n][j], r->h->dimsize[n], fp);
+}
+
+static const idam_Backend idam_replay = {
+  "replay", NULL, Replay_request, Replay_release, Replay_status, Replay_errorMsg,
+  Replay_dataNum, Replay_rank, Replay_order, Replay_label, Replay_units, Replay_desc,
+  Replay_dataType, Replay_data, Replay_errorType, Replay_errorAsymmetry, Replay_error,
+  Replay_floatData, Replay_floatError,
+  Replay_dimNum, Replay_dimLabel, Replay_dimUnits, Replay_dimType, Replay_dimData,
+  Replay_dimErrorType, Replay_dimErrorAsymmetry, Replay_dimError,
+  Replay_floatDimData, Replay_floatDimError
+};
+
+/* Read a signal from shared memory, the disk cache, or the
+   server if not cached. Call with the GIL released. On failure sig->error
+   is set */
+static void
+Signal_get(idam_Signal *sig, idam_CacheEntry *cache, const char *name,
+           const char *source, const idam_Server *srv, const idam_Options *opt)
+{
+  double t = idam_now();
+  
+  if((cache->shm != NULL) && (Shm_read(cache, sig) == 0)) {
+    Stats_phase(IDAM_PHASE_DISK, t, name);
+    Stats_add(&idam_shmhits, 1);
+  }else if((cache->path != NULL) && (Cache_read(cache, sig) == 0)) {
+    if((cache->shm != NULL) && cache->share)
+      Shm_copy(sig, cache);
+    Stats_phase(IDAM_PHASE_DISK, t, name);
+    Stats_add(&idam_diskhits, 1);
+  }else {
+    Signal_read(sig, name, source, srv, opt);
+    if((cache->shm != NULL) && cache->share && (sig->error == NULL)) {
+      t = idam_now();
+      Shm_publish(sig, cache, opt->native);
+      Stats_phase(IDAM_PHASE_STORE, t, name);
+    }
+  }
+  
+  if(opt->dedup)
+    Signal_hash(sig);
+}
+
+/* Save a signal to the disk cache and fill its arrays. Call
+   with the GIL released, after the arrays are created */
+static void
+Signal_finish(idam_Signal *sig, idam_CacheEntry *cache, const char *name)
+{
+  double t = idam_now();
+  
+  Cache_write(cache, sig); /* Only if read from IDAM, and not by Shm_publish */
+  t = Stats_phase(IDAM_PHASE_STORE, t, name);
+  Signal_fill(sig);
+  Stats_phase(IDAM_PHASE_CONVERT, t, name);
+}
+
+static PyObject*
+idam_test(PyObject *self, PyObject *args)
+{
+  const char *str;
+  int ret;
+  if(!PyArg_ParseTuple(args, "s", &str))
+    return NULL;
+
+  printf("String: %s\n", str);
+
+  ret = 1;
+  return Py_BuildValue("i", ret);
+}
+
+static PyObject*
+idam_setHost(PyObject *self, PyObject *args)
+{
+  const char* host;
+  int port = -1;
+
+  if(!PyArg_ParseTuple(args, "s|i", &host, &port))
+    // Hostname, optional port
+    return NULL;
+  
+  if(strlen(host) >= MAXNAME) {
+    PyErr_SetString(PyExc_ValueError, "Host name too long");
+    return NULL;
+  }
+  
+  if(port > 0)
+    idam_port = port;
+  
+  strcpy(idam_host, host);
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject*
+idam_setPort(PyObject *self, PyObject *args)
+{
+  int port;
+  if(!PyArg_ParseTuple(args, "i", &port))
+    return NULL;
+  
+  idam_port = port;
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+/************************************************************
+ * Disk cache settings
+ ************************************************************/
+
+static PyObject*
+idam_setCache(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  const char *path;
+  long long maxsize = 1LL << 30; /* 1 Gb */
+  char *dir = NULL;
+  
+  static char *kwlist[] = {"path", "maxsize", NULL};
+  
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "z|L", kwlist, &path, &maxsize))
+    return NULL;
+  
+  if(path != NULL) {
+    /* Create the directory if needed */
+    if((mkdir(path, 0777) < 0) && (errno != EEXIST))
+      return PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char*) path);
+    if((dir = copyString(path)) == NULL)
+      return PyErr_NoMemory();
+  }
+  
+  free(idam_cachedir);
+  idam_cachedir = dir;
+  idam_cachemax = maxsize;
+  cacheCounted(&idam_cachebytes, -1); /* Scan on the next write */
+  
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject*
+idam_setSharedMemory(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  long long maxsize = 1LL << 30; /* 1 Gb */
+  
+  static char *kwlist[] = {"maxsize", NULL};
+  
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "|L", kwlist, &maxsize))
+    return NULL;
+  if(maxsize < 0) {
+    PyErr_SetString(PyExc_ValueError, "maxsize must not be negative");
+    return NULL;
+  }
+  
+  idam_shmmax = maxsize;
+  
+  /* Remove segments left by killed processes. If turned off, let
+     go of those held for pickled Data too */
+  Py_BEGIN_ALLOW_THREADS
+  if(maxsize == 0)
+    while(Shm_unpin(1));
+  cacheCounted(&idam_shmbytes, Shm_trim());
+  Py_END_ALLOW_THREADS
+  
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject*
+idam_sharedMemoryInfo(PyObject *self, PyObject *args)
+{
+  idam_CacheFile *files;
+  size_t n, i;
+  long long total;
+  int held, pinned;
+  
+  Py_BEGIN_ALLOW_THREADS
+  total = Shm_list(&files, &n);
+  for(i=0;i<n;i++)
+    free(files[i].name);
+  free(files);
+  PyThread_acquire_lock(idam_cachelock, WAIT_LOCK);
+  held = idam_nshmholds;
+  pinned = idam_nshmpins;
+  PyThread_release_lock(idam_cachelock);
+  Py_END_ALLOW_THREADS
+  
+  return Py_BuildValue("{s:L,s:n,s:L,s:i,s:i}",
+                       "maxsize", idam_shmmax,
+                       "segments", (Py_ssize_t) n,
+                       "bytes", total,
+                       "held", held,
+                       "pinned", pinned);
+}
+
+/************************************************************
+ * Backend settings
+ ************************************************************/
+
+static PyObject*
+idam_setBackend(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  const char *name, *path = NULL;
+  const idam_Backend *backend;
+  char *dir = NULL, *old;
+  
+  static char *kwlist[] = {"name", "path", NULL};
+  
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|z", kwlist, &name, &path))
+    return NULL;
+  
+  if(strcmp(name, "live") == 0)
+    backend = &idam_live;
+  else if(strcmp(name, "record") == 0)
+    backend = &idam_record;
+  else if(strcmp(name, "replay") == 0)
+    backend = &idam_replay;
+  else {
+    PyErr_SetString(PyExc_ValueError, "backend must be 'live', 'record' or 'replay'");
+    return NULL;
+  }
+  
+  if(backend != &idam_live) {
+    if(path == NULL) {
+      PyErr_SetString(PyExc_ValueError, "A directory is needed to record or replay");
+      return NULL;
+    }
+    if((backend == &idam_record) && (mkdir(path, 0777) < 0) && (errno != EEXIST))
+      return PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char*) path);
+    if((dir = copyString(path)) == NULL)
+      return PyErr_NoMemory();
+  }
+  
+  Py_BEGIN_ALLOW_THREADS
+  IDAM_LOCK;
+  old = idam_recorddir;
+  idam_recorddir = dir;
+  idam_backend = backend;
+  IDAM_UNLOCK;
+  Py_END_ALLOW_THREADS
+  
+  free(old);
+  
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject*
+idam_getBackend(PyObject *self, PyObject *args)
+{
+  const char *name;
+  char *dir = NULL;
+  PyObject *result;
+  
+  Py_BEGIN_ALLOW_THREADS
+  IDAM_LOCK;
+  name = idam_backend->name;
+  if(idam_recorddir)
+    dir = copyString(idam_recorddir);
+  IDAM_UNLOCK;
+  Py_END_ALLOW_THREADS
+  
+  result = Py_BuildValue("(sz)", name, dir);
+  free(dir);
+  return result;
+}
+
+/************************************************************
+ * Server pool settings
+ ************************************************************/
+
+/* Read "host" or "host:port", with port as the default */
+static int
+poolServer(idam_PoolServer *p, const char *spec, int port)
+{
+  const char *colon = strrchr(spec, ':');
+  size_t n = colon ? (size_t) (colon - spec) : strlen(spec);
+  
+  memset(p, 0, sizeof(idam_PoolServer));
+  if(colon)
+    port = atoi(colon + 1);
+  if((n == 0) || (n >= MAXNAME) || (port <= 0))
+    return -1;
+  memcpy(p->host, spec, n);
+  p->host[n] = '\0';
+  p->port = port;
+  return 0;
+}
+
+/* Read a comma-separated list of servers, skipping any which
+   aren't valid. Returns the number read */
+static int
+poolList(const char *list, idam_PoolServer *servers)
+{
+  char spec[MAXNAME + 16];
+  const char *end;
+  size_t len;
+  int n = 0;
+  
+  while(*list && (n < IDAM_MAXSERVERS)) {
+    end = strchr(list, ',');
+    len = end ? (size_t) (end - list) : strlen(list);
+    if(len < sizeof(spec)) {
+      memcpy(spec, list, len);
+      spec[len] = '\0';
+      if(poolServer(&servers[n], spec, idam_port) == 0)
+        n++;
+    }
+    if(end == NULL)
+      break;
+    list = end + 1;
+  }
+  return n;
+}
+
+static void
+Pool_set(const idam_PoolServer *servers, int n)
+{
+  Py_BEGIN_ALLOW_THREADS
+  IDAM_LOCK;
+  memcpy(idam_pool, servers, n*sizeof(idam_PoolServer));
+  idam_npool = n;
+  IDAM_UNLOCK;
+  Py_END_ALLOW_THREADS
+}
+
+static PyObject*
+idam_setServers(PyObject *self, PyObject *args)
+{
+  PyObject *list, *seq, *item;
+  idam_PoolServer servers[IDAM_MAXSERVERS];
+  const char *host;
+  Py_ssize_t i, n = 0;
+  int port;
+  
+  if(!PyArg_ParseTuple(args, "O", &list))
+    return NULL;
+  
+  if(list != Py_None) {
+    if((seq = PySequence_Fast(list, "setServers() needs a list of servers")) == NULL)
+      return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+    if(n > IDAM_MAXSERVERS) {
+      Py_DECREF(seq);
+      PyErr_Format(PyExc_ValueError, "At most %d servers", IDAM_MAXSERVERS);
+      return NULL;
+    }
+    for(i=0;i<n;i++) {
+      item = PySequence_Fast_GET_ITEM(seq, i);
+      port = idam_port;
+      if(PyTuple_Check(item)) {
+        if(!PyArg_ParseTuple(item, "si", &host, &port)) {
+          Py_DECREF(seq);
+          return NULL;
+        }
+      }else if((host = StringToChars(item)) == NULL) {
+        Py_DECREF(seq);
+        return NULL;
+      }
+      if(poolServer(&servers[i], host, port) < 0) {
+        PyErr_Format(PyExc_ValueError, "Invalid server '%s'", host);
+        Py_DECREF(seq);
+        return NULL;
+      }
+    }
+    Py_DECREF(seq);
+  }
+  
+  Pool_set(servers, (int) n);
+  
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject*
+idam_serverInfo(PyObject *self, PyObject *args)
+{
+  idam_PoolServer servers[IDAM_MAXSERVERS];
+  char connhost[MAXNAME];
+  int i, n, connport;
+  double now;
+  PyObject *list, *item, *latency;
+  
+  /* Copy, so the lock isn't held while making objects */
+  Py_BEGIN_ALLOW_THREADS
+  IDAM_LOCK;
+  n = idam_npool;
+  memcpy(servers, idam_pool, n*sizeof(idam_PoolServer));
+  strcpy(connhost, idam_connhost);
+  connport = idam_connport;
+  IDAM_UNLOCK;
+  Py_END_ALLOW_THREADS
+  
+  now = idam_now();
+  if((list = PyList_New(n)) == NULL)
+    return NULL;
+  for(i=0;i<n;i++) {
+    idam_PoolServer *p = &servers[i];
+    if(p->measured > 0)
+      latency = PyFloat_FromDouble(p->latency);
+    else {
+      Py_INCREF(Py_None);
+      latency = Py_None;
+    }
+    item = Py_BuildValue("{s:s,s:i,s:L,s:L,s:N,s:d,s:N}",
+                         "host", p->host,
+                         "port", p->port,
+                         "requests", p->requests,
+                         "failures", p->failures,
+                         "latency", latency,
+                         "down", (p->down > now) ? p->down - now : 0.0,
+                         "current", PyBool_FromLong((strcmp(p->host, connhost) == 0) &&
+                                                    (p->port == connport)));
+    if(item == NULL) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, i, item);
+  }
+  return list;
+}
+
+/************************************************************
+ * Simple true/false properties for Client/Server behavior
+ ************************************************************/
+
+static PyObject*
+idam_setProperty(PyObject *self, PyObject *args)
+{
+  const char* prop;
+  int val;
+  
+  val = 1; /* By default, set to true */
+
+  if(!PyArg_ParseTuple(args, "s|i", &prop, &val)) {
+    return NULL;
+  }
+  
+  Py_BEGIN_ALLOW_THREADS
+  IDAM_LOCK;
+  if(val) {
+    setIdamProperty(prop);
+  }else
+    resetIdamProperty(prop);
+  IDAM_UNLOCK;
+  Py_END_ALLOW_THREADS
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject*
+idam_getProperty(PyObject *self, PyObject *args)
+{
+  const char* prop;
+  int val;
+
+  if(!PyArg_ParseTuple(args, "s", &prop))
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  IDAM_LOCK;
+  val = getIdamProperty(prop);
+  IDAM_UNLOCK;
+  Py_END_ALLOW_THREADS
+
+  return Py_BuildValue("i", val);
+}
+
+/************************************************************
+ * Array buffers
+ *
+ * With setBufferPool(), the memory of arrays created here is
+ * kept when they are freed, and reused for the next array of
+ * the same size. A loop reading signals of the same shape then
+ * stops allocating (and page-faulting) new buffers. Arrays
+ * keep their buffer through a capsule as their base object.
+ * Arrays given with out= are checked before being filled.
+ ************************************************************/
+
+#define IDAM_BLOCKHEAD 64 /* Header size, so buffers stay aligned */
+
+typedef struct idam_Block {
+  struct idam_Block *next;
+  size_t size;            /* Of the buffer after the header */
+} idam_Block;
+
+static idam_Block *idam_blocks = NULL; /* Free buffers, newest first */
+static long long idam_bufmax = 0;      /* Size limit. Zero if off */
+static long long idam_bufbytes = 0;
+static long long idam_bufhits = 0, idam_bufmisses = 0;
+
+/* Free the oldest buffers until within the size limit. Needs the GIL */
+static void
+Block_trim(void)
+{
+  idam_Block **p = &idam_blocks, *b;
+  long long kept = 0;
+  
+  while((b = *p) != NULL) {
+    if(kept + (long long) b->size > idam_bufmax) {
+      *p = b->next;
+      idam_bufbytes -= b->size;
+      free(b);
+    }else {
+      kept += b->size;
+      p = &b->next;
+    }
+  }
+}
+
+/* Capsule destructor, called when an array is freed */
+static void
+Block_release(PyObject *capsule)
+{
+  idam_Block *b = (idam_Block*) PyCapsule_GetPointer(capsule, "idam.block");
+  
+  if(b == NULL) {
+    PyErr_Clear();
+    return;
+  }
+  if(idam_bufbytes + (long long) b->size > idam_bufmax) {
+    free(b);
+    return;
+  }
+  b->next = idam_blocks;
+  idam_blocks = b;
+  idam_bufbytes += b->size;
+}
+
+/* Create an array, with undefined values, using a pooled buffer
+   if the pool is on. Needs the GIL */
+static PyArrayObject *
+emptyArray(int rank, npy_intp *dimsize, int npytype)
+{
+  PyArray_Descr *descr;
+  PyArrayObject *arr;
+  PyObject *capsule;
+  idam_Block **p, *b;
+  size_t size;
+  int i;
+  
+  if(idam_bufmax <= 0)
+    return (PyArrayObject*) PyArray_SimpleNew(rank, dimsize, npytype);
+  
+  if((descr = PyArray_DescrFromType(npytype)) == NULL)
+    return NULL;
+  size = descr->elsize;
+  Py_DECREF(descr);
+  for(i=0;i<rank;i++)
+    size *= dimsize[i];
+  
+  /* Most recently freed first, as most likely to be in cache */
+  for(p=&idam_blocks;*p && ((*p)->size != size);p=&(*p)->next);
+  if((b = *p) != NULL) {
+    *p = b->next;
+    idam_bufbytes -= size;
+    idam_bufhits++;
+  }else {
+    if((b = (idam_Block*) malloc(IDAM_BLOCKHEAD + size)) == NULL)
+      return (PyArrayObject*) PyErr_NoMemory();
+    b->size = size;
+    idam_bufmisses++;
+  }
+  
+  if((capsule = PyCapsule_New(b, "idam.block", Block_release)) == NULL) {
+    free(b);
+    return NULL;
+  }
+  arr = (PyArrayObject*) PyArray_SimpleNewFromData(rank, dimsize, npytype,
+                                                   (char*) b + IDAM_BLOCKHEAD);
+  if((arr == NULL) || (PyArray_SetBaseObject(arr, capsule) < 0)) { /* Steals capsule */
+    Py_XDECREF(arr);
+    if(arr == NULL)
+      Py_DECREF(capsule);
+    return NULL;
+  }
+  return arr;
+}
+
+/* Check that an out= array can be filled with an array of the given
+   shape and type. what names it in the error */
+static int
+checkOut(PyObject *out, const char *what, int rank, const npy_intp *dimsize, int npytype)
+{
+  PyArrayObject *arr = (PyArrayObject*) out;
+  int i;
+  
+  if(!PyArray_Check(out)) {
+    PyErr_Format(PyExc_TypeError, "out= for %s must be a NumPy array", what);
+    return -1;
+  }
+  if(PyArray_TYPE(arr) != npytype) {
+    PyErr_Format(PyExc_ValueError, "out= for %s has the wrong dtype", what);
+    return -1;
+  }
+  if(PyArray_NDIM(arr) != rank) {
+    PyErr_Format(PyExc_ValueError, "out= for %s has %d dimensions, not %d",
+                 what, PyArray_NDIM(arr), rank);
+    return -1;
+  }
+  for(i=0;i<rank;i++) {
+    if(PyArray_DIM(arr, i) != dimsize[i]) {
+      PyErr_Format(PyExc_ValueError, "out= for %s has size %ld in dimension %d, not %ld",
+                   what, (long) PyArray_DIM(arr, i), i, (long) dimsize[i]);
+      return -1;
+    }
+  }
+  if(!PyArray_ISCARRAY(arr) || !PyArray_ISNOTSWAPPED(arr)) {
+    PyErr_Format(PyExc_ValueError, "out= for %s must be C-contiguous, aligned, "
+                 "writeable and in native byte order", what);
+    return -1;
+  }
+  return 0;
+}
+
+static PyObject*
+idam_setBufferPool(PyObject *self, PyObject *args)
+{
+  long long maxsize;
+  
+  if(!PyArg_ParseTuple(args, "L", &maxsize))
+    return NULL;
+  
+  idam_bufmax = (maxsize > 0) ? maxsize : 0;
+  Block_trim();
+  
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject*
+idam_bufferPoolInfo(PyObject *self, PyObject *args)
+{
+  idam_Block *b;
+  Py_ssize_t n = 0;
+  
+  for(b=idam_blocks;b;b=b->next)
+    n++;
+  return Py_BuildValue("{s:L,s:L,s:n,s:L,s:L}",
+                       "maxsize", idam_bufmax,
+                       "bytes", idam_bufbytes,
+                       "buffers", n,
+                       "hits", idam_bufhits,
+                       "misses", idam_bufmisses);
+}
+
+/************************************************************
+ * Low-level routines
+ *
+ * Handles come from the backend set by setBackend(), which
+ * shouldn't be changed while one is in use.
+ ************************************************************/
+
+static PyObject*
+idam_getAPI(PyObject *self, PyObject *args)
+{
+  int handle;
+  const char *data, *source;
+  idam_Server srv;
+  char *error = NULL;
+  
+  if(!PyArg_ParseTuple(args, "ss", &data, &source))
+    return NULL;
+  
+  defaultServer(&srv);
+  
+  Py_BEGIN_ALLOW_THREADS
+  IDAM_LOCK;
+  handle = idam_backend->request(&srv, data, source);
+  if(!idam_backend->status(handle))
+    error = copyString(idam_backend->errorMsg(handle));
+  IDAM_UNLOCK;
+  Py_END_ALLOW_THREADS
+
+  if(error) {
+    idam_log(IDAM_WARNING, "IDAM error: %s", error);
+    free(error);
+  }
+  
+  return Py_BuildValue("i", handle);
+}
+
+static PyObject*
+idam_freeAPI(PyObject *self, PyObject *args)
+{
+  int handle;
+  
+  if(!PyArg_ParseTuple(args, "i", &handle))
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  IDAM_LOCK;
+  idam_backend->release(handle);
+  IDAM_UNLOCK;
+  Py_END_ALLOW_THREADS
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject*
+idam_readData(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  int handle;
+  int data_n;
+  int rank;
+  npy_intp dimsize[IDAM_MAXRANK];
+  int i;
+  PyArrayObject *result;
+  const char *dtype = NULL;
+  PyObject *out = Py_None;
+  int native, type, npytype;
+  const char *raw = NULL;
+  double t;
+
+  static char *kwlist[] = {"handle", "dtype", "out", NULL};
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "i|zO", kwlist, &handle, &dtype, &out))
+    return NULL;
+
+  if(parseDtype(dtype, &native) < 0)
+    return NULL;
+
+  // Get the size, rank, shape and type of the data array
+
+  Py_BEGIN_ALLOW_THREADS
+  IDAM_LOCK;
+  data_n = idam_backend->dataNum(handle);
+  rank = idam_backend->rank(handle);
+  if((data_n > 0) && (rank >= 0) && (rank <= IDAM_MAXRANK)) {
+    for(i=0;i<rank;i++) {
+      dimsize[i] = idam_backend->dimNum(handle, i); 
+    }
+  }
+  type = idam_backend->dataType(handle);
+  if(data_n > 0)
+    raw = idam_backend->data(handle);
+  IDAM_UNLOCK;
+  Py_END_ALLOW_THREADS
+  
+  if(data_n <= 0) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  
+  if((rank < 0) || (rank > IDAM_MAXRANK)) {
+    PyErr_SetString(PyExc_RuntimeError, "Rank of data too large");
+    return NULL;
+  }
+  
+  npytype = arrayType(raw, type, native);
+  
+  if(out != Py_None) {
+    if(checkOut(out, "data", rank, dimsize, npytype) < 0)
+      return NULL;
+    Py_INCREF(out);
+    result = (PyArrayObject*) out;
+  }else {
+    //result = (PyArrayObject*) PyArray_FromDims(rank,dimsize,PyArray_FLOAT); // Depreciated
+    result = emptyArray(rank, dimsize, npytype);
+    if (result == NULL) {
+      return NULL;
+    }
+  }
+  
+  Py_BEGIN_ALLOW_THREADS
+  t = idam_now();
+  IDAM_LOCK;
+  t = Stats_phase(IDAM_PHASE_WAIT, t, NULL);
+  if(fillArray(result->data, npytype, raw, type, data_n) < 0)
+    idam_backend->floatData(handle, (float *)(result->data));
+  IDAM_UNLOCK;
+  Stats_phase(IDAM_PHASE_CONVERT, t, NULL);
+  Py_END_ALLOW_THREADS
+  
+  if(out != Py_None)
+    return out;
+  return PyArray_Return(result);
+}
+
+/* Replace an object member, stealing a reference to value */
+static int
+setMember(PyObject **member, PyObject *value)
+{
+  PyObject *tmp;
+  
+  if(value == NULL)
+    return -1;
+  
+  tmp = *member;
+  *member = value;
+  Py_XDECREF(tmp);
+  return 0;
+}
+
+/************************************************************
+ * Shared dimensions
+ *
+ * With setDedup(True), dimension arrays with the same values
+ * (e.g. the time base of many channels from one shot) are one
+ * read-only array. Arrays are found by a hash of the IDAM
+ * values, then checked value by value. The table holds weak
+ * references, so arrays are freed when no longer used.
+ ************************************************************/
+
+static PyObject *idam_deduptable = NULL; /* Key -> weakref to array */
+static long long idam_dedupshared = 0;   /* Arrays not created */
+
+/* Weakref callback, removing a dead array from the table */
+static PyObject *
+Dedup_forget(PyObject *key, PyObject *ref)
+{
+  if(idam_deduptable && (PyDict_GetItem(idam_deduptable, key) == ref))
+    PyDict_DelItem(idam_deduptable, key);
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyMethodDef idam_dedupForgetDef = {"_dedupForget", (PyCFunction) Dedup_forget, METH_O, NULL};
+
+static PyObject *
+dedupKey(const idam_SignalDim *d, npy_intp n)
+{
+  return Py_BuildValue("(Knii)", (unsigned long long) d->hash, (Py_ssize_t) n, d->npytype, d->type);
+}
+
+/* Check that an array holds the values in raw. Doesn't need the GIL */
+static int
+sameValues(PyArrayObject *arr, const char *raw, int type, npy_intp n)
+{
+  const float *f;
+  npy_intp i;
+  int t;
+  
+  if(PyArray_TYPE(arr) == NPY_FLOAT) {
+    f = (const float*) PyArray_DATA(arr);
+    if(type == TYPE_FLOAT)
+      return memcmp(f, raw, n*sizeof(float)) == 0;
+    for(i=0;i<n;i++) {
+      if((float) rawValue(raw, type, i) != f[i])
+        return 0;
+    }
+    return 1;
+  }
+  t = findType(type);
+  return (t >= 0) && (memcmp(PyArray_DATA(arr), raw, n*idam_types[t].size) == 0);
+}
+
+/* Find an array with the values of a dimension. Returns a new
+   reference, or NULL if there isn't one. Needs the GIL */
+static PyObject *
+Dedup_find(const idam_SignalDim *d, npy_intp n)
+{
+  PyObject *key, *ref, *arr = NULL;
+  int same = 0;
+  
+  if(!d->hashed || (idam_deduptable == NULL))
+    return NULL;
+  if((key = dedupKey(d, n)) == NULL) {
+    PyErr_Clear();
+    return NULL;
+  }
+  ref = PyDict_GetItem(idam_deduptable, key);
+  Py_DECREF(key);
+  if(ref != NULL)
+    arr = PyWeakref_GetObject(ref);
+  if((arr == NULL) || (arr == Py_None) || !PyArray_Check(arr) ||
+     (PyArray_SIZE((PyArrayObject*) arr) != n))
+    return NULL;
+  
+  Py_INCREF(arr);
+  Py_BEGIN_ALLOW_THREADS
+  same = sameValues((PyArrayObject*) arr, d->raw, d->type, n);
+  Py_END_ALLOW_THREADS
+  if(!same) {
+    Py_DECREF(arr);
+    return NULL;
+  }
+  
+  idam_dedupshared++;
+  return arr;
+}
+
+/* Remember a new dimension array. It is made read-only now,
+   rather than when first shared, so that nobody holding it
+   finds it changed later. Needs the GIL */
+static void
+Dedup_add(const idam_SignalDim *d, npy_intp n, PyObject *arr)
+{
+  PyObject *key, *forget = NULL, *ref = NULL;
+  
+  if(!d->hashed || (arr == NULL) || !PyArray_Check(arr))
+    return;
+  PyArray_CLEARFLAGS((PyArrayObject*) arr, NPY_ARRAY_WRITEABLE);
+  if((idam_deduptable == NULL) && ((idam_deduptable = PyDict_New()) == NULL)) {
+    PyErr_Clear();
+    return;
+  }
+  if((key = dedupKey(d, n)) != NULL) {
+    forget = PyCFunction_New(&idam_dedupForgetDef, key);
+    if(forget)
+      ref = PyWeakref_NewRef(arr, forget);
+    if(ref)
+      PyDict_SetItem(idam_deduptable, key, ref);
+  }
+  Py_XDECREF(ref);
+  Py_XDECREF(forget);
+  Py_XDECREF(key);
+  PyErr_Clear(); /* Just not shared */
+}
+
+/************************************************************
+ * IDAM handle objects
+ *
+ * Used as the base object of arrays which share memory with
+ * an IDAM data block. The handle is freed when the last of
+ * these arrays is deleted.
+ ************************************************************/
+
+typedef struct {
+  PyObject_HEAD
+  int handle;
+  idam_Signal sig;    /* Snapshot, without the strings */
+  idam_Options opt;
+} idam_Handle;
+
+static void
+Handle_dealloc(idam_Handle* self)
+{
+  int handle = self->handle;
+  
+  if(handle >= 0) {
+    Py_BEGIN_ALLOW_THREADS
+    IDAM_LOCK;
+    self->sig.backend->release(handle);
+    IDAM_UNLOCK;
+    Py_END_ALLOW_THREADS
+  }
+  
+  Signal_unmap(&self->sig);
+  
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyTypeObject idam_HandleType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+    "idam.Handle",             /*tp_name*/
+    sizeof(idam_Handle),       /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)Handle_dealloc,  /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "IDAM data block or cache file shared with NumPy arrays",  /* tp_doc */
+};
+
+/* Take ownership of the handle (or mapped file) in a signal snapshot */
+static PyObject *
+Handle_new(const idam_Signal *sig, const idam_Options *opt)
+{
+  idam_Handle *self;
+  int i;
+  
+  self = PyObject_New(idam_Handle, &idam_HandleType);
+  if(self == NULL)
+    return NULL;
+  
+  self->handle = sig->handle;
+  self->opt = *opt;
+  if(sig->map)
+    self->opt.copy = 0; /* Share the mapped file */
+  
+  /* Strings and output pointers belong to the caller */
+  self->sig = *sig;
+  self->sig.error = self->sig.label = self->sig.units = self->sig.desc = NULL;
+  self->sig.data = self->sig.errl = self->sig.errh = NULL;
+  self->sig.base = NULL;
+  for(i=0;i<IDAM_MAXRANK;i++) {
+    idam_SignalDim *d = &self->sig.dim[i];
+    d->label = d->units = NULL;
+    d->data = d->errl = d->errh = NULL;
+  }
+  self->sig.owner = NULL;
+  
+  return (PyObject*) self;
+}
+
+/* Create an array, returning a pointer to its data */
+static PyObject *
+newArray(int rank, npy_intp *dimsize, int npytype, void **ptr)
+{
+  PyArrayObject* pyarr;
+  
+  pyarr = emptyArray(rank, dimsize, npytype);
+  if (pyarr == NULL)
+    return NULL;
+  *ptr = (void *)(pyarr->data);
+  return PyArray_Return(pyarr);
+}
+
+/* Create an array for an IDAM buffer. If owner is set and no
+   conversion is needed then the array shares the buffer, and
+   keeps owner alive. Otherwise *ptr is set ready for Signal_fill */
+static PyObject *
+signalArray(int rank, npy_intp *dimsize, int npytype,
+            const char *raw, int type, PyObject *owner, void **ptr)
+{
+  PyArrayObject* pyarr;
+  int t;
+  
+  if((owner == NULL) || (raw == NULL) ||
+     ((t = findType(type)) < 0) || (idam_types[t].npytype != npytype))
+    return newArray(rank, dimsize, npytype, ptr);
+  
+  *ptr = NULL;
+  pyarr = (PyArrayObject*) PyArray_SimpleNewFromData(rank, dimsize, npytype, (void*) raw);
+  if (pyarr == NULL)
+    return NULL;
+  Py_INCREF(owner);
+  if(PyArray_SetBaseObject(pyarr, owner) < 0) { /* Steals owner */
+    Py_DECREF(pyarr);
+    return NULL;
+  }
+  return PyArray_Return(pyarr);
+}
+
+/* Create an array from a retained handle. dim is the index of
+   the dimension in NumPy order, or -1 for the data. Needs the GIL */
+static PyObject *
+Handle_array(idam_Handle *self, int dim, int which)
+{
+  idam_ArrayInfo info;
+  PyObject *arr;
+  void *ptr;
+  
+  Signal_array(&self->sig, dim, which, &info);
+  
+  if((dim >= 0) && (which == IDAM_DATA) && self->opt.dedup) {
+    if((arr = Dedup_find(&self->sig.dim[dim], info.count)) != NULL)
+      return arr;
+  }
+  
+  arr = signalArray(info.rank, info.dimsize, info.npytype, info.raw, info.type,
+                    self->opt.copy ? NULL : (PyObject*) self, &ptr);
+  if((dim >= 0) && (which == IDAM_DATA) && self->opt.dedup)
+    Dedup_add(&self->sig.dim[dim], info.count, arr);
+  if((arr == NULL) || (ptr == NULL))
+    return arr;
+  
+  Py_BEGIN_ALLOW_THREADS
+  if(fillArray(ptr, info.npytype, info.raw, info.type, info.count) < 0) {
+    IDAM_LOCK;
+    Signal_floatArray(&self->sig, self->handle, dim, which, (float*) ptr);
+    IDAM_UNLOCK;
+  }
+  Py_END_ALLOW_THREADS
+  
+  return arr;
+}
+
+/************************************************************
+ * Lazy members
+ *
+ * Members which can be created on first use are NULL until
+ * then. These are accessed through getters rather than
+ * PyMemberDef.
+ ************************************************************/
+
+/* Return a new reference to a member, or raise AttributeError
+   if it is not set */
+static PyObject *
+getMember(PyObject *value, const char *name)
+{
+  if(value == NULL) {
+    PyErr_SetString(PyExc_AttributeError, name);
+    return NULL;
+  }
+  Py_INCREF(value);
+  return value;
+}
+
+/* Store a value created on first use, unless another thread
+   got there first (the GIL may have been released) */
+static void
+setLazy(PyObject **member, PyObject *value)
+{
+  if(*member == NULL)
+    *member = value;
+  else
+    Py_DECREF(value);
+}
+
+/* Setter for lazy members. closure is the offset of the member */
+static int
+setMemberAt(PyObject *self, PyObject *value, void *closure)
+{
+  PyObject **member = (PyObject**) ((char*) self + (size_t) closure);
+  
+  if(value == NULL) {
+    PyErr_SetString(PyExc_TypeError, "Cannot delete this attribute");
+    return -1;
+  }
+  Py_INCREF(value);
+  return setMember(member, value);
+}
+
+/************************************************************
+ * IDAM dimension members
+ ************************************************************/
+
+/* Define data type */
+typedef struct {
+  PyObject_HEAD
+  
+  PyObject *label; /* Short label */
+  PyObject *units; 
+  PyObject *data;  /* NumPy array */
+
+  PyObject *errl;  /* NumPy array of low-side errors */
+  PyObject *errh;  /* NumPy array of high-side errors */
+
+  PyObject *handle; /* Retained handle if arrays are created lazily */
+  int index;        /* Index of this dimension, in NumPy order */
+} idam_Dimension;
+
+/* Members of the type */
+static PyMemberDef idam_DimensionMembers[] = {
+  {"label", T_OBJECT_EX, offsetof(idam_Dimension, label), 0,
+   "Short label"},
+  {"units", T_OBJECT_EX, offsetof(idam_Dimension, units), 0,
+   "units"},
+  {NULL}  /* Sentinel */
+};
+
+/* Members created on first use */
+
+static PyObject *
+Dimension_getdata(idam_Dimension *self, void *closure)
+{
+  if((self->data == NULL) && self->handle) {
+    PyObject *arr = Handle_array((idam_Handle*) self->handle, self->index, IDAM_DATA);
+    if(arr == NULL)
+      return NULL;
+    setLazy(&self->data, arr);
+  }
+  return getMember(self->data, "data");
+}
+
+static PyObject *
+Dimension_geterror(idam_Dimension *self, int which)
+{
+  PyObject **member = (which == IDAM_ERRL) ? &self->errl : &self->errh;
+  idam_Handle *h = (idam_Handle*) self->handle;
+  PyObject *arr;
+  
+  if((*member == NULL) && h) {
+    if(h->sig.dim[self->index].errtype == TYPE_UNKNOWN) {
+      /* No error data */
+      Py_INCREF(Py_None);
+      arr = Py_None;
+    }else if((which == IDAM_ERRH) && !h->sig.dim[self->index].errasym) {
+      /* Symmetric error */
+      arr = Dimension_geterror(self, IDAM_ERRL);
+    }else
+      arr = Handle_array(h, self->index, which);
+    if(arr == NULL)
+      return NULL;
+    setLazy(member, arr);
+  }
+  return getMember(*member, (which == IDAM_ERRL) ? "errl" : "errh");
+}
+
+static PyObject *
+Dimension_geterrl(idam_Dimension *self, void *closure)
+{
+  return Dimension_geterror(self, IDAM_ERRL);
+}
+
+static PyObject *
+Dimension_geterrh(idam_Dimension *self, void *closure)
+{
+  return Dimension_geterror(self, IDAM_ERRH);
+}
+
+static PyGetSetDef idam_DimensionGetSet[] = {
+  {"data", (getter)Dimension_getdata, setMemberAt,
+   "NumPy array of dimension values", (void*) offsetof(idam_Dimension, data)},
+  {"errl", (getter)Dimension_geterrl, setMemberAt,
+   "NumPy array of low-side errors", (void*) offsetof(idam_Dimension, errl)},
+  {"errh", (getter)Dimension_geterrh, setMemberAt,
+   "NumPy array of high-side errors", (void*) offsetof(idam_Dimension, errh)},
+  {NULL}  /* Sentinel */
+};
+
+/************************************************************
+ * IDAM dimension methods
+ ************************************************************/
+
+/* Free memory */
+static void
+Dimension_dealloc(idam_Dimension* self)
+{
+  Py_XDECREF(self->label);
+  Py_XDECREF(self->units);
+  
+  Py_XDECREF(self->data);
+  
+  Py_XDECREF(self->errl);
+  Py_XDECREF(self->errh);
+
+  Py_XDECREF(self->handle);
+
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* Create a new instance (NOT initialisation) */
+static PyObject *
+Dimension_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  idam_Dimension *self;
+
+  self = (idam_Dimension *)type->tp_alloc(type, 0);
+  if (self != NULL) {
+    
+    self->label = CharsToString("No data");
+    if (self->label == NULL) {
+      Py_DECREF(self);
+      return NULL;
+    }
+
+    self->units = CharsToString("No units");
+    if (self->units == NULL) {
+      Py_DECREF(self);
+      return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    self->data = Py_None;
+    
+    Py_INCREF(Py_None);
+    self->errl = Py_None;
+
+    Py_INCREF(Py_None);
+    self->errh = Py_None;
+  }
+  
+  return (PyObject *)self;
+}
+
+/* Methods */
+static PyMethodDef idam_DimensionMethods[] = {
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject idam_DimensionType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+    "idam.Dimension",          /*tp_name*/
+    sizeof(idam_Dimension),    /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)Dimension_dealloc,  /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "IDAM dimension objects",  /* tp_doc */
+    0,		               /* tp_traverse */
+    0,		               /* tp_clear */
+    0,		               /* tp_richcompare */
+    0,		               /* tp_weaklistoffset */
+    0,		               /* tp_iter */
+    0,		               /* tp_iternext */
+    idam_DimensionMethods,     /* tp_methods */
+    idam_DimensionMembers,     /* tp_members */
+    idam_DimensionGetSet,      /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    0,                         /* tp_init */
+    0,                         /* tp_alloc */
+    Dimension_new,             /* tp_new */
+};
+
+/************************************************************
+ * IDAM data members
+ ************************************************************/
+
+/* Define data type */
+typedef struct {
+  PyObject_HEAD
+  PyObject *name;   /* Name of the data (e.g. 'amc_plasma current' */
+  PyObject *source; /* Source of the data (e.g. '15100') */
+  
+  PyObject *label;  /* Data label */
+  PyObject *units;  /* Units */
+  PyObject *desc;   /* Description */
+
+  PyObject *dim;    /* List of dimensions */
+  int order;        /* Which dimension is time */
+  
+  PyObject *time;   /* Refers to same NumPy array as dim[order]->data */
+
+  PyObject *errl; /* Error on the low side */
+  PyObject *errh;  /* Error on the high side */
+  
+  PyObject *data;
+
+  PyObject *handle; /* Retained handle if arrays are created lazily */
+} idam_Data;
+
+/* Members of the type */
+static PyMemberDef idam_DataMembers[] = {
+  {"name", T_OBJECT_EX, offsetof(idam_Data, name), 0,
+   "Name used to request the data"},
+  {"source", T_OBJECT_EX, offsetof(idam_Data, source), 0,
+   "Source of the data"},
+
+  {"label", T_OBJECT_EX, offsetof(idam_Data, label), 0,
+   "Data label"},
+  {"units", T_OBJECT_EX, offsetof(idam_Data, units), 0,
+   "Data units"},
+  {"desc", T_OBJECT_EX, offsetof(idam_Data, desc), 0,
+   "Longer description of the data"},
+
+  {"dim", T_OBJECT_EX, offsetof(idam_Data, dim), 0,
+   "Dimensions"},
+
+  {"order", T_INT, offsetof(idam_Data, order), 0,
+   "Index of time dimension"},
+
+  {"data", T_OBJECT_EX, offsetof(idam_Data, data), 0,
+   "NumPy data array"},
+  {NULL}  /* Sentinel */
+};
+
+/* Members created on first use */
+
+static PyObject *
+Data_gettime(idam_Data *self, void *closure)
+{
+  PyObject *arr;
+  
+  if((self->time == NULL) && self->handle) {
+    if(PyList_Check(self->dim) && (self->order >= 0) && (self->order < PyList_GET_SIZE(self->dim))) {
+      arr = Dimension_getdata((idam_Dimension*) PyList_GET_ITEM(self->dim, self->order), NULL);
+    }else {
+      /* No time dimension */
+      Py_INCREF(Py_None);
+      arr = Py_None;
+    }
+    if(arr == NULL)
+      return NULL;
+    setLazy(&self->time, arr);
+  }
+  return getMember(self->time, "time");
+}
+
+static PyObject *
+Data_geterror(idam_Data *self, int which)
+{
+  PyObject **member = (which == IDAM_ERRL) ? &self->errl : &self->errh;
+  idam_Handle *h = (idam_Handle*) self->handle;
+  PyObject *arr;
+  
+  if((*member == NULL) && h) {
+    if(h->sig.errtype == TYPE_UNKNOWN) {
+      /* No error data */
+      Py_INCREF(Py_None);
+      arr = Py_None;
+    }else if((which == IDAM_ERRH) && !h->sig.errasym) {
+      /* Symmetric error */
+      arr = Data_geterror(self, IDAM_ERRL);
+    }else
+      arr = Handle_array(h, -1, which);
+    if(arr == NULL)
+      return NULL;
+    setLazy(member, arr);
+  }
+  return getMember(*member, (which == IDAM_ERRL) ? "errl" : "errh");
+}
+
+static PyObject *
+Data_geterrl(idam_Data *self, void *closure)
+{
+  return Data_geterror(self, IDAM_ERRL);
+}
+
+static PyObject *
+Data_geterrh(idam_Data *self, void *closure)
+{
+  return Data_geterror(self, IDAM_ERRH);
+}
+
+static PyGetSetDef idam_DataGetSet[] = {
+  {"time", (getter)Data_gettime, setMemberAt,
+   "Time values. Same as dim[order].data", (void*) offsetof(idam_Data, time)},
+  {"errl", (getter)Data_geterrl, setMemberAt,
+   "Error on the low side", (void*) offsetof(idam_Data, errl)},
+  {"errh", (getter)Data_geterrh, setMemberAt,
+   "Error on the high side", (void*) offsetof(idam_Data, errh)},
+  {NULL}  /* Sentinel */
+};
+
+/************************************************************
+ * IDAM data methods
+ ************************************************************/
+
+/* Free memory */
+static void
+Data_dealloc(idam_Data* self)
+{
+  Py_XDECREF(self->name);
+  Py_XDECREF(self->source);
+
+  Py_XDECREF(self->label);
+  Py_XDECREF(self->units);
+  Py_XDECREF(self->desc);
+
+  Py_XDECREF(self->dim);
+
+  Py_XDECREF(self->time);
+
+  Py_XDECREF(self->errl);
+  Py_XDECREF(self->errh);
+
+  Py_XDECREF(self->data);
+
+  Py_XDECREF(self->handle);
+  
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* Create a new instance (NOT initialisation) */
+static PyObject *
+Data_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  idam_Data *self;
+
+  self = (idam_Data *)type->tp_alloc(type, 0);
+  if (self != NULL) {
+    self->name = CharsToString("");
+    if (self->name == NULL) {
+      Py_DECREF(self);
+      return NULL;
+    }
+    
+    self->source = CharsToString("");
+    if (self->source == NULL) {
+      Py_DECREF(self);
+      return NULL;
+    }
+    
+    self->label = CharsToString("No data");
+    if (self->label == NULL) {
+      Py_DECREF(self);
+      return NULL;
+    }
+
+    self->units = CharsToString("No units");
+    if (self->units == NULL) {
+      Py_DECREF(self);
+      return NULL;
+    }
+
+    self->desc = CharsToString("No description");
+    if (self->desc == NULL) {
+      Py_DECREF(self);
+      return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    self->dim = Py_None;
+    
+    self->order = 0;
+
+    Py_INCREF(Py_None);
+    self->time = Py_None;
+
+    Py_INCREF(Py_None);
+    self->errl = Py_None;
+    Py_INCREF(Py_None);
+    self->errh = Py_None;
+
+    Py_INCREF(Py_None);
+    self->data = Py_None;
+  }
+  
+  return (PyObject *)self;
+}
+
+/* The array given with out= to use for one of the arrays of a
+   signal: which is 0 for values, 1 and 2 for low and high errors,
+   of the data (dim -1) or a dimension. NULL if one should be
+   created. out is an array (just for the data) or a Data object */
+static PyObject *
+outMember(PyObject *out, int dim, int which)
+{
+  idam_Data *d = (idam_Data*) out;
+  idam_Dimension *dm;
+  PyObject *arr;
+  
+  if(out == NULL)
+    return NULL;
+  if(PyArray_Check(out))
+    return ((dim < 0) && (which == 0)) ? out : NULL;
+  
+  if(dim < 0)
+    arr = (which == 0) ? d->data : (which == 1) ? d->errl : d->errh;
+  else {
+    if(!PyList_Check(d->dim) || (dim >= PyList_GET_SIZE(d->dim)))
+      return NULL;
+    dm = (idam_Dimension*) PyList_GET_ITEM(d->dim, dim);
+    arr = (which == 0) ? dm->data : (which == 1) ? dm->errl : dm->errh;
+  }
+  return (arr == Py_None) ? NULL : arr;
+}
+
+/* Check the out= arrays match a signal, before any are used */
+static int
+Signal_checkOut(const idam_Signal *sig, PyObject *out)
+{
+  static const char *what[] = {"data", "errl", "errh"};
+  PyObject *arr;
+  char name[64];
+  int i, k;
+  
+  for(k=0;k<3;k++) {
+    if(((k > 0) && (sig->errtype == TYPE_UNKNOWN)) || ((k == 2) && !sig->errasym))
+      continue;
+    if(((arr = outMember(out, -1, k)) != NULL) &&
+       (checkOut(arr, what[k], sig->rank, sig->dimsize,
+                 (k == 0) ? sig->npytype : sig->npyerrtype) < 0))
+      return -1;
+  }
+  for(i=0;i<sig->rank;i++) {
+    const idam_SignalDim *d = &sig->dim[i];
+    for(k=0;k<3;k++) {
+      if(((k > 0) && (d->errtype == TYPE_UNKNOWN)) || ((k == 2) && !d->errasym))
+        continue;
+      sprintf(name, "dim[%d].%s", i, what[k]);
+      if(((arr = outMember(out, i, k)) != NULL) &&
+         (checkOut(arr, name, 1, &sig->dimsize[i],
+                   (k == 0) ? d->npytype : d->npyerrtype) < 0))
+        return -1;
+    }
+  }
+  return 0;
+}
+
+/* Use out if given (already checked), otherwise as signalArray */
+static PyObject *
+outArray(PyObject *out, int rank, npy_intp *dimsize, int npytype,
+         const char *raw, int type, PyObject *owner, void **ptr)
+{
+  if(out == NULL)
+    return signalArray(rank, dimsize, npytype, raw, type, owner, ptr);
+  Py_INCREF(out);
+  *ptr = PyArray_DATA((PyArrayObject*) out);
+  return out;
+}
+
+/* Set up members from a signal snapshot, and point the snapshot at
+   the new arrays ready for Signal_fill. If opt->native is set then
+   arrays have the same type as the IDAM data, otherwise float. If
+   opt->copy is zero, opt->lazy is set or the signal came from the
+   cache, then sig->owner is set to keep the handle or mapped file.
+   Arrays then share its buffers where possible, or (if lazy) errors
+   and dimensions are left until used. Arrays given by opt->out are
+   filled instead of new ones, and opt->transform is set up for
+   Signal_fill to apply to the data and errors.
+   Needs the GIL */
+static int
+Data_setSignal(idam_Data *self, idam_Signal *sig, const idam_Options *opt)
+{
+  idam_Dimension *dim;
+  PyObject *dimlist;
+  int i;
+  PyObject *share; /* Owner, if arrays can share IDAM buffers */
+  PyObject *vshare; /* The same, for the data and errors */
+  PyObject *shared;
+  
+  Signal_types(sig, opt->native);
+  if(Signal_transform(sig, &opt->transform) < 0)
+    return -1;
+  if(opt->out && (Signal_checkOut(sig, opt->out) < 0))
+    return -1;
+  
+  if((!opt->copy || opt->lazy || sig->map) && (sig->owner == NULL)) {
+    if((sig->owner = Handle_new(sig, opt)) == NULL)
+      return -1;
+  }
+  /* Cached arrays always share the mapped file */
+  share = (opt->copy && !sig->map) ? NULL : sig->owner;
+  /* Transformed values are never shared */
+  vshare = sig->transform ? NULL : share;
+
+  /* Set data label, units and description */
+  if((setMember(&self->label, InternString(sig->label)) < 0) ||
+     (setMember(&self->units, InternString(opt->transform.units[0] ? opt->transform.units
+                                           : sig->units)) < 0) ||
+     (setMember(&self->desc, CharsToString(sig->desc)) < 0))
+    return -1;
+  
+  /* Set the data */
+  if(setMember(&self->data, outArray(outMember(opt->out, -1, 0), sig->rank, sig->dimsize,
+                                     sig->npytype, sig->raw, sig->type, vshare, &sig->data)) < 0) {
+    PyErr_SetString(PyExc_RuntimeError, "Could not create NumPy array for data");
+    return -1;
+  }
+  
+  /* Get the data errors (low and high asymmetric) */
+  if(opt->lazy) {
+    /* Create errors and time when first used */
+    Py_INCREF(sig->owner);
+    setMember(&self->handle, sig->owner);
+    Py_CLEAR(self->errl);
+    Py_CLEAR(self->errh);
+  }else if(sig->errtype != TYPE_UNKNOWN) {
+    /* Got error data */
+    if(setMember(&self->errl, outArray(outMember(opt->out, -1, 1), sig->rank, sig->dimsize,
+                                       sig->npyerrtype, sig->rawerrl, sig->errtype, vshare, &sig->errl)) < 0) {
+      PyErr_SetString(PyExc_RuntimeError, "Could not create NumPy array for error array");
+      return -1;
+    }
+    
+    if(!sig->errasym) {
+      /* Error is symmetric. Just point to the same data */
+      Py_INCREF(self->errl);
+      setMember(&self->errh, self->errl);
+    }else {
+      /* Need separate array */
+      if(setMember(&self->errh, outArray(outMember(opt->out, -1, 2), sig->rank, sig->dimsize,
+                                         sig->npyerrtype, sig->rawerrh, sig->errtype, vshare, &sig->errh)) < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Could not create NumPy array for error array");
+        return -1;
+      }
+    }
+  }else {
+    /* No error data, so set to None */
+    Py_INCREF(Py_None);
+    setMember(&self->errl, Py_None);
+    Py_INCREF(Py_None);
+    setMember(&self->errh, Py_None);
+  }
+
+  if(!opt->lazy)
+    Py_CLEAR(self->handle);
+
+  /* Set the time dimension to null (or unset if lazy) */
+  Py_CLEAR(self->time);
+  if(!opt->lazy) {
+    Py_INCREF(Py_None);
+    self->time = Py_None;
+  }
+  
+  /* Get the dimensions */
+  dimlist = PyList_New(sig->rank);
+  if(setMember(&self->dim, dimlist) < 0) {
+    PyErr_SetString(PyExc_RuntimeError, "Could not create list of dimensions");
+    return -1;
+  }
+  
+  for(i=0;i<sig->rank;i++) {
+    dim = (idam_Dimension *) Dimension_new(&idam_DimensionType, NULL, NULL);
+    if(dim == NULL)
+      return -1;
+    /* Add this dimension to the list */
+    PyList_SET_ITEM(dimlist, i, (PyObject*) dim);
+    
+    /* Labels and units are often the same, so interned */
+    if((setMember(&dim->label, InternString(sig->dim[i].label)) < 0) ||
+       (setMember(&dim->units, InternString(sig->dim[i].units)) < 0))
+      return -1;
+    
+    if(opt->lazy) {
+      /* Create arrays when first used */
+      Py_INCREF(sig->owner);
+      dim->handle = sig->owner;
+      dim->index = i;
+      Py_CLEAR(dim->data);
+      Py_CLEAR(dim->errl);
+      Py_CLEAR(dim->errh);
+      continue;
+    }
+    
+    if(opt->dedup && !outMember(opt->out, i, 0) &&
+       ((shared = Dedup_find(&sig->dim[i], sig->dimsize[i])) != NULL)) {
+      /* Same values as an existing array, so nothing to fill */
+      setMember(&dim->data, shared);
+      sig->dim[i].data = NULL;
+    }else {
+      if(setMember(&dim->data, outArray(outMember(opt->out, i, 0), 1, &(sig->dimsize[i]), sig->dim[i].npytype,
+                                        sig->dim[i].raw, sig->dim[i].type, share, &sig->dim[i].data)) < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Could not create NumPy array for dimension");
+        return -1;
+      }
+      if(opt->dedup && !outMember(opt->out, i, 0))
+        Dedup_add(&sig->dim[i], sig->dimsize[i], dim->data);
+    }
+    
+    if(sig->dim[i].errtype != TYPE_UNKNOWN) {
+      if(setMember(&dim->errl, outArray(outMember(opt->out, i, 1), 1, &(sig->dimsize[i]), sig->dim[i].npyerrtype,
+                                        sig->dim[i].rawerrl, sig->dim[i].errtype, share, &sig->dim[i].errl)) < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Could not create NumPy array for dimension error");
+        return -1;
+      }
+      
+      if(!sig->dim[i].errasym) {
+        /* Symmetric error */
+        Py_INCREF(dim->errl);
+        setMember(&dim->errh, dim->errl);
+      }else {
+        /* Asymmetric error */
+        if(setMember(&dim->errh, outArray(outMember(opt->out, i, 2), 1, &(sig->dimsize[i]), sig->dim[i].npyerrtype,
+                                          sig->dim[i].rawerrh, sig->dim[i].errtype, share, &sig->dim[i].errh)) < 0) {
+          PyErr_SetString(PyExc_RuntimeError, "Could not create NumPy array for dimension error");
+          return -1;
+        }
+      }
+    }
+    /* Otherwise errl and errh are left as None */
+    
+    /* Create shortcut to time data */
+    if(i == sig->order) { /* This is the time dimension */
+      Py_INCREF(dim->data);
+      setMember(&self->time, dim->data);
+    }
+  }
+  
+  /*  Set index of time dimension */
+  self->order = sig->order;
+  
+  return 0;
+}
+
+/************************************************************
+ * Memory cache
+ *
+ * Recently read Data objects, kept in least recently used
+ * order up to a total size of arrays. A repeated request gets
+ * a new Data object sharing the cached arrays, which are made
+ * read-only. While a request is being read, other requests
+ * for the same signal wait for it rather than reading again.
+ *
+ * Everything here needs the GIL.
+ ************************************************************/
+
+static PyTypeObject idam_DataType;
+
+typedef struct idam_MemEntry {
+  struct idam_MemEntry *prev, *next; /* Most recently used first */
+  PyObject *key;
+  PyObject *data;             /* Cached Data, or NULL while being read */
+  long long nbytes;
+  PyThread_type_lock ready;   /* Held while being read */
+  int refs;                   /* Threads using it, plus one if in table */
+  int intable;
+} idam_MemEntry;
+
+static PyObject *idam_memtable = NULL; /* Key -> capsule of entry */
+static idam_MemEntry *idam_memhead = NULL, *idam_memtail = NULL;
+static long long idam_memmax = 0;      /* Size limit. Zero if off */
+static long long idam_membytes = 0;
+static long long idam_memhits = 0, idam_memmisses = 0, idam_memevictions = 0;
+
+/* Share all the members of src with dst. Dimensions are new
+   objects sharing the same arrays */
+static int
+Data_copy(idam_Data *dst, idam_Data *src)
+{
+  PyObject *dimlist = NULL;
+  idam_Dimension *dim, *sdim;
+  Py_ssize_t i, n;
+  
+  if(PyList_Check(src->dim)) {
+    n = PyList_GET_SIZE(src->dim);
+    if((dimlist = PyList_New(n)) == NULL)
+      return -1;
+    for(i=0;i<n;i++) {
+      sdim = (idam_Dimension*) PyList_GET_ITEM(src->dim, i);
+      dim = (idam_Dimension *) Dimension_new(&idam_DimensionType, NULL, NULL);
+      if(dim == NULL) {
+        Py_DECREF(dimlist);
+        return -1;
+      }
+      PyList_SET_ITEM(dimlist, i, (PyObject*) dim);
+      Py_XINCREF(sdim->label); setMember(&dim->label, sdim->label);
+      Py_XINCREF(sdim->units); setMember(&dim->units, sdim->units);
+      Py_XINCREF(sdim->data);  setMember(&dim->data, sdim->data);
+      Py_XINCREF(sdim->errl);  setMember(&dim->errl, sdim->errl);
+      Py_XINCREF(sdim->errh);  setMember(&dim->errh, sdim->errh);
+    }
+  }else {
+    Py_XINCREF(src->dim);
+    dimlist = src->dim;
+  }
+  setMember(&dst->dim, dimlist);
+  
+  Py_XINCREF(src->name);   setMember(&dst->name, src->name);
+  Py_XINCREF(src->source); setMember(&dst->source, src->source);
+  Py_XINCREF(src->label);  setMember(&dst->label, src->label);
+  Py_XINCREF(src->units);  setMember(&dst->units, src->units);
+  Py_XINCREF(src->desc);   setMember(&dst->desc, src->desc);
+  Py_XINCREF(src->time);   setMember(&dst->time, src->time);
+  Py_XINCREF(src->errl);   setMember(&dst->errl, src->errl);
+  Py_XINCREF(src->errh);   setMember(&dst->errh, src->errh);
+  Py_XINCREF(src->data);   setMember(&dst->data, src->data);
+  Py_XINCREF(src->handle); setMember(&dst->handle, src->handle);
+  dst->order = src->order;
+  
+  return 0;
+}
+
+/* Make an array read-only, returning its size in bytes */
+static long long
+readOnly(PyObject *obj)
+{
+  if((obj == NULL) || !PyArray_Check(obj))
+    return 0;
+  PyArray_CLEARFLAGS((PyArrayObject*) obj, NPY_ARRAY_WRITEABLE);
+  return PyArray_NBYTES((PyArrayObject*) obj);
+}
+
+static void
+MemEntry_release(idam_MemEntry *e)
+{
+  if(--e->refs > 0)
+    return;
+  Py_XDECREF(e->key);
+  Py_XDECREF(e->data);
+  if(e->ready)
+    PyThread_free_lock(e->ready);
+  free(e);
+}
+
+/* Remove an entry from the table and list */
+static void
+MemCache_remove(idam_MemEntry *e)
+{
+  if(!e->intable)
+    return;
+  
+  if(e->prev) e->prev->next = e->next; else idam_memhead = e->next;
+  if(e->next) e->next->prev = e->prev; else idam_memtail = e->prev;
+  e->prev = e->next = NULL;
+  
+  idam_membytes -= e->nbytes;
+  e->intable = 0;
+  PyDict_DelItem(idam_memtable, e->key);
+  MemEntry_release(e);
+}
+
+/* Remove least recently used entries until within the size limit */
+static void
+MemCache_evict(void)
+{
+  idam_MemEntry *e = idam_memtail, *prev;
+  
+  while(e && (idam_membytes > idam_memmax)) {
+    prev = e->prev;
+    if(e->data) { /* Not being read */
+      MemCache_remove(e);
+      idam_memevictions++;
+    }
+    e = prev;
+  }
+}
+
+static void
+MemCache_clear(void)
+{
+  while(idam_memhead)
+    MemCache_remove(idam_memhead);
+}
+
+static idam_MemEntry *
+MemCache_find(PyObject *key)
+{
+  PyObject *capsule;
+  
+  if(idam_memtable == NULL)
+    return NULL;
+  capsule = PyDict_GetItem(idam_memtable, key);
+  if(capsule == NULL)
+    return NULL;
+  return (idam_MemEntry*) PyCapsule_GetPointer(capsule, NULL);
+}
+
+/* Move to the front of the list */
+static void
+MemCache_touch(idam_MemEntry *e)
+{
+  if(idam_memhead == e)
+    return;
+  if(e->prev) e->prev->next = e->next;
+  if(e->next) e->next->prev = e->prev; else idam_memtail = e->prev;
+  e->prev = NULL;
+  e->next = idam_memhead;
+  idam_memhead->prev = e;
+  idam_memhead = e;
+}
+
+/* Add an entry for a request about to be read. The caller must
+   call MemCache_finish when done */
+static idam_MemEntry *
+MemCache_start(PyObject *key)
+{
+  idam_MemEntry *e;
+  PyObject *capsule;
+  
+  if((idam_memtable == NULL) && ((idam_memtable = PyDict_New()) == NULL))
+    return NULL;
+  
+  if((e = (idam_MemEntry*) calloc(1, sizeof(idam_MemEntry))) == NULL) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  if((e->ready = PyThread_allocate_lock()) == NULL) {
+    free(e);
+    PyErr_SetString(PyExc_RuntimeError, "Could not allocate lock");
+    return NULL;
+  }
+  PyThread_acquire_lock(e->ready, WAIT_LOCK);
+  
+  capsule = PyCapsule_New(e, NULL, NULL);
+  if((capsule == NULL) || (PyDict_SetItem(idam_memtable, key, capsule) < 0)) {
+    Py_XDECREF(capsule);
+    PyThread_release_lock(e->ready);
+    PyThread_free_lock(e->ready);
+    free(e);
+    return NULL;
+  }
+  Py_DECREF(capsule);
+  
+  Py_INCREF(key);
+  e->key = key;
+  e->refs = 2; /* Table and caller */
+  e->intable = 1;
+  e->next = idam_memhead;
+  if(idam_memhead) idam_memhead->prev = e; else idam_memtail = e;
+  idam_memhead = e;
+  
+  return e;
+}
+
+/* Store the result of a read, or remove the entry if d is NULL.
+   Threads waiting for the entry are then woken. Any exception
+   being raised is kept */
+static void
+MemCache_finish(idam_MemEntry *e, idam_Data *d)
+{
+  idam_Data *copy = NULL;
+  idam_Dimension *dim;
+  Py_ssize_t i;
+  PyObject *type, *value, *tb;
+  
+  PyErr_Fetch(&type, &value, &tb);
+  
+  if(d && e->intable) {
+    copy = (idam_Data*) Data_new(&idam_DataType, NULL, NULL);
+    if(copy && (Data_copy(copy, d) == 0)) {
+      /* Arrays are now shared, so make them read-only */
+      e->nbytes = readOnly(copy->data) + readOnly(copy->errl);
+      if(copy->errh != copy->errl)
+        e->nbytes += readOnly(copy->errh);
+      for(i=0;PyList_Check(copy->dim) && (i<PyList_GET_SIZE(copy->dim));i++) {
+        dim = (idam_Dimension*) PyList_GET_ITEM(copy->dim, i);
+        e->nbytes += readOnly(dim->data) + readOnly(dim->errl);
+        if(dim->errh != dim->errl)
+          e->nbytes += readOnly(dim->errh);
+      }
+      e->data = (PyObject*) copy;
+      idam_membytes += e->nbytes;
+    }else {
+      Py_XDECREF(copy);
+      PyErr_Clear(); /* Just don't cache it */
+      d = NULL;
+    }
+  }
+  
+  PyThread_release_lock(e->ready);
+  
+  if(d == NULL)
+    MemCache_remove(e);
+  else
+    MemCache_evict();
+  MemEntry_release(e);
+  
+  PyErr_Restore(type, value, tb);
+}
+
+/* Wait for an entry being read by another thread */
+static void
+MemCache_wait(idam_MemEntry *e)
+{
+  e->refs++;
+  Py_BEGIN_ALLOW_THREADS
+  PyThread_acquire_lock(e->ready, WAIT_LOCK);
+  PyThread_release_lock(e->ready);
+  Py_END_ALLOW_THREADS
+  MemEntry_release(e);
+}
+
+/* Look up a request. Returns 1 and fills self if found. Otherwise
+   returns 0, and *entry is set if the caller should store the
+   result. Returns -1 on error */
+static int
+MemCache_get(idam_Data *self, const char *key_chars, idam_MemEntry **entry)
+{
+  PyObject *key;
+  idam_MemEntry *e;
+  int ret = 0;
+  
+  *entry = NULL;
+  if((key = CharsToString(key_chars)) == NULL)
+    return -1;
+  
+  while(((e = MemCache_find(key)) != NULL) && (e->data == NULL))
+    MemCache_wait(e); /* Being read by another thread */
+  
+  if(e) {
+    /* Found */
+    if(Data_copy(self, (idam_Data*) e->data) < 0)
+      ret = -1;
+    else {
+      MemCache_touch(e);
+      idam_memhits++;
+      ret = 1;
+    }
+  }else {
+    idam_memmisses++;
+    if((*entry = MemCache_start(key)) == NULL)
+      ret = -1;
+  }
+  
+  Py_DECREF(key);
+  return ret;
+}
+
+static PyObject*
+idam_setMemoryCache(PyObject *self, PyObject *args)
+{
+  long long maxsize;
+  
+  if(!PyArg_ParseTuple(args, "L", &maxsize))
+    return NULL;
+  
+  idam_memmax = maxsize;
+  if(maxsize <= 0) {
+    idam_memmax = 0;
+    MemCache_clear();
+  }else
+    MemCache_evict();
+  
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject*
+idam_setDedup(PyObject *self, PyObject *args)
+{
+  int on = 1;
+  
+  if(!PyArg_ParseTuple(args, "|i", &on))
+    return NULL;
+  
+  idam_dedup = on ? 1 : 0;
+  if(!idam_dedup)
+    Py_CLEAR(idam_deduptable);
+  
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject*
+idam_memoryCacheInfo(PyObject *self, PyObject *args)
+{
+  return Py_BuildValue("{s:L,s:L,s:L,s:L,s:L,s:n}",
+                       "maxsize", idam_memmax,
+                       "bytes", idam_membytes,
+                       "hits", idam_memhits,
+                       "misses", idam_memmisses,
+                       "evictions", idam_memevictions,
+                       "entries", idam_memtable ? PyDict_Size(idam_memtable) : (Py_ssize_t) 0);
+}
+
+/* See Prefetching, and Timeouts and cancellation, below */
+static void Prefetch_observe(const char *name, const char *source,
+                             const idam_Server *srv, const idam_Options *opt);
+static int Prefetch_take(idam_Data *self, const char *name, const char *source,
+                         const idam_Server *srv, const idam_Options *opt);
+static int Data_wait(idam_Data *self, const char *data, PyObject *source_obj,
+                     const idam_Server *srv, const idam_Options *opt);
+
+/* Read a signal into self, from the prefetch buffer, disk cache
+   or server. Steals the reference to source_obj */
+static int
+Data_read(idam_Data *self, const char *data, PyObject *source_obj,
+          const idam_Server *srv, const idam_Options *opt)
+{
+  const char *source = StringToChars(source_obj);
+  idam_CacheEntry cache;
+  idam_Signal sig;
+  int ret;
+  double start = idam_now(), t;
+  
+  if(source == NULL) {
+    Py_DECREF(source_obj);
+    return -1;
+  }
+  
+  if(!opt->out && ((ret = Prefetch_take(self, data, source, srv, opt)) != 0)) {
+    Py_DECREF(source_obj);
+    return (ret > 0) ? 0 : -1;
+  }
+  
+  if(!opt->out && (opt->timeout > 0))
+    return Data_wait(self, data, source_obj, srv, opt);
+  
+  if(Cache_entry(&cache, data, source, srv, opt) < 0) {
+    Py_DECREF(source_obj);
+    return -1;
+  }
+
+  /* Open connection and get data */
+  idam_log(IDAM_DEBUG, "Reading '%s' from '%s' on %s:%d", data, source, srv->host, srv->port);
+  
+  Py_BEGIN_ALLOW_THREADS
+  Signal_get(&sig, &cache, data, source, srv, opt);
+  Py_END_ALLOW_THREADS
+  
+  if(sig.error) {
+    idam_log(IDAM_DEBUG, "IDAM error: %s", sig.error);
+    Stats_add(&idam_failures, 1);
+    Stats_phase(IDAM_PHASE_TOTAL, start, data);
+    PyErr_SetString(PyExc_RuntimeError, sig.error);
+    Py_DECREF(source_obj);
+    Signal_clear(&sig); /* Handle already freed */
+    Cache_free(&cache);
+    return -1;
+  }
+  
+  /* Set data name and source */
+  t = idam_now();
+  ret = setMember(&self->name, CharsToString(data));
+  setMember(&self->source, source_obj);
+  
+  /* Create the arrays */
+  if(ret == 0)
+    ret = Data_setSignal(self, &sig, opt);
+  Stats_phase(IDAM_PHASE_OBJECTS, t, data);
+  
+  /* Fill the arrays and free IDAM data */
+  Py_BEGIN_ALLOW_THREADS
+  if(ret == 0)
+    Signal_finish(&sig, &cache, data);
+  Signal_clear(&sig);
+  Py_END_ALLOW_THREADS
+  
+  /* Arrays sharing IDAM buffers now keep the handle */
+  Py_XDECREF(sig.owner);
+  Cache_free(&cache);
+  
+  Stats_add((ret == 0) ? &idam_requests : &idam_failures, 1);
+  Stats_phase(IDAM_PHASE_TOTAL, start, data);
+  return ret;
+}
+
+/* Read a signal from the server given by base, unless the
+   host or port keywords are given */
+static int
+Data_initFrom(idam_Data *self, PyObject *args, PyObject *kwds, const idam_Server *base)
+{
+  const char *data, *source;
+  const char *host = NULL;
+  idam_Server srv;
+  int port = -1;
+  const char *dtype = NULL;
+  Py_ssize_t decimate = 0;
+  const char *method = NULL;
+  idam_Options opt = IDAM_OPTIONS_INIT;
+  double connect = -1;
+  PyObject *source_obj;
+  PyObject *tmp;
+  PyObject *out = Py_None;
+  double scale = 1.0, offset = 0.0;
+  const char *units = NULL;
+  PyObject *baseline = Py_None, *valid = Py_None;
+  int ret;
+
+  static char *kwlist[] = {"data", "source", "host", "port", "dtype", "copy",
+                           "errors", "lazy", "cache", "tmin", "tmax", "stride",
+                           "decimate", "method", "timeout", "connect_timeout",
+                           "out", "scale", "offset", "units", "baseline",
+                           "valid", NULL};
+
+  opt.timeout = idam_timeout;
+  
+  /* First argument is a string, second an object */
+  if (! PyArg_ParseTupleAndKeywords(args, kwds, "sO|siziiiiddinzddOddzOO", kwlist, 
+				    &data, &tmp,
+				    &host, &port, &dtype, &opt.copy,
+                                    &opt.errors, &opt.lazy, &opt.cache,
+                                    &opt.tmin, &opt.tmax, &opt.stride,
+                                    &decimate, &method, &opt.timeout,
+                                    &connect, &out,
+                                    &scale, &offset, &units, &baseline, &valid))
+    return -1; 
+  
+  if((parseOptions(&opt, dtype, decimate, method) < 0) ||
+     (parseTransform(&opt, scale, offset, units, baseline, valid) < 0))
+    return -1;
+  
+  if(out != Py_None) {
+    if(!PyArray_Check(out) && !PyObject_TypeCheck(out, &idam_DataType)) {
+      PyErr_SetString(PyExc_TypeError, "out must be an array or a Data object");
+      return -1;
+    }
+    if(opt.lazy) {
+      PyErr_SetString(PyExc_ValueError, "out can't be used with lazy=True");
+      return -1;
+    }
+    opt.out = out;
+  }
+
+  /* Convert second argument to a string */
+  source_obj = PyObject_Str(tmp); /* NB: This object is returned */
+  if (source_obj == NULL)
+    return -1;
+  source = StringToChars(source_obj); /* Refers to internal buffer */
+  
+  /* Check if an error occurred */
+  if (source == NULL) {
+    Py_DECREF(source_obj);
+    PyErr_SetString(PyExc_RuntimeError, "Invalid arguments to idam.Data()");
+    return -1;
+  }
+
+  if(resolveServer(&srv, base, host, port) < 0) {
+    Py_DECREF(source_obj);
+    return -1;
+  }
+  if(connect >= 0)
+    srv.connect = connect;
+  
+  /* Filled here, so not from another thread or the memory cache */
+  if(opt.out)
+    return Data_read(self, data, source_obj, &srv, &opt);
+  
+  /* Read ahead if this continues a sequence of shots */
+  Prefetch_observe(data, source, &srv, &opt);
+
+  /* Check the memory cache */
+  if((idam_memmax > 0) && opt.cache && !opt.lazy) {
+    idam_MemEntry *entry;
+    char *key = requestKey(data, source, &srv, &opt);
+    if(key == NULL) {
+      Py_DECREF(source_obj);
+      PyErr_NoMemory();
+      return -1;
+    }
+    ret = MemCache_get(self, key, &entry);
+    free(key);
+    if(ret != 0) {
+      Py_DECREF(source_obj);
+      return (ret > 0) ? 0 : -1;
+    }
+    
+    ret = Data_read(self, data, source_obj, &srv, &opt);
+    MemCache_finish(entry, (ret == 0) ? self : NULL);
+    return ret;
+  }
+  
+  return Data_read(self, data, source_obj, &srv, &opt);
+}
+
+/* Initialise */
+static int
+Data_init(idam_Data *self, PyObject *args, PyObject *kwds)
+{
+  idam_Server srv;
+  
+  defaultServer(&srv);
+  return Data_initFrom(self, args, kwds, &srv);
+}
+
+/* Get a 1D array in a form decimate() can read: C-contiguous,
+   of a real type in idam_types. Sets *type to the IDAM type */
+static PyArrayObject *
+decimateInput(PyObject *obj, int *type)
+{
+  int i, npytype = NPY_DOUBLE;
+  PyArrayObject *arr;
+  
+  *type = TYPE_DOUBLE;
+  if(obj && PyArray_Check(obj)) {
+    for(i=0;idam_types[i].npytype >= 0;i++) {
+      if((idam_types[i].npytype == PyArray_TYPE((PyArrayObject*) obj)) &&
+         realType(idam_types[i].type)) {
+        npytype = idam_types[i].npytype;
+        *type = idam_types[i].type;
+        break;
+      }
+    }
+  }
+  
+  arr = (PyArrayObject*) PyArray_FROM_OTF(obj, npytype, NPY_ARRAY_IN_ARRAY);
+  if(arr && (PyArray_NDIM(arr) != 1)) {
+    Py_DECREF(arr);
+    PyErr_SetString(PyExc_ValueError, "Can only decimate 1D data");
+    return NULL;
+  }
+  return arr;
+}
+
+static PyObject *
+Data_decimate(idam_Data *self, PyObject *args, PyObject *kwds)
+{
+  Py_ssize_t npoints;
+  const char *method = NULL;
+  int m, ttype, dtype, outttype, outdtype;
+  PyObject *timeobj;
+  PyArrayObject *time = NULL, *data = NULL;
+  PyArrayObject *outtime = NULL, *outdata = NULL;
+  idam_Data *result = NULL;
+  idam_Dimension *dim;
+  npy_intp n, nout;
+  
+  static char *kwlist[] = {"npoints", "method", NULL};
+  
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "n|z", kwlist, &npoints, &method))
+    return NULL;
+  if(parseMethod(method, npoints, &m) < 0)
+    return NULL;
+  
+  if(!PyList_Check(self->dim) || (PyList_GET_SIZE(self->dim) != 1)) {
+    PyErr_SetString(PyExc_ValueError, "Can only decimate 1D data");
+    return NULL;
+  }
+  
+  /* May create the time array if lazy */
+  if((timeobj = PyObject_GetAttrString((PyObject*) self, "time")) == NULL)
+    return NULL;
+  time = decimateInput(timeobj, &ttype);
+  Py_DECREF(timeobj);
+  if(time == NULL)
+    return NULL;
+  if((data = decimateInput(self->data, &dtype)) == NULL)
+    goto fail;
+  
+  n = PyArray_DIM(data, 0);
+  if(PyArray_DIM(time, 0) != n) {
+    PyErr_SetString(PyExc_ValueError, "Time and data are different lengths");
+    goto fail;
+  }
+  
+  /* Keep float32, otherwise use double */
+  outttype = (ttype == TYPE_FLOAT) ? TYPE_FLOAT : TYPE_DOUBLE;
+  outdtype = (dtype == TYPE_FLOAT) ? TYPE_FLOAT : TYPE_DOUBLE;
+  nout = decimatedSize(n, npoints, m);
+  outtime = (PyArrayObject*) PyArray_SimpleNew(1, &nout, (outttype == TYPE_FLOAT) ? NPY_FLOAT : NPY_DOUBLE);
+  outdata = (PyArrayObject*) PyArray_SimpleNew(1, &nout, (outdtype == TYPE_FLOAT) ? NPY_FLOAT : NPY_DOUBLE);
+  if((outtime == NULL) || (outdata == NULL))
+    goto fail;
+  
+  Py_BEGIN_ALLOW_THREADS
+  nout = decimate(PyArray_DATA(time), ttype, PyArray_DATA(data), dtype, n, npoints, m,
+                  PyArray_DATA(outtime), outttype, PyArray_DATA(outdata), outdtype);
+  Py_END_ALLOW_THREADS
+  if(nout < 0) {
+    PyErr_NoMemory();
+    goto fail;
+  }
+  
+  /* Same signal, with new data and time and no errors */
+  result = (idam_Data*) Data_new(&idam_DataType, NULL, NULL);
+  if((result == NULL) || (Data_copy(result, self) < 0))
+    goto fail;
+  Py_CLEAR(result->handle);
+  dim = (idam_Dimension*) PyList_GET_ITEM(result->dim, 0);
+  Py_INCREF(outtime);
+  Py_INCREF(Py_None); Py_INCREF(Py_None); Py_INCREF(Py_None); Py_INCREF(Py_None);
+  setMember(&result->data, (PyObject*) outdata);
+  setMember(&result->time, (PyObject*) outtime);
+  setMember(&dim->data, (PyObject*) outtime);
+  setMember(&result->errl, Py_None);
+  setMember(&result->errh, Py_None);
+  setMember(&dim->errl, Py_None);
+  setMember(&dim->errh, Py_None);
+  Py_CLEAR(dim->handle);
+  result->order = 0;
+  
+  Py_DECREF(time);
+  Py_DECREF(data);
+  return (PyObject*) result;
+  
+ fail:
+  Py_XDECREF(time);
+  Py_XDECREF(data);
+  Py_XDECREF(outtime);
+  Py_XDECREF(outdata);
+  Py_XDECREF(result);
+  return NULL;
+}
+
+/************************************************************
+ * Arrow export
+ *
+ * Data objects can be handed to Apache Arrow (and so pandas,
+ * Polars, ...) through the Arrow C data interface, without
+ * copying the arrays. The signal is exported as a record batch
+ * with columns time, data, errl and errh (those which are set).
+ * Data with more than one dimension is exported as fixed size
+ * lists of the values at each time, so time must be the first
+ * dimension. Labels and units are kept as field metadata.
+ *
+ * Each exported array holds a reference to its NumPy array,
+ * released (taking the GIL) when Arrow is finished with it.
+ ************************************************************/
+
+/* From the Arrow C data interface specification */
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+  const char* format;
+  const char* name;
+  const char* metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema** children;
+  struct ArrowSchema* dictionary;
+  void (*release)(struct ArrowSchema*);
+  void* private_data;
+};
+
+struct ArrowArray {
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void** buffers;
+  struct ArrowArray** children;
+  struct ArrowArray* dictionary;
+  void (*release)(struct ArrowArray*);
+  void* private_data;
+};
+
+#endif /* ARROW_C_DATA_INTERFACE */
+
+#define IDAM_ARROWCOLS 4  /* time, data, errl, errh */
+
+typedef struct {
+  char *format;
+  char *name;
+  char *metadata;
+  struct ArrowSchema *children[IDAM_ARROWCOLS];
+} idam_ArrowSchemaPrivate;
+
+typedef struct {
+  const void *buffers[2];
+  struct ArrowArray *children[IDAM_ARROWCOLS];
+  PyObject *owner;  /* NumPy array holding the values */
+} idam_ArrowArrayPrivate;
+
+/* Release a schema and its children */
+static void
+Arrow_releaseSchema(struct ArrowSchema *schema)
+{
+  idam_ArrowSchemaPrivate *p = (idam_ArrowSchemaPrivate*) schema->private_data;
+  int i;
+  
+  for(i=0;i<schema->n_children;i++) {
+    if(p->children[i]->release)
+      p->children[i]->release(p->children[i]);
+    free(p->children[i]);
+  }
+  free(p->format);
+  free(p->name);
+  free(p->metadata);
+  free(p);
+  schema->release = NULL;
+}
+
+/* Release an array and its children. May be called from any
+   thread, with or without the GIL */
+static void
+Arrow_releaseArray(struct ArrowArray *array)
+{
+  idam_ArrowArrayPrivate *p = (idam_ArrowArrayPrivate*) array->private_data;
+  PyGILState_STATE state;
+  int i;
+  
+  for(i=0;i<array->n_children;i++) {
+    if(p->children[i]->release)
+      p->children[i]->release(p->children[i]);
+    free(p->children[i]);
+  }
+  if(p->owner) {
+    state = PyGILState_Ensure();
+    Py_DECREF(p->owner);
+    PyGILState_Release(state);
+  }
+  free(p);
+  array->release = NULL;
+}
+
+/* Set up a schema. Takes the metadata, which can be NULL */
+static int
+Arrow_schema(struct ArrowSchema *schema, const char *format, const char *name, char *metadata)
+{
+  idam_ArrowSchemaPrivate *p;
+  
+  memset(schema, 0, sizeof(struct ArrowSchema));
+  p = (idam_ArrowSchemaPrivate*) calloc(1, sizeof(idam_ArrowSchemaPrivate));
+  if(p == NULL) {
+    free(metadata);
+    return -1;
+  }
+  p->format = copyString(format);
+  p->name = copyString(name);
+  p->metadata = metadata;
+  
+  schema->format = p->format;
+  schema->name = p->name;
+  schema->metadata = metadata;
+  schema->children = p->children;
+  schema->release = Arrow_releaseSchema;
+  schema->private_data = p;
+  
+  if(!p->format || !p->name) {
+    Arrow_releaseSchema(schema);
+    return -1;
+  }
+  return 0;
+}
+
+/* Add a child to a schema, returning it or NULL */
+static struct ArrowSchema *
+Arrow_schemaChild(struct ArrowSchema *schema, const char *format, const char *name, char *metadata)
+{
+  struct ArrowSchema *child = (struct ArrowSchema*) malloc(sizeof(struct ArrowSchema));
+  
+  if((child == NULL) || (Arrow_schema(child, format, name, metadata) < 0)) {
+    free(child);
+    return NULL;
+  }
+  schema->children[schema->n_children++] = child;
+  return child;
+}
+
+/* Set up an array. values is NULL for a struct or list, which
+   have only a validity buffer. Takes a reference to owner */
+static int
+Arrow_array(struct ArrowArray *array, int64_t length, const void *values, PyObject *owner)
+{
+  idam_ArrowArrayPrivate *p;
+  
+  memset(array, 0, sizeof(struct ArrowArray));
+  p = (idam_ArrowArrayPrivate*) calloc(1, sizeof(idam_ArrowArrayPrivate));
+  if(p == NULL)
+    return -1;
+  p->buffers[1] = values;
+  Py_XINCREF(owner);
+  p->owner = owner;
+  
+  array->length = length;
+  array->n_buffers = values ? 2 : 1; /* No nulls, so no validity buffer */
+  array->buffers = p->buffers;
+  array->children = p->children;
+  array->release = Arrow_releaseArray;
+  array->private_data = p;
+  return 0;
+}
+
+static struct ArrowArray *
+Arrow_arrayChild(struct ArrowArray *array, int64_t length, const void *values, PyObject *owner)
+{
+  struct ArrowArray *child = (struct ArrowArray*) malloc(sizeof(struct ArrowArray));
+  
+  if((child == NULL) || (Arrow_array(child, length, values, owner) < 0)) {
+    free(child);
+    return NULL;
+  }
+  array->children[array->n_children++] = child;
+  return child;
+}
+
+/* Arrow format string for a NumPy array, or NULL if none */
+static const char *
+arrowFormat(PyArrayObject *arr)
+{
+  static const char *sints[] = {NULL, "c", "s", NULL, "i", NULL, NULL, NULL, "l"};
+  static const char *uints[] = {NULL, "C", "S", NULL, "I", NULL, NULL, NULL, "L"};
+  int size = PyArray_ITEMSIZE(arr);
+  
+  switch(PyArray_TYPE(arr)) {
+  case NPY_FLOAT:  return "f";
+  case NPY_DOUBLE: return "g";
+  case NPY_BYTE: case NPY_SHORT: case NPY_INT: case NPY_LONG: case NPY_LONGLONG:
+    return (size <= 8) ? sints[size] : NULL;
+  case NPY_UBYTE: case NPY_USHORT: case NPY_UINT: case NPY_ULONG: case NPY_ULONGLONG:
+    return (size <= 8) ? uints[size] : NULL;
+  }
+  return NULL;
+}
+
+/* Encode key/value pairs as Arrow metadata. Empty or NULL values
+   are left out. Returns NULL if there are none, or out of memory */
+static char *
+arrowMetadata(const char **keys, const char **values, int n)
+{
+  int32_t count = 0, len;
+  size_t size = 4;
+  char *meta, *p;
+  int i;
+  
+  for(i=0;i<n;i++) {
+    if(values[i] && *values[i]) {
+      size += 8 + strlen(keys[i]) + strlen(values[i]);
+      count++;
+    }
+  }
+  if((count == 0) || ((meta = (char*) malloc(size)) == NULL))
+    return NULL;
+  
+  memcpy(meta, &count, 4);
+  p = meta + 4;
+  for(i=0;i<n;i++) {
+    if(!values[i] || !*values[i])
+      continue;
+    len = strlen(keys[i]);
+    memcpy(p, &len, 4);
+    memcpy(p + 4, keys[i], len);
+    p += 4 + len;
+    len = strlen(values[i]);
+    memcpy(p, &len, 4);
+    memcpy(p + 4, values[i], len);
+    p += 4 + len;
+  }
+  return meta;
+}
+
+/* A string member as UTF-8, or NULL */
+static const char *
+memberChars(PyObject *obj)
+{
+  const char *s;
+  
+  if((obj == NULL) || (obj == Py_None))
+    return NULL;
+  if((s = StringToChars(obj)) == NULL)
+    PyErr_Clear();
+  return s;
+}
+
+/* One column of the record batch */
+typedef struct {
+  const char *name;
+  PyArrayObject *arr;
+  const char *format;
+  const char *label;
+  const char *units;
+} idam_ArrowColumn;
+
+/* Get the columns of a Data object. The arrays are new references.
+   Returns the number of columns, and the number of times in *n,
+   or -1 with an exception set */
+static int
+Arrow_columns(idam_Data *self, idam_ArrowColumn *cols, npy_intp *n)
+{
+  static const char *names[] = {"time", "data", "errl", "errh"};
+  PyObject *obj;
+  PyArrayObject *arr, *data = NULL;
+  idam_Dimension *tdim = NULL;
+  int i, ncols = 0;
+  
+  memset(cols, 0, IDAM_ARROWCOLS*sizeof(idam_ArrowColumn));
+  
+  if(PyList_Check(self->dim) && (self->order >= 0) && (self->order < PyList_GET_SIZE(self->dim)))
+    tdim = (idam_Dimension*) PyList_GET_ITEM(self->dim, self->order);
+  
+  for(i=0;i<IDAM_ARROWCOLS;i++) {
+    /* Through the getters, in case the arrays are lazy */
+    if((obj = PyObject_GetAttrString((PyObject*) self, names[i])) == NULL)
+      goto fail;
+    if(obj == Py_None) {
+      Py_DECREF(obj);
+      if(i == 1) {
+        PyErr_SetString(PyExc_ValueError, "No data to export");
+        goto fail;
+      }
+      continue;
+    }
+    arr = (PyArrayObject*) PyArray_FROM_OF(obj, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_NOTSWAPPED);
+    Py_DECREF(obj);
+    if(arr == NULL)
+      goto fail;
+    
+    cols[ncols].name = names[i];
+    cols[ncols].arr = arr;
+    if((cols[ncols].format = arrowFormat(arr)) == NULL) {
+      PyErr_Format(PyExc_ValueError, "Can't export %s of this type to Arrow", names[i]);
+      ncols++;
+      goto fail;
+    }
+    if(i == 0) {
+      if(tdim) {
+        cols[ncols].label = memberChars(tdim->label);
+        cols[ncols].units = memberChars(tdim->units);
+      }
+    }else {
+      cols[ncols].label = memberChars(self->label);
+      cols[ncols].units = memberChars(self->units);
+      if(i == 1)
+        data = arr;
+    }
+    ncols++;
+  }
+  
+  if((PyArray_NDIM(data) < 1) || ((PyArray_NDIM(data) > 1) && (self->order != 0))) {
+    PyErr_SetString(PyExc_ValueError, "Time must be the first dimension to export to Arrow");
+    goto fail;
+  }
+  *n = PyArray_DIM(data, 0);
+  
+  for(i=0;i<ncols;i++) {
+    arr = cols[i].arr;
+    if((cols[i].name == names[0]) ?
+       ((PyArray_NDIM(arr) != 1) || (PyArray_DIM(arr, 0) != *n)) :
+       (PyArray_SIZE(arr) != PyArray_SIZE(data)) || (PyArray_DIM(arr, 0) != *n)) {
+      PyErr_Format(PyExc_ValueError, "%s and data are different sizes", cols[i].name);
+      goto fail;
+    }
+  }
+  return ncols;
+  
+ fail:
+  for(i=0;i<ncols;i++)
+    Py_DECREF(cols[i].arr);
+  return -1;
+}
+
+/* Export a Data object. Either schema or array can be NULL.
+   Returns 0, or -1 with an exception set */
+static int
+Arrow_export(idam_Data *self, struct ArrowSchema *schema, struct ArrowArray *array)
+{
+  idam_ArrowColumn cols[IDAM_ARROWCOLS];
+  const char *keys[3] = {"name", "source", "desc"};
+  const char *values[3];
+  char listformat[32];
+  struct ArrowSchema *s;
+  struct ArrowArray *a;
+  npy_intp n, width;
+  int i, ncols;
+  
+  if(schema)
+    schema->release = NULL;
+  if(array)
+    array->release = NULL;
+  
+  if((ncols = Arrow_columns(self, cols, &n)) < 0)
+    return -1;
+  
+  if(schema) {
+    values[0] = memberChars(self->name);
+    values[1] = memberChars(self->source);
+    values[2] = memberChars(self->desc);
+    if(Arrow_schema(schema, "+s", "", arrowMetadata(keys, values, 3)) < 0)
+      goto nomem;
+  }
+  if(array && (Arrow_array(array, n, NULL, NULL) < 0))
+    goto nomem;
+  
+  keys[0] = "label";
+  keys[1] = "units";
+  for(i=0;i<ncols;i++) {
+    width = (n > 0) ? PyArray_SIZE(cols[i].arr) / n : 1;
+    
+    if(schema) {
+      values[0] = cols[i].label;
+      values[1] = cols[i].units;
+      if(PyArray_NDIM(cols[i].arr) == 1)
+        s = Arrow_schemaChild(schema, cols[i].format, cols[i].name, arrowMetadata(keys, values, 2));
+      else {
+        sprintf(listformat, "+w:%ld", (long) width);
+        s = Arrow_schemaChild(schema, listformat, cols[i].name, arrowMetadata(keys, values, 2));
+        if(s)
+          s = Arrow_schemaChild(s, cols[i].format, "item", NULL);
+      }
+      if(s == NULL)
+        goto nomem;
+    }
+    if(array) {
+      if(PyArray_NDIM(cols[i].arr) == 1)
+        a = Arrow_arrayChild(array, n, PyArray_DATA(cols[i].arr), (PyObject*) cols[i].arr);
+      else {
+        a = Arrow_arrayChild(array, n, NULL, NULL);
+        if(a)
+          a = Arrow_arrayChild(a, n*width, PyArray_DATA(cols[i].arr), (PyObject*) cols[i].arr);
+      }
+      if(a == NULL)
+        goto nomem;
+    }
+  }
+  
+  for(i=0;i<ncols;i++)
+    Py_DECREF(cols[i].arr);
+  return 0;
+  
+ nomem:
+  if(schema && schema->release)
+    schema->release(schema);
+  if(array && array->release)
+    array->release(array);
+  for(i=0;i<ncols;i++)
+    Py_DECREF(cols[i].arr);
+  PyErr_NoMemory();
+  return -1;
+}
+
+static void
+Arrow_schemaCapsule(PyObject *capsule)
+{
+  struct ArrowSchema *schema = (struct ArrowSchema*) PyCapsule_GetPointer(capsule, "arrow_schema");
+  if(schema->release)
+    schema->release(schema);
+  free(schema);
+}
+
+static void
+Arrow_arrayCapsule(PyObject *capsule)
+{
+  struct ArrowArray *array = (struct ArrowArray*) PyCapsule_GetPointer(capsule, "arrow_array");
+  if(array->release)
+    array->release(array);
+  free(array);
+}
+
+/* Export as a pair of capsules, either of which can be skipped */
+static PyObject *
+Arrow_capsules(idam_Data *self, int wantschema, int wantarray)
+{
+  struct ArrowSchema *schema = NULL;
+  struct ArrowArray *array = NULL;
+  PyObject *sc = NULL, *ac = NULL, *result;
+  
+  if((wantschema && ((schema = (struct ArrowSchema*) malloc(sizeof(struct ArrowSchema))) == NULL)) ||
+     (wantarray && ((array = (struct ArrowArray*) malloc(sizeof(struct ArrowArray))) == NULL))) {
+    free(schema);
+    return PyErr_NoMemory();
+  }
+  if(Arrow_export(self, schema, array) < 0) {
+    free(schema);
+    free(array);
+    return NULL;
+  }
+  
+  /* The capsules own the structures from here */
+  if(schema && ((sc = PyCapsule_New(schema, "arrow_schema", Arrow_schemaCapsule)) == NULL)) {
+    schema->release(schema);
+    free(schema);
+  }
+  if(array && ((ac = PyCapsule_New(array, "arrow_array", Arrow_arrayCapsule)) == NULL)) {
+    array->release(array);
+    free(array);
+  }
+  if((schema && !sc) || (array && !ac)) {
+    Py_XDECREF(sc);
+    Py_XDECREF(ac);
+    return NULL;
+  }
+  
+  if(!array)
+    return sc;
+  result = PyTuple_Pack(2, sc, ac);
+  Py_DECREF(sc);
+  Py_DECREF(ac);
+  return result;
+}
+
+static PyObject *
+Data_arrowSchema(idam_Data *self, PyObject *args)
+{
+  return Arrow_capsules(self, 1, 0);
+}
+
+static PyObject *
+Data_arrowArray(idam_Data *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *requested = NULL;
+  
+  static char *kwlist[] = {"requested_schema", NULL};
+  
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &requested))
+    return NULL;
+  /* The requested schema is only a hint, so is ignored */
+  return Arrow_capsules(self, 1, 1);
+}
+
+/* Make a pyarrow RecordBatch from a Data object */
+static PyObject *
+Data_toArrow(idam_Data *self, PyObject *args)
+{
+  PyObject *pyarrow, *result;
+  
+  if((pyarrow = PyImport_ImportModule("pyarrow")) == NULL)
+    return NULL;
+  result = PyObject_CallMethod(pyarrow, "record_batch", "O", (PyObject*) self);
+  Py_DECREF(pyarrow);
+  return result;
+}
+
+/* RecordBatches for a list of Data objects, e.g. from fetchMany().
+   Exceptions in the list are passed through */
+static PyObject *
+idam_toArrow(PyObject *self, PyObject *args)
+{
+  PyObject *datas, *seq, *pyarrow, *result, *item, *batch;
+  Py_ssize_t i, n;
+  
+  if(!PyArg_ParseTuple(args, "O", &datas))
+    return NULL;
+  if((seq = PySequence_Fast(datas, "to_arrow() needs a list of Data objects")) == NULL)
+    return NULL;
+  if((pyarrow = PyImport_ImportModule("pyarrow")) == NULL) {
+    Py_DECREF(seq);
+    return NULL;
+  }
+  
+  n = PySequence_Fast_GET_SIZE(seq);
+  if((result = PyList_New(n)) == NULL)
+    goto done;
+  for(i=0;i<n;i++) {
+    item = PySequence_Fast_GET_ITEM(seq, i);
+    if(PyExceptionInstance_Check(item)) {
+      Py_INCREF(item);
+      batch = item;
+    }else if(PyObject_TypeCheck(item, &idam_DataType))
+      batch = PyObject_CallMethod(pyarrow, "record_batch", "O", item);
+    else {
+      PyErr_SetString(PyExc_TypeError, "to_arrow() needs a list of Data objects");
+      batch = NULL;
+    }
+    if(batch == NULL) {
+      Py_CLEAR(result);
+      break;
+    }
+    PyList_SET_ITEM(result, i, batch);
+  }
+  
+ done:
+  Py_DECREF(pyarrow);
+  Py_DECREF(seq);
+  return result;
+}
+
+/************************************************************
+ * Pickling
+ *
+ * Data read from shared memory pickle as the segment name, so
+ * multiprocessing workers on the same host map the segment
+ * rather than receive a copy of the arrays.
+ ************************************************************/
+
+/* Make a Data object from a shared memory segment. Used when
+   unpickling, so arguments are as given by Data_reduce */
+static PyObject *
+idam_attachShared(PyObject *self, PyObject *args)
+{
+  const char *segment;
+  PyObject *name, *source;
+  idam_Options opt = IDAM_OPTIONS_INIT;
+  idam_Signal sig;
+  idam_Data *d;
+  int ret;
+  
+  if(!PyArg_ParseTuple(args, "sOOi", &segment, &name, &source, &opt.native))
+    return NULL;
+  
+  Py_BEGIN_ALLOW_THREADS
+  ret = Shm_map(segment, NULL, &sig);
+  Py_END_ALLOW_THREADS
+  if(ret < 0) {
+    PyErr_Format(PyExc_RuntimeError, "Could not map shared memory segment '%s'", segment);
+    return NULL;
+  }
+  
+  if((d = (idam_Data*) Data_new(&idam_DataType, NULL, NULL)) != NULL) {
+    Py_INCREF(name);
+    setMember(&d->name, name);
+    Py_INCREF(source);
+    setMember(&d->source, source);
+    if(Data_setSignal(d, &sig, &opt) < 0)
+      Py_CLEAR(d);
+  }
+  
+  /* Arrays share the segment, so there is nothing to convert */
+  Py_BEGIN_ALLOW_THREADS
+  if(d != NULL)
+    Signal_fill(&sig);
+  Signal_clear(&sig);
+  Py_END_ALLOW_THREADS
+  Py_XDECREF(sig.owner);
+  
+  return (PyObject*) d;
+}
+
+/* Pickle as the shared memory segment holding the arrays, which
+   is pinned so that it outlives the arrays here. The segment is
+   mapped privately, so changes made to the arrays in place are
+   not pickled */
+static PyObject *
+Data_reduce(idam_Data *self, PyObject *args)
+{
+  PyObject *base = self->handle, *module, *attach;
+  idam_Handle *h;
+  
+  if((base == NULL) && (self->data != NULL) && PyArray_Check(self->data))
+    base = PyArray_BASE((PyArrayObject*) self->data);
+  if((base == NULL) || !PyObject_TypeCheck(base, &idam_HandleType) ||
+     (((idam_Handle*) base)->sig.shm == NULL)) {
+    PyErr_SetString(PyExc_TypeError, "Only Data read from shared memory can be pickled. "
+                    "See idam.setSharedMemory()");
+    return NULL;
+  }
+  h = (idam_Handle*) base;
+  if(Shm_pin(h->sig.shm) < 0) {
+    PyErr_Format(PyExc_RuntimeError, "Shared memory segment '%s' has been removed", h->sig.shm);
+    return NULL;
+  }
+  
+  if((module = PyImport_ImportModule("idam")) == NULL)
+    return NULL;
+  attach = PyObject_GetAttrString(module, "_attachShared");
+  Py_DECREF(module);
+  if(attach == NULL)
+    return NULL;
+  return Py_BuildValue("N(sOOi)", attach, h->sig.shm, self->name, self->source, h->opt.native);
+}
+
+/* Methods */
+static PyMethodDef idam_DataMethods[] = {
+  {"decimate", (PyCFunction) Data_decimate, METH_VARARGS | METH_KEYWORDS,
+   "decimate(npoints, method='minmax')\n"
+   "Return a copy with at most npoints points, for plotting.\n"
+   "method is 'minmax' (smallest and largest in each interval),\n"
+   "'mean' or 'lttb' (Largest-Triangle-Three-Buckets). 1D data only"},
+  {"to_arrow", (PyCFunction) Data_toArrow, METH_NOARGS,
+   "Return a pyarrow RecordBatch with columns time, data, errl and errh,\n"
+   "sharing memory with the arrays. Labels and units are field metadata"},
+  {"__arrow_c_schema__", (PyCFunction) Data_arrowSchema, METH_NOARGS,
+   "Arrow PyCapsule interface: export the schema"},
+  {"__arrow_c_array__", (PyCFunction) Data_arrowArray, METH_VARARGS | METH_KEYWORDS,
+   "Arrow PyCapsule interface: export the schema and a struct array,\n"
+   "without copying"},
+  {"__reduce__", (PyCFunction) Data_reduce, METH_NOARGS,
+   "Pickle as the name of the shared memory segment holding the arrays.\n"
+   "Only Data read with idam.setSharedMemory() on can be pickled"},
+  {NULL}  /* Sentinel */
+};
+
+static PyTypeObject idam_DataType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+    "idam.Data",               /*tp_name*/
+    sizeof(idam_Data),         /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)Data_dealloc,  /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "IDAM data objects",       /* tp_doc */
+    0,		               /* tp_traverse */
+    0,		               /* tp_clear */
+    0,		               /* tp_richcompare */
+    0,		               /* tp_weaklistoffset */
+    0,		               /* tp_iter */
+    0,		               /* tp_iternext */
+    idam_DataMethods,          /* tp_methods */
+    idam_DataMembers,          /* tp_members */
+    idam_DataGetSet,           /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)Data_init,       /* tp_init */
+    0,                         /* tp_alloc */
+    Data_new,                  /* tp_new */
+};
+
+/************************************************************
+ * Signal descriptions
+ *
+ * describe() returns the labels, sizes and types of a signal
+ * without creating any arrays. libidam can't ask the server
+ * for these alone, so the signal is still read (or mapped from
+ * the disk cache), but nothing is converted or copied, and the
+ * handle is freed straight away.
+ ************************************************************/
+
+/* The dtype which dtype="native" would give, or None for no values */
+static PyObject *
+describeType(const char *raw, int type)
+{
+  if(type == TYPE_UNKNOWN) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  return (PyObject*) PyArray_DescrFromType(arrayType(raw, type, 1));
+}
+
+/* A dict describing a signal snapshot, with sizes and dimensions
+   in NumPy order. Needs the GIL */
+static PyObject *
+Signal_describe(const idam_Signal *sig, const char *name, PyObject *source)
+{
+  PyObject *shape, *dims, *item;
+  const idam_SignalDim *d;
+  int i;
+  
+  shape = PyTuple_New(sig->rank);
+  dims = PyList_New(sig->rank);
+  if((shape == NULL) || (dims == NULL))
+    goto fail;
+  
+  for(i=0;i<sig->rank;i++) {
+    d = &sig->dim[i];
+    item = Py_BuildValue("{s:s,s:s,s:n,s:N,s:N}",
+                         "label", d->label,
+                         "units", d->units,
+                         "size", (Py_ssize_t) sig->dimsize[i],
+                         "dtype", describeType(d->raw, d->type),
+                         "errors", describeType(d->rawerrl, d->errtype));
+    if(item == NULL)
+      goto fail;
+    PyList_SET_ITEM(dims, i, item);
+    PyTuple_SET_ITEM(shape, i, Py_BuildValue("n", (Py_ssize_t) sig->dimsize[i]));
+    if(PyTuple_GET_ITEM(shape, i) == NULL)
+      goto fail;
+  }
+  
+  return Py_BuildValue("{s:s,s:O,s:s,s:s,s:s,s:i,s:N,s:i,s:N,s:N,s:N,s:N}",
+                       "name", name,
+                       "source", source,
+                       "label", sig->label,
+                       "units", sig->units,
+                       "desc", sig->desc,
+                       "rank", sig->rank,
+                       "shape", shape,
+                       "order", sig->order,
+                       "dtype", describeType(sig->raw, sig->type),
+                       "errors", describeType(sig->rawerrl, sig->errtype),
+                       "asymmetric", PyBool_FromLong(sig->errasym && (sig->errtype != TYPE_UNKNOWN)),
+                       "dim", dims);
+ fail:
+  Py_XDECREF(shape);
+  Py_XDECREF(dims);
+  return NULL;
+}
+
+/************************************************************
+ * Batch reads
+ *
+ * fetchMany() shares a list of requests between a few worker
+ * threads. While one worker is waiting on the server, the
+ * others are creating Python objects or converting arrays.
+ ************************************************************/
+
+typedef struct {
+  const char *name;    /* Refers to a string in the request list */
+  PyObject *source;    /* Source as a string */
+  const char *source_chars;
+  idam_CacheEntry cache;
+  idam_MemEntry *mem;  /* Memory cache entry to store the result in */
+  idam_Signal sig;
+  int ok;              /* Set if result is a Data object */
+  PyObject *result;    /* Data object, or exception if the read failed */
+} idam_Job;
+
+typedef struct {
+  idam_Job *jobs;
+  Py_ssize_t njobs;
+  Py_ssize_t next;     /* Next job to start */
+  int running;         /* Number of workers still going */
+  idam_Server srv;
+  idam_Options opt;
+  PyThread_type_lock lock; /* Protects next and running */
+  PyThread_type_lock done; /* Released when running reaches 0 */
+} idam_Batch;
+
+/* Turn a job into a Data object (or with opt->describe, a
+   description), or the exception which prevented it. Needs the GIL */
+static PyObject *
+Job_result(idam_Job *job, const idam_Options *opt)
+{
+  idam_Data *d;
+  PyObject *desc;
+  PyObject *type, *value, *tb;
+  
+  if(job->sig.error)
+    return PyObject_CallFunction(PyExc_RuntimeError, "s", job->sig.error);
+  
+  if(opt->describe) {
+    if((desc = Signal_describe(&job->sig, job->name, job->source)) != NULL) {
+      job->ok = 1;
+      return desc;
+    }
+  }else if((d = (idam_Data*) Data_new(&idam_DataType, NULL, NULL)) != NULL) {
+    Py_INCREF(job->source);
+    if((setMember(&d->name, CharsToString(job->name)) == 0) &&
+       (setMember(&d->source, job->source) == 0) &&
+       (Data_setSignal(d, &job->sig, opt) == 0)) {
+      job->ok = 1;
+      return (PyObject*) d;
+    }
+    Py_DECREF(d);
+  }
+  
+  /* Return the exception rather than raising it */
+  PyErr_Fetch(&type, &value, &tb);
+  PyErr_NormalizeException(&type, &value, &tb);
+  Py_XDECREF(type);
+  Py_XDECREF(tb);
+  return value;
+}
+
+/* Look up a job in the memory cache. Sets job->result if found,
+   or job->mem if the result should be stored. Needs the GIL */
+static int
+Job_memcache(idam_Job *job, const idam_Server *srv, const idam_Options *opt)
+{
+  char *key_chars;
+  PyObject *key;
+  idam_MemEntry *e;
+  idam_Data *d;
+  int ret = 0;
+  
+  key_chars = requestKey(job->name, job->source_chars, srv, opt);
+  if(key_chars == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  key = CharsToString(key_chars);
+  free(key_chars);
+  if(key == NULL)
+    return -1;
+  
+  e = MemCache_find(key);
+  if(e == NULL) {
+    idam_memmisses++;
+    if((job->mem = MemCache_start(key)) == NULL)
+      ret = -1;
+  }else if(e->data) {
+    d = (idam_Data*) Data_new(&idam_DataType, NULL, NULL);
+    if((d == NULL) || (Data_copy(d, (idam_Data*) e->data) < 0)) {
+      Py_XDECREF(d);
+      ret = -1;
+    }else {
+      job->result = (PyObject*) d;
+      MemCache_touch(e);
+      idam_memhits++;
+    }
+  }
+  /* Otherwise being read by another thread. Waiting here could
+     deadlock if it's this batch, so just read it again */
+  
+  Py_DECREF(key);
+  return ret;
+}
+
+/* Read a job, setting job->result. Call with the GIL released */
+static void
+Job_run(idam_Job *job, const idam_Server *srv, const idam_Options *opt)
+{
+  PyGILState_STATE gstate;
+  double start = idam_now(), t;
+  
+  Signal_get(&job->sig, &job->cache, job->name, job->source_chars, srv, opt);
+  
+  gstate = PyGILState_Ensure();
+  t = idam_now();
+  job->result = Job_result(job, opt);
+  Stats_phase(IDAM_PHASE_OBJECTS, t, job->name);
+  PyGILState_Release(gstate);
+  
+  if(job->ok && !opt->describe)
+    Signal_finish(&job->sig, &job->cache, job->name);
+  Signal_clear(&job->sig);
+  
+  Stats_add(job->ok ? &idam_requests : &idam_failures, 1);
+  Stats_phase(IDAM_PHASE_TOTAL, start, job->name);
+  
+  if(job->sig.owner || job->mem) {
+    gstate = PyGILState_Ensure();
+    Py_CLEAR(job->sig.owner);
+    if(job->mem) {
+      MemCache_finish(job->mem, job->ok ? (idam_Data*) job->result : NULL);
+      job->mem = NULL;
+    }
+    PyGILState_Release(gstate);
+  }
+}
+
+/* Run jobs until there are none left. Call with the GIL released */
+static void
+Batch_worker(void *arg)
+{
+  idam_Batch *batch = (idam_Batch*) arg;
+  idam_Job *job;
+  Py_ssize_t i;
+  int last;
+  
+  while(1) {
+    PyThread_acquire_lock(batch->lock, WAIT_LOCK);
+    i = batch->next;
+    if(i < batch->njobs)
+      batch->next++;
+    PyThread_release_lock(batch->lock);
+    
+    if(i >= batch->njobs)
+      break;
+    job = &batch->jobs[i];
+    if(job->result)
+      continue; /* From the memory cache */
+    
+    Job_run(job, &batch->srv, &batch->opt);
+  }
+  
+  PyThread_acquire_lock(batch->lock, WAIT_LOCK);
+  last = (--batch->running == 0);
+  PyThread_release_lock(batch->lock);
+  
+  if(last)
+    PyThread_release_lock(batch->done);
+}
+
+/* Read a list of (signal, source) requests with a few workers,
+   from the server given by base unless host or port are given.
+   Returns a list of results from Job_result. what names the
+   calling function in errors */
+static PyObject*
+Batch_run(PyObject *requests, const char *host, int port, int workers,
+          const idam_Options *opt, const idam_Server *base, const char *what)
+{
+  PyObject *seq, *item, *src;
+  PyObject *result = NULL;
+  idam_Batch batch;
+  Py_ssize_t i;
+  int started;
+  char msg[128];
+  
+  PyOS_snprintf(msg, sizeof(msg), "%s() needs a list of (signal, source) pairs", what);
+  
+  seq = PySequence_Fast(requests, msg);
+  if(seq == NULL)
+    return NULL;
+  
+  memset(&batch, 0, sizeof(idam_Batch));
+  batch.opt = *opt;
+  batch.njobs = PySequence_Fast_GET_SIZE(seq);
+  batch.jobs = (idam_Job*) calloc(batch.njobs + 1, sizeof(idam_Job));
+  if(batch.jobs == NULL) {
+    Py_DECREF(seq);
+    return PyErr_NoMemory();
+  }
+  
+  /* Check the requests before starting any reads */
+  for(i=0;i<batch.njobs;i++) {
+    item = PySequence_Fast_GET_ITEM(seq, i);
+    if(!PyTuple_Check(item) ||
+       !PyArg_ParseTuple(item, "sO", &batch.jobs[i].name, &src)) {
+      PyErr_SetString(PyExc_TypeError, msg);
+      goto cleanup;
+    }
+    batch.jobs[i].source = PyObject_Str(src);
+    if(batch.jobs[i].source == NULL)
+      goto cleanup;
+    batch.jobs[i].source_chars = StringToChars(batch.jobs[i].source);
+    if(batch.jobs[i].source_chars == NULL)
+      goto cleanup;
+    batch.jobs[i].sig.handle = -1;
+  }
+  
+  if(resolveServer(&batch.srv, base, host, port) < 0)
+    goto cleanup;
+  
+  for(i=0;i<batch.njobs;i++) {
+    if(Cache_entry(&batch.jobs[i].cache, batch.jobs[i].name, batch.jobs[i].source_chars,
+                   &batch.srv, opt) < 0)
+      goto cleanup;
+    if((idam_memmax > 0) && opt->cache && !opt->lazy && !opt->describe &&
+       (Job_memcache(&batch.jobs[i], &batch.srv, opt) < 0))
+      goto cleanup;
+  }
+  
+  if(workers > batch.njobs)
+    workers = (int) batch.njobs;
+  if(workers < 1)
+    workers = 1;
+  
+  batch.lock = PyThread_allocate_lock();
+  batch.done = PyThread_allocate_lock();
+  if((batch.lock == NULL) || (batch.done == NULL)) {
+    PyErr_SetString(PyExc_RuntimeError, "Could not allocate lock");
+    goto cleanup;
+  }
+  PyThread_acquire_lock(batch.done, WAIT_LOCK);
+  
+  batch.running = workers;
+  
+  Py_BEGIN_ALLOW_THREADS
+  for(started=1;started<workers;started++) {
+    if((long) PyThread_start_new_thread(Batch_worker, &batch) == -1) {
+      /* Carry on with fewer workers */
+      PyThread_acquire_lock(batch.lock, WAIT_LOCK);
+      batch.running -= workers - started;
+      PyThread_release_lock(batch.lock);
+      break;
+    }
+  }
+  /* This thread does its share too */
+  Batch_worker(&batch);
+  PyThread_acquire_lock(batch.done, WAIT_LOCK);
+  Py_END_ALLOW_THREADS
+  
+  /* Collect results in the order requested */
+  result = PyList_New(batch.njobs);
+  if(result == NULL)
+    goto cleanup;
+  for(i=0;i<batch.njobs;i++) {
+    if(batch.jobs[i].result == NULL) {
+      Py_INCREF(Py_None);
+      batch.jobs[i].result = Py_None;
+    }
+    PyList_SET_ITEM(result, i, batch.jobs[i].result);
+    batch.jobs[i].result = NULL;
+  }
+  
+ cleanup:
+  for(i=0;i<batch.njobs;i++) {
+    Py_XDECREF(batch.jobs[i].source);
+    Py_XDECREF(batch.jobs[i].result);
+    Cache_free(&batch.jobs[i].cache);
+    if(batch.jobs[i].mem)
+      MemCache_finish(batch.jobs[i].mem, NULL); /* Not read */
+  }
+  free(batch.jobs);
+  if(batch.lock)
+    PyThread_free_lock(batch.lock);
+  if(batch.done)
+    PyThread_free_lock(batch.done);
+  Py_DECREF(seq);
+  
+  return result;
+}
+
+/* Read a list of signals from the server given by base,
+   unless the host or port keywords are given */
+static PyObject*
+fetchMany(PyObject *args, PyObject *kwds, const idam_Server *base)
+{
+  PyObject *requests;
+  const char *host = NULL;
+  int port = -1, workers = 4;
+  const char *dtype = NULL;
+  Py_ssize_t decimate = 0;
+  const char *method = NULL;
+  idam_Options opt = IDAM_OPTIONS_INIT;
+  double scale = 1.0, offset = 0.0;
+  const char *units = NULL;
+  PyObject *baseline = Py_None, *valid = Py_None;
+  
+  static char *kwlist[] = {"requests", "host", "port", "workers", "dtype", "copy",
+                           "errors", "lazy", "cache", "tmin", "tmax", "stride",
+                           "decimate", "method", "scale", "offset", "units",
+                           "baseline", "valid", NULL};
+  
+  if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|siiziiiiddinzddzOO", kwlist,
+                                    &requests, &host, &port, &workers, &dtype, &opt.copy,
+                                    &opt.errors, &opt.lazy, &opt.cache,
+                                    &opt.tmin, &opt.tmax, &opt.stride,
+                                    &decimate, &method,
+                                    &scale, &offset, &units, &baseline, &valid))
+    return NULL;
+  
+  if((parseOptions(&opt, dtype, decimate, method) < 0) ||
+     (parseTransform(&opt, scale, offset, units, baseline, valid) < 0))
+    return NULL;
+  
+  return Batch_run(requests, host, port, workers, &opt, base, "fetchMany");
+}
+
+static PyObject*
+idam_fetchMany(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  idam_Server srv;
+  
+  defaultServer(&srv);
+  return fetchMany(args, kwds, &srv);
+}
+
+/* Describe a list of signals on the server given by base, unless
+   the host or port keywords are given */
+static PyObject*
+describeMany(PyObject *args, PyObject *kwds, const idam_Server *base)
+{
+  PyObject *requests;
+  const char *host = NULL;
+  int port = -1, workers = 4;
+  idam_Options opt = IDAM_OPTIONS_INIT;
+  
+  static char *kwlist[] = {"requests", "host", "port", "workers", "errors", "cache", NULL};
+  
+  if (! PyArg_ParseTupleAndKeywords(args, kwds, "O|siiii", kwlist,
+                                    &requests, &host, &port, &workers,
+                                    &opt.errors, &opt.cache))
+    return NULL;
+  
+  opt.native = 1;  /* IDAM's types, and cache files that kept them */
+  opt.describe = 1;
+  opt.share = 0;   /* Nothing is kept, so nothing to share */
+  return Batch_run(requests, host, port, workers, &opt, base, "describeMany");
+}
+
+/* Describe one signal, raising an exception if it can't be read */
+static PyObject*
+describe(PyObject *args, PyObject *kwds, const idam_Server *base)
+{
+  const char *data, *host = NULL;
+  PyObject *source, *requests, *results, *result;
+  int port = -1;
+  idam_Options opt = IDAM_OPTIONS_INIT;
+  
+  static char *kwlist[] = {"signal", "source", "host", "port", "errors", "cache", NULL};
+  
+  if (! PyArg_ParseTupleAndKeywords(args, kwds, "sO|siii", kwlist,
+                                    &data, &source, &host, &port,
+                                    &opt.errors, &opt.cache))
+    return NULL;
+  
+  requests = Py_BuildValue("[(sO)]", data, source);
+  if(requests == NULL)
+    return NULL;
+  
+  opt.native = 1;
+  opt.describe = 1;
+  opt.share = 0;
+  results = Batch_run(requests, host, port, 1, &opt, base, "describe");
+  Py_DECREF(requests);
+  if(results == NULL)
+    return NULL;
+  
+  result = PyList_GET_ITEM(results, 0);
+  Py_INCREF(result);
+  Py_DECREF(results);
+  
+  if(PyExceptionInstance_Check(result)) {
+    PyErr_SetObject((PyObject*) Py_TYPE(result), result);
+    Py_DECREF(result);
+    return NULL;
+  }
+  return result;
+}
+
+static PyObject*
+idam_describe(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  idam_Server srv;
+  
+  defaultServer(&srv);
+  return describe(args, kwds, &srv);
+}
+
+static PyObject*
+idam_describeMany(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  idam_Server srv;
+  
+  defaultServer(&srv);
+  return describeMany(args, kwds, &srv);
+}
+
+/************************************************************
+ * Asynchronous reads
+ *
+ * fetch() returns an asyncio future, and queues the read for
+ * a pool of at most idam_asyncmax worker threads. Threads are
+ * started when there is work and no spare worker, and exit
+ * when the queue is empty. The result is passed back to the
+ * event loop with call_soon_threadsafe.
+ ************************************************************/
+
+typedef struct idam_AsyncJob {
+  struct idam_AsyncJob *next;
+  idam_Job job;
+  char *name;              /* job.name points here */
+  idam_Server srv;
+  idam_Options opt;
+  PyObject *future;
+  PyObject *loop;
+  struct idam_Prefetch *prefetch; /* Set if a prefetch, not a fetch() */
+  struct idam_Call *call;         /* Set if a read with a timeout */
+} idam_AsyncJob;
+
+static PyThread_type_lock idam_asynclock = NULL; /* Protects the queue */
+static idam_AsyncJob *idam_asynchead = NULL, *idam_asynctail = NULL;
+static int idam_asyncrunning = 0; /* Worker threads */
+static int idam_asyncmax = 4;
+
+/* Complete a future, unless it has been cancelled. Called in
+   the event loop */
+static PyObject *
+idam_asyncSet(PyObject *self, PyObject *args)
+{
+  PyObject *future, *result, *done, *ret;
+  int ok;
+  
+  if(!PyArg_ParseTuple(args, "OOi", &future, &result, &ok))
+    return NULL;
+  
+  if((done = PyObject_CallMethod(future, "done", NULL)) == NULL)
+    return NULL;
+  ok = ok ? 1 : 0;
+  if(!PyObject_IsTrue(done)) {
+    ret = PyObject_CallMethod(future, ok ? "set_result" : "set_exception", "O", result);
+    if(ret == NULL) {
+      Py_DECREF(done);
+      return NULL;
+    }
+    Py_DECREF(ret);
+  }
+  Py_DECREF(done);
+  
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyMethodDef idam_asyncSetDef = {"_asyncSet", idam_asyncSet, METH_VARARGS, NULL};
+
+/* See Prefetching and Timeouts below */
+static void Prefetch_finish(struct idam_Prefetch *e, PyObject *result, int ok);
+static int Prefetch_cancelled(struct idam_Prefetch *e);
+static void Call_finish(struct idam_Call *c, idam_AsyncJob *a);
+static int Call_cancelled(struct idam_Call *c);
+
+static void
+AsyncJob_free(idam_AsyncJob *a)
+{
+  if(a->job.mem)
+    MemCache_finish(a->job.mem, NULL); /* Not read */
+  Py_XDECREF(a->job.source);
+  Py_XDECREF(a->job.result);
+  Cache_free(&a->job.cache);
+  Py_XDECREF(a->future);
+  Py_XDECREF(a->loop);
+  free(a->name);
+  free(a);
+}
+
+/* Make a job reading name from source (a string), not yet queued.
+   Returns NULL with an exception set on error. Needs the GIL */
+static idam_AsyncJob *
+AsyncJob_new(const char *name, PyObject *source, const idam_Server *srv,
+             const idam_Options *opt)
+{
+  idam_AsyncJob *a;
+  
+  if((a = (idam_AsyncJob*) calloc(1, sizeof(idam_AsyncJob))) == NULL) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  a->job.sig.handle = -1;
+  a->srv = *srv;
+  a->opt = *opt;
+  Py_INCREF(source);
+  a->job.source = source;
+  if((a->name = copyString(name)) == NULL) {
+    PyErr_NoMemory();
+    goto fail;
+  }
+  a->job.name = a->name;
+  if(((a->job.source_chars = StringToChars(source)) == NULL) ||
+     (Cache_entry(&a->job.cache, a->name, a->job.source_chars, srv, opt) < 0))
+    goto fail;
+  return a;
+  
+ fail:
+  AsyncJob_free(a);
+  return NULL;
+}
+
+/* Pass the result to the event loop. Needs the GIL */
+static void
+AsyncJob_finish(idam_AsyncJob *a)
+{
+  PyObject *set, *ret = NULL;
+  
+  if(a->prefetch) {
+    Prefetch_finish(a->prefetch, a->job.result, a->job.ok);
+    AsyncJob_free(a);
+    return;
+  }
+  if(a->call) {
+    Call_finish(a->call, a);
+    AsyncJob_free(a);
+    return;
+  }
+  
+  if(a->job.result == NULL) {
+    AsyncJob_free(a);
+    return;
+  }
+  
+  set = PyCFunction_New(&idam_asyncSetDef, NULL);
+  if(set != NULL)
+    ret = PyObject_CallMethod(a->loop, "call_soon_threadsafe", "OOOi",
+                              set, a->future, a->job.result, a->job.ok);
+  if(ret == NULL)
+    PyErr_Clear(); /* Loop closed, so nobody is waiting */
+  Py_XDECREF(ret);
+  Py_XDECREF(set);
+  AsyncJob_free(a);
+}
+
+/* Check if a future has been cancelled. Needs the GIL */
+static int
+futureCancelled(PyObject *future)
+{
+  PyObject *res = PyObject_CallMethod(future, "cancelled", NULL);
+  int cancelled = 0;
+  
+  if(res == NULL)
+    PyErr_Clear();
+  else {
+    cancelled = PyObject_IsTrue(res) > 0;
+    Py_DECREF(res);
+  }
+  return cancelled;
+}
+
+/* Run queued reads until there are none left */
+static void
+Async_worker(void *arg)
+{
+  idam_AsyncJob *a;
+  PyGILState_STATE gstate;
+  int cancelled;
+  
+  while(1) {
+    PyThread_acquire_lock(idam_asynclock, WAIT_LOCK);
+    a = idam_asynchead;
+    if(a == NULL) {
+      idam_asyncrunning--;
+      PyThread_release_lock(idam_asynclock);
+      break;
+    }
+    idam_asynchead = a->next;
+    if(idam_asynchead == NULL)
+      idam_asynctail = NULL;
+    PyThread_release_lock(idam_asynclock);
+    
+    /* Skip reads cancelled while queued. Once started, a read
+       can't be stopped, but its result is thrown away */
+    gstate = PyGILState_Ensure();
+    if(a->prefetch)
+      cancelled = Prefetch_cancelled(a->prefetch);
+    else if(a->call)
+      cancelled = Call_cancelled(a->call);
+    else
+      cancelled = futureCancelled(a->future);
+    PyGILState_Release(gstate);
+    
+    if(!cancelled)
+      Job_run(&a->job, &a->srv, &a->opt);
+    
+    gstate = PyGILState_Ensure();
+    AsyncJob_finish(a);
+    PyGILState_Release(gstate);
+  }
+}
+
+/* Add a job to the queue, starting a worker if needed. Needs the GIL */
+static int
+Async_queue(idam_AsyncJob *a)
+{
+  int start = 0;
+  
+  Py_BEGIN_ALLOW_THREADS
+  PyThread_acquire_lock(idam_asynclock, WAIT_LOCK);
+  if(idam_asynctail)
+    idam_asynctail->next = a;
+  else
+    idam_asynchead = a;
+  idam_asynctail = a;
+  if(idam_asyncrunning < idam_asyncmax) {
+    idam_asyncrunning++;
+    start = 1;
+  }
+  PyThread_release_lock(idam_asynclock);
+  
+  if(start && ((long) PyThread_start_new_thread(Async_worker, NULL) == -1)) {
+    PyThread_acquire_lock(idam_asynclock, WAIT_LOCK);
+    idam_asyncrunning--;
+    start = (idam_asyncrunning == 0) ? -1 : 0; /* Nobody to run it */
+    if(start < 0) {
+      /* Take it back off the queue */
+      idam_AsyncJob **p = &idam_asynchead, *prev = NULL;
+      while(*p != a) {
+        prev = *p;
+        p = &(*p)->next;
+      }
+      *p = a->next;
+      if(idam_asynctail == a)
+        idam_asynctail = prev;
+    }
+    PyThread_release_lock(idam_asynclock);
+  }
+  Py_END_ALLOW_THREADS
+  
+  if(start < 0) {
+    PyErr_SetString(PyExc_RuntimeError, "Could not start a thread");
+    return -1;
+  }
+  return 0;
+}
+
+/* Get the running event loop. Futures are only of use to await,
+   so without one this raises RuntimeError */
+static PyObject *
+eventLoop(void)
+{
+  PyObject *asyncio, *loop;
+  
+  if((asyncio = PyImport_ImportModule("asyncio")) == NULL)
+    return NULL;
+  loop = PyObject_CallMethod(asyncio, "get_running_loop", NULL);
+  Py_DECREF(asyncio);
+  if((loop == NULL) && PyErr_ExceptionMatches(PyExc_RuntimeError)) {
+    PyErr_Clear();
+    PyErr_SetString(PyExc_RuntimeError, "fetch() must be called from a running event loop");
+  }
+  return loop;
+}
+
+/* Start reading a signal from the server given by base,
+   unless the host or port keywords are given */
+static PyObject*
+fetchAsync(PyObject *args, PyObject *kwds, const idam_Server *base)
+{
+  const char *data;
+  PyObject *src;
+  const char *host = NULL;
+  int port = -1;
+  const char *dtype = NULL;
+  Py_ssize_t decimate = 0;
+  const char *method = NULL;
+  idam_Options opt = IDAM_OPTIONS_INIT;
+  double scale = 1.0, offset = 0.0;
+  const char *units = NULL;
+  PyObject *baseline = Py_None, *valid = Py_None;
+  idam_Server srv;
+  idam_AsyncJob *a;
+  PyObject *source, *future, *ret;
+  
+  static char *kwlist[] = {"data", "source", "host", "port", "dtype", "copy",
+                           "errors", "lazy", "cache", "tmin", "tmax", "stride",
+                           "decimate", "method", "scale", "offset", "units",
+                           "baseline", "valid", NULL};
+  
+  if (! PyArg_ParseTupleAndKeywords(args, kwds, "sO|siziiiiddinzddzOO", kwlist,
+                                    &data, &src, &host, &port, &dtype, &opt.copy,
+                                    &opt.errors, &opt.lazy, &opt.cache,
+                                    &opt.tmin, &opt.tmax, &opt.stride,
+                                    &decimate, &method,
+                                    &scale, &offset, &units, &baseline, &valid))
+    return NULL;
+  
+  if((parseOptions(&opt, dtype, decimate, method) < 0) ||
+     (parseTransform(&opt, scale, offset, units, baseline, valid) < 0))
+    return NULL;
+  
+  if((resolveServer(&srv, base, host, port) < 0) ||
+     ((source = PyObject_Str(src)) == NULL))
+    return NULL;
+  a = AsyncJob_new(data, source, &srv, &opt);
+  Py_DECREF(source);
+  if(a == NULL)
+    return NULL;
+  
+  if(((a->loop = eventLoop()) == NULL) ||
+     ((a->future = PyObject_CallMethod(a->loop, "create_future", NULL)) == NULL))
+    goto fail;
+  
+  if((idam_memmax > 0) && opt.cache && !opt.lazy &&
+     (Job_memcache(&a->job, &a->srv, &opt) < 0))
+    goto fail;
+  
+  future = a->future;
+  Py_INCREF(future);
+  
+  if(a->job.result) {
+    /* In the memory cache */
+    ret = PyObject_CallMethod(future, "set_result", "O", a->job.result);
+    Py_XDECREF(ret);
+    AsyncJob_free(a);
+    if(ret == NULL) {
+      Py_DECREF(future);
+      return NULL;
+    }
+    return future;
+  }
+  
+  if(Async_queue(a) < 0) {
+    Py_DECREF(future);
+    goto fail;
+  }
+  return future;
+  
+ fail:
+  AsyncJob_free(a);
+  return NULL;
+}
+
+static PyObject*
+idam_fetch(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  idam_Server srv;
+  
+  defaultServer(&srv);
+  return fetchAsync(args, kwds, &srv);
+}
+
+static PyObject*
+idam_setWorkers(PyObject *self, PyObject *args)
+{
+  int n;
+  
+  if(!PyArg_ParseTuple(args, "i", &n))
+    return NULL;
+  if(n < 1) {
+    PyErr_SetString(PyExc_ValueError, "Need at least one worker");
+    return NULL;
+  }
+  idam_asyncmax = n;
+  
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+/************************************************************
+ * Prefetching
+ *
+ * With setPrefetch(depth), each request whose source is a shot
+ * number is compared with the last request for the same signal,
+ * server and options. Once the shot has changed by the same step
+ * twice running, the next depth shots in the sequence are queued
+ * for the fetch() workers. Results are kept until they are asked
+ * for, up to a size limit. A request which breaks the sequence
+ * cancels the rest of its prefetches, and results thrown away
+ * unused are counted as wasted.
+ ************************************************************/
+
+#define IDAM_MAXPATTERNS 256 /* Sequences followed at once */
+#define IDAM_MAXPREFETCH 256 /* Prefetches buffered or being read */
+
+typedef struct idam_Prefetch {
+  PyObject *key;              /* requestKey of the read */
+  PyObject *pattern;          /* Sequence it belongs to */
+  long long shot;
+  PyObject *result;           /* Data object, once read */
+  long long nbytes;
+  int done;                   /* Set when the worker has finished */
+  int cancelled;
+  PyThread_type_lock ready;   /* Held until done */
+  int refs;                   /* Queued job, plus one if in table */
+} idam_Prefetch;
+
+static PyObject *idam_prefetchtable = NULL; /* Key -> capsule of entry */
+static PyObject *idam_patterns = NULL;      /* Sequence -> (shot, step) */
+static int idam_prefetchdepth = 0;          /* Zero if off */
+static long long idam_prefetchmax = 256LL << 20;
+static long long idam_prefetchbytes = 0;    /* Read, but not yet used */
+static long long idam_prefetchissued = 0, idam_prefetchhits = 0;
+static long long idam_prefetchmisses = 0, idam_prefetchcancelled = 0;
+static long long idam_prefetchfailed = 0, idam_prefetchwasted = 0;
+static long long idam_prefetchwastedbytes = 0;
+
+static long long
+arrayBytes(PyObject *obj)
+{
+  if((obj == NULL) || !PyArray_Check(obj))
+    return 0;
+  return PyArray_NBYTES((PyArrayObject*) obj);
+}
+
+/* Size of the arrays in a Data object */
+static long long
+dataBytes(idam_Data *d)
+{
+  idam_Dimension *dim;
+  long long n;
+  Py_ssize_t i;
+  
+  n = arrayBytes(d->data) + arrayBytes(d->errl);
+  if(d->errh != d->errl)
+    n += arrayBytes(d->errh);
+  for(i=0;PyList_Check(d->dim) && (i<PyList_GET_SIZE(d->dim));i++) {
+    dim = (idam_Dimension*) PyList_GET_ITEM(d->dim, i);
+    n += arrayBytes(dim->data) + arrayBytes(dim->errl);
+    if(dim->errh != dim->errl)
+      n += arrayBytes(dim->errh);
+  }
+  return n;
+}
+
+static void
+Prefetch_release(idam_Prefetch *e)
+{
+  if(--e->refs > 0)
+    return;
+  Py_XDECREF(e->key);
+  Py_XDECREF(e->pattern);
+  Py_XDECREF(e->result);
+  if(e->ready)
+    PyThread_free_lock(e->ready);
+  free(e);
+}
+
+/* Checked by a worker before starting the read. Needs the GIL */
+static int
+Prefetch_cancelled(idam_Prefetch *e)
+{
+  return e->cancelled;
+}
+
+/* Store the result of a read, and wake anyone waiting for it.
+   Called by the worker, with the GIL */
+static void
+Prefetch_finish(idam_Prefetch *e, PyObject *result, int ok)
+{
+  long long nbytes = (result && ok) ? dataBytes((idam_Data*) result) : 0;
+  
+  if(e->cancelled) {
+    if(result && ok) {
+      /* Too late to stop it */
+      idam_prefetchwasted++;
+      idam_prefetchwastedbytes += nbytes;
+    }else
+      idam_prefetchcancelled++; /* Skipped, or failed after all */
+  }else if(result && ok) {
+    Py_INCREF(result);
+    e->result = result;
+    e->nbytes = nbytes;
+    idam_prefetchbytes += nbytes;
+  }else
+    idam_prefetchfailed++;
+  
+  e->done = 1;
+  PyThread_release_lock(e->ready);
+  Prefetch_release(e);
+}
+
+static idam_Prefetch *
+Prefetch_find(PyObject *key)
+{
+  PyObject *capsule;
+  
+  if(idam_prefetchtable == NULL)
+    return NULL;
+  capsule = PyDict_GetItem(idam_prefetchtable, key);
+  if(capsule == NULL)
+    return NULL;
+  return (idam_Prefetch*) PyCapsule_GetPointer(capsule, NULL);
+}
+
+/* Remove an entry from the table. A finished result is wasted,
+   and a read not yet finished is cancelled */
+static void
+Prefetch_drop(idam_Prefetch *e)
+{
+  if(e->done) {
+    if(e->result) {
+      idam_prefetchwasted++;
+      idam_prefetchwastedbytes += e->nbytes;
+      idam_prefetchbytes -= e->nbytes;
+    }
+  }else
+    e->cancelled = 1;
+  PyDict_DelItem(idam_prefetchtable, e->key);
+  Prefetch_release(e);
+}
+
+/* Drop entries for which keep() returns 0, oldest first. Stops
+   early once keep() returns -1 */
+static void
+Prefetch_filter(int (*keep)(idam_Prefetch *e, PyObject *pattern, long long shot),
+                PyObject *pattern, long long shot)
+{
+  PyObject *keys;
+  idam_Prefetch *e;
+  Py_ssize_t i;
+  int k;
+  
+  if((idam_prefetchtable == NULL) ||
+     ((keys = PyDict_Keys(idam_prefetchtable)) == NULL)) {
+    PyErr_Clear();
+    return;
+  }
+  for(i=0;i<PyList_GET_SIZE(keys);i++) {
+    if((e = Prefetch_find(PyList_GET_ITEM(keys, i))) == NULL)
+      continue;
+    if((k = keep(e, pattern, shot)) < 0)
+      break;
+    if(k == 0)
+      Prefetch_drop(e);
+  }
+  Py_DECREF(keys);
+}
+
+/* Keep everything except other shots in the sequence */
+static int
+keepOthers(idam_Prefetch *e, PyObject *pattern, long long shot)
+{
+  int same = PyObject_RichCompareBool(e->pattern, pattern, Py_EQ);
+  
+  if(same < 0)
+    PyErr_Clear();
+  return (same > 0) && (e->shot != shot) ? 0 : 1;
+}
+
+/* Keep reads in progress, until within the size limit */
+static int
+keepUnfinished(idam_Prefetch *e, PyObject *pattern, long long shot)
+{
+  if(idam_prefetchbytes <= idam_prefetchmax)
+    return -1;
+  return e->done ? 0 : 1;
+}
+
+static int
+keepNone(idam_Prefetch *e, PyObject *pattern, long long shot)
+{
+  return 0;
+}
+
+/* Queue a read of the next shot in a sequence, if there is room
+   and it isn't already buffered. Needs the GIL */
+static void
+Prefetch_start(const char *name, long long shot, PyObject *pattern,
+               const idam_Server *srv, const idam_Options *opt)
+{
+  char source[32], *key_chars;
+  PyObject *key, *capsule, *src;
+  idam_Prefetch *e;
+  idam_AsyncJob *a = NULL;
+  
+  sprintf(source, "%lld", shot);
+  if((key_chars = requestKey(name, source, srv, opt)) == NULL)
+    return;
+  key = CharsToString(key_chars);
+  free(key_chars);
+  if(key == NULL) {
+    PyErr_Clear();
+    return;
+  }
+  
+  Prefetch_filter(keepUnfinished, NULL, 0);
+  if(Prefetch_find(key) || (idam_prefetchbytes > idam_prefetchmax) ||
+     (PyDict_Size(idam_prefetchtable) >= IDAM_MAXPREFETCH) ||
+     ((e = (idam_Prefetch*) calloc(1, sizeof(idam_Prefetch))) == NULL)) {
+    Py_DECREF(key);
+    return;
+  }
+  e->key = key;
+  Py_INCREF(pattern);
+  e->pattern = pattern;
+  e->shot = shot;
+  e->refs = 1;
+  if((e->ready = PyThread_allocate_lock()) == NULL)
+    goto fail;
+  PyThread_acquire_lock(e->ready, WAIT_LOCK);
+  
+  if((src = CharsToString(source)) == NULL)
+    goto fail;
+  a = AsyncJob_new(name, src, srv, opt);
+  Py_DECREF(src);
+  if(a == NULL)
+    goto fail;
+  
+  capsule = PyCapsule_New(e, NULL, NULL);
+  if((capsule == NULL) || (PyDict_SetItem(idam_prefetchtable, key, capsule) < 0)) {
+    Py_XDECREF(capsule);
+    goto fail;
+  }
+  Py_DECREF(capsule);
+  e->refs++;
+  
+  a->prefetch = e; /* Job's reference */
+  if(Async_queue(a) < 0) {
+    a->prefetch = NULL;
+    PyDict_DelItem(idam_prefetchtable, key);
+    e->refs--;
+    goto fail;
+  }
+  idam_prefetchissued++;
+  return;
+  
+ fail:
+  /* Prefetching is only a guess, so errors aren't raised */
+  PyErr_Clear();
+  if(a)
+    AsyncJob_free(a);
+  if(e->ready)
+    PyThread_release_lock(e->ready);
+  Prefetch_release(e);
+}
+
+/* Follow the sequence of shots read for a signal, prefetching
+   the next ones or cancelling them. Needs the GIL */
+static void
+Prefetch_observe(const char *name, const char *source,
+                 const idam_Server *srv, const idam_Options *opt)
+{
+  char *key_chars, *end;
+  PyObject *pattern, *last, *value;
+  long long shot, step = 0, laststep;
+  int i;
+  
+  if((idam_prefetchdepth <= 0) || opt->lazy)
+    return;
+  
+  errno = 0;
+  shot = strtoll(source, &end, 10);
+  if((end == source) || *end || errno)
+    return; /* Not a shot number */
+  
+  if(((idam_patterns == NULL) && ((idam_patterns = PyDict_New()) == NULL)) ||
+     ((idam_prefetchtable == NULL) && ((idam_prefetchtable = PyDict_New()) == NULL))) {
+    PyErr_Clear();
+    return;
+  }
+  
+  /* Everything but the source */
+  if((key_chars = requestKey(name, "", srv, opt)) == NULL)
+    return;
+  pattern = CharsToString(key_chars);
+  free(key_chars);
+  if(pattern == NULL) {
+    PyErr_Clear();
+    return;
+  }
+  
+  last = PyDict_GetItem(idam_patterns, pattern);
+  if(last) {
+    step = shot - PyLong_AsLongLong(PyTuple_GET_ITEM(last, 0));
+    laststep = PyLong_AsLongLong(PyTuple_GET_ITEM(last, 1));
+    if((step != 0) && (step == laststep)) {
+      for(i=1;i<=idam_prefetchdepth;i++)
+        Prefetch_start(name, shot + i*step, pattern, srv, opt);
+    }else
+      Prefetch_filter(keepOthers, pattern, shot); /* Sequence broken */
+  }else if(PyDict_Size(idam_patterns) >= IDAM_MAXPATTERNS)
+    PyDict_Clear(idam_patterns);
+  
+  value = Py_BuildValue("(LL)", shot, step);
+  if((value == NULL) || (PyDict_SetItem(idam_patterns, pattern, value) < 0))
+    PyErr_Clear();
+  Py_XDECREF(value);
+  Py_DECREF(pattern);
+}
+
+/* If a request was prefetched, wait for it and fill self. Returns 1
+   if filled, 0 if it should be read as usual, or -1 on error */
+static int
+Prefetch_take(idam_Data *self, const char *name, const char *source,
+              const idam_Server *srv, const idam_Options *opt)
+{
+  char *key_chars;
+  PyObject *key;
+  idam_Prefetch *e;
+  int ret = 0;
+  
+  if((idam_prefetchdepth <= 0) || opt->lazy)
+    return 0;
+  
+  if((key_chars = requestKey(name, source, srv, opt)) == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  key = CharsToString(key_chars);
+  free(key_chars);
+  if(key == NULL)
+    return -1;
+  e = Prefetch_find(key);
+  Py_DECREF(key);
+  
+  if(e == NULL) {
+    idam_prefetchmisses++;
+    return 0;
+  }
+  
+  /* Take it out of the table, so nobody else can */
+  e->refs++;
+  PyDict_DelItem(idam_prefetchtable, e->key);
+  Prefetch_release(e);
+  
+  if(!e->done) {
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(e->ready, WAIT_LOCK);
+    PyThread_release_lock(e->ready);
+    Py_END_ALLOW_THREADS
+  }
+  
+  if(e->result) {
+    idam_prefetchbytes -= e->nbytes;
+    if(Data_copy(self, (idam_Data*) e->result) < 0)
+      ret = -1;
+    else {
+      idam_prefetchhits++;
+      ret = 1;
+    }
+  }else
+    idam_prefetchmisses++; /* Failed, so try again */
+  
+  Prefetch_release(e);
+  return ret;
+}
+
+static PyObject*
+idam_setPrefetch(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  int depth;
+  long long maxsize = -1;
+  
+  static char *kwlist[] = {"depth", "maxsize", NULL};
+  
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "i|L", kwlist, &depth, &maxsize))
+    return NULL;
+  if(depth < 0) {
+    PyErr_SetString(PyExc_ValueError, "Prefetch depth can't be negative");
+    return NULL;
+  }
+  
+  idam_prefetchdepth = depth;
+  if(maxsize >= 0)
+    idam_prefetchmax = maxsize;
+  if(depth == 0) {
+    Prefetch_filter(keepNone, NULL, 0);
+    Py_CLEAR(idam_patterns);
+  }else
+    Prefetch_filter(keepUnfinished, NULL, 0);
+  
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject*
+idam_prefetchInfo(PyObject *self, PyObject *args)
+{
+  long long used = idam_prefetchhits + idam_prefetchmisses;
+  
+  return Py_BuildValue("{s:i,s:L,s:L,s:L,s:L,s:d,s:L,s:L,s:L,s:L,s:L,s:n}",
+                       "depth", idam_prefetchdepth,
+                       "maxsize", idam_prefetchmax,
+                       "issued", idam_prefetchissued,
+                       "hits", idam_prefetchhits,
+                       "misses", idam_prefetchmisses,
+                       "hit_rate", used ? ((double) idam_prefetchhits) / used : 0.0,
+                       "cancelled", idam_prefetchcancelled,
+                       "failed", idam_prefetchfailed,
+                       "wasted", idam_prefetchwasted,
+                       "wasted_bytes", idam_prefetchwastedbytes,
+                       "bytes", idam_prefetchbytes,
+                       "entries", idam_prefetchtable ? PyDict_Size(idam_prefetchtable) : (Py_ssize_t) 0);
+}
+
+/************************************************************
+ * Timeouts and cancellation
+ *
+ * A read with a timeout is passed to the fetch() workers, and
+ * the caller waits for an idam_Call to finish. The caller gives
+ * up when the timeout passes or another thread calls cancel().
+ * The IDAM library can't be interrupted, so the read carries on
+ * in the background and its result is thrown away. So a timeout
+ * only stops waiting: the read still holds the library until it
+ * finishes, and later reads queue behind it.
+ ************************************************************/
+
+typedef struct idam_Call {
+  struct idam_Call *prev, *next; /* Calls being waited for */
+  unsigned long thread;          /* Thread waiting */
+  PyThread_type_lock done;       /* Held until finished */
+  int finished;                  /* Set before done is released */
+  int cancelled;
+  PyObject *result;              /* Data object, or an exception */
+  int ok;                        /* Set if result is a Data object */
+  int refs;                      /* Waiting thread, and the read */
+} idam_Call;
+
+static idam_Call *idam_calls = NULL;
+static long long idam_timeouts = 0, idam_cancels = 0;
+
+static PyObject *idam_TimeoutError = NULL;   /* Both subclass RuntimeError */
+static PyObject *idam_CancelledError = NULL;
+
+/* Wait for a lock for up to timeout seconds, or forever if negative.
+   Returns 1 if acquired. Call with the GIL released */
+static int
+waitLock(PyThread_type_lock lock, double timeout)
+{
+#if PY_MAJOR_VERSION >= 3
+  PY_TIMEOUT_T us;
+  
+  if(timeout < 0)
+    return PyThread_acquire_lock(lock, WAIT_LOCK);
+  us = (timeout*1e6 < (double) PY_TIMEOUT_MAX) ? (PY_TIMEOUT_T) (timeout*1e6) : PY_TIMEOUT_MAX;
+  return PyThread_acquire_lock_timed(lock, us, 0) == PY_LOCK_ACQUIRED;
+#else
+  /* No timed locks in Python 2, so poll */
+  double end = idam_now() + timeout;
+  
+  if(timeout < 0)
+    return PyThread_acquire_lock(lock, WAIT_LOCK);
+  while(!PyThread_acquire_lock(lock, NOWAIT_LOCK)) {
+    if(idam_now() >= end)
+      return 0;
+    usleep(1000);
+  }
+  return 1;
+#endif
+}
+
+static void
+Call_release(idam_Call *c)
+{
+  if(--c->refs > 0)
+    return;
+  Py_XDECREF(c->result);
+  if(c->done)
+    PyThread_free_lock(c->done);
+  free(c);
+}
+
+/* Start waiting for a read in this thread. Needs the GIL */
+static idam_Call *
+Call_new(void)
+{
+  idam_Call *c;
+  
+  if((c = (idam_Call*) calloc(1, sizeof(idam_Call))) == NULL) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  if((c->done = PyThread_allocate_lock()) == NULL) {
+    free(c);
+    PyErr_SetString(PyExc_RuntimeError, "Could not allocate lock");
+    return NULL;
+  }
+  PyThread_acquire_lock(c->done, WAIT_LOCK);
+  c->thread = PyThread_get_thread_ident();
+  c->refs = 1;
+  
+  c->next = idam_calls;
+  if(idam_calls)
+    idam_calls->prev = c;
+  idam_calls = c;
+  return c;
+}
+
+/* Wake the waiting thread, if not already done. Needs the GIL */
+static void
+Call_wake(idam_Call *c)
+{
+  if(c->finished)
+    return;
+  c->finished = 1;
+  PyThread_release_lock(c->done);
+}
+
+/* Stop waiting, and forget the call. Reads not yet started
+   are then skipped. Needs the GIL */
+static void
+Call_end(idam_Call *c)
+{
+  if(c->prev) c->prev->next = c->next; else idam_calls = c->next;
+  if(c->next) c->next->prev = c->prev;
+  Call_wake(c);
+  Call_release(c);
+}
+
+/* Checked by a worker before starting a read. Needs the GIL */
+static int
+Call_cancelled(idam_Call *c)
+{
+  return c->finished;
+}
+
+/* Keep the result, unless no longer waiting. Called by the
+   worker, with the GIL */
+static void
+Call_finish(idam_Call *c, idam_AsyncJob *a)
+{
+  PyObject *result = a->job.result;
+  
+  if(!c->finished && result) {
+    Py_INCREF(result);
+    c->result = result;
+    c->ok = a->job.ok;
+    Call_wake(c);
+  }
+  Call_release(c);
+}
+
+/* Queue the read for a call. Needs the GIL */
+static int
+Call_start(idam_Call *c, const char *name, PyObject *source,
+           const idam_Server *srv, const idam_Options *opt)
+{
+  idam_AsyncJob *a;
+  
+  if((a = AsyncJob_new(name, source, srv, opt)) == NULL)
+    return -1;
+  a->call = c;
+  c->refs++;
+  if(Async_queue(a) < 0) {
+    a->call = NULL;
+    c->refs--;
+    AsyncJob_free(a);
+    return -1;
+  }
+  return 0;
+}
+
+/* Wait for up to timeout seconds, or forever if negative.
+   Returns 1 if the call has finished. Needs the GIL */
+static int
+Call_wait(idam_Call *c, double timeout)
+{
+  int got;
+  
+  Py_BEGIN_ALLOW_THREADS
+  got = waitLock(c->done, timeout);
+  if(got)
+    PyThread_release_lock(c->done);
+  Py_END_ALLOW_THREADS
+  return c->finished;
+}
+
+/* Read a signal into self with a worker thread, giving up after
+   opt->timeout seconds. Steals the reference to source_obj */
+static int
+Data_wait(idam_Data *self, const char *data, PyObject *source_obj,
+          const idam_Server *srv, const idam_Options *opt)
+{
+  idam_Call *c;
+  int ret = -1;
+  
+  if((c = Call_new()) == NULL) {
+    Py_DECREF(source_obj);
+    return -1;
+  }
+  if(Call_start(c, data, source_obj, srv, opt) < 0)
+    goto done;
+  
+  Call_wait(c, opt->timeout);
+  
+  if(!c->finished) {
+    idam_timeouts++;
+    PyErr_Format(idam_TimeoutError, "Timed out after %g s reading '%s' from '%s'",
+                 opt->timeout, data, StringToChars(source_obj));
+  }else if(c->cancelled)
+    PyErr_Format(idam_CancelledError, "Reading '%s' from '%s' was cancelled",
+                 data, StringToChars(source_obj));
+  else if(c->ok)
+    ret = Data_copy(self, (idam_Data*) c->result);
+  else
+    PyErr_SetObject((PyObject*) Py_TYPE(c->result), c->result);
+  
+ done:
+  Call_end(c);
+  Py_DECREF(source_obj);
+  return ret;
+}
+
+static PyObject*
+idam_setTimeout(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  double timeout = -1, connect = -1;
+  
+  static char *kwlist[] = {"timeout", "connect", NULL};
+  
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "|dd", kwlist, &timeout, &connect))
+    return NULL;
+  
+  if(timeout >= 0)
+    idam_timeout = timeout;
+  if(connect >= 0)
+    idam_connecttimeout = connect;
+  
+  return Py_BuildValue("{s:d,s:d}",
+                       "timeout", idam_timeout,
+                       "connect", idam_connecttimeout);
+}
+
+static PyObject*
+idam_cancel(PyObject *self, PyObject *args)
+{
+  PyObject *thread = Py_None;
+  unsigned long id = 0;
+  idam_Call *c;
+  int n = 0;
+  
+  if(!PyArg_ParseTuple(args, "|O", &thread))
+    return NULL;
+  if(thread != Py_None) {
+    id = PyLong_AsUnsignedLongMask(thread);
+    if(PyErr_Occurred())
+      return NULL;
+  }
+  
+  for(c=idam_calls;c;c=c->next) {
+    if(!c->finished && ((thread == Py_None) || (c->thread == id))) {
+      c->cancelled = 1;
+      Call_wake(c);
+      n++;
+    }
+  }
+  idam_cancels += n;
+  
+  return Py_BuildValue("i", n);
+}
+
+/************************************************************
+ * Streaming reads
+ *
+ * idam.stream() reads a signal once, then gives it as Data
+ * objects each holding a range of times, so that a large
+ * signal can be processed without converting all of it at
+ * once. The IDAM buffers are kept by an idam_Handle until the
+ * stream is finished; each chunk is copied (or converted)
+ * straight out of them. The dimensions are created once, and
+ * each chunk's time is a view of the whole time array.
+ ************************************************************/
+
+#define IDAM_CHUNKBYTES (16 << 20)  /* Default size of a chunk */
+
+typedef struct {
+  PyObject_HEAD
+  PyObject *name;
+  PyObject *source;
+  PyObject *label;
+  PyObject *units;
+  PyObject *desc;
+  PyObject *dim;      /* List of dimensions, with whole arrays */
+  PyObject *handle;   /* idam_Handle, or NULL once finished */
+  PyObject *whole[3]; /* Data and errors, if they must be converted at once */
+  int order;
+  int errors;
+  npy_intp ntimes;
+  npy_intp chunk;     /* Times in each chunk */
+  npy_intp next;      /* First time of the next chunk */
+} idam_Stream;
+
+static void
+Stream_dealloc(idam_Stream *self)
+{
+  int i;
+  
+  Py_XDECREF(self->name);
+  Py_XDECREF(self->source);
+  Py_XDECREF(self->label);
+  Py_XDECREF(self->units);
+  Py_XDECREF(self->desc);
+  Py_XDECREF(self->dim);
+  Py_XDECREF(self->handle);
+  for(i=0;i<3;i++)
+    Py_XDECREF(self->whole[i]);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* A view of count elements of an array from first, along axis */
+static PyObject *
+sliceAxis(PyObject *arr, int axis, npy_intp first, npy_intp count)
+{
+  PyObject *index, *item, *result;
+  int i;
+  
+  if(arr == Py_None) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  if((index = PyTuple_New(axis+1)) == NULL)
+    return NULL;
+  for(i=0;i<=axis;i++) {
+    if(i < axis)
+      item = PySlice_New(NULL, NULL, NULL);
+    else {
+      PyObject *start = PyLong_FromSsize_t(first);
+      PyObject *stop = PyLong_FromSsize_t(first + count);
+      item = (start && stop) ? PySlice_New(start, stop, NULL) : NULL;
+      Py_XDECREF(start);
+      Py_XDECREF(stop);
+    }
+    if(item == NULL) {
+      Py_DECREF(index);
+      return NULL;
+    }
+    PyTuple_SET_ITEM(index, i, item);
+  }
+  result = PyObject_GetItem(arr, index);
+  Py_DECREF(index);
+  return result;
+}
+
+/* Copy times first to first+count of an IDAM buffer, where time
+   is axis k, converting to npytype as fillArray does. Doesn't
+   need the GIL */
+static void
+copyChunk(char *dst, int npytype, const char *src, int type,
+          int rank, const npy_intp *dimsize, int k, npy_intp first, npy_intp count)
+{
+  npy_intp outer = 1, inner = 1, o;
+  size_t insize, outsize;
+  int i;
+  
+  for(i=0;i<k;i++)
+    outer *= dimsize[i];
+  for(i=k+1;i<rank;i++)
+    inner *= dimsize[i];
+  insize = idam_types[findType(type)].size;
+  outsize = (npytype == NPY_FLOAT) ? sizeof(float) : insize;
+  
+  for(o=0;o<outer;o++)
+    fillArray(dst + o*count*inner*outsize, npytype,
+              src + (o*dimsize[k] + first)*inner*insize, type, count*inner);
+}
+
+/* Check if copyChunk can be used, rather than the IDAM routines */
+static int
+canChunk(const char *raw, int type, int npytype)
+{
+  if(raw == NULL)
+    return 0;
+  return (npytype == NPY_FLOAT) ? realType(type) : (findType(type) >= 0);
+}
+
+/* One of the data or error arrays for the next chunk */
+static PyObject *
+Stream_array(idam_Stream *self, idam_Handle *h, PyObject *whole, int which,
+             npy_intp first, npy_intp count)
+{
+  idam_ArrayInfo info;
+  npy_intp dimsize[IDAM_MAXRANK];
+  PyObject *arr;
+  void *ptr;
+  
+  if(whole)
+    return sliceAxis(whole, self->order, first, count);
+  
+  Signal_array(&h->sig, -1, which, &info);
+  memcpy(dimsize, info.dimsize, info.rank*sizeof(npy_intp));
+  dimsize[self->order] = count;
+  if((arr = newArray(info.rank, dimsize, info.npytype, &ptr)) == NULL)
+    return NULL;
+  
+  Py_BEGIN_ALLOW_THREADS
+  copyChunk((char*) ptr, info.npytype, info.raw, info.type,
+            info.rank, info.dimsize, self->order, first, count);
+  Py_END_ALLOW_THREADS
+  return arr;
+}
+
+/* Copy of a dimension, with its arrays sliced if it is time */
+static PyObject *
+Stream_dim(idam_Dimension *src, int istime, npy_intp first, npy_intp count)
+{
+  idam_Dimension *dim = (idam_Dimension*) Dimension_new(&idam_DimensionType, NULL, NULL);
+  
+  if(dim == NULL)
+    return NULL;
+  Py_INCREF(src->label);
+  Py_INCREF(src->units);
+  setMember(&dim->label, src->label);
+  setMember(&dim->units, src->units);
+  if(istime) {
+    if((setMember(&dim->data, sliceAxis(src->data, 0, first, count)) < 0) ||
+       (setMember(&dim->errl, sliceAxis(src->errl, 0, first, count)) < 0)) {
+      Py_DECREF(dim);
+      return NULL;
+    }
+    if(src->errh == src->errl) {
+      Py_INCREF(dim->errl);
+      setMember(&dim->errh, dim->errl);
+    }else if(setMember(&dim->errh, sliceAxis(src->errh, 0, first, count)) < 0) {
+      Py_DECREF(dim);
+      return NULL;
+    }
+  }else {
+    Py_INCREF(src->data);
+    Py_INCREF(src->errl);
+    Py_INCREF(src->errh);
+    setMember(&dim->data, src->data);
+    setMember(&dim->errl, src->errl);
+    setMember(&dim->errh, src->errh);
+  }
+  return (PyObject*) dim;
+}
+
+static PyObject *
+Stream_next(idam_Stream *self)
+{
+  idam_Handle *h = (idam_Handle*) self->handle;
+  idam_Data *d;
+  PyObject *dimlist, *whole[3];
+  npy_intp first, count;
+  Py_ssize_t i, rank;
+  
+  if((h == NULL) || (self->next >= self->ntimes)) {
+    /* Finished, so free the IDAM buffers */
+    Py_CLEAR(self->handle);
+    for(i=0;i<3;i++)
+      Py_CLEAR(self->whole[i]);
+    return NULL;
+  }
+  
+  /* Take the chunk before the GIL is released while copying, so
+     threads sharing the stream each get a different one. The
+     buffers are kept in case another thread finishes the stream */
+  first = self->next;
+  count = self->ntimes - first;
+  if(count > self->chunk)
+    count = self->chunk;
+  self->next += count;
+  Py_INCREF(h);
+  for(i=0;i<3;i++) {
+    whole[i] = self->whole[i];
+    Py_XINCREF(whole[i]);
+  }
+  
+  if((d = (idam_Data*) Data_new(&idam_DataType, NULL, NULL)) == NULL)
+    goto done;
+  
+  Py_INCREF(self->name);
+  Py_INCREF(self->source);
+  Py_INCREF(self->label);
+  Py_INCREF(self->units);
+  Py_INCREF(self->desc);
+  setMember(&d->name, self->name);
+  setMember(&d->source, self->source);
+  setMember(&d->label, self->label);
+  setMember(&d->units, self->units);
+  setMember(&d->desc, self->desc);
+  d->order = self->order;
+  
+  rank = PyList_GET_SIZE(self->dim);
+  if(setMember(&d->dim, PyList_New(rank)) < 0)
+    goto fail;
+  for(i=0;i<rank;i++) {
+    dimlist = Stream_dim((idam_Dimension*) PyList_GET_ITEM(self->dim, i),
+                         i == self->order, first, count);
+    if(dimlist == NULL)
+      goto fail;
+    PyList_SET_ITEM(d->dim, i, dimlist);
+  }
+  Py_INCREF(((idam_Dimension*) PyList_GET_ITEM(d->dim, self->order))->data);
+  setMember(&d->time, ((idam_Dimension*) PyList_GET_ITEM(d->dim, self->order))->data);
+  
+  if(setMember(&d->data, Stream_array(self, h, whole[IDAM_DATA], IDAM_DATA, first, count)) < 0)
+    goto fail;
+  if(self->errors && (h->sig.errtype != TYPE_UNKNOWN)) {
+    if(setMember(&d->errl, Stream_array(self, h, whole[IDAM_ERRL], IDAM_ERRL, first, count)) < 0)
+      goto fail;
+    if(!h->sig.errasym) {
+      Py_INCREF(d->errl);
+      setMember(&d->errh, d->errl);
+    }else if(setMember(&d->errh, Stream_array(self, h, whole[IDAM_ERRH], IDAM_ERRH,
+                                              first, count)) < 0)
+      goto fail;
+  }else {
+    Py_INCREF(Py_None);
+    Py_INCREF(Py_None);
+    setMember(&d->errl, Py_None);
+    setMember(&d->errh, Py_None);
+  }
+  
+  goto done;
+  
+ fail:
+  Py_CLEAR(d);
+ done:
+  Py_DECREF(h);
+  for(i=0;i<3;i++)
+    Py_XDECREF(whole[i]);
+  return (PyObject*) d;
+}
+
+static PyMemberDef idam_StreamMembers[] = {
+  {"name", T_OBJECT_EX, offsetof(idam_Stream, name), READONLY, "Signal name"},
+  {"source", T_OBJECT_EX, offsetof(idam_Stream, source), READONLY, "Source of the signal"},
+  {"label", T_OBJECT_EX, offsetof(idam_Stream, label), READONLY, "Data label"},
+  {"units", T_OBJECT_EX, offsetof(idam_Stream, units), READONLY, "Data units"},
+  {"dim", T_OBJECT_EX, offsetof(idam_Stream, dim), READONLY, "Dimensions, with all times"},
+  {"order", T_INT, offsetof(idam_Stream, order), READONLY, "Index of the time dimension"},
+  {"ntimes", T_PYSSIZET, offsetof(idam_Stream, ntimes), READONLY, "Number of times"},
+  {"chunk", T_PYSSIZET, offsetof(idam_Stream, chunk), READONLY, "Times in each chunk"},
+  {NULL}  /* Sentinel */
 };
 
-static PyTypeObject idam_DimensionType = {
+static PyTypeObject idam_StreamType = {
   PyVarObject_HEAD_INIT(NULL, 0)
-    "idam.Dimension",          /*tp_name*/
-    sizeof(idam_Dimension),    /*tp_basicsize*/
+    "idam.Stream",             /*tp_name*/
+    sizeof(idam_Stream),       /*tp_basicsize*/
     0,                         /*tp_itemsize*/
-    (destructor)Dimension_dealloc,  /*tp_dealloc*/
+    (destructor)Stream_dealloc, /*tp_dealloc*/
     0,                         /*tp_print*/
     0,                         /*tp_getattr*/
     0,                         /*tp_setattr*/
@@ -364,468 +8437,865 @@ static PyTypeObject idam_DimensionType = {
     0,                         /*tp_setattro*/
     0,                         /*tp_as_buffer*/
     Py_TPFLAGS_DEFAULT,        /*tp_flags*/
-    "IDAM dimension objects",  /* tp_doc */
+    "Iterator over a signal in chunks of time, from idam.stream()",  /* tp_doc */
     0,		               /* tp_traverse */
     0,		               /* tp_clear */
     0,		               /* tp_richcompare */
     0,		               /* tp_weaklistoffset */
-    0,		               /* tp_iter */
-    0,		               /* tp_iternext */
-    idam_DimensionMethods,     /* tp_methods */
-    idam_DimensionMembers,     /* tp_members */
-    0,                         /* tp_getset */
-    0,                         /* tp_base */
-    0,                         /* tp_dict */
-    0,                         /* tp_descr_get */
-    0,                         /* tp_descr_set */
-    0,                         /* tp_dictoffset */
-    0,                         /* tp_init */
-    0,                         /* tp_alloc */
-    Dimension_new,             /* tp_new */
+    PyObject_SelfIter,         /* tp_iter */
+    (iternextfunc)Stream_next, /* tp_iternext */
+    0,                         /* tp_methods */
+    idam_StreamMembers,        /* tp_members */
 };
 
-/************************************************************
- * IDAM data members
- ************************************************************/
-
-/* Define data type */
-typedef struct {
-  PyObject_HEAD
-  PyObject *name;   /* Name of the data (e.g. 'amc_plasma current' */
-  PyObject *source; /* Source of the data (e.g. '15100') */
+/* Set up a stream from a signal snapshot, taking its handle */
+static int
+Stream_setSignal(idam_Stream *self, idam_Signal *sig, const idam_Options *opt, npy_intp chunk)
+{
+  idam_Handle *h;
+  idam_Dimension *dim;
+  npy_intp rowbytes;
+  int i, which;
   
-  PyObject *label;  /* Data label */
-  PyObject *units;  /* Units */
-  PyObject *desc;   /* Description */
-
-  PyObject *dim;    /* List of dimensions */
-  int order;        /* Which dimension is time */
+  if((sig->rank < 1) || (sig->order < 0) || (sig->order >= sig->rank)) {
+    PyErr_SetString(PyExc_ValueError, "Can only stream signals with a time dimension");
+    return -1;
+  }
   
-  PyObject *time;   /* Refers to same NumPy array as dim[order]->data */
+  Signal_types(sig, opt->native);
+  if((sig->owner = Handle_new(sig, opt)) == NULL)
+    return -1;
+  h = (idam_Handle*) sig->owner;
+  Py_INCREF(sig->owner);
+  self->handle = sig->owner;
+  
+  self->order = sig->order;
+  self->errors = opt->errors;
+  self->ntimes = sig->dimsize[sig->order];
+  
+  if((setMember(&self->label, InternString(sig->label)) < 0) ||
+     (setMember(&self->units, InternString(sig->units)) < 0) ||
+     (setMember(&self->desc, CharsToString(sig->desc)) < 0) ||
+     (setMember(&self->dim, PyList_New(sig->rank)) < 0))
+    return -1;
+  
+  /* Dimensions are small, so created whole */
+  for(i=0;i<sig->rank;i++) {
+    if((dim = (idam_Dimension*) Dimension_new(&idam_DimensionType, NULL, NULL)) == NULL)
+      return -1;
+    PyList_SET_ITEM(self->dim, i, (PyObject*) dim);
+    if((setMember(&dim->label, InternString(sig->dim[i].label)) < 0) ||
+       (setMember(&dim->units, InternString(sig->dim[i].units)) < 0) ||
+       (setMember(&dim->data, Handle_array(h, i, IDAM_DATA)) < 0))
+      return -1;
+    if(sig->dim[i].errtype != TYPE_UNKNOWN) {
+      if(setMember(&dim->errl, Handle_array(h, i, IDAM_ERRL)) < 0)
+        return -1;
+      if(!sig->dim[i].errasym) {
+        Py_INCREF(dim->errl);
+        setMember(&dim->errh, dim->errl);
+      }else if(setMember(&dim->errh, Handle_array(h, i, IDAM_ERRH)) < 0)
+        return -1;
+    }
+  }
+  
+  /* Types which need the IDAM routines are converted at once */
+  for(which=IDAM_DATA;which<=IDAM_ERRH;which++) {
+    idam_ArrayInfo info;
+    if((which != IDAM_DATA) && (!opt->errors || (sig->errtype == TYPE_UNKNOWN)))
+      break;
+    Signal_array(&h->sig, -1, which, &info);
+    if(!canChunk(info.raw, info.type, info.npytype) &&
+       ((self->whole[which] = Handle_array(h, -1, which)) == NULL))
+      return -1;
+  }
+  
+  /* Default chunk size, in times */
+  rowbytes = (sig->data_n / (self->ntimes > 0 ? self->ntimes : 1)) *
+    ((sig->npytype == NPY_FLOAT) ? sizeof(float) : idam_types[findType(sig->type)].size);
+  if(chunk <= 0)
+    chunk = IDAM_CHUNKBYTES / (rowbytes > 0 ? rowbytes : 1);
+  self->chunk = (chunk > 0) ? chunk : 1;
+  return 0;
+}
 
-  PyObject *errl; /* Error on the low side */
-  PyObject *errh;  /* Error on the high side */
+/* Start streaming a signal from the server given by base,
+   unless the host or port keywords are given */
+static PyObject *
+streamFrom(PyObject *args, PyObject *kwds, const idam_Server *base)
+{
+  const char *data, *source, *host = NULL, *dtype = NULL;
+  int port = -1, ret;
+  Py_ssize_t chunk = 0;
+  idam_Server srv;
+  idam_Options opt = IDAM_OPTIONS_INIT;
+  idam_CacheEntry cache;
+  idam_Signal sig;
+  idam_Stream *self;
+  PyObject *tmp, *source_obj;
+  double start = idam_now(), t;
   
-  PyObject *data;
-} idam_Data;
+  static char *kwlist[] = {"data", "source", "chunk", "host", "port", "dtype",
+                           "errors", "cache", "tmin", "tmax", "stride", NULL};
+  
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "sO|nsiziiddi", kwlist,
+                                  &data, &tmp, &chunk, &host, &port, &dtype,
+                                  &opt.errors, &opt.cache,
+                                  &opt.tmin, &opt.tmax, &opt.stride))
+    return NULL;
+  if(parseOptions(&opt, dtype, 0, NULL) < 0)
+    return NULL;
+  opt.lazy = 1;  /* Arrays are made by the stream */
+  opt.dedup = 0;
+  opt.share = 0; /* A whole copy in shared memory would undo the chunking */
+  if(resolveServer(&srv, base, host, port) < 0)
+    return NULL;
+  
+  if((source_obj = PyObject_Str(tmp)) == NULL)
+    return NULL;
+  if((source = StringToChars(source_obj)) == NULL) {
+    Py_DECREF(source_obj);
+    return NULL;
+  }
+  
+  self = PyObject_New(idam_Stream, &idam_StreamType);
+  if(self == NULL) {
+    Py_DECREF(source_obj);
+    return NULL;
+  }
+  memset(&self->name, 0, sizeof(idam_Stream) - offsetof(idam_Stream, name));
+  self->name = CharsToString(data);
+  self->source = source_obj;
+  
+  if((self->name == NULL) || (Cache_entry(&cache, data, source, &srv, &opt) < 0)) {
+    Py_DECREF(self);
+    return NULL;
+  }
+  
+  idam_log(IDAM_DEBUG, "Streaming '%s' from '%s' on %s:%d", data, source, srv.host, srv.port);
+  
+  Py_BEGIN_ALLOW_THREADS
+  Signal_get(&sig, &cache, data, source, &srv, &opt);
+  Py_END_ALLOW_THREADS
+  
+  if(sig.error) {
+    idam_log(IDAM_DEBUG, "IDAM error: %s", sig.error);
+    PyErr_SetString(PyExc_RuntimeError, sig.error);
+    ret = -1;
+  }else
+    ret = Stream_setSignal(self, &sig, &opt, chunk);
+  
+  /* The stream's handle object keeps the IDAM buffers, which are
+     still open to be saved to the disk cache, as by Data() */
+  Py_BEGIN_ALLOW_THREADS
+  if(ret == 0) {
+    t = idam_now();
+    Cache_write(&cache, &sig);
+    Stats_phase(IDAM_PHASE_STORE, t, data);
+  }
+  Signal_clear(&sig);
+  Py_END_ALLOW_THREADS
+  Py_XDECREF(sig.owner);
+  Cache_free(&cache);
+  
+  Stats_add((ret == 0) ? &idam_requests : &idam_failures, 1);
+  Stats_phase(IDAM_PHASE_TOTAL, start, data);
+  if(ret < 0) {
+    Py_DECREF(self);
+    return NULL;
+  }
+  return (PyObject*) self;
+}
 
-/* Members of the type */
-static PyMemberDef idam_DataMembers[] = {
-  {"name", T_OBJECT_EX, offsetof(idam_Data, name), 0,
-   "Name used to request the data"},
-  {"source", T_OBJECT_EX, offsetof(idam_Data, source), 0,
-   "Source of the data"},
+static PyObject *
+idam_stream(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  idam_Server srv;
+  
+  defaultServer(&srv);
+  return streamFrom(args, kwds, &srv);
+}
 
-  {"label", T_OBJECT_EX, offsetof(idam_Data, label), 0,
-   "Data label"},
-  {"units", T_OBJECT_EX, offsetof(idam_Data, units), 0,
-   "Data units"},
-  {"desc", T_OBJECT_EX, offsetof(idam_Data, desc), 0,
-   "Longer description of the data"},
+/************************************************************
+ * Resampling
+ *
+ * align() interpolates many 1D signals onto one timebase. The
+ * output is split into jobs of IDAM_ALIGNCHUNK points, shared
+ * between worker threads as for fetchMany(). Each point is
+ * looked up first where it would be on a uniform time axis,
+ * so this is O(1) for uniform axes, and a binary search
+ * otherwise.
+ ************************************************************/
 
-  {"dim", T_OBJECT_EX, offsetof(idam_Data, dim), 0,
-   "Dimensions"},
+#define IDAM_ALIGNCHUNK 16384 /* Output points in each job */
 
-  {"order", T_INT, offsetof(idam_Data, order), 0,
-   "Index of time dimension"},
+/* Ways to resample */
+enum { IDAM_LINEAR, IDAM_NEAREST, IDAM_ZOH };
 
-  {"time", T_OBJECT_EX, offsetof(idam_Data, time), 0,
-   "Time values. Same as dim[order].data"},
+/* One signal. Arrays are float64 if the flag is set, else float32 */
+typedef struct {
+  PyObject *time;  /* Contiguous arrays */
+  PyObject *data;
+  const char *t;
+  const char *d;
+  int tdouble, ddouble;
+  npy_intp n;
+  double rdt;      /* Index of time x on a uniform axis is (x - t[0])*rdt */
+} idam_AlignSignal;
 
-  {"errl", T_OBJECT_EX, offsetof(idam_Data, errl), 0,
-   "Error on the low side"},
-  {"errh", T_OBJECT_EX, offsetof(idam_Data, errh), 0,
-   "Error on the high side"},
+typedef struct {
+  idam_AlignSignal *sigs;
+  Py_ssize_t nsigs;
+  const double *x;     /* Timebase */
+  npy_intp m;
+  double *out;         /* nsigs by m */
+  int method;
+  double fill;         /* Value outside a signal's times */
+  Py_ssize_t nchunks;  /* Jobs for each signal */
+  Py_ssize_t njobs;
+  Py_ssize_t next;     /* Next job to start */
+  int running;         /* Number of workers still going */
+  PyThread_type_lock lock; /* Protects next and running */
+  PyThread_type_lock done; /* Released when running reaches 0 */
+} idam_Align;
 
-  {"data", T_OBJECT_EX, offsetof(idam_Data, data), 0,
-   "NumPy data array"},
-  {NULL}  /* Sentinel */
-};
+#define ALIGN_VALUE(p, dbl, i) ((dbl) ? ((const double*) (p))[i] : (double) ((const float*) (p))[i])
 
-/************************************************************
- * IDAM data methods
- ************************************************************/
+/* Find i in 0..n-2 with t[i] <= x < t[i+1] (or i = n-2 if x is
+   the last time), for t[0] <= x <= t[n-1] and n >= 2 */
+static npy_intp
+alignIndex(const idam_AlignSignal *s, double x)
+{
+  npy_intp i, lo, hi, mid, last = s->n - 2;
+  double g = (x - ALIGN_VALUE(s->t, s->tdouble, 0)) * s->rdt;
+  
+  i = (g <= 0) ? 0 : (g >= (double) last) ? last : (npy_intp) g;
+  
+  /* The guess or its neighbours, if the axis is (nearly) uniform */
+  if(ALIGN_VALUE(s->t, s->tdouble, i) <= x) {
+    if((i == last) || (x < ALIGN_VALUE(s->t, s->tdouble, i+1)))
+      return i;
+    if((i+1 == last) || (x < ALIGN_VALUE(s->t, s->tdouble, i+2)))
+      return i+1;
+    lo = i+2;
+    hi = last;
+  }else {
+    if(ALIGN_VALUE(s->t, s->tdouble, i-1) <= x)
+      return i-1;
+    lo = 0;
+    hi = i-2;
+  }
+  
+  /* Otherwise the last index in lo..hi with t[index] <= x */
+  while(lo < hi) {
+    mid = lo + (hi - lo + 1)/2;
+    if(ALIGN_VALUE(s->t, s->tdouble, mid) <= x)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
 
-/* Free memory */
+/* Resample points start to end of the timebase for one signal.
+   Doesn't need the GIL */
 static void
-Data_dealloc(idam_Data* self)
+alignPoints(const idam_AlignSignal *s, const double *xs, npy_intp start, npy_intp end,
+            int method, double fill, double *out)
 {
-  Py_XDECREF(self->name);
-  Py_XDECREF(self->source);
-
-  Py_XDECREF(self->label);
-  Py_XDECREF(self->units);
-  Py_XDECREF(self->desc);
-
-  Py_XDECREF(self->dim);
+  npy_intp j, i;
+  double x, t1, t2, d1, d2, tfirst, tlast;
+  
+  if(s->n == 0) {
+    for(j=start;j<end;j++)
+      out[j] = fill;
+    return;
+  }
+  tfirst = ALIGN_VALUE(s->t, s->tdouble, 0);
+  tlast = ALIGN_VALUE(s->t, s->tdouble, s->n-1);
+  
+  for(j=start;j<end;j++) {
+    x = xs[j];
+    if(!((x >= tfirst) && (x <= tlast))) {
+      out[j] = fill;
+      continue;
+    }
+    if(s->n == 1) {
+      out[j] = ALIGN_VALUE(s->d, s->ddouble, 0);
+      continue;
+    }
+    
+    i = alignIndex(s, x);
+    t1 = ALIGN_VALUE(s->t, s->tdouble, i);
+    t2 = ALIGN_VALUE(s->t, s->tdouble, i+1);
+    d1 = ALIGN_VALUE(s->d, s->ddouble, i);
+    d2 = ALIGN_VALUE(s->d, s->ddouble, i+1);
+    
+    switch(method) {
+    case IDAM_LINEAR:
+      out[j] = (t2 > t1) ? d1 + (d2 - d1)*((x - t1)/(t2 - t1)) : d1;
+      break;
+    case IDAM_NEAREST:
+      out[j] = (x - t1 <= t2 - x) ? d1 : d2;
+      break;
+    default: /* IDAM_ZOH */
+      out[j] = (x >= t2) ? d2 : d1;
+    }
+  }
+}
 
-  Py_XDECREF(self->time);
+/* Run jobs until there are none left. Call with the GIL released */
+static void
+Align_worker(void *arg)
+{
+  idam_Align *a = (idam_Align*) arg;
+  Py_ssize_t i, k;
+  npy_intp start, end;
+  int last;
+  
+  while(1) {
+    PyThread_acquire_lock(a->lock, WAIT_LOCK);
+    i = a->next;
+    if(i < a->njobs)
+      a->next++;
+    PyThread_release_lock(a->lock);
+    
+    if(i >= a->njobs)
+      break;
+    k = i / a->nchunks;
+    start = (i % a->nchunks) * IDAM_ALIGNCHUNK;
+    end = (start + IDAM_ALIGNCHUNK < a->m) ? start + IDAM_ALIGNCHUNK : a->m;
+    alignPoints(&a->sigs[k], a->x, start, end, a->method, a->fill, a->out + k*a->m);
+  }
+  
+  PyThread_acquire_lock(a->lock, WAIT_LOCK);
+  last = (--a->running == 0);
+  PyThread_release_lock(a->lock);
+  
+  if(last)
+    PyThread_release_lock(a->done);
+}
 
-  Py_XDECREF(self->errl);
-  Py_XDECREF(self->errh);
+/* Get a contiguous float32 or float64 array, converting other
+   types to float64. Sets *dbl if float64 */
+static PyObject *
+alignArray(PyObject *obj, int *dbl)
+{
+  int type = NPY_DOUBLE;
+  
+  if(PyArray_Check(obj) && (PyArray_TYPE((PyArrayObject*) obj) == NPY_FLOAT))
+    type = NPY_FLOAT;
+  *dbl = (type == NPY_DOUBLE);
+  return PyArray_FROM_OTF(obj, type, NPY_ARRAY_IN_ARRAY);
+}
 
-  Py_XDECREF(self->data);
+/* Get the time and data arrays of the i'th signal given to align() */
+static int
+alignSignal(idam_AlignSignal *s, PyObject *item, Py_ssize_t i)
+{
+  PyObject *data, *dims, *order, *dim, *time;
+  npy_intp n;
+  double span;
   
-  Py_TYPE(self)->tp_free((PyObject*)self);
+  data = PyObject_GetAttrString(item, "data");
+  dims = PyObject_GetAttrString(item, "dim");
+  order = PyObject_GetAttrString(item, "order");
+  dim = time = NULL;
+  if(data && dims && order)
+    dim = PyObject_GetItem(dims, order);
+  if(dim)
+    time = PyObject_GetAttrString(dim, "data");
+  if(time) {
+    s->data = alignArray(data, &s->ddouble);
+    if(s->data)
+      s->time = alignArray(time, &s->tdouble);
+  }
+  Py_XDECREF(data);
+  Py_XDECREF(dims);
+  Py_XDECREF(order);
+  Py_XDECREF(dim);
+  Py_XDECREF(time);
+  if(s->time == NULL)
+    return -1;
+  
+  n = PyArray_SIZE((PyArrayObject*) s->data);
+  if((PyArray_NDIM((PyArrayObject*) s->data) != 1) || (PyArray_NDIM((PyArrayObject*) s->time) != 1) ||
+     (PyArray_SIZE((PyArrayObject*) s->time) != n)) {
+    PyErr_Format(PyExc_ValueError, "align() needs 1D signals with one time for each value, "
+                 "which signal %ld isn't", (long) i);
+    return -1;
+  }
+  
+  s->t = (const char*) PyArray_DATA((PyArrayObject*) s->time);
+  s->d = (const char*) PyArray_DATA((PyArrayObject*) s->data);
+  s->n = n;
+  span = (n > 1) ? ALIGN_VALUE(s->t, s->tdouble, n-1) - ALIGN_VALUE(s->t, s->tdouble, 0) : 0.0;
+  s->rdt = (span > 0) ? (n - 1) / span : 0.0;
+  return 0;
 }
 
-/* Create a new instance (NOT initialisation) */
 static PyObject *
-Data_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+idam_align(PyObject *self, PyObject *args, PyObject *kwds)
 {
-  idam_Data *self;
-
-  self = (idam_Data *)type->tp_alloc(type, 0);
-  if (self != NULL) {
-    self->name = CharsToString("");
-    if (self->name == NULL) {
-      Py_DECREF(self);
-      return NULL;
-    }
-    
-    self->source = CharsToString("");
-    if (self->source == NULL) {
-      Py_DECREF(self);
-      return NULL;
+  PyObject *datas, *timebase, *seq = NULL, *x = NULL, *result = NULL;
+  const char *method = "linear";
+  int workers = 0, started;
+  idam_Align a;
+  npy_intp dims[2];
+  Py_ssize_t i;
+  long ncpu;
+  
+  static char *kwlist[] = {"datas", "timebase", "method", "fill", "workers", NULL};
+  
+  memset(&a, 0, sizeof(idam_Align));
+  a.fill = Py_NAN;
+  if (! PyArg_ParseTupleAndKeywords(args, kwds, "OO|sdi", kwlist,
+                                    &datas, &timebase, &method, &a.fill, &workers))
+    return NULL;
+  
+  if(strcmp(method, "linear") == 0)
+    a.method = IDAM_LINEAR;
+  else if(strcmp(method, "nearest") == 0)
+    a.method = IDAM_NEAREST;
+  else if(strcmp(method, "zoh") == 0)
+    a.method = IDAM_ZOH;
+  else {
+    PyErr_SetString(PyExc_ValueError, "method must be \"linear\", \"nearest\" or \"zoh\"");
+    return NULL;
+  }
+  
+  if((seq = PySequence_Fast(datas, "align() needs a list of Data objects")) == NULL)
+    return NULL;
+  x = PyArray_ContiguousFromAny(timebase, NPY_DOUBLE, 1, 1);
+  if(x == NULL)
+    goto cleanup;
+  
+  a.nsigs = PySequence_Fast_GET_SIZE(seq);
+  a.sigs = (idam_AlignSignal*) calloc(a.nsigs + 1, sizeof(idam_AlignSignal));
+  if(a.sigs == NULL) {
+    PyErr_NoMemory();
+    goto cleanup;
+  }
+  for(i=0;i<a.nsigs;i++) {
+    if(alignSignal(&a.sigs[i], PySequence_Fast_GET_ITEM(seq, i), i) < 0)
+      goto cleanup;
+  }
+  
+  a.x = (const double*) PyArray_DATA((PyArrayObject*) x);
+  a.m = PyArray_SIZE((PyArrayObject*) x);
+  dims[0] = a.nsigs;
+  dims[1] = a.m;
+  if((result = (PyObject*) emptyArray(2, dims, NPY_DOUBLE)) == NULL)
+    goto cleanup;
+  a.out = (double*) PyArray_DATA((PyArrayObject*) result);
+  
+  a.nchunks = (a.m + IDAM_ALIGNCHUNK - 1) / IDAM_ALIGNCHUNK;
+  a.njobs = a.nsigs * a.nchunks;
+  if(a.njobs == 0)
+    goto cleanup;
+  
+  if(workers < 1) {
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = (ncpu > 0) ? (int) ncpu : 1;
+  }
+  if(workers > a.njobs)
+    workers = (int) a.njobs;
+  
+  a.lock = PyThread_allocate_lock();
+  a.done = PyThread_allocate_lock();
+  if((a.lock == NULL) || (a.done == NULL)) {
+    PyErr_SetString(PyExc_RuntimeError, "Could not allocate lock");
+    Py_CLEAR(result);
+    goto cleanup;
+  }
+  PyThread_acquire_lock(a.done, WAIT_LOCK);
+  
+  a.running = workers;
+  
+  Py_BEGIN_ALLOW_THREADS
+  for(started=1;started<workers;started++) {
+    if((long) PyThread_start_new_thread(Align_worker, &a) == -1) {
+      /* Carry on with fewer workers */
+      PyThread_acquire_lock(a.lock, WAIT_LOCK);
+      a.running -= workers - started;
+      PyThread_release_lock(a.lock);
+      break;
     }
-    
-    self->label = CharsToString("No data");
-    if (self->label == NULL) {
-      Py_DECREF(self);
-      return NULL;
+  }
+  /* This thread does its share too */
+  Align_worker(&a);
+  PyThread_acquire_lock(a.done, WAIT_LOCK);
+  Py_END_ALLOW_THREADS
+  
+ cleanup:
+  if(a.sigs) {
+    for(i=0;i<a.nsigs;i++) {
+      Py_XDECREF(a.sigs[i].time);
+      Py_XDECREF(a.sigs[i].data);
     }
+    free(a.sigs);
+  }
+  if(a.lock)
+    PyThread_free_lock(a.lock);
+  if(a.done)
+    PyThread_free_lock(a.done);
+  Py_XDECREF(x);
+  Py_DECREF(seq);
+  return result;
+}
 
-    self->units = CharsToString("No units");
-    if (self->units == NULL) {
-      Py_DECREF(self);
-      return NULL;
-    }
+/************************************************************
+ * Statistics and tracing
+ ************************************************************/
 
-    self->desc = CharsToString("No description");
-    if (self->desc == NULL) {
-      Py_DECREF(self);
+static PyObject*
+idam_stats(PyObject *self, PyObject *args)
+{
+  PyObject *dict, *phases, *phase, *hist;
+  idam_PhaseStats p[IDAM_NPHASES];
+  long long requests, failures, bytes, diskhits, shmhits;
+  int i, j;
+  
+  /* Copy, so the lock isn't held while making objects */
+  PyThread_acquire_lock(idam_statslock, WAIT_LOCK);
+  memcpy(p, idam_phases, sizeof(p));
+  requests = idam_requests;
+  failures = idam_failures;
+  bytes = idam_bytes;
+  diskhits = idam_diskhits;
+  shmhits = idam_shmhits;
+  PyThread_release_lock(idam_statslock);
+  
+  if((phases = PyDict_New()) == NULL)
+    return NULL;
+  for(i=0;i<IDAM_NPHASES;i++) {
+    if((hist = PyList_New(IDAM_HISTBINS)) == NULL) {
+      Py_DECREF(phases);
       return NULL;
     }
-
-    Py_INCREF(Py_None);
-    self->dim = Py_None;
-    
-    self->order = 0;
-
-    Py_INCREF(Py_None);
-    self->time = Py_None;
-
-    Py_INCREF(Py_None);
-    self->errl = Py_None;
-    Py_INCREF(Py_None);
-    self->errh = Py_None;
-
-    Py_INCREF(Py_None);
-    self->data = Py_None;
+    for(j=0;j<IDAM_HISTBINS;j++)
+      PyList_SET_ITEM(hist, j, PyLong_FromLongLong(p[i].hist[j]));
+    phase = Py_BuildValue("{s:L,s:d,s:d,s:d,s:N}",
+                          "count", p[i].count,
+                          "total", p[i].total,
+                          "mean", p[i].count ? p[i].total / p[i].count : 0.0,
+                          "max", p[i].max,
+                          "histogram", hist);
+    if((phase == NULL) || (PyDict_SetItemString(phases, idam_phasenames[i], phase) < 0)) {
+      Py_XDECREF(phase);
+      Py_DECREF(phases);
+      return NULL;
+    }
+    Py_DECREF(phase);
   }
   
-  return (PyObject *)self;
+  dict = Py_BuildValue("{s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:N}",
+                       "requests", requests,
+                       "errors", failures,
+                       "bytes", bytes,
+                       "disk_cache_hits", diskhits,
+                       "shared_memory_hits", shmhits,
+                       "memory_cache_hits", idam_memhits,
+                       "memory_cache_misses", idam_memmisses,
+                       "shared_dimensions", idam_dedupshared,
+                       "timeouts", idam_timeouts,
+                       "cancelled", idam_cancels,
+                       "phases", phases);
+  return dict;
 }
 
-/* Initialise */
-static int
-Data_init(idam_Data *self, PyObject *args, PyObject *kwds)
+static void
+Stats_clearSpans(void)
 {
-  const char *data, *source;
-  const char *host = NULL;
-  char tmphost[MAXNAME];
-  int port = -1, tmpport=-1;
-  PyObject *source_obj;
-  PyObject *tmp, *tmp2;
-
-  idam_Dimension *dim;
-
-  int handle;
-  PyArrayObject* pyarr;
-  int data_n;
-  int rank, order;
-  npy_intp dimsize[8];
   int i;
+  for(i=0;i<idam_nspans;i++)
+    free(idam_spans[i].name);
+  idam_nspans = 0;
+}
 
-  static char *kwlist[] = {"data", "source", "host", "port", NULL};
+static PyObject*
+idam_reset_stats(PyObject *self, PyObject *args)
+{
+  Py_BEGIN_ALLOW_THREADS
+  PyThread_acquire_lock(idam_statslock, WAIT_LOCK);
+  memset(idam_phases, 0, sizeof(idam_phases));
+  idam_requests = idam_failures = idam_bytes = idam_diskhits = idam_shmhits = 0;
+  Stats_clearSpans();
+  PyThread_release_lock(idam_statslock);
+  Py_END_ALLOW_THREADS
+  
+  idam_memhits = idam_memmisses = idam_memevictions = 0;
+  idam_dedupshared = 0;
+  idam_timeouts = idam_cancels = 0;
+  
+  Py_INCREF(Py_None);
+  return Py_None;
+}
 
+static PyObject*
+idam_setTrace(PyObject *self, PyObject *args)
+{
+  int on = 1;
   
-  /* First argument is a string, second an object */
-  if (! PyArg_ParseTupleAndKeywords(args, kwds, "sO|si", kwlist, 
-				    &data, &tmp,
-				    &host, &port))
-    return -1; 
+  if(!PyArg_ParseTuple(args, "|i", &on))
+    return NULL;
+  idam_tracing = on ? 1 : 0;
+  
+  Py_INCREF(Py_None);
+  return Py_None;
+}
 
-  /* Convert second argument to a string */
-  source_obj = PyObject_Str(tmp); /* NB: This object is returned */
-  source = StringToChars(source_obj); /* Refers to internal buffer */
+/* Spans as a dictionary in Chrome's trace event format */
+static PyObject*
+idam_trace(PyObject *self, PyObject *args)
+{
+  PyObject *events, *event, *result;
+  idam_Span *spans;
+  int i, n;
   
-  /* Check if an error occurred */
-  if (source == NULL) {
-    Py_XDECREF(self);
-    PyErr_SetString(PyExc_RuntimeError, "Invalid arguments to idam.Data()");
-    return -1;
+  /* Copy, so the lock isn't held while making objects */
+  Py_BEGIN_ALLOW_THREADS
+  PyThread_acquire_lock(idam_statslock, WAIT_LOCK);
+  n = idam_nspans;
+  spans = (idam_Span*) malloc((n + 1)*sizeof(idam_Span));
+  if(spans) {
+    memcpy(spans, idam_spans, n*sizeof(idam_Span));
+    for(i=0;i<n;i++)
+      spans[i].name = copyString(spans[i].name ? spans[i].name : "");
+  }
+  PyThread_release_lock(idam_statslock);
+  Py_END_ALLOW_THREADS
+  if(spans == NULL)
+    return PyErr_NoMemory();
+  
+  events = PyList_New(0);
+  for(i=0;events && (i<n);i++) {
+    event = Py_BuildValue("{s:s,s:s,s:s,s:d,s:d,s:l,s:l,s:{s:s}}",
+                          "name", idam_phasenames[spans[i].phase],
+                          "cat", "idam",
+                          "ph", "X",
+                          "ts", spans[i].start * 1e6,
+                          "dur", spans[i].dur * 1e6,
+                          "pid", (long) getpid(),
+                          "tid", spans[i].tid,
+                          "args", "signal", spans[i].name ? spans[i].name : "");
+    if((event == NULL) || (PyList_Append(events, event) < 0))
+      Py_CLEAR(events);
+    Py_XDECREF(event);
   }
+  for(i=0;i<n;i++)
+    free(spans[i].name);
+  free(spans);
+  
+  if(events == NULL)
+    return NULL;
+  result = Py_BuildValue("{s:N,s:s}", "traceEvents", events, "displayTimeUnit", "ms");
+  return result;
+}
+
+/************************************************************
+ * Clients
+ *
+ * A Client holds a server and properties, used instead of the
+ * defaults for requests made through it. The IDAM library has
+ * one connection, so clients take turns using it; requests to
+ * the same server as the last one reuse the open connection.
+ ************************************************************/
+
+typedef struct {
+  PyObject_HEAD
+  idam_Server srv;
+} idam_Client;
 
-  /* Set host and port. Keep old settings for restore after */
-  if(port > 0) {  
-    tmpport = getIdamServerPort();
-    putIdamServerPort(port);
+/* Set a property for this client */
+static int
+Client_setProp(idam_Client *self, const char *name, int value)
+{
+  int i;
+  
+  if(strlen(name) >= IDAM_PROPLEN) {
+    PyErr_SetString(PyExc_ValueError, "Property name too long");
+    return -1;
   }
-  if(host != NULL) {
-    strcpy(tmphost, getIdamServerHost());
-    putIdamServerHost(host);
+  for(i=0;i<self->srv.nprops;i++) {
+    if(strcmp(self->srv.props[i].name, name) == 0)
+      break;
   }
-
-  /* Open connection and get data */
-  printf("Connecting to %s:%d\n", getIdamServerHost(), getIdamServerPort());
-  printf("Reading '%s' from '%s'\n", data, source);
-  handle = idamGetAPI(data, source);
-
-  if(!getIdamSignalStatus(handle)) {
-    fprintf(stderr, "IDAM error: %s\n", getIdamErrorMsg(handle));
-    /* Restore host and port */
-    if(port > 0)
-      putIdamServerPort(tmpport);
-    if(host != NULL)
-      putIdamServerHost(tmphost);
-    
-    PyErr_SetString(PyExc_RuntimeError, getIdamErrorMsg(handle));
+  if(i == IDAM_MAXPROPS) {
+    PyErr_SetString(PyExc_ValueError, "Too many properties");
     return -1;
   }
- 
-  /* Set data name and source */
-  tmp = self->name;
-  self->name = CharsToString(data);
-  Py_XDECREF(tmp);
-  tmp = self->source;
-  self->source = source_obj;
-  Py_XDECREF(tmp);
-
-  /* Set data label, units and description */
-  tmp = self->label;
-  self->label = CharsToString(getIdamDataLabel(handle));
-  Py_XDECREF(tmp);
-  tmp = self->units;
-  self->units = CharsToString(getIdamDataUnits(handle));
-  Py_XDECREF(tmp);
-  tmp = self->desc;
-  self->desc = CharsToString(getIdamDataDesc(handle));
-  Py_XDECREF(tmp);
-
-  /* Get the size of the data array */
-  if((data_n = getIdamDataNum(handle)) <= 0) {
-    /* Restore host and port */
-    if(port > 0)
-      putIdamServerPort(tmpport);
-    if(host != NULL)
-      putIdamServerHost(tmphost);
+  if(i == self->srv.nprops) {
+    strcpy(self->srv.props[i].name, name);
+    self->srv.nprops++;
+  }
+  self->srv.props[i].value = value;
+  return 0;
+}
 
-    Py_XDECREF(self);
-    PyErr_SetString(PyExc_RuntimeError, getIdamErrorMsg(handle));
+static int
+Client_init(idam_Client *self, PyObject *args, PyObject *kwds)
+{
+  const char *host = NULL, *name;
+  int port = -1, value;
+  PyObject *key, *item;
+  Py_ssize_t pos = 0;
+  idam_Server def;
+  
+  if(!PyArg_ParseTuple(args, "|zi", &host, &port))
     return -1;
+  
+  /* Keywords are host, port, or properties */
+  while(kwds && PyDict_Next(kwds, &pos, &key, &item)) {
+    if((name = StringToChars(key)) == NULL)
+      return -1;
+    if(strcmp(name, "host") == 0) {
+      if((item != Py_None) && ((host = StringToChars(item)) == NULL))
+        return -1;
+    }else if(strcmp(name, "port") == 0) {
+      port = (int) PyLong_AsLong(item);
+      if(PyErr_Occurred())
+        return -1;
+    }
   }
   
-  /* Get the rank and order of the data */
-  rank = getIdamRank(handle);
-  order = getIdamOrder(handle);
+  defaultServer(&def);
+  if(resolveServer(&self->srv, &def, host, port) < 0)
+    return -1;
   
-  /* NOTE: Order of the dimensions is reversed */
-  order = rank - 1 - order;
-
-  for(i=0;i<rank;i++) {
-    dimsize[rank-1-i] = getIdamDimNum(handle, i); 
+  pos = 0;
+  while(kwds && PyDict_Next(kwds, &pos, &key, &item)) {
+    name = StringToChars(key);
+    if((strcmp(name, "host") == 0) || (strcmp(name, "port") == 0))
+      continue;
+    if(((value = PyObject_IsTrue(item)) < 0) || (Client_setProp(self, name, value) < 0))
+      return -1;
   }
+  return 0;
+}
 
-  /* Set the data */
-  tmp = self->data;
-  pyarr = (PyArrayObject*) PyArray_SimpleNew(rank,dimsize,PyArray_FLOAT);
-  if (pyarr == NULL) {
-    if(port > 0)
-      putIdamServerPort(tmpport);
-    if(host != NULL)
-      putIdamServerHost(tmphost);
-    Py_XDECREF(self);
-    PyErr_SetString(PyExc_RuntimeError, "Could not create NumPy array for data");
-    return -1;
+static PyObject *
+Client_get(idam_Client *self, PyObject *args, PyObject *kwds)
+{
+  idam_Data *d = (idam_Data*) Data_new(&idam_DataType, NULL, NULL);
+  
+  if(d == NULL)
+    return NULL;
+  if(Data_initFrom(d, args, kwds, &self->srv) < 0) {
+    Py_DECREF(d);
+    return NULL;
   }
-  getIdamFloatData(handle, (float *)(pyarr->data));
-  self->data = PyArray_Return(pyarr);
-  Py_XDECREF(tmp);
+  return (PyObject*) d;
+}
 
-  /* Get the data errors (low and high asymmetric) */
-  if(getIdamErrorType(handle) != TYPE_UNKNOWN) {
-    /* Got error data */
-    
-    tmp = self->errl;
-    pyarr = (PyArrayObject*) PyArray_SimpleNew(rank,dimsize,PyArray_FLOAT);
-    if (pyarr == NULL) {
-      if(port > 0)
-	putIdamServerPort(tmpport);
-      if(host != NULL)
-	putIdamServerHost(tmphost);
-      Py_XDECREF(self);
-      PyErr_SetString(PyExc_RuntimeError, "Could not create NumPy array for error array");
-      return -1;
-    }
-    getIdamFloatAsymmetricError(handle, 0, (float *)(pyarr->data));
-    self->errl = PyArray_Return(pyarr);
-    Py_XDECREF(tmp);
+static PyObject *
+Client_fetchMany(idam_Client *self, PyObject *args, PyObject *kwds)
+{
+  return fetchMany(args, kwds, &self->srv);
+}
 
-    tmp = self->errh;
-    if(!getIdamErrorAsymmetry(handle)) {
-      /* Error is symmetric. Just point to the same data */
-      self->errh = self->errl;
-      Py_INCREF(self->errh);
-    }else {
-      /* Need separate array */
-      pyarr = (PyArrayObject*) PyArray_SimpleNew(rank,dimsize,PyArray_FLOAT);
-      if (pyarr == NULL) {
-	if(port > 0)
-	  putIdamServerPort(tmpport);
-	if(host != NULL)
-	  putIdamServerHost(tmphost);
-	Py_XDECREF(self);
-        PyErr_SetString(PyExc_RuntimeError, "Could not create NumPy array for error array");
-	return -1;
-      }
-      getIdamFloatAsymmetricError(handle, 1, (float *)(pyarr->data));
-      self->errh = PyArray_Return(pyarr);
-    }
-    Py_XDECREF(tmp);
-  }else {
-    /* No error data, so set to None */
-    
-    tmp = self->errl;
-    Py_INCREF(Py_None);
-    self->errl = Py_None;
-    Py_XDECREF(tmp);
-    
-    tmp = self->errh;
-    Py_INCREF(Py_None);
-    self->errh = Py_None;
-    Py_XDECREF(tmp);
-  }
+static PyObject *
+Client_fetch(idam_Client *self, PyObject *args, PyObject *kwds)
+{
+  return fetchAsync(args, kwds, &self->srv);
+}
 
-  /* Set the time dimension to null */
-  tmp = self->time;
-  Py_INCREF(Py_None);
-  self->time = Py_None;
-  Py_XDECREF(tmp);
+static PyObject *
+Client_describe(idam_Client *self, PyObject *args, PyObject *kwds)
+{
+  return describe(args, kwds, &self->srv);
+}
 
-  /* Get the dimensions */
+static PyObject *
+Client_describeMany(idam_Client *self, PyObject *args, PyObject *kwds)
+{
+  return describeMany(args, kwds, &self->srv);
+}
 
-  tmp = self->dim;
-  self->dim = PyList_New(rank);
-  if(!(self->dim)) {
-    Py_XDECREF(self);
-    PyErr_SetString(PyExc_RuntimeError, "Could not create list of dimensions");
-    return -1;
-  }
+static PyObject *
+Client_stream(idam_Client *self, PyObject *args, PyObject *kwds)
+{
+  return streamFrom(args, kwds, &self->srv);
+}
 
-  for(i=0;i<rank;i++) {
-    dim = (idam_Dimension *) Dimension_new(&idam_DimensionType, NULL, NULL);
-    
-    tmp2 = dim->label;
-    dim->label = CharsToString(getIdamDimLabel(handle, rank-1-i));
-    Py_XDECREF(tmp2);
-    
-    tmp2 = dim->units;
-    dim->units = CharsToString(getIdamDimUnits(handle, rank-1-i));
-    Py_XDECREF(tmp2);
-    
-    tmp2 = dim->data;
-    pyarr = (PyArrayObject*) PyArray_SimpleNew(1,&(dimsize[i]),PyArray_FLOAT);
-    if (pyarr == NULL) {
-      Py_XDECREF(self);
-      PyErr_SetString(PyExc_RuntimeError, "Could not create NumPy array for dimension");
-      return -1;
-    }
-    getIdamFloatDimData(handle, rank-1-i, (float *)(pyarr->data));
-    dim->data = PyArray_Return(pyarr);
-    Py_XDECREF(tmp2);
-    
-    if(getIdamDimErrorType(handle, rank-1-i) != TYPE_UNKNOWN) {
-      tmp2 = dim->errl;
-      pyarr = (PyArrayObject*) PyArray_SimpleNew(1,&(dimsize[i]),PyArray_FLOAT);
-      if (pyarr == NULL) {
-	Py_XDECREF(self);
-        PyErr_SetString(PyExc_RuntimeError, "Could not create NumPy array for dimension error");
-	return -1;
-      }
-      getIdamFloatDimAsymmetricError(handle, rank-1-i, 0, (float *)(pyarr->data));
-      dim->errl = PyArray_Return(pyarr);
-      Py_XDECREF(tmp2);
-      
-      tmp2 = dim->errh;
-      if(!getIdamDimErrorAsymmetry(handle, rank-1-i)) {
-	/* Symmetric error */
-	dim->errh = dim->errl;
-	Py_INCREF(self->errh);
-      }else {
-	/* Asymmetric error */
-	pyarr = (PyArrayObject*) PyArray_SimpleNew(1,&(dimsize[i]),PyArray_FLOAT);
-	if (pyarr == NULL) {
-	  Py_XDECREF(self);
-          PyErr_SetString(PyExc_RuntimeError, "Could not create NumPy array for dimension error");
-	  return -1;
-	}
-	getIdamFloatDimAsymmetricError(handle, rank-1-i, 1, (float *)(pyarr->data));
-	dim->errh = PyArray_Return(pyarr);
-      }
-      Py_XDECREF(tmp2);
-    }else {
-      /* No error data, so set to None */
-      tmp2 = dim->errl;
-      Py_INCREF(Py_None);
-      dim->errl = Py_None;
-      Py_XDECREF(tmp2);
-      
-      tmp2 = dim->errh;
-      Py_INCREF(Py_None);
-      dim->errh = Py_None;
-      Py_XDECREF(tmp2);
-    }
-    
-    /* Create shortcut to time data */
-    if(i == order) { /* This is the time dimension */
-      tmp2 = self->time;
-      Py_INCREF(dim->data);
-      self->time = dim->data;
-      Py_XDECREF(tmp2);
-    }
-    
-    /* Add this dimension to the list */
-    PyList_SET_ITEM(self->dim, i, (PyObject*) dim);
-  }
-  Py_XDECREF(tmp); /* Delete the old dim list */
-  
-  /*  Set index of time dimension */
-  self->order = order;
+static PyObject *
+Client_setProperty(idam_Client *self, PyObject *args)
+{
+  const char *prop;
+  int val = 1;
   
-  /* Free IDAM data */
-  idamFree(handle);
+  if(!PyArg_ParseTuple(args, "s|i", &prop, &val))
+    return NULL;
+  if(Client_setProp(self, prop, val ? 1 : 0) < 0)
+    return NULL;
   
-  /* Restore host and port */
-  if(port > 0)
-    putIdamServerPort(tmpport);
-  if(host != NULL)
-    putIdamServerHost(tmphost);
+  Py_INCREF(Py_None);
+  return Py_None;
+}
 
-  return 0;
+static PyObject *
+Client_getHost(idam_Client *self, void *closure)
+{
+  return CharsToString(self->srv.host);
 }
 
-/* Methods */
-static PyMethodDef idam_DataMethods[] = {
-    {NULL}  /* Sentinel */
+static PyObject *
+Client_getPort(idam_Client *self, void *closure)
+{
+  return Py_BuildValue("i", self->srv.port);
+}
+
+static PyObject *
+Client_getProperties(idam_Client *self, void *closure)
+{
+  PyObject *dict = PyDict_New(), *value;
+  int i;
+  
+  for(i=0;dict && (i<self->srv.nprops);i++) {
+    value = PyBool_FromLong(self->srv.props[i].value);
+    if((value == NULL) || (PyDict_SetItemString(dict, self->srv.props[i].name, value) < 0)) {
+      Py_XDECREF(value);
+      Py_CLEAR(dict);
+      break;
+    }
+    Py_DECREF(value);
+  }
+  return dict;
+}
+
+static PyGetSetDef idam_ClientGetSet[] = {
+  {"host", (getter) Client_getHost, NULL, "Host name of the server", NULL},
+  {"port", (getter) Client_getPort, NULL, "Port number of the server", NULL},
+  {"properties", (getter) Client_getProperties, NULL,
+   "Dictionary of properties set for this client", NULL},
+  {NULL}  /* Sentinel */
 };
 
-static PyTypeObject idam_DataType = {
+static PyMethodDef idam_ClientMethods[] = {
+  {"get", (PyCFunction) Client_get, METH_VARARGS | METH_KEYWORDS,
+   "get(signal, source, ...)\n"
+   "Read a Data object. Takes the same keywords as idam.Data()"},
+  {"fetchMany", (PyCFunction) Client_fetchMany, METH_VARARGS | METH_KEYWORDS,
+   "Read a list of (signal, source) pairs, as idam.fetchMany()"},
+  {"fetch", (PyCFunction) Client_fetch, METH_VARARGS | METH_KEYWORDS,
+   "Return an asyncio future for a Data object, as idam.fetch()"},
+  {"describe", (PyCFunction) Client_describe, METH_VARARGS | METH_KEYWORDS,
+   "Describe a signal without reading arrays, as idam.describe()"},
+  {"describeMany", (PyCFunction) Client_describeMany, METH_VARARGS | METH_KEYWORDS,
+   "Describe a list of (signal, source) pairs, as idam.describeMany()"},
+  {"stream", (PyCFunction) Client_stream, METH_VARARGS | METH_KEYWORDS,
+   "Iterate over a signal in chunks of time, as idam.stream()"},
+  {"setProperty", (PyCFunction) Client_setProperty, METH_VARARGS,
+   "Set (or with False, reset) a property for requests from this client"},
+  {NULL}  /* Sentinel */
+};
+
+static PyTypeObject idam_ClientType = {
   PyVarObject_HEAD_INIT(NULL, 0)
-    "idam.Data",               /*tp_name*/
-    sizeof(idam_Data),         /*tp_basicsize*/
+    "idam.Client",             /*tp_name*/
+    sizeof(idam_Client),       /*tp_basicsize*/
     0,                         /*tp_itemsize*/
-    (destructor)Data_dealloc,  /*tp_dealloc*/
+    0,                         /*tp_dealloc*/
     0,                         /*tp_print*/
     0,                         /*tp_getattr*/
     0,                         /*tp_setattr*/
@@ -840,25 +9310,26 @@ static PyTypeObject idam_DataType = {
     0,                         /*tp_getattro*/
     0,                         /*tp_setattro*/
     0,                         /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
-    "IDAM data objects",       /* tp_doc */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
+    "Client(host, port, **properties)\n"
+    "Reads data from one server, with its own IDAM properties",  /* tp_doc */
     0,		               /* tp_traverse */
     0,		               /* tp_clear */
     0,		               /* tp_richcompare */
     0,		               /* tp_weaklistoffset */
     0,		               /* tp_iter */
     0,		               /* tp_iternext */
-    idam_DataMethods,          /* tp_methods */
-    idam_DataMembers,          /* tp_members */
-    0,                         /* tp_getset */
+    idam_ClientMethods,        /* tp_methods */
+    0,                         /* tp_members */
+    idam_ClientGetSet,         /* tp_getset */
     0,                         /* tp_base */
     0,                         /* tp_dict */
     0,                         /* tp_descr_get */
     0,                         /* tp_descr_set */
     0,                         /* tp_dictoffset */
-    (initproc)Data_init,       /* tp_init */
+    (initproc)Client_init,     /* tp_init */
     0,                         /* tp_alloc */
-    Data_new,                  /* tp_new */
+    PyType_GenericNew,         /* tp_new */
 };
 
 /************************************************************
@@ -875,6 +9346,115 @@ static PyMethodDef IdamMethods[] = {
   {"setPort",  idam_setPort, METH_VARARGS,
    "Set the port number of the IDAM server"},
 
+  {"setCache",  (PyCFunction) idam_setCache, METH_VARARGS | METH_KEYWORDS,
+   "Set a directory for caching signals on disk, with optional maxsize in bytes.\n"
+   "Use None to turn off caching"},
+
+  {"setSharedMemory",  (PyCFunction) idam_setSharedMemory, METH_VARARGS | METH_KEYWORDS,
+   "setSharedMemory(maxsize=2**30)\n"
+   "Keep signals in POSIX shared memory, up to maxsize bytes for this user,\n"
+   "so that processes on this host read each signal once. Data read this way\n"
+   "pickle as the segment name. 0 turns off, letting go of pinned segments"},
+
+  {"sharedMemoryInfo",  idam_sharedMemoryInfo, METH_NOARGS,
+   "Return a dict of the shared memory maxsize, the number of segments and\n"
+   "bytes this user has (found only on Linux), and the number this process\n"
+   "holds and has pinned for pickles"},
+
+  {"_attachShared",  idam_attachShared, METH_VARARGS,
+   "Map a shared memory segment as a Data object. Used by pickle"},
+
+  {"stream",  (PyCFunction) idam_stream, METH_VARARGS | METH_KEYWORDS,
+   "stream(signal, source, chunk=None, ...)\n"
+   "Read a signal, then iterate over it as Data objects of chunk times\n"
+   "each (by default about 16 Mb). Also takes the host, port, dtype,\n"
+   "errors, cache, tmin, tmax and stride keywords of idam.Data()"},
+  {"align",  (PyCFunction) idam_align, METH_VARARGS | METH_KEYWORDS,
+   "align(datas, timebase, method=\"linear\", fill=nan, workers=0)\n"
+   "Resample a list of 1D Data objects onto timebase, returning a 2D\n"
+   "float64 array with a row for each. method is \"linear\", \"nearest\"\n"
+   "or \"zoh\" (the last value at or before each time). Times outside a\n"
+   "signal are set to fill. workers is the number of threads, by default\n"
+   "one for each CPU"},
+
+  {"to_arrow",  idam_toArrow, METH_VARARGS,
+   "Convert a list of Data objects to a list of pyarrow RecordBatches,\n"
+   "without copying the arrays. Exceptions in the list are kept"},
+
+  {"setBackend",  (PyCFunction) idam_setBackend, METH_VARARGS | METH_KEYWORDS,
+   "Where signals come from: \"live\" (the server, default), \"record\"\n"
+   "(the server, saving each signal in path) or \"replay\" (files in path)"},
+
+  {"getBackend",  idam_getBackend, METH_NOARGS,
+   "Return the backend name and its directory (or None)"},
+
+  {"fetch",  (PyCFunction) idam_fetch, METH_VARARGS | METH_KEYWORDS,
+   "fetch(signal, source, ...)\n"
+   "Return an asyncio future for a Data object, read by a worker thread.\n"
+   "Takes the same keywords as Data(). Must be called in a coroutine"},
+
+  {"setWorkers",  idam_setWorkers, METH_VARARGS,
+   "Set the maximum number of worker threads used by fetch() (default 4)"},
+
+  {"setDedup",  idam_setDedup, METH_VARARGS,
+   "Share dimension arrays with the same values between signals.\n"
+   "Shared arrays are read-only. setDedup(False) turns this off"},
+
+  {"stats",  idam_stats, METH_NOARGS,
+   "Return a dictionary of read counts, bytes received, cache hits and\n"
+   "for each phase of a read, its count, total, mean and max time (s)\n"
+   "and a histogram (bin i counts times of 2**i to 2**(i+1) microseconds)"},
+
+  {"reset_stats",  idam_reset_stats, METH_NOARGS,
+   "Set all statistics back to zero, and discard trace spans"},
+
+  {"setTrace",  idam_setTrace, METH_VARARGS,
+   "Start (or with False, stop) keeping a span for each phase of each read"},
+
+  {"trace",  idam_trace, METH_NOARGS,
+   "Return trace spans in Chrome trace format. Save with json.dump()\n"
+   "and load in chrome://tracing or Perfetto"},
+
+  {"setMemoryCache",  idam_setMemoryCache, METH_VARARGS,
+   "Keep recently read data in memory, up to the given size in bytes.\n"
+   "Zero turns this off and empties the cache"},
+
+  {"memoryCacheInfo",  idam_memoryCacheInfo, METH_NOARGS,
+   "Return a dictionary of memory cache size, hits, misses and evictions"},
+
+  {"setServers",  idam_setServers, METH_VARARGS,
+   "setServers(servers)\n"
+   "Send requests for the default server to the fastest of a list of\n"
+   "mirrors, each \"host\", \"host:port\" or (host, port). Servers which\n"
+   "can't be reached are left out for a while. None turns this off"},
+
+  {"serverInfo",  idam_serverInfo, METH_NOARGS,
+   "Return a list of dictionaries of each pool server's requests, failures,\n"
+   "average latency (s), seconds until it's tried again, and if current"},
+
+  {"setTimeout",  (PyCFunction) idam_setTimeout, METH_VARARGS | METH_KEYWORDS,
+   "setTimeout(timeout=None, connect=None)\n"
+   "Defaults in seconds for Data() and Client.get() (zero to turn off):\n"
+   "timeout to wait for a read, and connect to wait for the server to\n"
+   "accept a connection. Returns the settings"},
+
+  {"cancel",  idam_cancel, METH_VARARGS,
+   "cancel(thread=None)\n"
+   "Make reads with a timeout, waiting in the given thread (from\n"
+   "threading.get_ident(), or all threads if None), raise CancelledError.\n"
+   "Returns the number cancelled. Reads without a timeout are made in the\n"
+   "calling thread, so can't be cancelled and aren't counted"},
+
+  {"setPrefetch",  (PyCFunction) idam_setPrefetch, METH_VARARGS | METH_KEYWORDS,
+   "setPrefetch(depth, maxsize=None)\n"
+   "When reads step through shots at a fixed interval, read the next\n"
+   "depth shots in the background, keeping up to maxsize bytes\n"
+   "(default 256 Mb). Zero turns this off"},
+
+  {"prefetchInfo",  idam_prefetchInfo, METH_NOARGS,
+   "Return a dictionary of prefetches issued, hits, misses, cancelled,\n"
+   "failed, and wasted (read but never used) with their size in bytes"},
+
   {"setProperty",  idam_setProperty, METH_VARARGS,
    "Set a property for client/server behavior"},
 
@@ -887,8 +9467,33 @@ static PyMethodDef IdamMethods[] = {
   {"freeAPI",  idam_freeAPI, METH_VARARGS,
    "Low-level routine to free a connection"},
 
-  {"readData",  idam_readData, METH_VARARGS,
-   "Low-level read a data array"},
+  {"readData",  (PyCFunction) idam_readData, METH_VARARGS | METH_KEYWORDS,
+   "Low-level read a data array. Optional second argument is the dtype,\n"
+   "\"float32\" (default) or \"native\". With out=, fills that array instead\n"
+   "(C-contiguous, of the same shape and dtype) and returns it"},
+
+  {"setBufferPool",  idam_setBufferPool, METH_VARARGS,
+   "Keep the memory of freed arrays, up to the given size in bytes, and\n"
+   "reuse it for new arrays of the same size. Zero turns this off"},
+
+  {"bufferPoolInfo",  idam_bufferPoolInfo, METH_NOARGS,
+   "Return a dictionary of buffer pool size, buffers, hits and misses"},
+
+  {"fetchMany",  (PyCFunction) idam_fetchMany, METH_VARARGS | METH_KEYWORDS,
+   "Read a list of (signal, source) pairs, returning a list of Data objects.\n"
+   "Reads which fail give an exception object in the list instead.\n"
+   "Optional keywords: host, port, workers (number of threads, default 4)\n"
+   "dtype (\"float32\" or \"native\"), copy, errors, lazy and cache"},
+  {"describe",  (PyCFunction) idam_describe, METH_VARARGS | METH_KEYWORDS,
+   "describe(signal, source)\n"
+   "Return a dict with the label, units, desc, rank, shape, order,\n"
+   "dtype and error type of a signal, and of each dimension in dim,\n"
+   "without creating any arrays.\n"
+   "Optional keywords: host, port, errors and cache"},
+  {"describeMany", (PyCFunction) idam_describeMany, METH_VARARGS | METH_KEYWORDS,
+   "Describe a list of (signal, source) pairs, as describe(), returning a list.\n"
+   "Signals which can't be read give an exception object in the list instead.\n"
+   "Optional keywords: host, port, workers, errors and cache"},
 
   {NULL, NULL, 0, NULL}        /* Sentinel */
 };
@@ -933,6 +9538,15 @@ moduleinit(void)   // Module initialisation for Python 3
   if (PyType_Ready(&idam_DimensionType) < 0)
     return NULL;
 
+  if (PyType_Ready(&idam_ClientType) < 0)
+    return NULL;
+  
+  if (PyType_Ready(&idam_HandleType) < 0)
+    return NULL;
+
+  if (PyType_Ready(&idam_StreamType) < 0)
+    return NULL;
+
   /* Initialise module */
   #if PY_MAJOR_VERSION >= 3
   m = PyModule_Create(&moduledef);
@@ -951,12 +9565,49 @@ moduleinit(void)   // Module initialisation for Python 3
   Py_INCREF(&idam_DimensionType);
   PyModule_AddObject(m, "Dimension", (PyObject *)&idam_DimensionType);
   
+  Py_INCREF(&idam_ClientType);
+  PyModule_AddObject(m, "Client", (PyObject *)&idam_ClientType);
+  
+  /* Exceptions */
+  idam_TimeoutError = PyErr_NewException("idam.TimeoutError", PyExc_RuntimeError, NULL);
+  idam_CancelledError = PyErr_NewException("idam.CancelledError", PyExc_RuntimeError, NULL);
+  if((idam_TimeoutError == NULL) || (idam_CancelledError == NULL))
+    return NULL;
+  Py_INCREF(idam_TimeoutError);
+  PyModule_AddObject(m, "TimeoutError", idam_TimeoutError);
+  Py_INCREF(idam_CancelledError);
+  PyModule_AddObject(m, "CancelledError", idam_CancelledError);
+  
   /* Import NumPy */
   import_array();
 
-  /* Initialise IDAM with default values */
-  putIdamServerHost("mast.fusion.org.uk");
-  putIdamServerPort(56565);
+#if PY_VERSION_HEX < 0x03070000
+  /* Needed before fetchMany() starts threads */
+  PyEval_InitThreads();
+#endif
+
+  /* Lock for calls into IDAM. Default server is set in idam_host */
+  idam_lock = PyThread_allocate_lock();
+  if(idam_lock == NULL)
+    return NULL;
+  
+  /* Server pool, e.g. IDAM_SERVERS=host1,host2:56566 */
+  if(getenv("IDAM_SERVERS"))
+    idam_npool = poolList(getenv("IDAM_SERVERS"), idam_pool);
+  
+  /* Queue for fetch() */
+  idam_asynclock = PyThread_allocate_lock();
+  if(idam_asynclock == NULL)
+    return NULL;
+  
+  idam_statslock = PyThread_allocate_lock();
+  if(idam_statslock == NULL)
+    return NULL;
+  
+  idam_cachelock = PyThread_allocate_lock();
+  if(idam_cachelock == NULL)
+    return NULL;
+  Py_AtExit(Shm_exit);
 
   /* Check for errors */
   if (PyErr_Occurred())
@@ -9,10 +9,12 @@ idamdir = '/home/ben/codes/idam'
 
 from distutils.core import setup, Extension
 
+import sys
+
 module1 = Extension('idam',
                     include_dirs = [idamdir],
                     library_dirs = [idamdir],
-                    libraries = ['idam'],
+                    libraries = ['idam'] + (['rt'] if sys.platform.startswith('linux') else []),
                     sources = ['idammodule.c'])
 
 setup (name = 'IDAM',
@@ -9,12 +9,14 @@ idamdir = '/home/ben/codes/idam'
 
 from distutils.core import setup, Extension
 
+import sys
+
 import numpy
 
 module1 = Extension('idam',
                     include_dirs = [idamdir, numpy.get_include()],
                     library_dirs = [idamdir],
-                    libraries = ['idam'],
+                    libraries = ['idam'] + (['rt'] if sys.platform.startswith('linux') else []),
                     sources = ['idammodule.c'])
 
 setup (name = 'IDAM',